@@ -0,0 +1,85 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+/**
+ * Bump allocator that releases everything at once when destroyed.
+ *
+ * Destructors of objects allocated here are never run, so only use it
+ * for trivially destructible types. Not thread safe.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <memory>
+#include <new>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "disallow.h"
+
+class Arena {
+ public:
+  Arena() {}
+  ~Arena() {}
+
+  void* Allocate(size_t size, size_t alignment) {
+    size_t padding = -reinterpret_cast<uintptr_t>(current_) & (alignment - 1);
+    if (padding + size > remaining_) {
+      if (size > kBlockSize / 4) {
+        // Large allocations get their own block so that the remainder
+        // of the current block is not wasted.
+        return NewBlock(size);
+      }
+      current_ = NewBlock(kBlockSize);
+      remaining_ = kBlockSize;
+      padding = 0;
+    }
+    char* result = current_ + padding;
+    current_ += padding + size;
+    remaining_ -= padding + size;
+    return result;
+  }
+
+  template <class T, class... Args>
+  T* New(Args&&... args) {
+    static_assert(std::is_trivially_destructible_v<T>);
+    return new (Allocate(sizeof(T), alignof(T)))
+        T(std::forward<Args>(args)...);
+  }
+
+  // Uninitialized array of |n| elements.
+  template <class T>
+  T* NewArray(size_t n) {
+    static_assert(std::is_trivially_destructible_v<T>);
+    return static_cast<T*>(Allocate(sizeof(T) * n, alignof(T)));
+  }
+
+  std::string_view CopyString(std::string_view s) {
+    char* copy = NewArray<char>(s.size());
+    memcpy(copy, s.data(), s.size());
+    return std::string_view(copy, s.size());
+  }
+
+  // Total size of the blocks obtained from the system.
+  size_t allocated_bytes() const { return allocated_bytes_; }
+
+ private:
+  static constexpr size_t kBlockSize = 64 * 1024;
+
+  char* NewBlock(size_t size) {
+    // operator new[] returns memory aligned for any fundamental type.
+    blocks_.emplace_back(new char[size]);
+    allocated_bytes_ += size;
+    return blocks_.back().get();
+  }
+
+  std::vector<std::unique_ptr<char[]> > blocks_{};
+  char* current_{};
+  size_t remaining_{};
+  size_t allocated_bytes_{};
+  DISALLOW_COPY_AND_ASSIGN(Arena);
+};
+
+#endif
@@ -1,62 +1,359 @@
 #include "base64decode.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <stdint.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <array>
+#include <memory>
 #include <string>
 
-#include "disallow.h"
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
-using std::array;
 using std::string;
 
 namespace {
-static constexpr int64_t kEmptyChar = -1;
-class Base64Decoder {
- public:
-  Base64Decoder() {
-    constexpr char kAlphabet[] =
-        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-    lookup_.fill(kEmptyChar);
-    for (size_t i = 0; i < sizeof(kAlphabet); ++i) {
-      lookup_[kAlphabet[i]] = i;
+constexpr uint8_t kInvalid = 0xff;
+
+constexpr std::array<uint8_t, 256> MakeLookup() {
+  constexpr char kAlphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::array<uint8_t, 256> lookup{};
+  for (auto& value : lookup) value = kInvalid;
+  for (size_t i = 0; i < sizeof(kAlphabet) - 1; ++i) {
+    lookup[static_cast<unsigned char>(kAlphabet[i])] = i;
+  }
+  return lookup;
+}
+
+constexpr std::array<uint8_t, 256> kLookup = MakeLookup();
+
+// Sextets of a group of 4 characters that is not complete yet, carried
+// over from one block of input to the next.
+struct Quad {
+  uint32_t bits{};
+  int count{};
+};
+
+inline void DecodeChar(char c, Quad* quad, char** out) {
+  const uint8_t value = kLookup[static_cast<unsigned char>(c)];
+  if (value == kInvalid) return;
+  quad->bits = quad->bits << 6 | value;
+  if (++quad->count == 4) {
+    (*out)[0] = quad->bits >> 16;
+    (*out)[1] = quad->bits >> 8;
+    (*out)[2] = quad->bits;
+    *out += 3;
+    *quad = Quad();
+  }
+}
+
+// The bytes of the trailing incomplete group, one less than its
+// characters.
+char* FinishQuad(const Quad& quad, char* out) {
+  const uint32_t bits = quad.bits << (6 * (4 - quad.count));
+  for (int i = 0; i < quad.count - 1; ++i) {
+    *out++ = bits >> ((2 - i) * 8);
+  }
+  return out;
+}
+
+// Each of these decodes |size| characters at |p| into |out|, continuing
+// |quad|, and returns the end of the output.
+typedef char* (*DecodeFunction)(const char* p, size_t size, Quad* quad,
+                                char* out);
+
+char* DecodeScalar(const char* p, size_t size, Quad* quad, char* out) {
+  for (size_t i = 0; i < size; ++i) DecodeChar(p[i], quad, &out);
+  return out;
+}
+
+#ifdef __SSE2__
+// Sextet values of the characters in |c|, with a bit set in |valid| for
+// each that is in the alphabet.
+inline __m128i Translate(__m128i c, unsigned* valid) {
+  const auto in_range = [c](char low, char high) {
+    return _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8(low - 1)),
+                         _mm_cmpgt_epi8(_mm_set1_epi8(high + 1), c));
+  };
+  const __m128i upper = in_range('A', 'Z');
+  const __m128i lower = in_range('a', 'z');
+  const __m128i digit = in_range('0', '9');
+  const __m128i plus = _mm_cmpeq_epi8(c, _mm_set1_epi8('+'));
+  const __m128i slash = _mm_cmpeq_epi8(c, _mm_set1_epi8('/'));
+  *valid = _mm_movemask_epi8(_mm_or_si128(
+      _mm_or_si128(_mm_or_si128(upper, lower), _mm_or_si128(digit, plus)),
+      slash));
+  const __m128i shift = _mm_or_si128(
+      _mm_or_si128(
+          _mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8(-'A')),
+                       _mm_and_si128(lower, _mm_set1_epi8(26 - 'a'))),
+          _mm_or_si128(_mm_and_si128(digit, _mm_set1_epi8(52 - '0')),
+                       _mm_and_si128(plus, _mm_set1_epi8(62 - '+')))),
+      _mm_and_si128(slash, _mm_set1_epi8(63 - '/')));
+  return _mm_add_epi8(c, shift);
+}
+
+// Store the first 12 bytes of |v|.
+inline void Store12(char* out, __m128i v) {
+  _mm_storel_epi64(reinterpret_cast<__m128i*>(out), v);
+  const uint32_t rest = _mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+  memcpy(out + 8, &rest, 4);
+}
+
+// Store the first |size| bytes of |v|.
+inline void StorePrefix(char* out, __m128i v, size_t size) {
+  alignas(16) char bytes[16];
+  _mm_store_si128(reinterpret_cast<__m128i*>(bytes), v);
+  memcpy(out, bytes, size);
+}
+
+size_t CountAlphabet(const char* p, size_t size) {
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    unsigned valid;
+    Translate(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i)),
+              &valid);
+    count += __builtin_popcount(valid);
+  }
+  for (; i < size; ++i) {
+    if (kLookup[static_cast<unsigned char>(p[i])] != kInvalid) count++;
+  }
+  return count;
+}
+
+// Join the 6 bit values of each 4 bytes into 3, in the first 12 bytes.
+__attribute__((target("ssse3"))) inline __m128i Pack(__m128i values) {
+  const __m128i pairs =
+      _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+  const __m128i joined = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+  return _mm_shuffle_epi8(joined, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                                14, 13, 12, -1, -1, -1, -1));
+}
+
+// Blocks entirely in the alphabet are decoded at once. Otherwise the
+// complete groups before the first character that is not, usually a
+// line break, are taken from the block, and the rest up to that
+// character is decoded one at a time.
+__attribute__((target("ssse3"))) char* DecodeSsse3(const char* p,
+                                                   size_t size, Quad* quad,
+                                                   char* out) {
+  size_t i = 0;
+  while (i < size) {
+    if (quad->count == 0 && i + 16 <= size) {
+      unsigned valid;
+      const __m128i values = Translate(
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i)), &valid);
+      if (valid == 0xffff) {
+        Store12(out, Pack(values));
+        out += 12;
+        i += 16;
+        continue;
+      }
+      const size_t prefix = __builtin_ctz(~valid);
+      if (prefix >= 4) {
+        StorePrefix(out, Pack(values), prefix / 4 * 3);
+        out += prefix / 4 * 3;
+        i += prefix / 4 * 4;
+        continue;
+      }
+      out = DecodeScalar(p + i, prefix + 1, quad, out);
+      i += prefix + 1;
+      continue;
     }
+    DecodeChar(p[i++], quad, &out);
   }
-  ~Base64Decoder() {}
-
-  string doit(const string& b64) const {
-    string output;
-    output.reserve(b64.size() * 0.7);
-
-    for (size_t position = 0; position < b64.size();) {
-      uint64_t result = 0;
-      int j;
-      for (j = 0; j < 4 && position < b64.size(); ++j) {
-        int64_t t = 0;
-        do {
-          t = lookup_[b64[position++]];
-        } while (t == kEmptyChar && position < b64.size());
-        if (t != kEmptyChar) {
-          result |= (t << ((3 - j) * 6));
-        } else {
-          break;
-        }
+  return out;
+}
+
+__attribute__((target("avx2"))) inline __m256i InRange(__m256i c, char low,
+                                                       char high) {
+  return _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8(low - 1)),
+                          _mm256_cmpgt_epi8(_mm256_set1_epi8(high + 1), c));
+}
+
+// The same as Translate() and Pack(), 32 characters at a time.
+__attribute__((target("avx2"))) inline __m256i Translate(__m256i c,
+                                                         unsigned* valid) {
+  const __m256i upper = InRange(c, 'A', 'Z');
+  const __m256i lower = InRange(c, 'a', 'z');
+  const __m256i digit = InRange(c, '0', '9');
+  const __m256i plus = _mm256_cmpeq_epi8(c, _mm256_set1_epi8('+'));
+  const __m256i slash = _mm256_cmpeq_epi8(c, _mm256_set1_epi8('/'));
+  *valid = _mm256_movemask_epi8(
+      _mm256_or_si256(_mm256_or_si256(_mm256_or_si256(upper, lower),
+                                      _mm256_or_si256(digit, plus)),
+                      slash));
+  const __m256i shift = _mm256_or_si256(
+      _mm256_or_si256(
+          _mm256_or_si256(_mm256_and_si256(upper, _mm256_set1_epi8(-'A')),
+                          _mm256_and_si256(lower, _mm256_set1_epi8(26 - 'a'))),
+          _mm256_or_si256(
+              _mm256_and_si256(digit, _mm256_set1_epi8(52 - '0')),
+              _mm256_and_si256(plus, _mm256_set1_epi8(62 - '+')))),
+      _mm256_and_si256(slash, _mm256_set1_epi8(63 - '/')));
+  return _mm256_add_epi8(c, shift);
+}
+
+// 12 bytes in each 128 bit lane.
+__attribute__((target("avx2"))) inline __m256i Pack(__m256i values) {
+  const __m256i pairs =
+      _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+  const __m256i joined =
+      _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00011000));
+  return _mm256_shuffle_epi8(
+      joined, _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1,
+                               -1, -1, 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+                               -1, -1, -1, -1));
+}
+
+__attribute__((target("avx2"))) char* DecodeAvx2(const char* p, size_t size,
+                                                 Quad* quad, char* out) {
+  size_t i = 0;
+  while (i < size) {
+    if (quad->count == 0 && i + 32 <= size) {
+      unsigned valid;
+      const __m256i values = Translate(
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i)),
+          &valid);
+      if (valid == 0xffffffff) {
+        const __m256i packed = Pack(values);
+        Store12(out, _mm256_castsi256_si128(packed));
+        Store12(out + 12, _mm256_extracti128_si256(packed, 1));
+        out += 24;
+        i += 32;
+        continue;
+      }
+      if ((valid & 0xffff) == 0xffff) {
+        Store12(out, _mm256_castsi256_si128(Pack(values)));
+        out += 12;
+        i += 16;
+        continue;
       }
-      for (int k = 0; k < j - 1; ++k) {
-        char c = char((result >> ((2 - k) * 8)) & 255);
-        output += c;
+      // As in DecodeSsse3(), which is not called as its SSE
+      // instructions would be slow to mix with AVX ones.
+      const size_t prefix = __builtin_ctz(~valid);
+      if (prefix >= 4) {
+        StorePrefix(out, _mm256_castsi256_si128(Pack(values)),
+                    prefix / 4 * 3);
+        out += prefix / 4 * 3;
+        i += prefix / 4 * 4;
+        continue;
       }
+      out = DecodeScalar(p + i, prefix + 1, quad, out);
+      i += prefix + 1;
+      continue;
     }
-    return output;
+    DecodeChar(p[i++], quad, &out);
   }
+  return out;
+}
+#else
+size_t CountAlphabet(const char* p, size_t size) {
+  size_t count = 0;
+  for (size_t i = 0; i < size; ++i) {
+    if (kLookup[static_cast<unsigned char>(p[i])] != kInvalid) count++;
+  }
+  return count;
+}
+#endif
 
- private:
-  array<int64_t, 256> lookup_{};
-  DISALLOW_COPY_AND_ASSIGN(Base64Decoder);
-};
+DecodeFunction Select(Base64Implementation implementation) {
+  assert(base64implementation_supported(implementation));
+  switch (implementation) {
+    case Base64Implementation::kAuto:
+      for (auto best :
+           {Base64Implementation::kAvx2, Base64Implementation::kSsse3}) {
+        if (base64implementation_supported(best)) return Select(best);
+      }
+      return DecodeScalar;
+    case Base64Implementation::kScalar:
+      return DecodeScalar;
+#ifdef __SSE2__
+    case Base64Implementation::kSsse3:
+      return DecodeSsse3;
+    case Base64Implementation::kAvx2:
+      return DecodeAvx2;
+#else
+    default:
+      return nullptr;
+#endif
+  }
+  return nullptr;
+}
 
-static Base64Decoder b;
+bool WriteAll(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t written = write(fd, data, size);
+    if (written == -1 && errno == EINTR) continue;
+    if (written <= 0) return false;
+    data += written;
+    size -= written;
+  }
+  return true;
+}
 }  // anonymous namespace
 
-string base64decode(const string& b64) { return b.doit(b64); }
+bool base64implementation_supported(Base64Implementation implementation) {
+  switch (implementation) {
+    case Base64Implementation::kAuto:
+    case Base64Implementation::kScalar:
+      return true;
+#ifdef __SSE2__
+    case Base64Implementation::kSsse3:
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("ssse3");
+    case Base64Implementation::kAvx2:
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("avx2");
+#else
+    default:
+      return false;
+#endif
+  }
+  return false;
+}
+
+size_t base64decoded_size(std::string_view b64) {
+  const size_t count = CountAlphabet(b64.data(), b64.size());
+  return count / 4 * 3 + (count % 4 ? count % 4 - 1 : 0);
+}
+
+size_t base64decode(std::string_view b64, char* out,
+                    Base64Implementation implementation) {
+  static const DecodeFunction best = Select(Base64Implementation::kAuto);
+  const DecodeFunction decode = implementation == Base64Implementation::kAuto
+                                    ? best
+                                    : Select(implementation);
+  Quad quad;
+  char* end = decode(b64.data(), b64.size(), &quad, out);
+  end = FinishQuad(quad, end);
+  return end - out;
+}
+
+string base64decode(std::string_view b64) {
+  string output(base64decoded_size(b64), '\0');
+  const size_t size = base64decode(b64, output.data());
+  assert(size == output.size());
+  return output;
+}
+
+bool base64decode_to_fd(std::string_view b64, int fd) {
+  static const DecodeFunction decode = Select(Base64Implementation::kAuto);
+  constexpr size_t kPieceSize = 256 * 1024;
+  // Output of a piece, and of the group carried over.
+  std::unique_ptr<char[]> buffer(new char[kPieceSize / 4 * 3 + 3]);
+  Quad quad;
+  for (size_t i = 0; i < b64.size(); i += kPieceSize) {
+    const std::string_view piece = b64.substr(i, kPieceSize);
+    char* end = decode(piece.data(), piece.size(), &quad, buffer.get());
+    if (!WriteAll(fd, buffer.get(), end - buffer.get())) return false;
+  }
+  char* end = FinishQuad(quad, buffer.get());
+  return WriteAll(fd, buffer.get(), end - buffer.get());
+}
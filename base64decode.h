@@ -1,5 +1,39 @@
 #ifndef BASE64DECODE_H_
 #define BASE64DECODE_H_
+/**
+ * Base64 decoder for blob content from the GitHub API. Characters outside
+ * the alphabet, such as the line breaks GitHub inserts and '=' padding,
+ * are skipped.
+ */
+#include <stddef.h>
+
 #include <string>
-std::string base64decode(const std::string& b64);
+#include <string_view>
+
+enum class Base64Implementation {
+  // The fastest the CPU supports.
+  kAuto,
+  kScalar,
+  kSsse3,
+  kAvx2,
+};
+
+// Whether |implementation| can run on this CPU.
+bool base64implementation_supported(Base64Implementation implementation);
+
+// Exact size of the decoded |b64|.
+size_t base64decoded_size(std::string_view b64);
+
+// Decode into |out|, which has room for base64decoded_size(b64) bytes.
+// Returns the number of bytes written.
+size_t base64decode(
+    std::string_view b64, char* out,
+    Base64Implementation implementation = Base64Implementation::kAuto);
+
+std::string base64decode(std::string_view b64);
+
+// Decode into |fd| a piece at a time, without holding the whole output
+// in memory. Returns false if writing failed.
+bool base64decode_to_fd(std::string_view b64, int fd);
+
 #endif
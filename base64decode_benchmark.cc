@@ -1,11 +1,30 @@
+#include <assert.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <string>
 
 #include "base64decode.h"
 #include "strutil.h"
 
+namespace {
+void Measure(const char* name, size_t size, size_t iter,
+             std::function<void()> decode) {
+  auto begin = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < iter; ++i) decode();
+  auto end = std::chrono::steady_clock::now();
+  double seconds = std::chrono::duration<double>(end - begin).count();
+  std::cout << name << ": " << size * iter / seconds / 1e9 << " GB/s"
+            << std::endl;
+}
+}  // namespace
+
 int main(int ac, char** av) {
   // Do benchmark.
   if (ac != 3) {
@@ -14,8 +33,31 @@ int main(int ac, char** av) {
   }
   size_t iter = atoi(av[2]);
   std::string b = ReadFromFileOrDie(AT_FDCWD, av[1]);
-  for (size_t i = 0; i < iter; ++i) {
-    base64decode(b);
+  const size_t size = base64decoded_size(b);
+  std::string out(size, '\0');
+  const std::pair<const char*, Base64Implementation> implementations[] = {
+      {"scalar", Base64Implementation::kScalar},
+      {"ssse3", Base64Implementation::kSsse3},
+      {"avx2", Base64Implementation::kAvx2},
+  };
+  // Throughput of the encoded input.
+  for (const auto& [name, implementation] : implementations) {
+    if (!base64implementation_supported(implementation)) {
+      std::cout << name << ": not supported" << std::endl;
+      continue;
+    }
+    Measure(name, b.size(), iter, [&]() {
+      size_t decoded = base64decode(b, out.data(), implementation);
+      assert(decoded == size);
+    });
   }
+  Measure("string", b.size(), iter, [&]() { base64decode(b); });
+  int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  assert(fd != -1);
+  Measure("fd", b.size(), iter, [&]() {
+    bool ok = base64decode_to_fd(b, fd);
+    assert(ok);
+  });
+  close(fd);
   return 0;
 }
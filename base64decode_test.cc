@@ -1,12 +1,84 @@
 #include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <string>
+#include <string_view>
 
 #include "base64decode.h"
+#include "strutil.h"
 
 std::string operator"" _b64(const char* str, std::size_t len) {
   std::string s(str, len);
   return base64decode(s);
 }
 
+namespace {
+std::string Encode(const std::string& data, size_t line_length) {
+  constexpr char kAlphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string encoded;
+  for (size_t i = 0; i < data.size(); i += 3) {
+    uint32_t bits = 0;
+    for (size_t j = 0; j < 3; ++j) {
+      bits <<= 8;
+      if (i + j < data.size()) bits |= static_cast<unsigned char>(data[i + j]);
+    }
+    for (size_t j = 0; j < 4; ++j) {
+      encoded += j <= data.size() - i ? kAlphabet[(bits >> (18 - j * 6)) & 63]
+                                      : '=';
+    }
+  }
+  if (line_length == 0) return encoded;
+  std::string lines;
+  for (size_t i = 0; i < encoded.size(); i += line_length) {
+    lines += encoded.substr(i, line_length) + "\n";
+  }
+  return lines;
+}
+
+std::string Data(size_t size) {
+  std::string data;
+  for (size_t i = 0; i < size; ++i) data += static_cast<char>(i * 37 + 11);
+  return data;
+}
+
+// All the implementations agree, with line breaks anywhere relative to
+// their blocks.
+void ImplementationsTest() {
+  for (size_t size = 0; size < 200; ++size) {
+    const std::string data = Data(size);
+    for (size_t line_length : {0, 1, 3, 4, 15, 16, 17, 31, 60, 76}) {
+      const std::string encoded = Encode(data, line_length);
+      assert(base64decoded_size(encoded) == size);
+      assert(base64decode(encoded) == data);
+      for (auto implementation :
+           {Base64Implementation::kScalar, Base64Implementation::kSsse3,
+            Base64Implementation::kAvx2}) {
+        if (!base64implementation_supported(implementation)) continue;
+        std::string out(size, '\0');
+        assert(base64decode(encoded, out.data(), implementation) == size);
+        assert(out == data);
+      }
+    }
+  }
+}
+
+void ToFdTest() {
+  // Larger than a piece, to carry incomplete groups over.
+  const std::string data = Data(1000000);
+  const std::string encoded = Encode(data, 61);
+  const char kPath[] = "out/base64decode_test.tmp";
+  int fd = open(kPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  assert(fd != -1);
+  assert(base64decode_to_fd(encoded, fd));
+  close(fd);
+  assert(ReadFromFileOrDie(AT_FDCWD, kPath) == data);
+  unlink(kPath);
+}
+}  // namespace
+
 int main(int argc, char** argv) {
   assert("aGVsbG8gd29ybGQK"_b64 == "hello world\n");
   assert("Mg=="_b64 == "2");
@@ -30,4 +102,10 @@ std::string PopenAndReadOrDie(const std::string& command,
   assert("AA==\n"_b64.size() == 1);
   assert("AAA=\n"_b64.size() == 2);
   assert("AAAA\n"_b64.size() == 3);
+
+  // Bytes outside of ASCII are skipped as well.
+  assert("aGVs\xff" "bG8=\x80"_b64 == "hello");
+
+  ImplementationsTest();
+  ToFdTest();
 }
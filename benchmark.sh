@@ -3,3 +3,8 @@
 #  sysctl kernel.perf_event_paranoid may need to be tweaked.
 perf stat -r 10 ./out/base64decode_benchmark testdata/base64encoded.txt 100000
 perf stat -r 10 ./out/jsonparser_util ./testdata/commits.json 1000
+perf stat -r 3 ./out/gitlstree_benchmark 1000000
+./out/gitlstree_benchmark 100000 .
+perf stat -r 3 ./out/directory_container_benchmark 1000000
+perf stat -r 3 ./out/cached_file_benchmark 100000 1024
+./stat_benchmark.sh 10
@@ -0,0 +1,195 @@
+#include "blob_prefetcher.h"
+
+#include <assert.h>
+
+#include <algorithm>
+#include <sstream>
+
+using std::lock_guard;
+using std::mutex;
+using std::string;
+using std::string_view;
+using std::unique_lock;
+using std::vector;
+
+namespace blob_prefetcher {
+
+namespace {
+string_view StripLeadingSlashes(string_view path) {
+  while (!path.empty() && path[0] == '/') path.remove_prefix(1);
+  return path;
+}
+}  // namespace
+
+bool BlobPrefetcher::ItemLater::operator()(const Item& a,
+                                           const Item& b) const {
+  if (a.priority != b.priority) return a.priority > b.priority;
+  if (smallest_first && a.size != b.size) return a.size > b.size;
+  return a.sequence > b.sequence;
+}
+
+BlobPrefetcher::BlobPrefetcher(const Config& config,
+                               std::function<bool(const string& sha1)> fetch)
+    : config_(config),
+      fetch_([fetch](const vector<string>& sha1s) {
+        vector<bool> ok;
+        for (const auto& sha1 : sha1s) ok.push_back(fetch(sha1));
+        return ok;
+      }),
+      // So that each blob can be paused for foreground fetches.
+      max_batch_blobs_(1),
+      queue_(ItemLater(config.smallest_first)) {}
+
+BlobPrefetcher::BlobPrefetcher(
+    const Config& config,
+    std::function<vector<bool>(const vector<string>& sha1s)> fetch)
+    : config_(config),
+      fetch_(fetch),
+      max_batch_blobs_(std::max<size_t>(config.max_batch_blobs, 1)),
+      queue_(ItemLater(config.smallest_first)) {}
+
+BlobPrefetcher::~BlobPrefetcher() { Cancel(); }
+
+size_t BlobPrefetcher::Priority(string_view path) const {
+  path = StripLeadingSlashes(path);
+  for (size_t i = 0; i < config_.priority_paths.size(); ++i) {
+    string_view prefix = StripLeadingSlashes(config_.priority_paths[i]);
+    if (path.substr(0, prefix.size()) == prefix) return i;
+  }
+  return config_.priority_paths.size();
+}
+
+void BlobPrefetcher::Add(const string& sha1, size_t size, string_view path) {
+  const size_t priority = Priority(path);
+  {
+    lock_guard<mutex> l(mutex_);
+    if (cancelled_ || !seen_.insert(sha1).second) return;
+    queue_.push(Item{priority, size, sequence_++, sha1});
+    added_blobs_++;
+    added_bytes_ += size;
+  }
+  cv_.notify_one();
+}
+
+void BlobPrefetcher::Start() {
+  lock_guard<mutex> l(mutex_);
+  assert(!thread_.joinable());
+  if (cancelled_) return;
+  thread_ = std::thread([this]() { Run(); });
+}
+
+void BlobPrefetcher::Cancel() {
+  {
+    lock_guard<mutex> l(mutex_);
+    cancelled_ = true;
+    queue_ = decltype(queue_)(ItemLater(config_.smallest_first));
+  }
+  cv_.notify_all();
+  idle_cv_.notify_all();
+  if (thread_.joinable()) thread_.join();
+}
+
+void BlobPrefetcher::WaitIdle() {
+  unique_lock<mutex> l(mutex_);
+  idle_cv_.wait(l, [this]() {
+    return cancelled_ || (queue_.empty() && !in_progress_);
+  });
+}
+
+void BlobPrefetcher::Run() {
+  unique_lock<mutex> l(mutex_);
+  while (!cancelled_) {
+    if (queue_.empty()) {
+      idle_cv_.notify_all();
+      cv_.wait(l);
+      continue;
+    }
+    if (foreground_ > 0) {
+      cv_.wait(l);
+      continue;
+    }
+    const auto now = std::chrono::steady_clock::now();
+    if (now < next_fetch_time_) {
+      cv_.wait_until(l, next_fetch_time_);
+      continue;
+    }
+
+    // At least one blob, then up to the limits.
+    const size_t max_batch_bytes =
+        config_.bytes_per_second
+            ? std::min(config_.bytes_per_second, config_.max_batch_bytes)
+            : config_.max_batch_bytes;
+    vector<Item> batch;
+    vector<string> sha1s;
+    size_t batch_bytes = 0;
+    while (!queue_.empty() && batch.size() < max_batch_blobs_ &&
+           (batch.empty() ||
+            batch_bytes + queue_.top().size <= max_batch_bytes)) {
+      batch.push_back(queue_.top());
+      queue_.pop();
+      sha1s.push_back(batch.back().sha1);
+      batch_bytes += batch.back().size;
+    }
+    in_progress_ = true;
+    l.unlock();
+    vector<bool> ok = fetch_(sha1s);
+    l.lock();
+    in_progress_ = false;
+    ok.resize(batch.size());
+    for (size_t i = 0; i < batch.size(); ++i) {
+      if (ok[i]) {
+        fetched_blobs_++;
+        fetched_bytes_ += batch[i].size;
+      } else {
+        failed_blobs_++;
+      }
+    }
+    if (config_.bytes_per_second) {
+      next_fetch_time_ =
+          std::max(now, next_fetch_time_) +
+          std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+              std::chrono::duration<double>(
+                  static_cast<double>(batch_bytes) / config_.bytes_per_second));
+    }
+  }
+  idle_cv_.notify_all();
+}
+
+BlobPrefetcher::ForegroundScope::ForegroundScope(BlobPrefetcher* prefetcher)
+    : prefetcher_(prefetcher) {
+  if (!prefetcher_) return;
+  lock_guard<mutex> l(prefetcher_->mutex_);
+  prefetcher_->foreground_++;
+}
+
+BlobPrefetcher::ForegroundScope::~ForegroundScope() {
+  if (!prefetcher_) return;
+  {
+    lock_guard<mutex> l(prefetcher_->mutex_);
+    prefetcher_->foreground_--;
+  }
+  prefetcher_->cv_.notify_one();
+}
+
+string BlobPrefetcher::Status() const {
+  lock_guard<mutex> l(mutex_);
+  const char* state;
+  if (cancelled_) {
+    state = "cancelled";
+  } else if (!thread_.joinable()) {
+    state = "not started";
+  } else if (queue_.empty() && !in_progress_) {
+    state = "done";
+  } else if (foreground_ > 0) {
+    state = "paused";
+  } else {
+    state = "running";
+  }
+  std::stringstream ss;
+  ss << "prefetch: " << fetched_blobs_ << "/" << added_blobs_ << " blobs "
+     << fetched_bytes_ << "/" << added_bytes_ << " bytes " << failed_blobs_
+     << " failed " << state << std::endl;
+  return ss.str();
+}
+
+}  // namespace blob_prefetcher
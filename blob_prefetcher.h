@@ -0,0 +1,127 @@
+#ifndef BLOB_PREFETCHER_H_
+#define BLOB_PREFETCHER_H_
+/**
+ * Fetches blobs into the cache on a background thread so that the
+ * first open of a file does not have to wait for git.
+ */
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "disallow.h"
+
+namespace blob_prefetcher {
+
+class BlobPrefetcher {
+ public:
+  struct Config {
+    Config() {}
+
+    // Blobs under these path prefixes are fetched first, in the order
+    // given. Leading slashes are ignored.
+    std::vector<std::string> priority_paths{};
+    // Within the same priority, fetch smaller blobs first instead of in
+    // the order they were added.
+    bool smallest_first{true};
+    // Rate limit, 0 for unlimited. Also limits the bytes in a batch.
+    size_t bytes_per_second{0};
+    // Limits of blobs passed to a batch fetch function at once. A batch
+    // is not paused by foreground fetches.
+    size_t max_batch_blobs{256};
+    size_t max_batch_bytes{16 << 20};
+  };
+
+  // |fetch| stores the blob |sha1| in the cache and returns false on
+  // failure. It is called from the background thread.
+  BlobPrefetcher(const Config& config,
+                 std::function<bool(const std::string& sha1)> fetch);
+  // Same, with |fetch| storing many blobs at once, for fetching in
+  // one pipelined pass. Returns whether each of them succeeded.
+  BlobPrefetcher(const Config& config,
+                 std::function<std::vector<bool>(
+                     const std::vector<std::string>& sha1s)>
+                     fetch);
+  // Cancels and waits for the blob being fetched, if any.
+  ~BlobPrefetcher();
+
+  // Queue a blob. Blobs already queued are ignored. Can be called
+  // before or after Start().
+  void Add(const std::string& sha1, size_t size, std::string_view path);
+  void Start();
+  // Stop fetching, remaining blobs are dropped.
+  void Cancel();
+  // Wait until the queue is drained or cancelled.
+  void WaitIdle();
+
+  // Prefetching is paused while a foreground fetch is in progress, so
+  // that opens do not queue behind prefetched blobs.
+  class ForegroundScope {
+   public:
+    // |prefetcher| may be nullptr.
+    explicit ForegroundScope(BlobPrefetcher* prefetcher);
+    ~ForegroundScope();
+
+   private:
+    BlobPrefetcher* const prefetcher_;
+    DISALLOW_COPY_AND_ASSIGN(ForegroundScope);
+  };
+
+  // One line summary of the progress for /.status.
+  std::string Status() const;
+
+ private:
+  struct Item {
+    size_t priority;
+    size_t size;
+    // Order of Add() calls.
+    size_t sequence;
+    std::string sha1;
+  };
+  // For priority_queue, which pops the largest element first.
+  struct ItemLater {
+    explicit ItemLater(bool smallest_first) : smallest_first(smallest_first) {}
+    bool operator()(const Item& a, const Item& b) const;
+    bool smallest_first;
+  };
+
+  size_t Priority(std::string_view path) const;
+  void Run();
+
+  const Config config_;
+  const std::function<std::vector<bool>(const std::vector<std::string>& sha1s)>
+      fetch_;
+  // 1 for the single blob fetch function.
+  const size_t max_batch_blobs_;
+
+  mutable std::mutex mutex_{};
+  std::condition_variable cv_{};
+  std::condition_variable idle_cv_{};
+  std::priority_queue<Item, std::vector<Item>, ItemLater> queue_;
+  std::unordered_set<std::string> seen_{};
+  size_t sequence_{};
+  int foreground_{};
+  bool in_progress_{};
+  bool cancelled_{};
+  std::chrono::steady_clock::time_point next_fetch_time_{};
+
+  // Progress.
+  size_t added_blobs_{};
+  size_t added_bytes_{};
+  size_t fetched_blobs_{};
+  size_t fetched_bytes_{};
+  size_t failed_blobs_{};
+
+  std::thread thread_{};
+  DISALLOW_COPY_AND_ASSIGN(BlobPrefetcher);
+};
+
+}  // namespace blob_prefetcher
+
+#endif
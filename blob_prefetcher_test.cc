@@ -0,0 +1,109 @@
+#include "blob_prefetcher.h"
+
+#include <assert.h>
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using blob_prefetcher::BlobPrefetcher;
+using std::string;
+using std::vector;
+
+void TestOrder() {
+  BlobPrefetcher::Config config;
+  config.priority_paths = {"/docs/"};
+  std::mutex m;
+  vector<string> fetched;
+  BlobPrefetcher prefetcher(config, [&](const string& sha1) {
+    std::lock_guard<std::mutex> l(m);
+    fetched.push_back(sha1);
+    return sha1 != "bad";
+  });
+  prefetcher.Add("large", 1000, "/src/large.cc");
+  prefetcher.Add("small", 10, "src/small.cc");
+  prefetcher.Add("doc", 5000, "/docs/README");
+  prefetcher.Add("bad", 100, "/src/bad.cc");
+  // Same blob at a different path is only fetched once.
+  prefetcher.Add("small", 10, "/src/copy_of_small.cc");
+  assert(prefetcher.Status().find("not started") != string::npos);
+  prefetcher.Start();
+  prefetcher.WaitIdle();
+
+  assert((fetched == vector<string>{"doc", "small", "bad", "large"}));
+  assert(prefetcher.Status() ==
+         "prefetch: 3/4 blobs 6010/6110 bytes 1 failed done\n");
+}
+
+void TestForegroundPausesPrefetch() {
+  int count = 0;
+  BlobPrefetcher prefetcher(BlobPrefetcher::Config(),
+                            [&count](const string&) {
+                              count++;
+                              return true;
+                            });
+  prefetcher.Add("a", 1, "a");
+  {
+    BlobPrefetcher::ForegroundScope foreground(&prefetcher);
+    prefetcher.Start();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    assert(count == 0);
+    assert(prefetcher.Status().find("paused") != string::npos);
+  }
+  prefetcher.WaitIdle();
+  assert(count == 1);
+  // nullptr is allowed when prefetching is disabled.
+  BlobPrefetcher::ForegroundScope no_prefetcher(nullptr);
+}
+
+void TestRateLimitAndCancel() {
+  BlobPrefetcher::Config config;
+  config.bytes_per_second = 1000;
+  int count = 0;
+  BlobPrefetcher prefetcher(config, [&count](const string&) {
+    count++;
+    return true;
+  });
+  for (int i = 0; i < 10; ++i) {
+    prefetcher.Add(std::to_string(i), 1000, "a");
+  }
+  prefetcher.Start();
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  prefetcher.Cancel();
+  // One blob per second.
+  assert(count == 1);
+  assert(prefetcher.Status().find("cancelled") != string::npos);
+  prefetcher.WaitIdle();
+}
+
+void TestBatch() {
+  BlobPrefetcher::Config config;
+  config.max_batch_blobs = 3;
+  config.max_batch_bytes = 100;
+  vector<vector<string>> batches;
+  BlobPrefetcher prefetcher(config, [&batches](const vector<string>& sha1s) {
+    batches.push_back(sha1s);
+    return vector<bool>(sha1s.size(), sha1s[0] != "e");
+  });
+  prefetcher.Add("a", 10, "a");
+  prefetcher.Add("b", 20, "b");
+  prefetcher.Add("c", 30, "c");
+  prefetcher.Add("d", 40, "d");
+  prefetcher.Add("e", 200, "e");
+  prefetcher.Start();
+  prefetcher.WaitIdle();
+  // Up to 3 blobs and 100 bytes, but at least one blob.
+  assert((batches == vector<vector<string>>{{"a", "b", "c"}, {"d"}, {"e"}}));
+  assert(prefetcher.Status() ==
+         "prefetch: 4/5 blobs 100/300 bytes 1 failed done\n");
+}
+
+int main(int argc, char** argv) {
+  TestOrder();
+  TestForegroundPausesPrefetch();
+  TestRateLimitAndCancel();
+  TestBatch();
+  return 0;
+}
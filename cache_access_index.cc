@@ -0,0 +1,180 @@
+#include "cache_access_index.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+#include <string_view>
+
+using std::string;
+using std::string_view;
+
+namespace {
+// Accesses closer than this to the recorded one are not logged again,
+// to keep the log small. Eviction works at a much coarser granularity.
+constexpr time_t kTouchResolution = 60 * 60;
+// Rewrite the log when it has this many times more records than live
+// entries.
+constexpr size_t kCompactRatio = 4;
+constexpr size_t kMinRecordsToCompact = 1024;
+}  // namespace
+
+CacheAccessIndex::CacheAccessIndex(const string& log_path)
+    : log_path_(log_path), log_fd_(-1) {
+  Load();
+  log_fd_.reset(open(log_path_.c_str(),
+                     O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600));
+  if (log_fd_.get() == -1) {
+    perror(("open " + log_path_).c_str());
+  }
+  MaybeCompactLog();
+}
+
+CacheAccessIndex::~CacheAccessIndex() {}
+
+void CacheAccessIndex::Load() {
+  ScopedFd fd(open(log_path_.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd.get() == -1) return;
+  string log;
+  char buf[65536];
+  ssize_t n;
+  while ((n = read(fd.get(), buf, sizeof(buf))) > 0) {
+    log.append(buf, n);
+  }
+
+  // A partially written last line is ignored.
+  string_view rest(log);
+  size_t newline;
+  while ((newline = rest.find('\n')) != string_view::npos) {
+    const string_view line = rest.substr(0, newline);
+    rest.remove_prefix(newline + 1);
+    log_records_++;
+    if (line == "B") {
+      bootstrapped_ = true;
+    } else if (line.substr(0, 2) == "R ") {
+      Erase(string(line.substr(2)));
+    } else if (line.substr(0, 2) == "T ") {
+      // T <time> <size> <name>
+      const size_t space1 = line.find(' ', 2);
+      if (space1 == string_view::npos) continue;
+      const size_t space2 = line.find(' ', space1 + 1);
+      if (space2 == string_view::npos) continue;
+      const time_t time = strtoll(string(line.substr(2, space1 - 2)).c_str(),
+                                  nullptr, 10);
+      const size_t size = strtoull(
+          string(line.substr(space1 + 1, space2 - space1 - 1)).c_str(),
+          nullptr, 10);
+      Apply(string(line.substr(space2 + 1)), size, time);
+    }
+  }
+}
+
+void CacheAccessIndex::Append(const string& record) {
+  log_records_++;
+  if (log_fd_.get() == -1) return;
+  if (write(log_fd_.get(), record.data(), record.size()) !=
+      static_cast<ssize_t>(record.size())) {
+    perror(("write " + log_path_).c_str());
+  }
+}
+
+void CacheAccessIndex::Apply(const string& name, size_t size, time_t time) {
+  auto it = entries_.find(name);
+  if (it != entries_.end()) {
+    total_bytes_ -= it->second.size;
+    by_time_.erase({it->second.time, name});
+    it->second = Entry{size, time};
+  } else {
+    entries_.emplace(name, Entry{size, time});
+  }
+  total_bytes_ += size;
+  by_time_.emplace(time, name);
+}
+
+void CacheAccessIndex::Erase(const string& name) {
+  auto it = entries_.find(name);
+  if (it == entries_.end()) return;
+  total_bytes_ -= it->second.size;
+  by_time_.erase({it->second.time, name});
+  entries_.erase(it);
+}
+
+void CacheAccessIndex::Touch(const string& name, size_t size, time_t time) {
+  auto it = entries_.find(name);
+  const bool recently_logged = it != entries_.end() &&
+                               it->second.size == size &&
+                               time - it->second.time < kTouchResolution;
+  if (recently_logged) return;
+  Apply(name, size, time);
+  Append("T " + std::to_string(time) + " " + std::to_string(size) + " " +
+         name + "\n");
+  MaybeCompactLog();
+}
+
+void CacheAccessIndex::AddIfAbsent(const string& name, size_t size,
+                                   time_t time) {
+  if (entries_.find(name) == entries_.end()) Touch(name, size, time);
+}
+
+void CacheAccessIndex::Remove(const string& name) {
+  if (entries_.find(name) == entries_.end()) return;
+  Erase(name);
+  Append("R " + name + "\n");
+  MaybeCompactLog();
+}
+
+void CacheAccessIndex::set_bootstrapped() {
+  if (bootstrapped_) return;
+  bootstrapped_ = true;
+  Append("B\n");
+}
+
+std::vector<string> CacheAccessIndex::EvictionCandidates(time_t now,
+                                                         time_t max_age,
+                                                         size_t max_bytes,
+                                                         size_t limit) const {
+  std::vector<string> candidates;
+  size_t remaining_bytes = total_bytes_;
+  for (const auto& [time, name] : by_time_) {
+    if (candidates.size() >= limit) break;
+    const bool too_old = now - time > max_age;
+    const bool over_budget = max_bytes && remaining_bytes > max_bytes;
+    if (!too_old && !over_budget) break;
+    candidates.push_back(name);
+    remaining_bytes -= entries_.find(name)->second.size;
+  }
+  return candidates;
+}
+
+void CacheAccessIndex::MaybeCompactLog() {
+  if (log_records_ < kMinRecordsToCompact ||
+      log_records_ < entries_.size() * kCompactRatio) {
+    return;
+  }
+  const string temporary = log_path_ + ".tmp";
+  ScopedFd fd(open(temporary.c_str(),
+                   O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+  if (fd.get() == -1) {
+    perror(("open " + temporary).c_str());
+    return;
+  }
+  string log;
+  for (const auto& [time, name] : by_time_) {
+    log += "T " + std::to_string(time) + " " +
+           std::to_string(entries_.find(name)->second.size) + " " + name +
+           "\n";
+  }
+  if (bootstrapped_) log += "B\n";
+  if (write(fd.get(), log.data(), log.size()) !=
+          static_cast<ssize_t>(log.size()) ||
+      rename(temporary.c_str(), log_path_.c_str()) == -1) {
+    perror(("write " + temporary).c_str());
+    unlink(temporary.c_str());
+    return;
+  }
+  log_fd_.reset(open(log_path_.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC));
+  log_records_ = entries_.size() + (bootstrapped_ ? 1 : 0);
+}
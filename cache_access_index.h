@@ -0,0 +1,75 @@
+#ifndef CACHE_ACCESS_INDEX_H_
+#define CACHE_ACCESS_INDEX_H_
+/**
+ * Persistent index of the objects in a cache directory, with their
+ * size and last access time, so that garbage collection does not need
+ * to walk the directory.
+ *
+ * Changes are appended to a log file which is replayed on load, and
+ * rewritten once it has grown to several times the number of live
+ * entries. Not thread safe.
+ */
+#include <time.h>
+
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "disallow.h"
+#include "scoped_fd.h"
+
+class CacheAccessIndex {
+ public:
+  explicit CacheAccessIndex(const std::string& log_path);
+  ~CacheAccessIndex();
+
+  // Record that |name| of |size| bytes was accessed at |time|.
+  void Touch(const std::string& name, size_t size, time_t time);
+  // Same as Touch, but does nothing if |name| is already known. For
+  // adding files found on disk.
+  void AddIfAbsent(const std::string& name, size_t size, time_t time);
+  void Remove(const std::string& name);
+
+  // Names that should be evicted, least recently accessed first: those
+  // older than |max_age| seconds, and then more until the total is
+  // within |max_bytes| (0 for no limit). At most |limit| names.
+  std::vector<std::string> EvictionCandidates(time_t now, time_t max_age,
+                                              size_t max_bytes,
+                                              size_t limit) const;
+
+  // Whether all files on disk have been added, for caches that existed
+  // before the index.
+  bool bootstrapped() const { return bootstrapped_; }
+  void set_bootstrapped();
+
+  size_t size() const { return entries_.size(); }
+  size_t total_bytes() const { return total_bytes_; }
+
+ private:
+  struct Entry {
+    size_t size;
+    time_t time;
+  };
+
+  void Load();
+  void Append(const std::string& record);
+  void Apply(const std::string& name, size_t size, time_t time);
+  void Erase(const std::string& name);
+  // Rewrite the log with the live entries if it has grown too much.
+  void MaybeCompactLog();
+
+  const std::string log_path_;
+  ScopedFd log_fd_;
+  std::unordered_map<std::string, Entry> entries_{};
+  // Ordered by access time.
+  std::set<std::pair<time_t, std::string>> by_time_{};
+  size_t total_bytes_{};
+  bool bootstrapped_{};
+  // Records in the log file, live or not.
+  size_t log_records_{};
+  DISALLOW_COPY_AND_ASSIGN(CacheAccessIndex);
+};
+
+#endif
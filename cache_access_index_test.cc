@@ -0,0 +1,82 @@
+#include "cache_access_index.h"
+
+#include <assert.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+namespace {
+const char kLog[] = "out/cache_access_index_test.log";
+
+void EvictionOrderTest() {
+  unlink(kLog);
+  CacheAccessIndex index(kLog);
+  index.Touch("old", 100, 1000);
+  index.Touch("new", 100, 5000);
+  index.Touch("middle", 100, 3000);
+  assert(index.total_bytes() == 300);
+
+  // By age.
+  assert((index.EvictionCandidates(6000, 2500, 0, 10) ==
+          vector<string>{"old", "middle"}));
+  // By size, least recently accessed first.
+  assert((index.EvictionCandidates(6000, 10000, 150, 10) ==
+          vector<string>{"old", "middle"}));
+  assert((index.EvictionCandidates(6000, 10000, 250, 10) ==
+          vector<string>{"old"}));
+  assert(index.EvictionCandidates(6000, 10000, 300, 10).empty());
+  // Bounded.
+  assert((index.EvictionCandidates(6000, 0, 0, 1) == vector<string>{"old"}));
+
+  // Access makes it most recent.
+  index.Touch("old", 100, 9000);
+  assert((index.EvictionCandidates(9500, 10000, 250, 10) ==
+          vector<string>{"middle"}));
+}
+
+void ReplayTest() {
+  unlink(kLog);
+  {
+    CacheAccessIndex index(kLog);
+    index.Touch("a", 1, 1000);
+    index.Touch("b", 2, 2000);
+    index.Remove("a");
+    index.AddIfAbsent("b", 20, 500);
+    index.set_bootstrapped();
+  }
+  CacheAccessIndex index(kLog);
+  assert(index.size() == 1);
+  assert(index.total_bytes() == 2);
+  assert(index.bootstrapped());
+}
+
+void CompactLogTest() {
+  unlink(kLog);
+  {
+    CacheAccessIndex index(kLog);
+    for (int i = 0; i < 10000; ++i) {
+      index.Touch("same", i, i);
+    }
+  }
+  struct stat st;
+  assert(stat(kLog, &st) == 0);
+  // Rewritten instead of keeping all 10000 records.
+  assert(st.st_size < 1024 * 20);
+  CacheAccessIndex index(kLog);
+  assert(index.size() == 1);
+  assert(index.total_bytes() == 9999);
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  EvictionOrderTest();
+  ReplayTest();
+  CompactLogTest();
+  return 0;
+}
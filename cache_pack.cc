@@ -0,0 +1,647 @@
+#include "cache_pack.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::string_view;
+
+namespace {
+constexpr char kIndexMagic[8] = {'C', 'P', 'I', 'D', 'X', '0', '0', '1'};
+constexpr uint32_t kRecordMagic = 0x31504b43;  // "CKP1"
+// Space of a cancelled reservation, skipped on recovery.
+constexpr uint32_t kPaddingMagic = 0x44504b43;  // "CKPD"
+constexpr uint64_t kInitialCapacity = 1024;
+
+struct RecordHeader {
+  uint32_t magic;
+  uint32_t key_size;
+  uint64_t value_size;
+  // Of key and value.
+  uint64_t checksum;
+};
+
+constexpr uint64_t kFnvOffset = 14695981039346656037ULL;
+constexpr uint64_t kFnvPrime = 1099511628211ULL;
+
+uint64_t Fnv1a(string_view data, uint64_t hash = kFnvOffset) {
+  for (unsigned char c : data) {
+    hash ^= c;
+    hash *= kFnvPrime;
+  }
+  return hash;
+}
+
+// Records are 8 byte aligned.
+constexpr char kPadding[8]{};
+
+uint64_t RecordSize(uint64_t key_size, uint64_t value_size) {
+  return (sizeof(RecordHeader) + key_size + value_size + 7) & ~7ULL;
+}
+
+uint32_t Today() { return time(nullptr) / (24 * 60 * 60); }
+
+bool PwriteRecord(int fd, uint64_t offset, string_view key, string_view value) {
+  RecordHeader header{kRecordMagic, static_cast<uint32_t>(key.size()),
+                      value.size(), Fnv1a(value, Fnv1a(key))};
+  const uint64_t record_size = RecordSize(key.size(), value.size());
+  struct iovec iov[] = {
+      {&header, sizeof(header)},
+      {const_cast<char*>(key.data()), key.size()},
+      {const_cast<char*>(value.data()), value.size()},
+      {const_cast<char*>(kPadding),
+       record_size - sizeof(header) - key.size() - value.size()}};
+  // Written with one call so that a record is either complete or is
+  // detected as truncated on recovery.
+  ssize_t written = pwritev(fd, iov, 4, offset);
+  if (written != static_cast<ssize_t>(record_size)) {
+    if (written == -1) perror("pwritev pack");
+    return false;
+  }
+  return true;
+}
+
+// Copy |size| bytes of whole records at |from| in |source| to |to| in
+// |destination|.
+bool CopyRecords(int source, uint64_t from, int destination, uint64_t to,
+                 uint64_t size) {
+  string buffer;
+  while (size > 0) {
+    buffer.resize(std::min<uint64_t>(size, 1 << 20));
+    if (pread(source, buffer.data(), buffer.size(), from) !=
+        static_cast<ssize_t>(buffer.size())) {
+      perror("pread pack");
+      return false;
+    }
+    if (pwrite(destination, buffer.data(), buffer.size(), to) !=
+        static_cast<ssize_t>(buffer.size())) {
+      perror("pwrite pack");
+      return false;
+    }
+    from += buffer.size();
+    to += buffer.size();
+    size -= buffer.size();
+  }
+  return true;
+}
+}  // namespace
+
+struct CachePack::IndexHeader {
+  char magic[8];
+  uint64_t capacity;
+  uint64_t count;
+  // Size of the pack that the index covers.
+  uint64_t pack_size;
+  // Set while the index is open for writing.
+  uint64_t dirty;
+};
+
+struct CachePack::Slot {
+  uint64_t hash;
+  // 0 for empty slots.
+  uint64_t record_offset_plus_one;
+  // Days since epoch.
+  uint32_t access_day;
+  uint32_t unused;
+};
+
+/* static */
+size_t CachePack::IndexFileSize(uint64_t capacity) {
+  return sizeof(IndexHeader) + capacity * sizeof(Slot);
+}
+
+CachePack::CachePack(const string& dir)
+    : dir_(dir), pack_fd_(-1), index_fd_(-1) {}
+
+CachePack::~CachePack() {
+  if (index_) {
+    // The pack needs to be on disk before the index claims to be clean.
+    fdatasync(pack_fd_.get());
+    index_->dirty = 0;
+    msync(index_, index_mapped_size_, MS_SYNC);
+    UnmapIndex();
+  }
+}
+
+/* static */
+std::unique_ptr<CachePack> CachePack::Open(const string& dir) {
+  std::unique_ptr<CachePack> pack(new CachePack(dir));
+  if (!pack->OpenFiles()) return nullptr;
+  return pack;
+}
+
+bool CachePack::OpenFiles() {
+  const string pack_path = dir_ + "pack";
+  pack_fd_.reset(open(pack_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600));
+  if (pack_fd_.get() == -1) {
+    perror(("open " + pack_path).c_str());
+    return false;
+  }
+  struct stat st;
+  if (fstat(pack_fd_.get(), &st) == -1) {
+    perror(("fstat " + pack_path).c_str());
+    return false;
+  }
+  pack_size_ = st.st_size;
+
+  if (!MapIndex() || index_->dirty || index_->pack_size != pack_size_) {
+    if (pack_size_ > 0) {
+      std::cout << "Rebuilding pack index " << dir_ << std::endl;
+    }
+    if (!RebuildIndex()) return false;
+  }
+  index_->dirty = 1;
+  return true;
+}
+
+bool CachePack::MapIndex() {
+  UnmapIndex();
+  const string index_path = dir_ + "pack.idx";
+  index_fd_.reset(open(index_path.c_str(), O_RDWR | O_CLOEXEC));
+  if (index_fd_.get() == -1) return false;
+  struct stat st;
+  if (fstat(index_fd_.get(), &st) == -1 ||
+      static_cast<size_t>(st.st_size) < sizeof(IndexHeader)) {
+    return false;
+  }
+  void* m = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                 index_fd_.get(), 0);
+  if (m == MAP_FAILED) {
+    perror(("mmap " + index_path).c_str());
+    return false;
+  }
+  index_ = static_cast<IndexHeader*>(m);
+  index_mapped_size_ = st.st_size;
+  const uint64_t capacity = index_->capacity;
+  if (memcmp(index_->magic, kIndexMagic, sizeof(kIndexMagic)) != 0 ||
+      capacity == 0 || (capacity & (capacity - 1)) != 0 ||
+      IndexFileSize(capacity) != index_mapped_size_) {
+    UnmapIndex();
+    return false;
+  }
+  return true;
+}
+
+void CachePack::UnmapIndex() {
+  if (index_) {
+    munmap(index_, index_mapped_size_);
+    index_ = nullptr;
+    index_mapped_size_ = 0;
+  }
+}
+
+CachePack::IndexHeader* CachePack::CreateIndex(uint64_t capacity,
+                                               ScopedFd* fd) {
+  const string temporary = dir_ + "pack.idx.tmp";
+  unlink(temporary.c_str());
+  fd->reset(
+      open(temporary.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600));
+  if (fd->get() == -1) {
+    perror(("open " + temporary).c_str());
+    return nullptr;
+  }
+  const size_t size = IndexFileSize(capacity);
+  if (ftruncate(fd->get(), size) == -1) {
+    perror(("ftruncate " + temporary).c_str());
+    unlink(temporary.c_str());
+    return nullptr;
+  }
+  void* m =
+      mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd->get(), 0);
+  if (m == MAP_FAILED) {
+    perror(("mmap " + temporary).c_str());
+    unlink(temporary.c_str());
+    return nullptr;
+  }
+  IndexHeader* header = static_cast<IndexHeader*>(m);
+  memcpy(header->magic, kIndexMagic, sizeof(kIndexMagic));
+  header->capacity = capacity;
+  header->pack_size = pack_size_;
+  header->dirty = 1;
+  return header;
+}
+
+void CachePack::SwitchIndex(IndexHeader* header, ScopedFd&& fd) {
+  const string index_path = dir_ + "pack.idx";
+  const string temporary = index_path + ".tmp";
+  if (rename(temporary.c_str(), index_path.c_str()) == -1) {
+    // Not fatal: the previous index file is still marked dirty, and is
+    // rebuilt on the next open.
+    perror(("rename " + temporary).c_str());
+  }
+  UnmapIndex();
+  index_ = header;
+  index_mapped_size_ = IndexFileSize(header->capacity);
+  index_fd_ = std::move(fd);
+}
+
+void CachePack::DiscardIndex(IndexHeader* header) {
+  munmap(header, IndexFileSize(header->capacity));
+  unlink((dir_ + "pack.idx.tmp").c_str());
+}
+
+/* static */
+void CachePack::InsertSlot(IndexHeader* header, const Slot& slot) {
+  Slot* slots = reinterpret_cast<Slot*>(header + 1);
+  const uint64_t mask = header->capacity - 1;
+  uint64_t i = slot.hash & mask;
+  while (slots[i].record_offset_plus_one) i = (i + 1) & mask;
+  slots[i] = slot;
+  header->count++;
+}
+
+bool CachePack::GrowIndex() {
+  ScopedFd fd(-1);
+  IndexHeader* header = CreateIndex(index_->capacity * 2, &fd);
+  if (!header) return false;
+  const Slot* slots = reinterpret_cast<const Slot*>(index_ + 1);
+  for (uint64_t i = 0; i < index_->capacity; ++i) {
+    if (slots[i].record_offset_plus_one) InsertSlot(header, slots[i]);
+  }
+  SwitchIndex(header, std::move(fd));
+  return true;
+}
+
+bool CachePack::RebuildIndex() {
+  // Access days of the records that the previous index has. The others
+  // were appended just before a crash, or the index was lost; they get
+  // the oldest day so that garbage collection does not keep them
+  // forever.
+  std::unordered_map<uint64_t, uint32_t> access_days;
+  if (index_) {
+    const Slot* slots = reinterpret_cast<const Slot*>(index_ + 1);
+    for (uint64_t i = 0; i < index_->capacity; ++i) {
+      if (slots[i].record_offset_plus_one) {
+        access_days[slots[i].record_offset_plus_one - 1] =
+            slots[i].access_day;
+      }
+    }
+  }
+  ScopedFd fd(-1);
+  IndexHeader* index = CreateIndex(kInitialCapacity, &fd);
+  if (!index) return false;
+  SwitchIndex(index, std::move(fd));
+
+  uint64_t offset = 0;
+  string record;
+  while (offset + sizeof(RecordHeader) <= pack_size_) {
+    RecordHeader header;
+    if (pread(pack_fd_.get(), &header, sizeof(header), offset) !=
+            sizeof(header) ||
+        (header.magic != kRecordMagic && header.magic != kPaddingMagic)) {
+      break;
+    }
+    const uint64_t record_size = RecordSize(header.key_size, header.value_size);
+    if (offset + record_size > pack_size_) break;
+    if (header.magic == kPaddingMagic) {
+      offset += record_size;
+      continue;
+    }
+    record.resize(header.key_size + header.value_size);
+    if (pread(pack_fd_.get(), record.data(), record.size(),
+              offset + sizeof(header)) !=
+        static_cast<ssize_t>(record.size())) {
+      break;
+    }
+    const string_view key(record.data(), header.key_size);
+    const string_view value(record.data() + header.key_size,
+                            header.value_size);
+    if (Fnv1a(value, Fnv1a(key)) != header.checksum) break;
+    Location unused;
+    Slot* slot = FindSlot(Fnv1a(key), key, &unused);
+    if (!slot->record_offset_plus_one) {
+      index_->count++;
+      slot->hash = Fnv1a(key);
+    }
+    // Later records replace earlier ones.
+    slot->record_offset_plus_one = offset + 1;
+    auto day = access_days.find(offset);
+    slot->access_day = day == access_days.end() ? 0 : day->second;
+    offset += record_size;
+    if (index_->count * 4 > index_->capacity * 3 && !GrowIndex()) {
+      return false;
+    }
+  }
+  if (offset != pack_size_) {
+    std::cout << "Truncating pack " << dir_ << " from " << pack_size_
+              << " to " << offset << std::endl;
+    if (ftruncate(pack_fd_.get(), offset) == -1) {
+      perror("ftruncate pack");
+      return false;
+    }
+    pack_size_ = offset;
+  }
+  index_->pack_size = pack_size_;
+  return true;
+}
+
+bool CachePack::MatchRecord(uint64_t record_offset, string_view key,
+                            Location* location) {
+  key_buffer_.resize(sizeof(RecordHeader) + key.size());
+  if (pread(pack_fd_.get(), key_buffer_.data(), key_buffer_.size(),
+            record_offset) != static_cast<ssize_t>(key_buffer_.size())) {
+    return false;
+  }
+  RecordHeader header;
+  memcpy(&header, key_buffer_.data(), sizeof(header));
+  if (header.magic != kRecordMagic || header.key_size != key.size() ||
+      memcmp(key_buffer_.data() + sizeof(header), key.data(), key.size()) !=
+          0) {
+    return false;
+  }
+  location->offset = record_offset + sizeof(header) + key.size();
+  location->size = header.value_size;
+  return true;
+}
+
+CachePack::Slot* CachePack::FindSlot(uint64_t hash, string_view key,
+                                     Location* location) {
+  Slot* slots = reinterpret_cast<Slot*>(index_ + 1);
+  const uint64_t mask = index_->capacity - 1;
+  for (uint64_t i = hash & mask;; i = (i + 1) & mask) {
+    Slot* slot = &slots[i];
+    if (!slot->record_offset_plus_one) return slot;
+    if (slot->hash == hash &&
+        MatchRecord(slot->record_offset_plus_one - 1, key, location)) {
+      return slot;
+    }
+  }
+}
+
+bool CachePack::Find(string_view key, Location* location) {
+  Slot* slot = FindSlot(Fnv1a(key), key, location);
+  if (!slot->record_offset_plus_one) return false;
+  slot->access_day = Today();
+  return true;
+}
+
+bool CachePack::Append(string_view key, string_view value,
+                       Location* location) {
+  if ((index_->count + 1) * 4 > index_->capacity * 3 && !GrowIndex()) {
+    return false;
+  }
+  if (!PwriteRecord(pack_fd_.get(), pack_size_, key, value)) {
+    // Drop the partial record.
+    if (ftruncate(pack_fd_.get(), pack_size_) == -1) perror("ftruncate pack");
+    return false;
+  }
+  const uint64_t hash = Fnv1a(key);
+  Location unused;
+  Slot* slot = FindSlot(hash, key, &unused);
+  if (!slot->record_offset_plus_one) {
+    index_->count++;
+    slot->hash = hash;
+  }
+  slot->record_offset_plus_one = pack_size_ + 1;
+  slot->access_day = Today();
+  location->offset = pack_size_ + sizeof(RecordHeader) + key.size();
+  location->size = value.size();
+  pack_size_ += RecordSize(key.size(), value.size());
+  index_->pack_size = pack_size_;
+  return true;
+}
+
+void CachePack::Reserve(string_view key, uint64_t value_size,
+                        Reservation* reservation) {
+  reservation->key = string(key);
+  reservation->record_offset = pack_size_;
+  reservation->value_size = value_size;
+  reservation->fd = pack_fd_.get();
+  pack_size_ += RecordSize(key.size(), value_size);
+  index_->pack_size = pack_size_;
+}
+
+/* static */
+bool CachePack::WriteReserved(const Reservation& reservation, int source_fd) {
+  const string& key = reservation.key;
+  const uint64_t value_offset =
+      reservation.record_offset + sizeof(RecordHeader) + key.size();
+  if (pwrite(reservation.fd, key.data(), key.size(),
+             reservation.record_offset + sizeof(RecordHeader)) !=
+      static_cast<ssize_t>(key.size())) {
+    perror("pwrite pack");
+    return false;
+  }
+  uint64_t checksum = Fnv1a(key);
+  string buffer;
+  for (uint64_t copied = 0; copied < reservation.value_size;) {
+    buffer.resize(std::min<uint64_t>(reservation.value_size - copied, 1 << 20));
+    if (pread(source_fd, buffer.data(), buffer.size(), copied) !=
+        static_cast<ssize_t>(buffer.size())) {
+      perror("pread reserved value");
+      return false;
+    }
+    if (pwrite(reservation.fd, buffer.data(), buffer.size(),
+               value_offset + copied) != static_cast<ssize_t>(buffer.size())) {
+      perror("pwrite pack");
+      return false;
+    }
+    checksum = Fnv1a(buffer, checksum);
+    copied += buffer.size();
+  }
+  const uint64_t padding =
+      RecordSize(key.size(), reservation.value_size) - sizeof(RecordHeader) -
+      key.size() - reservation.value_size;
+  if (pwrite(reservation.fd, kPadding, padding,
+             value_offset + reservation.value_size) !=
+      static_cast<ssize_t>(padding)) {
+    perror("pwrite pack");
+    return false;
+  }
+  // The header goes last, so that a record interrupted before it is
+  // complete is detected as truncated on recovery.
+  RecordHeader header{kRecordMagic, static_cast<uint32_t>(key.size()),
+                      reservation.value_size, checksum};
+  if (pwrite(reservation.fd, &header, sizeof(header),
+             reservation.record_offset) != sizeof(header)) {
+    perror("pwrite pack");
+    return false;
+  }
+  return true;
+}
+
+bool CachePack::Publish(const Reservation& reservation, Location* location) {
+  if ((index_->count + 1) * 4 > index_->capacity * 3 && !GrowIndex()) {
+    Cancel(reservation);
+    return false;
+  }
+  const uint64_t hash = Fnv1a(reservation.key);
+  Location unused;
+  Slot* slot = FindSlot(hash, reservation.key, &unused);
+  if (!slot->record_offset_plus_one) {
+    index_->count++;
+    slot->hash = hash;
+  }
+  slot->record_offset_plus_one = reservation.record_offset + 1;
+  slot->access_day = Today();
+  location->offset =
+      reservation.record_offset + sizeof(RecordHeader) + reservation.key.size();
+  location->size = reservation.value_size;
+  return true;
+}
+
+void CachePack::Cancel(const Reservation& reservation) {
+  const uint64_t record_size =
+      RecordSize(reservation.key.size(), reservation.value_size);
+  if (reservation.record_offset + record_size == pack_size_) {
+    // The last record, drop it.
+    pack_size_ = reservation.record_offset;
+    index_->pack_size = pack_size_;
+    if (ftruncate(pack_fd_.get(), pack_size_) == -1) perror("ftruncate pack");
+    return;
+  }
+  // Followed by other records, mark the space as unused so that
+  // recovery can skip over it.
+  RecordHeader header{kPaddingMagic, 0, record_size - sizeof(RecordHeader),
+                      0};
+  if (pwrite(pack_fd_.get(), &header, sizeof(header),
+             reservation.record_offset) != sizeof(header)) {
+    perror("pwrite pack");
+  }
+}
+
+CachePack::Compaction::Compaction(ScopedFd&& source, uint64_t source_size,
+                                  ScopedFd&& destination,
+                                  const string& temporary)
+    : source_(std::move(source)),
+      source_size_(source_size),
+      destination_(std::move(destination)),
+      temporary_(temporary) {}
+
+CachePack::Compaction::~Compaction() {
+  if (!committed_) unlink(temporary_.c_str());
+}
+
+bool CachePack::Compaction::Copy() {
+  for (const uint64_t offset : offsets_) {
+    RecordHeader header;
+    if (pread(source_.get(), &header, sizeof(header), offset) !=
+        sizeof(header)) {
+      perror("pread pack");
+      return false;
+    }
+    const uint64_t record_size = RecordSize(header.key_size, header.value_size);
+    if (!CopyRecords(source_.get(), offset, destination_.get(), copied_size_,
+                     record_size)) {
+      return false;
+    }
+    moved_.emplace(offset, copied_size_);
+    copied_size_ += record_size;
+  }
+  return true;
+}
+
+bool CachePack::StartCompaction(time_t accessed_since,
+                                std::unique_ptr<Compaction>* compaction) {
+  compaction->reset();
+  const uint32_t since_day = accessed_since / (24 * 60 * 60);
+  const Slot* slots = reinterpret_cast<const Slot*>(index_ + 1);
+  bool stale = false;
+  for (uint64_t i = 0; i < index_->capacity && !stale; ++i) {
+    stale = slots[i].record_offset_plus_one && slots[i].access_day < since_day;
+  }
+  if (!stale) return true;
+
+  const string temporary = dir_ + "pack.tmp";
+  unlink(temporary.c_str());
+  ScopedFd fd(
+      open(temporary.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600));
+  if (fd.get() == -1) {
+    perror(("open " + temporary).c_str());
+    return false;
+  }
+  ScopedFd source(fcntl(pack_fd_.get(), F_DUPFD_CLOEXEC, 0));
+  if (source.get() == -1) {
+    perror("dup pack");
+    unlink(temporary.c_str());
+    return false;
+  }
+  std::unique_ptr<Compaction> started(
+      new Compaction(std::move(source), pack_size_, std::move(fd), temporary));
+  for (uint64_t i = 0; i < index_->capacity; ++i) {
+    if (slots[i].record_offset_plus_one && slots[i].access_day >= since_day) {
+      started->offsets_.push_back(slots[i].record_offset_plus_one - 1);
+    }
+  }
+  // Read the pack sequentially.
+  std::sort(started->offsets_.begin(), started->offsets_.end());
+  *compaction = std::move(started);
+  return true;
+}
+
+bool CachePack::FinishCompaction(std::unique_ptr<Compaction> compaction) {
+  // Records appended since the start are moved over as they are.
+  const uint64_t appended = pack_size_ - compaction->source_size_;
+  if (!CopyRecords(pack_fd_.get(), compaction->source_size_,
+                   compaction->destination_.get(), compaction->copied_size_,
+                   appended)) {
+    return false;
+  }
+
+  // The new index is ready before the pack is replaced, so that a
+  // failure leaves the previous pack and index in use.
+  const uint64_t pack_size = compaction->copied_size_ + appended;
+  std::vector<Slot> kept;
+  const Slot* slots = reinterpret_cast<const Slot*>(index_ + 1);
+  for (uint64_t i = 0; i < index_->capacity; ++i) {
+    Slot slot = slots[i];
+    if (!slot.record_offset_plus_one) continue;
+    const uint64_t offset = slot.record_offset_plus_one - 1;
+    if (offset >= compaction->source_size_) {
+      slot.record_offset_plus_one =
+          offset - compaction->source_size_ + compaction->copied_size_ + 1;
+    } else {
+      auto moved = compaction->moved_.find(offset);
+      if (moved == compaction->moved_.end()) continue;
+      slot.record_offset_plus_one = moved->second + 1;
+    }
+    kept.push_back(slot);
+  }
+  uint64_t capacity = kInitialCapacity;
+  while (kept.size() * 4 > capacity * 3) capacity *= 2;
+  ScopedFd index_fd(-1);
+  IndexHeader* index = CreateIndex(capacity, &index_fd);
+  if (!index) return false;
+  for (const Slot& slot : kept) InsertSlot(index, slot);
+  index->pack_size = pack_size;
+
+  // The index is dirty from here on, so an interrupted compaction is
+  // recovered by a rebuild.
+  const string pack_path = dir_ + "pack";
+  if (fdatasync(compaction->destination_.get()) == -1) {
+    perror(("fdatasync " + compaction->temporary_).c_str());
+    DiscardIndex(index);
+    return false;
+  }
+  if (rename(compaction->temporary_.c_str(), pack_path.c_str()) == -1) {
+    perror(("rename " + compaction->temporary_).c_str());
+    DiscardIndex(index);
+    return false;
+  }
+  compaction->committed_ = true;
+  pack_fd_.reset(compaction->destination_.release());
+  pack_size_ = pack_size;
+  SwitchIndex(index, std::move(index_fd));
+  return true;
+}
+
+bool CachePack::Compact(time_t accessed_since) {
+  std::unique_ptr<Compaction> compaction;
+  if (!StartCompaction(accessed_since, &compaction)) return false;
+  if (!compaction) return true;
+  return compaction->Copy() && FinishCompaction(std::move(compaction));
+}
+
+size_t CachePack::object_count() const { return index_->count; }
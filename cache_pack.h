@@ -0,0 +1,152 @@
+#ifndef CACHE_PACK_H_
+#define CACHE_PACK_H_
+/**
+ * Append-only pack file storage for Cache, as an alternative to one
+ * file per object.
+ *
+ * Objects are appended as checksummed records to |dir|/pack, and
+ * located through an open addressing hash table in |dir|/pack.idx that
+ * is mapped to memory. The index is marked dirty while open; if it was
+ * not closed cleanly, or does not match the pack, it is rebuilt by
+ * scanning the pack and truncating it after the last intact record.
+ *
+ * Not thread safe. The caller is expected to hold the cache directory
+ * lock.
+ */
+#include <stdint.h>
+#include <time.h>
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "disallow.h"
+#include "scoped_fd.h"
+
+class CachePack {
+ public:
+  // Where the value of an object is in the pack file.
+  struct Location {
+    uint64_t offset{};
+    uint64_t size{};
+  };
+
+  // Open or create the pack under |dir|, which ends with '/'. Returns
+  // nullptr on failure.
+  static std::unique_ptr<CachePack> Open(const std::string& dir);
+  ~CachePack();
+
+  // Look up |key| and record the access time.
+  bool Find(std::string_view key, Location* location);
+  bool Append(std::string_view key, std::string_view value,
+              Location* location);
+  // Appending a value from a file in steps, so that a large value is
+  // copied without holding the lock that guards the pack: Reserve()
+  // and Publish() or Cancel() are called with the lock held, and
+  // WriteReserved() in between without it. The object is not found
+  // until published. Compaction must not start or finish while a
+  // reservation is outstanding.
+  struct Reservation {
+    std::string key{};
+    uint64_t record_offset{};
+    uint64_t value_size{};
+    // The pack file to write to.
+    int fd{-1};
+  };
+  void Reserve(std::string_view key, uint64_t value_size,
+               Reservation* reservation);
+  // Write the record with the value read from offset 0 of |source_fd|.
+  static bool WriteReserved(const Reservation& reservation, int source_fd);
+  bool Publish(const Reservation& reservation, Location* location);
+  // Give up a reservation that could not be written.
+  void Cancel(const Reservation& reservation);
+  // Rewriting the pack without objects last accessed before some time,
+  // in steps so that the copying does not block users of the pack:
+  // StartCompaction() and FinishCompaction() are called with the lock
+  // that guards the pack held, and Copy() in between without it.
+  // Objects appended meanwhile are kept. Memory mapped from the
+  // previous pack stays valid. One compaction at a time.
+  class Compaction {
+   public:
+    ~Compaction();
+    // Copy the kept objects to the new pack file. Only reads records
+    // that were complete when started, which are never modified.
+    bool Copy();
+
+   private:
+    friend class CachePack;
+    Compaction(ScopedFd&& source, uint64_t source_size,
+               ScopedFd&& destination, const std::string& temporary);
+
+    const ScopedFd source_;
+    const uint64_t source_size_;
+    ScopedFd destination_;
+    const std::string temporary_;
+    // Source offsets of the records to keep, in order.
+    std::vector<uint64_t> offsets_{};
+    // Destination offsets of the copied records, by source offset.
+    std::unordered_map<uint64_t, uint64_t> moved_{};
+    uint64_t copied_size_{};
+    bool committed_{};
+    DISALLOW_COPY_AND_ASSIGN(Compaction);
+  };
+  // Start removing objects last accessed before |accessed_since|.
+  // |compaction| is left empty if there are none. Returns false on
+  // failure.
+  bool StartCompaction(time_t accessed_since,
+                       std::unique_ptr<Compaction>* compaction);
+  // Switch to the pack written by |compaction|.
+  bool FinishCompaction(std::unique_ptr<Compaction> compaction);
+  // All of the above at once.
+  bool Compact(time_t accessed_since);
+
+  // For mapping values at Location.
+  int pack_fd() const { return pack_fd_.get(); }
+  size_t object_count() const;
+  uint64_t pack_size() const { return pack_size_; }
+
+ private:
+  struct IndexHeader;
+  struct Slot;
+
+  explicit CachePack(const std::string& dir);
+  static size_t IndexFileSize(uint64_t capacity);
+  bool OpenFiles();
+  // Map the index file, returns false if it is missing or invalid.
+  bool MapIndex();
+  void UnmapIndex();
+  // Create and map an empty index with |capacity| slots as a temporary
+  // file, nullptr on failure. Nothing changes until SwitchIndex().
+  IndexHeader* CreateIndex(uint64_t capacity, ScopedFd* fd);
+  // Replace the index with |header| from CreateIndex().
+  void SwitchIndex(IndexHeader* header, ScopedFd&& fd);
+  // Discard |header| from CreateIndex().
+  void DiscardIndex(IndexHeader* header);
+  // Add |slot| for a record known not to be in |header| yet.
+  static void InsertSlot(IndexHeader* header, const Slot& slot);
+  // Recreate the index from the records in the pack, keeping the
+  // access days in the currently mapped index if any.
+  bool RebuildIndex();
+  // Double the index capacity. The index is unchanged on failure.
+  bool GrowIndex();
+  // Returns the slot for |key| and fills |location|, or returns the
+  // empty slot to insert into.
+  Slot* FindSlot(uint64_t hash, std::string_view key, Location* location);
+  // Whether the record at |record_offset| is for |key|.
+  bool MatchRecord(uint64_t record_offset, std::string_view key,
+                   Location* location);
+
+  const std::string dir_;
+  ScopedFd pack_fd_;
+  ScopedFd index_fd_;
+  IndexHeader* index_{};
+  size_t index_mapped_size_{};
+  uint64_t pack_size_{};
+  // Scratch for key comparison.
+  std::string key_buffer_{};
+  DISALLOW_COPY_AND_ASSIGN(CachePack);
+};
+
+#endif
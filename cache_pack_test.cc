@@ -0,0 +1,224 @@
+#include "cache_pack.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include "scoped_fd.h"
+
+using std::string;
+
+namespace {
+const char kDir[] = "out/cache_pack_test_dir/";
+
+string ReadValue(CachePack* pack, const string& key) {
+  CachePack::Location location;
+  if (!pack->Find(key, &location)) return "not found";
+  string value(location.size, '\0');
+  assert(pread(pack->pack_fd(), value.data(), value.size(), location.offset) ==
+         static_cast<ssize_t>(value.size()));
+  return value;
+}
+
+void Reset() {
+  mkdir(kDir, 0700);
+  unlink((string(kDir) + "pack").c_str());
+  unlink((string(kDir) + "pack.idx").c_str());
+}
+
+void AppendAndFindTest() {
+  Reset();
+  {
+    auto pack = CachePack::Open(kDir);
+    CachePack::Location location;
+    assert(pack->Append("hello", "world", &location));
+    assert(location.size == 5);
+    // Enough to grow the index a few times.
+    for (int i = 0; i < 5000; ++i) {
+      assert(pack->Append("key" + std::to_string(i), std::to_string(i),
+                          &location));
+    }
+    assert(pack->object_count() == 5001);
+    assert(ReadValue(pack.get(), "hello") == "world");
+    assert(ReadValue(pack.get(), "key4999") == "4999");
+    assert(ReadValue(pack.get(), "missing") == "not found");
+  }
+  // Reopen a cleanly closed pack.
+  auto pack = CachePack::Open(kDir);
+  assert(pack->object_count() == 5001);
+  assert(ReadValue(pack.get(), "key1234") == "1234");
+}
+
+void CrashRecoveryTest() {
+  Reset();
+  pid_t pid = fork();
+  if (pid == 0) {
+    auto pack = CachePack::Open(kDir);
+    CachePack::Location location;
+    assert(pack->Append("first", "1", &location));
+    assert(pack->Append("second", "2", &location));
+    // Exit without closing the index, and leave a torn record.
+    int fd = open((string(kDir) + "pack").c_str(), O_WRONLY | O_APPEND);
+    assert(write(fd, "CKP1torn", 8) == 8);
+    close(fd);
+    _exit(0);
+  }
+  int status;
+  assert(waitpid(pid, &status, 0) == pid && status == 0);
+
+  struct stat st;
+  assert(stat((string(kDir) + "pack").c_str(), &st) == 0);
+  const off_t torn_size = st.st_size;
+  auto pack = CachePack::Open(kDir);
+  assert(pack->object_count() == 2);
+  assert(pack->pack_size() == static_cast<uint64_t>(torn_size) - 8);
+  assert(ReadValue(pack.get(), "first") == "1");
+  assert(ReadValue(pack.get(), "second") == "2");
+  CachePack::Location location;
+  assert(pack->Append("third", "3", &location));
+  assert(ReadValue(pack.get(), "third") == "3");
+}
+
+// Rebuilding the index keeps the access days it has, and treats
+// records it doesn't have as unused for long.
+void RebuildAccessDaysTest() {
+  Reset();
+  pid_t pid = fork();
+  if (pid == 0) {
+    auto pack = CachePack::Open(kDir);
+    CachePack::Location location;
+    assert(pack->Append("first", "1", &location));
+    _exit(0);
+  }
+  int status;
+  assert(waitpid(pid, &status, 0) == pid && status == 0);
+  const time_t yesterday = time(nullptr) - 24 * 60 * 60;
+  {
+    auto pack = CachePack::Open(kDir);
+    assert(pack->Compact(yesterday));
+    assert(ReadValue(pack.get(), "first") == "1");
+  }
+
+  assert(unlink((string(kDir) + "pack.idx").c_str()) == 0);
+  auto pack = CachePack::Open(kDir);
+  assert(pack->object_count() == 1);
+  assert(pack->Compact(yesterday));
+  assert(pack->object_count() == 0);
+}
+
+void CompactTest() {
+  Reset();
+  auto pack = CachePack::Open(kDir);
+  CachePack::Location location;
+  assert(pack->Append("a", "old", &location));
+  assert(pack->Append("a", "new", &location));
+  assert(pack->Append("b", "bbb", &location));
+  assert(pack->object_count() == 2);
+  const uint64_t size = pack->pack_size();
+  // Nothing is old enough.
+  assert(pack->Compact(time(nullptr) - 24 * 60 * 60));
+  assert(pack->pack_size() == size);
+  // Everything is old, replaced records are dropped as well.
+  assert(pack->Compact(time(nullptr) + 2 * 24 * 60 * 60));
+  assert(pack->object_count() == 0);
+  assert(pack->pack_size() == 0);
+  assert(ReadValue(pack.get(), "a") == "not found");
+  assert(pack->Append("c", "ccc", &location));
+  pack.reset();
+
+  pack = CachePack::Open(kDir);
+  assert(pack->object_count() == 1);
+  assert(ReadValue(pack.get(), "c") == "ccc");
+}
+// Objects appended while copying are kept.
+void ConcurrentCompactTest() {
+  Reset();
+  auto pack = CachePack::Open(kDir);
+  CachePack::Location location;
+  assert(pack->Append("a", "aaa", &location));
+  assert(pack->Append("b", "old", &location));
+  std::unique_ptr<CachePack::Compaction> compaction;
+  assert(pack->StartCompaction(time(nullptr) + 2 * 24 * 60 * 60, &compaction));
+  assert(compaction);
+  assert(compaction->Copy());
+  assert(pack->Append("b", "new", &location));
+  assert(pack->Append("c", "ccc", &location));
+  assert(pack->FinishCompaction(std::move(compaction)));
+  assert(pack->object_count() == 2);
+  assert(ReadValue(pack.get(), "a") == "not found");
+  assert(ReadValue(pack.get(), "b") == "new");
+  assert(ReadValue(pack.get(), "c") == "ccc");
+  pack.reset();
+
+  // The index matches the pack.
+  pack = CachePack::Open(kDir);
+  assert(pack->object_count() == 2);
+  assert(ReadValue(pack.get(), "b") == "new");
+  assert(access((string(kDir) + "pack.tmp").c_str(), F_OK) == -1);
+
+  // Nothing is old enough.
+  assert(pack->StartCompaction(time(nullptr) - 24 * 60 * 60, &compaction));
+  assert(!compaction);
+}
+
+// Values written from files through reservations, finished in any
+// order.
+void ReserveTest() {
+  Reset();
+  const string source_path = string(kDir) + "source";
+  ScopedFd source(open(source_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600));
+  unlink(source_path.c_str());
+  const string content(3 << 20, 'x');
+  assert(write(source.get(), content.data(), content.size()) ==
+         static_cast<ssize_t>(content.size()));
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    auto pack = CachePack::Open(kDir);
+    CachePack::Reservation first, second, cancelled, last;
+    pack->Reserve("first", content.size(), &first);
+    pack->Reserve("cancelled", 5, &cancelled);
+    pack->Reserve("second", 5, &second);
+    pack->Reserve("last", 5, &last);
+    assert(ReadValue(pack.get(), "second") == "not found");
+    CachePack::Location location;
+    assert(CachePack::WriteReserved(second, source.get()));
+    assert(pack->Publish(second, &location));
+    assert(location.size == 5);
+    assert(CachePack::WriteReserved(first, source.get()));
+    assert(pack->Publish(first, &location));
+    pack->Cancel(cancelled);
+    pack->Cancel(last);
+    assert(pack->pack_size() == last.record_offset);
+    assert(ReadValue(pack.get(), "first") == content);
+    assert(ReadValue(pack.get(), "second") == "xxxxx");
+    assert(ReadValue(pack.get(), "cancelled") == "not found");
+    // Exit without closing the index.
+    _exit(0);
+  }
+  int status;
+  assert(waitpid(pid, &status, 0) == pid && status == 0);
+
+  // Recovery skips the cancelled record.
+  auto pack = CachePack::Open(kDir);
+  assert(pack->object_count() == 2);
+  assert(ReadValue(pack.get(), "first") == content);
+  assert(ReadValue(pack.get(), "second") == "xxxxx");
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  AppendAndFindTest();
+  CrashRecoveryTest();
+  RebuildAccessDaysTest();
+  CompactTest();
+  ConcurrentCompactTest();
+  ReserveTest();
+  return 0;
+}
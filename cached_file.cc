@@ -2,10 +2,10 @@
  * An implementation of a dumb file-backed cache.
  */
 #include "cached_file.h"
-#include "stats_holder.h"
-#include "walk_filesystem.h"
 
 #include <assert.h>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <sys/file.h>
 #include <sys/mman.h>
@@ -13,8 +13,13 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <functional>
 #include <iostream>
+#include <memory>
+#include <sstream>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -28,10 +33,33 @@ using std::string;
 using std::unique_lock;
 using std::unordered_map;
 
-Cache::Memory::Memory(void* m, size_t s) : memory_(m), size_(s) {}
+namespace {
+struct DirCloser {
+  void operator()(DIR* dir) const { closedir(dir); }
+};
+using ScopedDir = std::unique_ptr<DIR, DirCloser>;
+
+// Hits on a mapped object record the access for garbage collection at
+// most this often, to keep locking the index off the hot path.
+constexpr time_t kHitRecordInterval = 60;
+
+std::shared_ptr<const ScopedFd> SharedDup(int fd) {
+  return std::make_shared<const ScopedFd>(fcntl(fd, F_DUPFD_CLOEXEC, 0));
+}
+}  // namespace
+
+Cache::Memory::Memory(void* m, size_t s) : Memory(m, s, 0) {}
+
+Cache::Memory::Memory(void* m, size_t s, size_t offset)
+    : memory_(m), size_(s), offset_(offset) {}
 
 // Move constructor.
-Cache::Memory::Memory(Cache::Memory&& m) : memory_(m.memory_), size_(m.size_) {
+Cache::Memory::Memory(Cache::Memory&& m)
+    : memory_(m.memory_),
+      size_(m.size_),
+      offset_(m.offset_),
+      fd_(std::move(m.fd_)),
+      fd_offset_(m.fd_offset_) {
   m.memory_ = MAP_FAILED;
 }
 
@@ -39,6 +67,9 @@ Cache::Memory::Memory(Cache::Memory&& m) : memory_(m.memory_), size_(m.size_) {
 Cache::Memory& Cache::Memory::operator=(Cache::Memory&& m) {
   memory_ = m.memory_;
   size_ = m.size_;
+  offset_ = m.offset_;
+  fd_ = std::move(m.fd_);
+  fd_offset_ = m.fd_offset_;
   m.memory_ = MAP_FAILED;
   return *this;
 }
@@ -48,15 +79,77 @@ Cache::Memory::~Memory() {
     munmap(memory_, size_);
   }
 }
-size_t Cache::Memory::size() const { return size_; }
+size_t Cache::Memory::size() const { return size_ - offset_; }
 const char* Cache::Memory::memory_charp() const {
-  return static_cast<const char*>(memory_);
+  return static_cast<const char*>(memory_) + offset_;
+}
+int Cache::Memory::fd() const { return fd_ ? fd_->get() : -1; }
+ssize_t Cache::Memory::ReadFd(size_t size, off_t offset, int* fd,
+                              off_t* fd_offset) const {
+  if (this->fd() == -1) return -ENOSYS;
+  if (offset < static_cast<off_t>(this->size())) {
+    if (offset + size > this->size()) size = this->size() - offset;
+  } else
+    size = 0;
+  *fd = this->fd();
+  *fd_offset = fd_offset_ + offset;
+  return size;
+}
+void Cache::Memory::set_fd(std::shared_ptr<const ScopedFd> fd,
+                           off_t fd_offset) {
+  fd_ = std::move(fd);
+  fd_offset_ = fd_offset;
 }
 std::string Cache::Memory::get_copy() const {
-  return std::string(memory_charp(), size_);
+  return std::string(memory_charp(), size());
 }
 
-Cache::Cache(const string& cache_dir) : cache_dir_(cache_dir), file_lock_(-1) {
+Cache::Progressive::Progressive(int fd) : fd_(fd) {}
+
+Cache::Progressive::~Progressive() {}
+
+ssize_t Cache::Progressive::Wait(size_t end) {
+  unique_lock<mutex> l(mutex_);
+  cv_.wait(l, [this, end]() { return done_ || written_ >= end; });
+  if (written_ < end && !ok_) return -EIO;
+  return written_;
+}
+
+ssize_t Cache::Progressive::Read(char* buf, size_t size, off_t offset) {
+  const ssize_t available = Wait(offset + size);
+  if (available < 0) return available;
+  if (offset >= available) return 0;
+  size = std::min<size_t>(size, available - offset);
+  size_t position = 0;
+  while (position < size) {
+    const ssize_t read_size =
+        pread(fd_.get(), buf + position, size - position, offset + position);
+    if (read_size == -1 && errno == EINTR) continue;
+    if (read_size <= 0) return -EIO;
+    position += read_size;
+  }
+  return size;
+}
+
+void Cache::Progressive::Advance(size_t written) {
+  {
+    lock_guard<mutex> l(mutex_);
+    written_ = written;
+  }
+  cv_.notify_all();
+}
+
+void Cache::Progressive::Finish(bool ok) {
+  {
+    lock_guard<mutex> l(mutex_);
+    done_ = true;
+    ok_ = ok;
+  }
+  cv_.notify_all();
+}
+
+Cache::Cache(const string& cache_dir, const Config& config)
+    : config_(config), cache_dir_(cache_dir), file_lock_(-1) {
   if (-1 == mkdir(cache_dir_.c_str(), 0700) && errno != EEXIST) {
     perror((string("Cannot create cache dir ") + cache_dir).c_str());
     abort();
@@ -71,9 +164,32 @@ Cache::Cache(const string& cache_dir) : cache_dir_(cache_dir), file_lock_(-1) {
   }
   assert(flock(file_lock_.get(), LOCK_EX) != -1);
   assert(cache_dir_[cache_dir_.size() - 1] == '/');
+  if (config_.packed) {
+    pack_ = CachePack::Open(cache_dir_);
+    if (!pack_) {
+      std::cerr << "Cannot open pack in " << cache_dir_ << std::endl;
+      abort();
+    }
+    pack_fd_ = SharedDup(pack_->pack_fd());
+  } else {
+    access_index_ = std::make_unique<CacheAccessIndex>(cache_dir_ +
+                                                       "access.log");
+  }
 }
 
-Cache::~Cache() { assert(flock(file_lock_.get(), LOCK_UN) != -1); }
+Cache::~Cache() {
+  {
+    lock_guard<mutex> g(gc_mutex_);
+    gc_stop_ = true;
+  }
+  gc_cv_.notify_all();
+  if (gc_thread_.joinable()) gc_thread_.join();
+  WaitProgressive();
+  // Close the pack while still holding the lock.
+  pack_fd_.reset();
+  pack_.reset();
+  assert(flock(file_lock_.get(), LOCK_UN) != -1);
+}
 
 void Cache::GetFileName(const string& name, string* dir_name,
                         string* file_name) const {
@@ -84,127 +200,630 @@ void Cache::GetFileName(const string& name, string* dir_name,
 // Get sha1 hash, and use fetch method to fetch if not available already.
 const Cache::Memory* Cache::get(const string& name,
                                 function<bool(string*)> fetch) {
+  return GetWithFetch(name, [this, &name, &fetch](unique_lock<mutex>* l) {
+    return FetchSingleFlightLocked(l, name, fetch);
+  });
+}
+
+const Cache::Memory* Cache::GetStreaming(const string& name,
+                                         StreamingFetch fetch) {
+  return GetWithFetch(name, [this, &name, &fetch](unique_lock<mutex>* l) {
+    return StreamSingleFlightLocked(l, name, fetch);
+  });
+}
+
+const Cache::Memory* Cache::GetWithFetch(
+    const string& name, function<bool(unique_lock<mutex>* l)> fetch_locked) {
   unique_lock<mutex> l(mutex_);
   // Check if we've already mapped the cache to memory.
   {
     auto it = mapped_files_.find(name);
     if (it != mapped_files_.end()) {
-      return &it->second;
+      stats_.hits++;
+      RecordHitLocked(name, &it->second);
+      return AcquireLocked(name, &it->second);
     }
   }
+  stats_.misses++;
 
-  string cache_file_dir;
-  string cache_file_name;
-  GetFileName(name, &cache_file_dir, &cache_file_name);
-  string cache_file_path(cache_file_dir + "/" + cache_file_name);
-  if (-1 == mkdir(cache_file_dir.c_str(), 0700) && (errno != EEXIST)) {
-    perror((string("mkdir ") + cache_file_dir).c_str());
-    return nullptr;
-  }
-  // Try if we've cached to file.
-  ScopedFd fd(open(cache_file_path.c_str(), O_RDONLY));
-  if (fd.get() == -1) {
-    assert(errno == ENOENT);
-    // Populate cache.
-    string result;
-    // TODO: This is RPC that may take arbitrary amount of time, we
-    // shouldn't be blocking others. However it does not properly
-    // handle multiple requests to one cache entry.
-
-    l.unlock();
-    if (!fetch(&result)) {
-      // Uncached fetching failed.
-      std::cout << "Uncached fetching failed: " << name << std::endl;
+  // Try if we've cached to disk.
+  std::unique_ptr<Memory> memory = MapLocked(name);
+  if (!memory) {
+    // Populate cache, or wait for another thread populating it.
+    if (!fetch_locked(&l)) {
       return nullptr;
     }
-    l.lock();
-
     // Re-check if we've already mapped the cache to memory by another
     // thread.
     auto it2 = mapped_files_.find(name);
     if (it2 != mapped_files_.end()) {
-      return &it2->second;
+      return AcquireLocked(name, &it2->second);
     }
+    memory = MapLocked(name);
+    if (!memory) {
+      return nullptr;
+    }
+  }
+  const size_t size = memory->size();
+  RecordAccessLocked(name, size);
+  auto emplace_result = mapped_files_.emplace(name, Entry(std::move(*memory)));
+  emplace_result.first->second.access_recorded = time(nullptr);
+  stats_.mapped_bytes += size;
+  stats_.mappings++;
+  const Memory* acquired =
+      AcquireLocked(name, &emplace_result.first->second);
+  EvictLocked();
+  return acquired;
+}
 
-    string temporary(cache_file_path + ".tmp");
-    unlink(temporary.c_str());  // Make sure the file does not exist.
-    {
-      fd.reset(open(temporary.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666));
-      if (fd.get() == -1) {
-        perror((string("open ") + temporary).c_str());
-        return nullptr;
-      }
-      assert(result.size() == static_cast<size_t>(write(fd.get(), result.data(),
-                                                        result.size())));
+std::unique_ptr<Cache::Memory> Cache::MapLocked(const string& name) {
+  if (pack_) {
+    CachePack::Location location;
+    if (!pack_->Find(name, &location)) {
+      return nullptr;
+    }
+    // mmap offset needs to be page aligned.
+    static const uint64_t page_size = sysconf(_SC_PAGESIZE);
+    const uint64_t begin = location.offset & ~(page_size - 1);
+    const size_t offset = location.offset - begin;
+    // Empty content can't be mapped, MAP_FAILED stands for no mapping.
+    void* m = offset + location.size
+                  ? mmap(nullptr, offset + location.size, PROT_READ,
+                         MAP_SHARED, pack_->pack_fd(), begin)
+                  : MAP_FAILED;
+    if (m == MAP_FAILED && offset + location.size) {
+      perror(("mmap pack " + name).c_str());
+      return nullptr;
     }
-    assert(-1 != rename(temporary.c_str(), cache_file_path.c_str()));
+    auto memory =
+        std::make_unique<Memory>(m, offset + location.size, offset);
+    memory->set_fd(pack_fd_, location.offset);
+    return memory;
+  }
+
+  string cache_file_path;
+  if (!PrepareCacheFilePath(name, &cache_file_path)) {
+    return nullptr;
+  }
+  ScopedFd fd(open(cache_file_path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd.get() == -1) {
+    assert(errno == ENOENT);
+    return nullptr;
   }
   struct stat stbuf;
   assert(0 == fstat(fd.get(), &stbuf));
   size_t size = stbuf.st_size;
-  void* m = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd.get(), 0);
-  if (m == MAP_FAILED) {
+  void* m = size ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd.get(), 0)
+                 : MAP_FAILED;
+  if (m == MAP_FAILED && size) {
     perror(("mmap " + cache_file_path).c_str());
     return nullptr;
   }
-  auto emplace_result = mapped_files_.emplace(name, Memory(m, size));
-  return &emplace_result.first->second;
+  auto memory = std::make_unique<Memory>(m, size);
+  memory->set_fd(std::make_shared<const ScopedFd>(fd.release()), 0);
+  return memory;
+}
+
+bool Cache::ExistsLocked(const string& name) {
+  if (pack_) {
+    CachePack::Location location;
+    return pack_->Find(name, &location);
+  }
+  string cache_file_path;
+  return PrepareCacheFilePath(name, &cache_file_path) &&
+         access(cache_file_path.c_str(), F_OK) == 0;
+}
+
+bool Cache::StoreLocked(const string& name, const string& content) {
+  if (pack_) {
+    CachePack::Location location;
+    return pack_->Append(name, content, &location);
+  }
+  string cache_file_path;
+  if (!PrepareCacheFilePath(name, &cache_file_path) ||
+      !WriteCacheFile(cache_file_path, content)) {
+    return false;
+  }
+  RecordAccessLocked(name, content.size());
+  return true;
+}
+
+const Cache::Memory* Cache::AcquireLocked(const string& name,
+                                          Entry* entry) {
+  if (entry->refcount++ == 0 && entry->in_lru) {
+    lru_.erase(entry->lru_position);
+    entry->in_lru = false;
+  }
+  string cache_file_path;
+  if (entry->memory.fd() == -1 && !pack_ &&
+      PrepareCacheFilePath(name, &cache_file_path)) {
+    // Readers fall back to the mapping if this fails.
+    ScopedFd fd(open(cache_file_path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd.get() != -1) {
+      entry->memory.set_fd(std::make_shared<const ScopedFd>(fd.release()), 0);
+    }
+  }
+  return &entry->memory;
+}
+
+void Cache::EvictLocked() {
+  while ((stats_.mapped_bytes > config_.max_mapped_bytes ||
+          stats_.mappings > config_.max_mappings) &&
+         !lru_.empty()) {
+    auto it = mapped_files_.find(lru_.front());
+    assert(it != mapped_files_.end() && it->second.refcount == 0);
+    stats_.mapped_bytes -= it->second.memory.size();
+    stats_.mappings--;
+    stats_.evictions++;
+    mapped_files_.erase(it);
+    lru_.pop_front();
+  }
+}
+
+bool Cache::Prefetch(const string& name, function<bool(string*)> fetch) {
+  unique_lock<mutex> l(mutex_);
+  if (mapped_files_.find(name) != mapped_files_.end() || ExistsLocked(name)) {
+    return true;
+  }
+  return FetchSingleFlightLocked(&l, name, fetch);
+}
+
+bool Cache::PrefetchStreaming(const string& name, StreamingFetch fetch) {
+  unique_lock<mutex> l(mutex_);
+  if (mapped_files_.find(name) != mapped_files_.end() || ExistsLocked(name)) {
+    return true;
+  }
+  return StreamSingleFlightLocked(&l, name, fetch);
+}
+
+std::shared_ptr<Cache::Progressive> Cache::StartProgressive(
+    const string& name, ProgressiveFetch fetch) {
+  lock_guard<mutex> l(mutex_);
+  {
+    auto it = progressive_.find(name);
+    if (it != progressive_.end()) return it->second;
+  }
+  if (in_flight_.count(name) ||
+      mapped_files_.find(name) != mapped_files_.end() || ExistsLocked(name)) {
+    return nullptr;
+  }
+  const string temporary = TemporaryPath(name);
+  unlink(temporary.c_str());  // Make sure the file does not exist.
+  ScopedFd fd(
+      open(temporary.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666));
+  if (fd.get() == -1) {
+    perror((string("open ") + temporary).c_str());
+    return nullptr;
+  }
+  std::shared_ptr<Progressive> progressive(new Progressive(fd.release()));
+  // Registered before the thread runs, so that other fetches of |name|
+  // wait for this one.
+  in_flight_.emplace(name, std::make_shared<InFlight>());
+  progressive_.emplace(name, progressive);
+  stats_.misses++;
+  // A thread cannot join itself once done, so it is detached, and
+  // WaitProgressive() waits for it to be done with this instead.
+  std::thread([this, name, temporary, progressive, fetch]() mutable {
+    RunProgressive(std::move(name), std::move(temporary),
+                   std::move(progressive), std::move(fetch));
+  }).detach();
+  return progressive;
+}
+
+void Cache::RunProgressive(string name, string temporary,
+                           std::shared_ptr<Progressive> progressive,
+                           ProgressiveFetch fetch) {
+  Progressive* p = progressive.get();
+  bool ok = fetch(p->fd(), [p](size_t written) { p->Advance(written); });
+  // Release what the fetch holds before its owner can be destroyed.
+  fetch = nullptr;
+  struct stat st;
+  ok = ok && fstat(p->fd(), &st) == 0;
+  {
+    unique_lock<mutex> l(mutex_);
+    if (ok) {
+      // Readers keep reading the descriptor, which still has the
+      // content once the file is renamed or removed.
+      ok = StoreTemporaryLocked(&l, name, temporary, st.st_size);
+    } else {
+      std::cout << "Uncached fetching failed: " << name << std::endl;
+      unlink(temporary.c_str());
+    }
+    auto it = in_flight_.find(name);
+    assert(it != in_flight_.end());
+    it->second->done = true;
+    it->second->ok = ok;
+    in_flight_.erase(it);
+    progressive_.erase(name);
+    in_flight_cv_.notify_all();
+  }
+  // This may be destroyed from here on; only wake up the readers, who
+  // share |progressive|.
+  p->Finish(ok);
+}
+
+void Cache::WaitProgressive() {
+  unique_lock<mutex> l(mutex_);
+  in_flight_cv_.wait(l, [this]() { return progressive_.empty(); });
+}
+
+bool Cache::Contains(const string& name) {
+  lock_guard<mutex> l(mutex_);
+  return mapped_files_.find(name) != mapped_files_.end() || ExistsLocked(name);
+}
+
+bool Cache::FetchSingleFlightLocked(unique_lock<mutex>* l, const string& name,
+                                    function<bool(string*)> fetch) {
+  string result;
+  return SingleFlightLocked(
+      l, name, [&fetch, &result]() { return fetch(&result); },
+      [this, &name, &result]() { return StoreLocked(name, result); });
+}
+
+bool Cache::StreamSingleFlightLocked(unique_lock<mutex>* l, const string& name,
+                                     StreamingFetch fetch) {
+  const string temporary = TemporaryPath(name);
+  size_t size = 0;
+  return SingleFlightLocked(
+      l, name,
+      [&fetch, &temporary, &size]() {
+        unlink(temporary.c_str());  // Make sure the file does not exist.
+        ScopedFd fd(open(temporary.c_str(),
+                         O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666));
+        if (fd.get() == -1) {
+          perror((string("open ") + temporary).c_str());
+          return false;
+        }
+        struct stat st;
+        if (!fetch(fd.get()) || fstat(fd.get(), &st) == -1) {
+          unlink(temporary.c_str());
+          return false;
+        }
+        size = st.st_size;
+        return true;
+      },
+      [this, l, &name, &temporary, &size]() {
+        return StoreTemporaryLocked(l, name, temporary, size);
+      });
+}
+
+string Cache::TemporaryPath(const string& name) const {
+  // Next to the final file for the file per object layout, so that it
+  // can be renamed into place.
+  string temporary;
+  if (pack_ || !PrepareCacheFilePath(name, &temporary)) {
+    temporary = cache_dir_ + name;
+  }
+  return temporary + ".tmp";
+}
+
+bool Cache::StoreTemporaryLocked(unique_lock<mutex>* l, const string& name,
+                                 const string& temporary, size_t size) {
+  if (pack_) {
+    // The content is copied from the file, which is not kept around.
+    // Others can use the cache meanwhile, and find |name| once it is
+    // published.
+    ScopedFd fd(open(temporary.c_str(), O_RDONLY | O_CLOEXEC));
+    unlink(temporary.c_str());
+    if (fd.get() == -1) return false;
+    CachePack::Reservation reservation;
+    pack_->Reserve(name, size, &reservation);
+    pack_writers_++;
+    l->unlock();
+    const bool written = CachePack::WriteReserved(reservation, fd.get());
+    l->lock();
+    if (--pack_writers_ == 0) pack_writers_cv_.notify_all();
+    if (!written) {
+      pack_->Cancel(reservation);
+      return false;
+    }
+    CachePack::Location location;
+    return pack_->Publish(reservation, &location);
+  }
+  string cache_file_path;
+  if (!PrepareCacheFilePath(name, &cache_file_path) ||
+      rename(temporary.c_str(), cache_file_path.c_str()) == -1) {
+    perror(("rename " + temporary).c_str());
+    unlink(temporary.c_str());
+    return false;
+  }
+  RecordAccessLocked(name, size);
+  return true;
+}
+
+bool Cache::SingleFlightLocked(unique_lock<mutex>* l, const string& name,
+                               function<bool()> fetch,
+                               function<bool()> store) {
+  {
+    auto it = in_flight_.find(name);
+    if (it != in_flight_.end()) {
+      // Another thread is fetching, use its result.
+      std::shared_ptr<InFlight> in_flight = it->second;
+      in_flight_cv_.wait(*l, [&in_flight]() { return in_flight->done; });
+      return in_flight->ok;
+    }
+  }
+  auto in_flight = std::make_shared<InFlight>();
+  in_flight_.emplace(name, in_flight);
+
+  // This is RPC that may take arbitrary amount of time, don't block
+  // others.
+  l->unlock();
+  bool ok = fetch();
+  l->lock();
+  if (ok) {
+    ok = store();
+  } else {
+    std::cout << "Uncached fetching failed: " << name << std::endl;
+  }
+  in_flight->done = true;
+  in_flight->ok = ok;
+  in_flight_.erase(name);
+  in_flight_cv_.notify_all();
+  return ok;
+}
+
+bool Cache::PrepareCacheFilePath(const string& name, string* path) const {
+  string cache_file_dir;
+  string cache_file_name;
+  GetFileName(name, &cache_file_dir, &cache_file_name);
+  if (-1 == mkdir(cache_file_dir.c_str(), 0700) && (errno != EEXIST)) {
+    perror((string("mkdir ") + cache_file_dir).c_str());
+    return false;
+  }
+  *path = cache_file_dir + "/" + cache_file_name;
+  return true;
+}
+
+bool Cache::WriteCacheFile(const string& path, const string& content) {
+  string temporary(path + ".tmp");
+  unlink(temporary.c_str());  // Make sure the file does not exist.
+  {
+    ScopedFd fd(open(temporary.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666));
+    if (fd.get() == -1) {
+      perror((string("open ") + temporary).c_str());
+      return false;
+    }
+    assert(content.size() == static_cast<size_t>(write(
+                                 fd.get(), content.data(), content.size())));
+  }
+  assert(-1 != rename(temporary.c_str(), path.c_str()));
+  return true;
 }
 
 bool Cache::release(const string& name, const Cache::Memory* item) {
-  // Delete the name, assert that the value was item.
   lock_guard<mutex> l(mutex_);
 
   auto it = mapped_files_.find(name);
-  if (it != mapped_files_.end()) {
+  if (it == mapped_files_.end()) {
     return false;
   }
-  assert(&it->second == item);
-  mapped_files_.erase(it);
+  Entry& entry = it->second;
+  assert(&entry.memory == item);
+  assert(entry.refcount > 0);
+  if (--entry.refcount == 0) {
+    // Keep it mapped for reuse until the budget is exceeded, but don't
+    // hold a descriptor per unreferenced file.
+    if (!pack_) entry.memory.set_fd(nullptr, 0);
+    entry.lru_position = lru_.insert(lru_.end(), name);
+    entry.in_lru = true;
+    EvictLocked();
+  }
   return true;
 }
 
 bool Cache::Gc() {
-  lock_guard<mutex> l(mutex_);
+  while (GcPass()) {
+  }
+  if (access_index_) {
+    lock_guard<mutex> g(gc_mutex_);
+    std::cout << "cache: " << access_index_->size() << " objects "
+              << access_index_->total_bytes() << " bytes" << std::endl;
+  }
+  return true;
+}
+
+bool Cache::GcPass() {
+  lock_guard<mutex> p(gc_pass_mutex_);
+  const time_t now = time(nullptr);
+  if (pack_) {
+    // Rewrite the pack without objects that haven't been used for a
+    // while, copying without holding the lock.
+    // Reserved records are published before compaction starts and
+    // finishes, so that none is left behind.
+    const auto no_writers = [this]() { return pack_writers_ == 0; };
+    std::unique_ptr<CachePack::Compaction> compaction;
+    {
+      unique_lock<mutex> l(mutex_);
+      pack_writers_cv_.wait(l, no_writers);
+      if (!pack_->StartCompaction(now - config_.max_age, &compaction) ||
+          !compaction) {
+        return false;
+      }
+    }
+    if (!compaction->Copy()) {
+      return false;
+    }
+    unique_lock<mutex> l(mutex_);
+    pack_writers_cv_.wait(l, no_writers);
+    const size_t before = pack_->object_count();
+    if (!pack_->FinishCompaction(std::move(compaction))) {
+      return false;
+    }
+    pack_fd_ = SharedDup(pack_->pack_fd());
+    std::cout << "garbage collected " << (before - pack_->object_count())
+              << " objects, " << pack_->object_count() << " objects "
+              << pack_->pack_size() << " bytes in pack" << std::endl;
+    return false;
+  }
 
-  time_t now = time(nullptr);
-  std::vector<std::string> to_delete{};
-  stats_holder::StatsHolder stats;
-  assert(WalkFilesystem(cache_dir_, [&to_delete, now, &stats](FTSENT* entry) {
-    if (entry->fts_info == FTS_F) {
-      std::string path(entry->fts_path, entry->fts_pathlen);
-      std::string name(entry->fts_name, entry->fts_namelen);
-      struct stat* st = entry->fts_statp;
-      time_t delta = now - st->st_atime;
-      /*
-         std::cout << path <<
-         " atime_delta_days:" << (delta / 60 / 60 / 24) <<
-         " size:" << st->st_size << std::endl;
-      */
-      stats.Add("size", st->st_size);
-      stats.Add("age", delta);
-      // .cache/bf/82c3eab3768308dfe445c7f8a314858cec09e0
-      if (name.size() == 38 && (delta / 60 / 60 / 24) > 60) {
-        // This is probably a cache file, and is probably hasn't been used for a
-        // while
-        to_delete.emplace_back(path);
+  bool more = BootstrapAccessIndex();
+  std::vector<string> candidates;
+  {
+    lock_guard<mutex> g(gc_mutex_);
+    candidates = access_index_->EvictionCandidates(
+        now, config_.max_age, config_.max_cache_bytes,
+        config_.gc_max_deletions_per_pass);
+  }
+  size_t deleted = 0;
+  for (const auto& name : candidates) {
+    lock_guard<mutex> l(mutex_);
+    if (in_flight_.count(name)) continue;
+    auto mapped = mapped_files_.find(name);
+    if (mapped != mapped_files_.end()) {
+      if (mapped->second.refcount > 0) {
+        // In use.
+        continue;
       }
+      // Unmap as well so that the space is freed.
+      if (mapped->second.in_lru) lru_.erase(mapped->second.lru_position);
+      stats_.mapped_bytes -= mapped->second.memory.size();
+      stats_.mappings--;
+      mapped_files_.erase(mapped);
     }
-  }));
-  for (const auto& path : to_delete) {
-    std::cout << "garbage collect old files : " << path << std::endl;
-    if (-1 == unlink(path.c_str())) {
+    string dir_name, file_name;
+    GetFileName(name, &dir_name, &file_name);
+    const string path = dir_name + "/" + file_name;
+    if (-1 == unlink(path.c_str()) && errno != ENOENT) {
       perror(path.c_str());
+      continue;
+    }
+    lock_guard<mutex> g(gc_mutex_);
+    access_index_->Remove(name);
+    deleted++;
+  }
+  if (deleted) {
+    std::cout << "garbage collected " << deleted << " files" << std::endl;
+  }
+  return more || deleted == config_.gc_max_deletions_per_pass;
+}
+
+bool Cache::BootstrapAccessIndex() {
+  {
+    lock_guard<mutex> g(gc_mutex_);
+    if (access_index_->bootstrapped()) return false;
+  }
+  if (!bootstrap_dirs_listed_) {
+    ScopedDir dir(opendir(cache_dir_.c_str()));
+    if (!dir) {
+      perror(("opendir " + cache_dir_).c_str());
       return false;
     }
+    while (struct dirent* entry = readdir(dir.get())) {
+      const string name(entry->d_name);
+      struct stat st;
+      const bool is_dir =
+          entry->d_type == DT_DIR ||
+          (entry->d_type == DT_UNKNOWN &&
+           fstatat(dirfd(dir.get()), entry->d_name, &st,
+                   AT_SYMLINK_NOFOLLOW) == 0 &&
+           S_ISDIR(st.st_mode));
+      // Objects are under the two character hash prefix directories,
+      // other directories such as trees/ are not managed here.
+      if (name.size() == 2 && name != ".." && is_dir) {
+        bootstrap_dirs_.push_back(name);
+      }
+    }
+    bootstrap_dirs_listed_ = true;
+  }
+
+  struct Found {
+    string name;
+    size_t size;
+    time_t atime;
+  };
+  for (size_t i = 0; i < config_.gc_max_bootstrap_dirs_per_pass &&
+                     !bootstrap_dirs_.empty();
+       ++i) {
+    const string dir_name = bootstrap_dirs_.back();
+    bootstrap_dirs_.pop_back();
+    // Scan without holding the lock.
+    std::vector<Found> found;
+    ScopedDir dir(opendir((cache_dir_ + dir_name).c_str()));
+    if (!dir) continue;
+    while (struct dirent* entry = readdir(dir.get())) {
+      const string file_name(entry->d_name);
+      struct stat st;
+      if (file_name == "." || file_name == ".." ||
+          file_name.find(".tmp") != string::npos ||
+          fstatat(dirfd(dir.get()), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) ==
+              -1 ||
+          !S_ISREG(st.st_mode)) {
+        continue;
+      }
+      found.push_back(
+          Found{dir_name + file_name, static_cast<size_t>(st.st_size),
+                st.st_atime});
+    }
+    lock_guard<mutex> g(gc_mutex_);
+    for (const auto& f : found) {
+      access_index_->AddIfAbsent(f.name, f.size, f.atime);
+    }
+  }
+  if (bootstrap_dirs_.empty()) {
+    lock_guard<mutex> g(gc_mutex_);
+    access_index_->set_bootstrapped();
+    return false;
   }
-  std::cout << stats.Dump() << std::endl;
   return true;
 }
 
+void Cache::StartBackgroundGc() {
+  assert(!gc_thread_.joinable());
+  gc_thread_ = std::thread([this]() {
+    unique_lock<mutex> g(gc_mutex_);
+    while (!gc_stop_) {
+      g.unlock();
+      const bool more = GcPass();
+      g.lock();
+      // Keep going with a short break if a pass was not enough.
+      gc_cv_.wait_for(g,
+                      more ? std::chrono::milliseconds(100)
+                           : std::chrono::milliseconds(
+                                 config_.gc_interval_seconds * 1000LL),
+                      [this]() { return gc_stop_; });
+    }
+  });
+}
+
+void Cache::RecordAccessLocked(const string& name, size_t size) {
+  if (!access_index_) return;
+  lock_guard<mutex> g(gc_mutex_);
+  access_index_->Touch(name, size, time(nullptr));
+}
+
+void Cache::RecordHitLocked(const string& name, Entry* entry) {
+  const time_t now = time(nullptr);
+  if (now - entry->access_recorded < kHitRecordInterval) return;
+  entry->access_recorded = now;
+  if (pack_) {
+    // Refreshes the access day in the pack index.
+    CachePack::Location location;
+    pack_->Find(name, &location);
+    return;
+  }
+  RecordAccessLocked(name, entry->memory.size());
+}
+
 void Cache::dump() const {
+  lock_guard<mutex> l(mutex_);
   for (const auto& p : mapped_files_) {
-    std::cout << p.first << ":" << (intptr_t)p.second.memory_charp() << " "
-              << p.second.size() << std::endl;
+    std::cout << p.first << ":" << (intptr_t)p.second.memory.memory_charp()
+              << " " << p.second.memory.size() << " refcount "
+              << p.second.refcount << std::endl;
   }
 }
+
+Cache::Stats Cache::stats() const {
+  lock_guard<mutex> l(mutex_);
+  return stats_;
+}
+
+string Cache::DumpStats() const {
+  const Stats s = stats();
+  std::stringstream ss;
+  ss << "cache: " << s.hits << " hits " << s.misses << " misses "
+     << s.evictions << " evictions " << s.mappings << " mappings "
+     << s.mapped_bytes << " bytes" << std::endl;
+  return ss.str();
+}
@@ -1,10 +1,19 @@
 #ifndef CACHED_FILE_H_
 #define CACHED_FILE_H_
+#include <sys/types.h>
+
+#include <condition_variable>
 #include <functional>
+#include <list>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 
+#include "cache_access_index.h"
+#include "cache_pack.h"
 #include "disallow.h"
 #include "scoped_fd.h"
 
@@ -14,6 +23,9 @@ class Cache {
   class Memory {
    public:
     Memory(void* m, size_t s);
+    // Only the part from |offset| is exposed, for mappings that start
+    // on a page boundary before the content.
+    Memory(void* m, size_t s, size_t offset);
 
     // Move constructor.
     Memory(Memory&& m);
@@ -23,38 +35,271 @@ class Cache {
 
     const char* memory_charp() const;
     size_t size() const;
+    // A file descriptor with the same content at fd_offset(), for
+    // splicing instead of copying from memory. -1 if not available,
+    // valid while the reference from get() is held.
+    int fd() const;
+    off_t fd_offset() const { return fd_offset_; }
+    // Where to splice |size| bytes at |offset| from, for
+    // File::ReadFd. Returns the size within the content, or -ENOSYS
+    // without a descriptor.
+    ssize_t ReadFd(size_t size, off_t offset, int* fd,
+                   off_t* fd_offset) const;
 
     // For debugging.
     std::string get_copy() const;
 
    private:
+    friend class Cache;
+    void set_fd(std::shared_ptr<const ScopedFd> fd, off_t fd_offset);
+
     void* memory_;
     size_t size_;
+    size_t offset_;
+    std::shared_ptr<const ScopedFd> fd_{};
+    off_t fd_offset_{};
     DISALLOW_COPY_AND_ASSIGN(Memory);
   };
 
-  explicit Cache(const std::string& cache_dir);
+  struct Config {
+    Config() {}
+
+    // Unreferenced mappings are unmapped, least recently used first,
+    // while either of these is exceeded. Referenced mappings are never
+    // unmapped.
+    size_t max_mapped_bytes{1ULL << 30};
+    size_t max_mappings{16384};
+    // Store objects in one append-only pack file instead of one file
+    // per object. See CachePack.
+    bool packed{false};
+
+    // Garbage collection removes objects not accessed for max_age
+    // seconds, and then the least recently accessed until the cache
+    // is within max_cache_bytes (0 for no limit). The size limit only
+    // applies to the file per object layout.
+    time_t max_age{60 * 24 * 60 * 60};
+    size_t max_cache_bytes{0};
+    // Bounds on the work done by one garbage collection pass.
+    size_t gc_max_deletions_per_pass{1000};
+    size_t gc_max_bootstrap_dirs_per_pass{16};
+    // Between background garbage collection passes.
+    int gc_interval_seconds{600};
+  };
+
+  struct Stats {
+    // get() calls that found the mapping in memory.
+    size_t hits{};
+    // get() calls that had to map the file, fetching it if necessary.
+    size_t misses{};
+    // Unreferenced mappings that were unmapped.
+    size_t evictions{};
+    size_t mapped_bytes{};
+    size_t mappings{};
+  };
+
+  // Writes the whole content to |fd|, a new file, returns false on
+  // failure.
+  typedef std::function<bool(int fd)> StreamingFetch;
+  // Same, calling |progress| with the number of bytes written so far.
+  typedef std::function<bool(
+      int fd, const std::function<void(size_t written)>& progress)>
+      ProgressiveFetch;
+
+  // An object that is being streamed into the cache on a background
+  // thread, readable while it arrives.
+  class Progressive {
+   public:
+    ~Progressive();
+
+    // Wait until the bytes up to |end| have arrived, or the fetch has
+    // ended. Returns the number of bytes available, or -EIO if the
+    // fetch failed before |end|.
+    ssize_t Wait(size_t end);
+    // Read up to |size| bytes at |offset|, after waiting for them.
+    ssize_t Read(char* buf, size_t size, off_t offset);
+    // The file being written, with the content from offset 0. Bytes
+    // returned by Wait() can be read or spliced from it. Valid while
+    // this is referenced.
+    int fd() const { return fd_.get(); }
+
+   private:
+    friend class Cache;
+    explicit Progressive(int fd);
+    void Advance(size_t written);
+    void Finish(bool ok);
+
+    const ScopedFd fd_;
+    std::mutex mutex_{};
+    std::condition_variable cv_{};
+    size_t written_{};
+    bool done_{};
+    bool ok_{};
+    DISALLOW_COPY_AND_ASSIGN(Progressive);
+  };
+
+  explicit Cache(const std::string& cache_dir, const Config& config = Config());
   ~Cache();
 
   // Get sha1 hash, and use fetch method to fetch if not available already.
+  // Each successful get() holds a reference to the mapping until
+  // release() is called.
   const Memory* get(const std::string& name,
                     std::function<bool(std::string*)> fetch);
+  // Same, with |fetch| writing to a temporary cache file that is mapped
+  // once complete, so that objects of any size are fetched without
+  // holding them in memory.
+  const Memory* GetStreaming(const std::string& name, StreamingFetch fetch);
+  // Drop a reference obtained by get(). Returns false if |name| is not
+  // mapped.
   bool release(const std::string& name, const Memory* item);
+  // Make sure |name| is in the on-disk cache, using fetch method if it
+  // is not, without mapping it to memory.
+  bool Prefetch(const std::string& name,
+                std::function<bool(std::string*)> fetch);
+  bool PrefetchStreaming(const std::string& name, StreamingFetch fetch);
+  // Start fetching |name| into the cache on a background thread, for
+  // reading parts of it before the whole object has arrived. Returns
+  // the one already in progress for |name| if any, or nullptr if
+  // |name| is cached or being fetched otherwise, in which case get()
+  // and GetStreaming() return it without delay or once fetched.
+  std::shared_ptr<Progressive> StartProgressive(const std::string& name,
+                                                ProgressiveFetch fetch);
+  // Wait for the background fetches of StartProgressive(). For owners
+  // of what the fetches use, before destroying it.
+  void WaitProgressive();
+  // Whether |name| is in the cache, without fetching it. For skipping
+  // cached objects before fetching many at once.
+  bool Contains(const std::string& name);
 
-  // Garbage collect old cache items.
+  // Garbage collect old cache items until there is nothing left to do.
   bool Gc();
+  // One garbage collection pass with bounded work. Returns true if
+  // there is more to do.
+  bool GcPass();
+  // Run garbage collection passes on a background thread until
+  // destroyed.
+  void StartBackgroundGc();
 
   void dump() const;
+  Stats stats() const;
+  // Human readable stats, for /.status.
+  std::string DumpStats() const;
 
  private:
+  struct Entry {
+    explicit Entry(Memory&& m) : memory(std::move(m)) {}
+
+    Memory memory;
+    int refcount{};
+    // Whether it is in lru_, which is when refcount dropped to 0.
+    bool in_lru{};
+    std::list<std::string>::iterator lru_position{};
+    // When the access was last recorded for garbage collection.
+    time_t access_recorded{};
+  };
+
+  // get() with |fetch_locked| to populate the cache, called with |l|
+  // held.
+  const Memory* GetWithFetch(
+      const std::string& name,
+      std::function<bool(std::unique_lock<std::mutex>* l)> fetch_locked);
   void GetFileName(const std::string& key, std::string*, std::string*) const;
+  // Create the directory for |name| and return the path of the cache file.
+  bool PrepareCacheFilePath(const std::string& name, std::string* path) const;
+  // Atomically create the cache file at |path| with |content|.
+  bool WriteCacheFile(const std::string& path, const std::string& content);
+  // Whether |name| is in the on-disk cache.
+  bool ExistsLocked(const std::string& name);
+  // Map |name| from the on-disk cache, nullptr if it is not there.
+  std::unique_ptr<Memory> MapLocked(const std::string& name);
+  bool StoreLocked(const std::string& name, const std::string& content);
+  // Fetch |name| and store it, with |l| held on entry and exit. If
+  // another thread is already fetching |name|, wait for it and return
+  // its result instead of fetching again.
+  bool FetchSingleFlightLocked(std::unique_lock<std::mutex>* l,
+                               const std::string& name,
+                               std::function<bool(std::string*)> fetch);
+  // Same, streaming to a temporary file that is moved into the cache.
+  bool StreamSingleFlightLocked(std::unique_lock<std::mutex>* l,
+                                const std::string& name,
+                                StreamingFetch fetch);
+  // The single flight part, with |fetch| called unlocked and |store|
+  // called locked if it succeeded.
+  bool SingleFlightLocked(std::unique_lock<std::mutex>* l,
+                          const std::string& name,
+                          std::function<bool()> fetch,
+                          std::function<bool()> store);
+  // Where |name| is written before moving it into the cache.
+  std::string TemporaryPath(const std::string& name) const;
+  // The body of the background thread of StartProgressive(). Takes
+  // what it uses, since the thread is detached.
+  void RunProgressive(std::string name, std::string temporary,
+                      std::shared_ptr<Progressive> progressive,
+                      ProgressiveFetch fetch);
+  // Move the complete |temporary| file of |size| bytes into the cache
+  // as |name|, with |l| held on entry and exit. The content is copied
+  // into the pack without holding |l|.
+  bool StoreTemporaryLocked(std::unique_lock<std::mutex>* l,
+                            const std::string& name,
+                            const std::string& temporary, size_t size);
+  // Record the access for garbage collection.
+  void RecordAccessLocked(const std::string& name, size_t size);
+  // Same, for a hit on a mapped |entry|, unless recently recorded.
+  void RecordHitLocked(const std::string& name, Entry* entry);
+  // Add files that were cached before the access index existed, a few
+  // directories at a time. Returns true if there is more to do.
+  bool BootstrapAccessIndex();
+  // Take a reference, reopening the file descriptor of |name| that
+  // was closed when the entry became unreferenced.
+  const Memory* AcquireLocked(const std::string& name, Entry* entry);
+  // Unmap unreferenced entries until within budget.
+  void EvictLocked();
 
-  std::unordered_map<std::string, Memory> mapped_files_{};
-  std::mutex mutex_{};
+  struct InFlight {
+    bool done{};
+    bool ok{};
+  };
+
+  const Config config_;
+  std::unordered_map<std::string, Entry> mapped_files_{};
+  // Names of unreferenced entries, least recently used first.
+  std::list<std::string> lru_{};
+  Stats stats_{};
+  // Fetches in progress, keyed by name.
+  std::unordered_map<std::string, std::shared_ptr<InFlight>> in_flight_{};
+  std::condition_variable in_flight_cv_{};
+  // Progressive fetches, until their threads are done with this.
+  std::unordered_map<std::string, std::shared_ptr<Progressive>>
+      progressive_{};
+  mutable std::mutex mutex_{};
 
   const std::string cache_dir_;
   // for directory.
   ScopedFd file_lock_;
+  // Only when Config::packed.
+  std::unique_ptr<CachePack> pack_{};
+  // Shared by the mappings of the current pack file, so that each does
+  // not need its own descriptor. Replaced when the pack is compacted.
+  std::shared_ptr<const ScopedFd> pack_fd_{};
+  // Pack reservations being written without mutex_. Compaction waits
+  // for them to be published.
+  int pack_writers_{};
+  std::condition_variable pack_writers_cv_{};
+
+  // Only for the file per object layout.
+  std::unique_ptr<CacheAccessIndex> access_index_{};
+  // Serializes garbage collection passes, and guards the bootstrap
+  // state. Acquired before mutex_.
+  std::mutex gc_pass_mutex_{};
+  // Directories left to add to access_index_.
+  std::vector<std::string> bootstrap_dirs_{};
+  bool bootstrap_dirs_listed_{};
+  // Guards access_index_ and gc_stop_. Acquired after mutex_ when both
+  // are held.
+  std::mutex gc_mutex_{};
+  std::condition_variable gc_cv_{};
+  bool gc_stop_{};
+  std::thread gc_thread_{};
   DISALLOW_COPY_AND_ASSIGN(Cache);
 };
 
@@ -0,0 +1,89 @@
+// Insertion and lookup throughput of the file per object cache layout
+// and the packed layout.
+//
+// $ ./out/cached_file_benchmark 100000 1024
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "cached_file.h"
+#include "walk_filesystem.h"
+
+namespace {
+void RemoveTree(const std::string& dir) {
+  WalkFilesystem(dir, [](FTSENT* entry) {
+    if (entry->fts_info == FTS_F) {
+      unlink(entry->fts_path);
+    } else if (entry->fts_info == FTS_DP) {
+      rmdir(entry->fts_path);
+    }
+  });
+}
+
+double Seconds(std::chrono::steady_clock::time_point begin) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       begin)
+      .count();
+}
+
+void Run(const char* name, const std::string& dir, bool packed,
+         const std::vector<std::string>& keys, const std::string& content) {
+  RemoveTree(dir);
+  Cache::Config config;
+  config.packed = packed;
+  auto fetch = [&content](std::string* ret) -> bool {
+    *ret = content;
+    return true;
+  };
+  auto fail = [](std::string* ret) -> bool { return false; };
+
+  auto begin = std::chrono::steady_clock::now();
+  {
+    Cache cache(dir, config);
+    for (const auto& key : keys) {
+      cache.release(key, cache.get(key, fetch));
+    }
+  }
+  const double insert_seconds = Seconds(begin);
+
+  // A new instance so that nothing is mapped already.
+  begin = std::chrono::steady_clock::now();
+  {
+    Cache cache(dir, config);
+    for (const auto& key : keys) {
+      const Cache::Memory* m = cache.get(key, fail);
+      if (!m || m->size() != content.size()) abort();
+      cache.release(key, m);
+    }
+  }
+  const double lookup_seconds = Seconds(begin);
+
+  std::cout << name << ": insert "
+            << static_cast<size_t>(keys.size() / insert_seconds)
+            << " objects/s, lookup "
+            << static_cast<size_t>(keys.size() / lookup_seconds)
+            << " objects/s" << std::endl;
+  RemoveTree(dir);
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  const size_t entries = argc > 1 ? atoi(argv[1]) : 100000;
+  const size_t object_size = argc > 2 ? atoi(argv[2]) : 1024;
+  std::vector<std::string> keys;
+  char key[41];
+  for (size_t i = 0; i < entries; ++i) {
+    snprintf(key, sizeof(key), "%040zx", i * 2654435761U);
+    keys.emplace_back(key);
+  }
+  const std::string content(object_size, 'x');
+  Run("files", "out/cached_file_benchmark_files/", false, keys, content);
+  Run("packed", "out/cached_file_benchmark_packed/", true, keys, content);
+  return 0;
+}
@@ -1,14 +1,278 @@
 #include "cached_file.h"
+#include "scoped_fd.h"
 
 #include <assert.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include <atomic>
+#include <chrono>
+#include <future>
 #include <iostream>
 #include <string>
+#include <thread>
+#include <vector>
 
 using std::string;
 
 static char kTestString[] = "HogeFuga";
 
+// Many threads opening the same uncached object only fetch once.
+void SingleFlightTest(Cache* c) {
+  constexpr int kOpeners = 64;
+  // Make sure it is not cached from a previous run.
+  unlink("out/cached_file_test_cache/si/ngleflight");
+
+  std::atomic<int> fetch_count{0};
+  std::promise<void> start;
+  std::shared_future<void> started = start.get_future().share();
+  std::vector<std::future<const Cache::Memory*>> openers;
+  for (int i = 0; i < kOpeners; ++i) {
+    openers.emplace_back(std::async(std::launch::async, [&]() {
+      started.wait();
+      return c->get("singleflight", [&fetch_count](string* ret) -> bool {
+        fetch_count++;
+        // Slow enough that the other openers arrive while fetching.
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        *ret = string(kTestString);
+        return true;
+      });
+    }));
+  }
+  start.set_value();
+  const Cache::Memory* first = openers[0].get();
+  assert(first != nullptr);
+  for (int i = 1; i < kOpeners; ++i) {
+    assert(openers[i].get() == first);
+  }
+  assert(first->get_copy() == kTestString);
+  std::cout << "fetch count for " << kOpeners
+            << " openers: " << fetch_count << std::endl;
+  assert(fetch_count == 1);
+}
+
+// Content through the file descriptor, as spliced by read_buf.
+string ReadFd(const Cache::Memory* m) {
+  string content(m->size() + 1, '\0');
+  int fd;
+  off_t fd_offset;
+  // Past the end is left out.
+  assert(m->ReadFd(content.size(), 0, &fd, &fd_offset) ==
+         static_cast<ssize_t>(m->size()));
+  content.resize(m->size());
+  assert(pread(fd, &content[0], content.size(), fd_offset) ==
+         static_cast<ssize_t>(content.size()));
+  return content;
+}
+
+// Unreferenced mappings are unmapped least recently used first when
+// over budget.
+void EvictionTest() {
+  Cache::Config config;
+  config.max_mappings = 2;
+  Cache c("out/cached_file_test_eviction_cache/", config);
+  auto fetch = [](string* ret) -> bool {
+    *ret = string(kTestString);
+    return true;
+  };
+  const Cache::Memory* a = c.get("aaa", fetch);
+  const Cache::Memory* b = c.get("bbb", fetch);
+  const Cache::Memory* cc = c.get("ccc", fetch);
+  // Everything is referenced, so over budget.
+  assert(c.stats().mappings == 3);
+  assert(c.stats().evictions == 0);
+
+  assert(c.release("aaa", a));
+  assert(c.stats().mappings == 2);
+  assert(c.stats().evictions == 1);
+  assert(!c.release("aaa", a));
+
+  assert(c.release("bbb", b));
+  assert(c.stats().mappings == 2);
+  assert(c.get("bbb", fetch) == b);
+  assert(c.stats().hits == 1);
+  // The descriptor closed on release is reopened.
+  assert(ReadFd(b) == kTestString);
+  assert(c.release("bbb", b));
+  assert(c.release("ccc", cc));
+
+  // bbb was released before ccc.
+  const Cache::Memory* d = c.get("ddd", fetch);
+  assert(c.stats().evictions == 2);
+  assert(c.stats().misses == 4);
+  assert(c.get("ccc", fetch) == cc);
+  assert(d->get_copy() == kTestString);
+  std::cout << c.DumpStats();
+}
+
+void PackedTest() {
+  Cache::Config config;
+  config.packed = true;
+  {
+    Cache c("out/cached_file_test_packed_cache/", config);
+    const Cache::Memory* m = c.get("packed1", [](string* ret) -> bool {
+      *ret = string(kTestString);
+      return true;
+    });
+    assert(m->get_copy() == kTestString);
+    assert(ReadFd(m) == kTestString);
+    assert(c.release("packed1", m));
+    assert(c.Prefetch("packed2", [](string* ret) -> bool {
+      *ret = string(kTestString) + "2";
+      return true;
+    }));
+    assert(c.Gc());
+  }
+  // Still there after reopening.
+  Cache c("out/cached_file_test_packed_cache/", config);
+  auto fail = [](string* ret) -> bool { return false; };
+  assert(c.get("packed1", fail)->get_copy() == kTestString);
+  const Cache::Memory* m = c.get("packed2", fail);
+  assert(m->get_copy() == string(kTestString) + "2");
+  assert(ReadFd(m) == m->get_copy());
+}
+
+// Garbage collection to a size budget, including files that were
+// cached before the access index existed.
+// Content written to the fd is stored without going through memory.
+void StreamingTest(bool packed) {
+  Cache::Config config;
+  config.packed = packed;
+  const string dir = packed ? "out/cached_file_test_streaming_packed/"
+                            : "out/cached_file_test_streaming/";
+  const string large(3 << 20, 'x');
+  auto write_large = [&large](int fd) -> bool {
+    for (size_t i = 0; i < large.size(); i += 65536) {
+      if (write(fd, large.data() + i, 65536) != 65536) return false;
+    }
+    return true;
+  };
+  {
+    Cache c(dir, config);
+    const Cache::Memory* m = c.GetStreaming("large", write_large);
+    assert(m->get_copy() == large);
+    assert(ReadFd(m) == large);
+    assert(c.release("large", m));
+    assert(c.PrefetchStreaming("empty", [](int fd) -> bool { return true; }));
+    assert(!c.GetStreaming("failed", [](int fd) -> bool {
+      return write(fd, "partial", 7) == 7 && false;
+    }));
+  }
+  // Nothing is left behind from the failed one.
+  assert(access((dir + (packed ? "failed.tmp" : "fa/iled.tmp")).c_str(),
+                F_OK) == -1);
+  Cache c(dir, config);
+  auto fail = [](int fd) -> bool { return false; };
+  assert(c.GetStreaming("large", fail)->get_copy() == large);
+  assert(c.GetStreaming("empty", fail)->size() == 0);
+  assert(!c.GetStreaming("failed", fail));
+}
+
+// Parts of an object can be read before the rest has arrived.
+void ProgressiveTest(bool packed) {
+  Cache::Config config;
+  config.packed = packed;
+  const string dir = packed ? "out/cached_file_test_progressive_packed/"
+                            : "out/cached_file_test_progressive/";
+  // Make sure nothing is cached from a previous run.
+  assert(system(("rm -rf " + dir).c_str()) == 0);
+  Cache c(dir, config);
+
+  std::promise<void> head_read;
+  std::shared_future<void> head_was_read = head_read.get_future().share();
+  auto fetch = [head_was_read](
+                   int fd, const std::function<void(size_t)>& progress) {
+    if (write(fd, "head", 4) != 4) return false;
+    progress(4);
+    head_was_read.wait();
+    if (write(fd, "tail", 4) != 4) return false;
+    progress(8);
+    return true;
+  };
+  std::shared_ptr<Cache::Progressive> p = c.StartProgressive("object", fetch);
+  assert(p);
+  // Later opens share the fetch in progress.
+  assert(c.StartProgressive("object", fetch) == p);
+  char buf[8];
+  assert(p->Read(buf, 4, 0) == 4);
+  assert(string(buf, 4) == "head");
+  head_read.set_value();
+  assert(p->Read(buf, 8, 0) == 8);
+  assert(string(buf, 8) == "headtail");
+  assert(p->Read(buf, 8, 6) == 2);
+  assert(p->Read(buf, 8, 8) == 0);
+  assert(p->Wait(100) == 8);
+
+  // get() waits for the fetch and maps the result.
+  auto fail = [](string* ret) -> bool { return false; };
+  const Cache::Memory* m = c.get("object", fail);
+  assert(m->get_copy() == "headtail");
+  assert(c.release("object", m));
+  c.WaitProgressive();
+  assert(!c.StartProgressive("object", fetch));
+
+  // What arrived before a failure is readable, the rest is not.
+  auto held = std::make_shared<int>();
+  p = c.StartProgressive(
+      "failed",
+      [held](int fd, const std::function<void(size_t)>& progress) {
+        if (write(fd, "ab", 2) != 2) return false;
+        progress(2);
+        return false;
+      });
+  assert(p->Read(buf, 2, 0) == 2);
+  assert(p->Read(buf, 4, 0) == -EIO);
+  assert(!c.get("failed", fail));
+  // Nothing of the fetch is kept once it is done.
+  c.WaitProgressive();
+  assert(held.use_count() == 1);
+}
+
+void GcTest() {
+  const string dir = "out/cached_file_test_gc_cache/";
+  for (const char* file : {"access.log", "aa/1", "aa/2", "bb/3", "cc/4"}) {
+    unlink((dir + file).c_str());
+  }
+  mkdir(dir.c_str(), 0700);
+  mkdir((dir + "cc").c_str(), 0700);
+  {
+    ScopedFd fd(open((dir + "cc/4").c_str(), O_WRONLY | O_CREAT, 0600));
+    assert(write(fd.get(), "0123456789", 10) == 10);
+    // Accessed a day ago.
+    struct timespec times[2] = {{time(nullptr) - 24 * 60 * 60, 0},
+                                {0, UTIME_OMIT}};
+    assert(futimens(fd.get(), times) == 0);
+  }
+
+  Cache::Config config;
+  config.max_cache_bytes = 25;
+  config.gc_max_deletions_per_pass = 1;
+  auto fetch = [](string* ret) -> bool {
+    *ret = string(10, 'x');
+    return true;
+  };
+  auto exists = [&dir](const char* file) {
+    return access((dir + file).c_str(), F_OK) == 0;
+  };
+  {
+    Cache c(dir, config);
+    for (const char* name : {"aa1", "aa2", "bb3"}) {
+      assert(c.release(name, c.get(name, fetch)));
+    }
+    assert(c.Gc());
+  }
+  // The oldest file goes first, then one more to fit in the budget.
+  assert(!exists("cc/4"));
+  assert(exists("aa/1") + exists("aa/2") + exists("bb/3") == 2);
+
+  // The index is loaded from the log, nothing more to collect.
+  Cache c(dir, config);
+  assert(!c.GcPass());
+  assert(exists("aa/1") + exists("aa/2") + exists("bb/3") == 2);
+  c.StartBackgroundGc();
+}
+
 int main(int argc, char** argv) {
   std::cout << "Wait for lock." << std::endl;
   Cache c("out/cached_file_test_cache/");
@@ -24,5 +288,25 @@ int main(int argc, char** argv) {
   string test2(m2->memory_charp(), m2->size());
   assert(test2 == kTestString);
   assert(m2->get_copy() == kTestString);
+
+  // Prefetched items are stored to disk and available to get().
+  assert(c.Prefetch("test2", [](string* ret) -> bool {
+    *ret = string(kTestString);
+    return true;
+  }));
+  assert(c.Prefetch("test2", [](string* ret) -> bool { return false; }));
+  assert(!c.Prefetch("test3", [](string* ret) -> bool { return false; }));
+  const Cache::Memory* m3 =
+      c.get("test2", [](string* ret) -> bool { return false; });
+  assert(m3->get_copy() == kTestString);
+
+  SingleFlightTest(&c);
+  EvictionTest();
+  PackedTest();
+  StreamingTest(false);
+  StreamingTest(true);
+  ProgressiveTest(false);
+  ProgressiveTest(true);
+  GcTest();
   return 0;
 }
@@ -0,0 +1,217 @@
+#include "compact_directory_container.h"
+
+#include <assert.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+namespace directory_container {
+
+namespace {
+// Index into the spare array lists for a power of two capacity.
+int CapacityIndex(uint32_t capacity) { return __builtin_ctz(capacity); }
+
+// For binary search over child arrays.
+constexpr auto kNameLess = [](const auto* node, std::string_view name) {
+  return node->name < name;
+};
+}  // namespace
+
+CompactDirectoryContainer::CompactDirectoryContainer() {
+  clock_gettime(CLOCK_REALTIME, &mount_time_);
+}
+
+CompactDirectoryContainer::~CompactDirectoryContainer() { DeleteFiles(&root_); }
+
+void CompactDirectoryContainer::DeleteFiles(Node* node) {
+  delete node->file;
+  for (uint32_t i = 0; i < node->children_size; ++i) {
+    DeleteFiles(node->children[i]);
+  }
+}
+
+std::string_view CompactDirectoryContainer::Intern(std::string_view name) {
+  auto it = interned_.find(name);
+  if (it != interned_.end()) return *it;
+  std::string_view copy = arena_.CopyString(name);
+  interned_.insert(copy);
+  return copy;
+}
+
+CompactDirectoryContainer::Node* CompactDirectoryContainer::
+    FindOrCreateChildLocked(Node* parent, std::string_view name) {
+  Node** begin = parent->children;
+  Node** end = begin + parent->children_size;
+  Node** it = std::lower_bound(begin, end, name, kNameLess);
+  if (it != end && (*it)->name == name) {
+    return *it;
+  }
+  const size_t position = it - begin;
+
+  if (parent->children_size == parent->children_capacity) {
+    const uint32_t capacity =
+        parent->children_capacity ? parent->children_capacity * 2 : 4;
+    Node**& spare = spare_children_[CapacityIndex(capacity)];
+    Node** children;
+    if (spare) {
+      children = spare;
+      memcpy(&spare, &children[0], sizeof(spare));
+    } else {
+      children = arena_.NewArray<Node*>(capacity);
+    }
+    std::copy(begin, end, children);
+    if (parent->children_capacity) {
+      // Keep the outgrown array for reuse by another directory.
+      Node**& old_spare =
+          spare_children_[CapacityIndex(parent->children_capacity)];
+      memcpy(&parent->children[0], &old_spare, sizeof(old_spare));
+      old_spare = parent->children;
+    }
+    parent->children = children;
+    parent->children_capacity = capacity;
+  }
+
+  Node** children = parent->children;
+  // Input is usually sorted, in which case this is an append.
+  std::copy_backward(children + position, children + parent->children_size,
+                     children + parent->children_size + 1);
+  Node* node = arena_.New<Node>();
+  node->name = Intern(name);
+  children[position] = node;
+  parent->children_size++;
+  return node;
+}
+
+const CompactDirectoryContainer::Node* CompactDirectoryContainer::FindLocked(
+    std::string_view path) const {
+  if (path.empty() || path[0] != '/') return nullptr;
+  path.remove_prefix(1);
+  const Node* node = &root_;
+  if (path.empty()) return node;
+  while (true) {
+    const size_t slash = path.find('/');
+    const std::string_view name = path.substr(0, slash);
+    const Node* const* begin = node->children;
+    const Node* const* end = begin + node->children_size;
+    auto it = std::lower_bound(begin, end, name, kNameLess);
+    if (it == end || (*it)->name != name) return nullptr;
+    node = *it;
+    if (slash == std::string_view::npos) return node;
+    path.remove_prefix(slash + 1);
+  }
+}
+
+void CompactDirectoryContainer::add(std::string_view path,
+                                    std::unique_ptr<File> file) {
+  assert(path.size() > 1 && path[0] == '/');
+  std::lock_guard<std::mutex> l(mutex_);
+  Node* node = &root_;
+  path.remove_prefix(1);
+  while (true) {
+    const size_t slash = path.find('/');
+    node = FindOrCreateChildLocked(node, path.substr(0, slash));
+    if (slash == std::string_view::npos) break;
+    path.remove_prefix(slash + 1);
+  }
+  delete node->file;
+  node->file = file.release();
+}
+
+void CompactDirectoryContainer::add_directory(std::string_view path) {
+  assert(!path.empty() && path[0] == '/');
+  std::lock_guard<std::mutex> l(mutex_);
+  Node* node = &root_;
+  path.remove_prefix(1);
+  while (!path.empty()) {
+    const size_t slash = path.find('/');
+    node = FindOrCreateChildLocked(node, path.substr(0, slash));
+    if (slash == std::string_view::npos) break;
+    path.remove_prefix(slash + 1);
+  }
+}
+
+const File* CompactDirectoryContainer::get(std::string_view path) const {
+  std::lock_guard<std::mutex> l(mutex_);
+  const Node* node = FindLocked(path);
+  return node ? node->file : nullptr;
+}
+
+File* CompactDirectoryContainer::mutable_get(std::string_view path) {
+  std::lock_guard<std::mutex> l(mutex_);
+  const Node* node = FindLocked(path);
+  return node ? node->file : nullptr;
+}
+
+bool CompactDirectoryContainer::exists(std::string_view path) const {
+  std::lock_guard<std::mutex> l(mutex_);
+  return FindLocked(path) != nullptr;
+}
+
+bool CompactDirectoryContainer::is_directory(std::string_view path) const {
+  std::lock_guard<std::mutex> l(mutex_);
+  const Node* node = FindLocked(path);
+  return node && !node->file;
+}
+
+int CompactDirectoryContainer::Getattr(std::string_view path,
+                                       struct stat* stbuf) const {
+  memset(stbuf, 0, sizeof(struct stat));
+  stbuf->st_atim = stbuf->st_mtim = stbuf->st_ctim = mount_time_;
+  File* file;
+  {
+    std::lock_guard<std::mutex> l(mutex_);
+    const Node* node = FindLocked(path);
+    if (!node) return -ENOENT;
+    file = node->file;
+  }
+  if (file) {
+    int ret = file->Getattr(stbuf);
+    if (ret == 0 && stbuf->st_ino == 0) stbuf->st_ino = PathInode(path);
+    return ret;
+  }
+  stbuf->st_uid = getuid();
+  stbuf->st_gid = getgid();
+  stbuf->st_mode = S_IFDIR | 0755;
+  stbuf->st_nlink = 2;
+  stbuf->st_ino = PathInode(path);
+  return 0;
+}
+
+void CompactDirectoryContainer::for_each(
+    std::string_view path,
+    std::function<void(std::string_view name, const File* f)> callback) const {
+  std::lock_guard<std::mutex> l(mutex_);
+  const Node* node = FindLocked(path);
+  if (!node || node->file) return;
+  for (uint32_t i = 0; i < node->children_size; ++i) {
+    callback(node->children[i]->name, node->children[i]->file);
+  }
+}
+
+void CompactDirectoryContainer::dump() const {
+  std::lock_guard<std::mutex> l(mutex_);
+  DumpLocked(&root_, 0);
+}
+
+void CompactDirectoryContainer::DumpLocked(const Node* node, int indent) const {
+  for (uint32_t i = 0; i < node->children_size; ++i) {
+    std::cout << std::string(indent, ' ') << node->children[i]->name
+              << std::endl;
+    DumpLocked(node->children[i], indent + 1);
+  }
+}
+
+size_t CompactDirectoryContainer::arena_bytes() const {
+  std::lock_guard<std::mutex> l(mutex_);
+  return arena_.allocated_bytes();
+}
+
+}  // namespace directory_container
@@ -0,0 +1,93 @@
+#ifndef COMPACT_DIRECTORY_CONTAINER_H_
+#define COMPACT_DIRECTORY_CONTAINER_H_
+
+#include <sys/stat.h>
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <unordered_set>
+
+#include "arena.h"
+#include "directory_container.h"
+#include "disallow.h"
+
+namespace directory_container {
+
+// Alternative to DirectoryContainer for large trees.
+//
+// Nodes are allocated from an arena, path components are interned and
+// stored once, and children of a directory are kept as a sorted array
+// of nodes. The full path is not stored anywhere; lookups walk the
+// path components without allocating.
+//
+// Directories are represented by the container itself and do not have
+// a File object.
+class CompactDirectoryContainer {
+ public:
+  CompactDirectoryContainer();
+  ~CompactDirectoryContainer();
+
+  // Add a file, creating parent directories as necessary. Replaces a
+  // file already at |path|.
+  void add(std::string_view path, std::unique_ptr<File> file);
+  // Add an empty directory, no-op if it already exists.
+  void add_directory(std::string_view path);
+
+  // Returns the file, or nullptr if it does not exist or is a
+  // directory.
+  const File* get(std::string_view path) const;
+  File* mutable_get(std::string_view path);
+  bool exists(std::string_view path) const;
+  bool is_directory(std::string_view path) const;
+
+  int Getattr(std::string_view path, struct stat* stbuf) const;
+
+  // Iterate directory entries in name order. |f| is nullptr for
+  // subdirectories.
+  void for_each(std::string_view path,
+                std::function<void(std::string_view name, const File* f)>
+                    callback) const;
+
+  void dump() const;
+
+  // Bytes used for nodes, names and child arrays.
+  size_t arena_bytes() const;
+
+ private:
+  struct Node {
+    // Interned, points into the arena.
+    std::string_view name{};
+    // Owned. nullptr for directories.
+    File* file{};
+    // Sorted by name.
+    Node** children{};
+    uint32_t children_size{};
+    uint32_t children_capacity{};
+  };
+
+  // Find the node for |path|, or nullptr.
+  const Node* FindLocked(std::string_view path) const;
+  // Find or create the child |name| of |parent|.
+  Node* FindOrCreateChildLocked(Node* parent, std::string_view name);
+  std::string_view Intern(std::string_view name);
+  void DeleteFiles(Node* node);
+  void DumpLocked(const Node* node, int indent) const;
+
+  Arena arena_{};
+  // Names stored in the arena.
+  std::unordered_set<std::string_view> interned_{};
+  // Child arrays that were outgrown, reused by capacity, indexed by
+  // log2 of capacity. Linked through their first element.
+  Node** spare_children_[32]{};
+
+  Node root_{};
+  mutable std::mutex mutex_{};
+
+  struct timespec mount_time_ {};
+  DISALLOW_COPY_AND_ASSIGN(CompactDirectoryContainer);
+};
+}  // namespace directory_container
+
+#endif
@@ -0,0 +1,117 @@
+#include "compact_directory_container.h"
+
+#include <assert.h>
+#include <sys/stat.h>
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using directory_container::CompactDirectoryContainer;
+using std::string;
+using std::string_view;
+using std::vector;
+
+namespace {
+// Concrete class.
+class TestFile : public directory_container::File {
+ public:
+  explicit TestFile(int* deleted = nullptr) : deleted_(deleted) {}
+  virtual ~TestFile() {
+    if (deleted_) (*deleted_)++;
+  }
+  virtual int Getattr(struct stat* stbuf) override {
+    stbuf->st_mode = S_IFREG | 0644;
+    return 0;
+  }
+  virtual ssize_t Read(char* buf, size_t size, off_t offset) override {
+    return -EINVAL;
+  }
+  virtual int Open() override { return -EINVAL; };
+  virtual int Release() override { return -EINVAL; };
+
+ private:
+  int* deleted_;
+};
+
+void BasicTest() {
+  CompactDirectoryContainer d;
+  d.add("/this/dir", std::make_unique<TestFile>());
+  d.add("/the", std::make_unique<TestFile>());
+  d.add("/a", std::make_unique<TestFile>());
+  d.add("/hoge/ccc", std::make_unique<TestFile>());
+  d.add("/hoge/bbb", std::make_unique<TestFile>());
+  d.add("/foo/bbbdir/ccc", std::make_unique<TestFile>());
+  d.add("/hoge/bbbdir/ccc", std::make_unique<TestFile>());
+  d.add_directory("/empty");
+
+  d.dump();
+
+  assert(d.is_directory("/"));
+  assert(d.is_directory("/this"));
+  assert(d.is_directory("/hoge"));
+  assert(d.is_directory("/empty"));
+  assert(!d.is_directory("/hog"));
+  assert(!d.is_directory("/a"));
+  assert(!d.is_directory("/hoge/ccc"));
+  assert(d.get("/hoge/ccc"));
+  assert(!d.get("/hoge"));
+  assert(!d.exists("/hoge/"));
+  assert(!d.exists("hoge"));
+  assert(!d.exists("/hoge//ccc"));
+
+  struct stat st;
+  assert(d.Getattr("/", &st) == 0);
+  assert(st.st_mode == (S_IFDIR | 0755));
+  assert(st.st_ino == 1);
+  assert(d.Getattr("/hoge/bbb", &st) == 0);
+  assert(st.st_mode == (S_IFREG | 0644));
+  assert(st.st_ino == directory_container::PathInode("/hoge/bbb"));
+  assert(d.Getattr("/hoge/bbb/", &st) == -ENOENT);
+
+  // Entries come out sorted regardless of insertion order.
+  vector<string> names;
+  d.for_each("/hoge", [&names](string_view name,
+                               const directory_container::File* f) {
+    names.emplace_back(name);
+  });
+  assert((names == vector<string>{"bbb", "bbbdir", "ccc"}));
+}
+
+void ReplaceTest() {
+  int deleted = 0;
+  {
+    CompactDirectoryContainer d;
+    d.add("/file", std::make_unique<TestFile>(&deleted));
+    d.add("/file", std::make_unique<TestFile>(&deleted));
+    assert(deleted == 1);
+  }
+  assert(deleted == 2);
+}
+
+void ManyEntriesTest() {
+  // Enough entries for child arrays to grow and get reused.
+  CompactDirectoryContainer d;
+  for (int i = 0; i < 1000; ++i) {
+    d.add("/dir" + std::to_string(i % 7) + "/file" + std::to_string(i),
+          std::make_unique<TestFile>());
+  }
+  for (int i = 0; i < 1000; ++i) {
+    assert(d.get("/dir" + std::to_string(i % 7) + "/file" + std::to_string(i)));
+  }
+  int count = 0;
+  d.for_each("/dir0", [&count](string_view, const directory_container::File*) {
+    count++;
+  });
+  assert(count == 143);
+}
+}  // namespace
+
+int main() {
+  BasicTest();
+  ReplaceTest();
+  ManyEntriesTest();
+  return 0;
+}
@@ -53,18 +53,31 @@ int main() {
   NinjaBuilder n(config);
   n.CclinkRule("cclinkwithgit2", "$gxx $in -o $out -lgit2 $ldflags");
   n.CclinkRule("cclinkcowfs", "$gxx $in -o $out -lgcrypt $ldflags");
+  n.CclinkRule("cclinkwithcurl", "$gxx $in -o $out -lcurl $ldflags");
 
   n.CompileLinkRunTest(
       "gitlstree_test",
-      {"basename", "cached_file", "concurrency_limit", "directory_container",
+      {"basename", "blob_prefetcher", "cache_access_index", "cache_pack",
+       "cached_file", "concurrency_limit", "directory_container",
        "get_current_dir", "git_cat_file", "gitlstree", "gitlstree_test",
-       "scoped_timer", "stats_holder", "strutil"},
+       "scoped_timer", "stats_holder", "strutil", "tree_index"},
       {"out/fetch_test_repo.sh.result"});
   n.CompileLink(
       "gitlstree",
-      {"basename", "cached_file", "concurrency_limit", "directory_container",
-       "get_current_dir", "git_adapter", "git_cat_file", "gitlstree",
-       "gitlstree_fusemain", "scoped_timer", "stats_holder", "strutil"});
+      {"basename", "blob_prefetcher", "cache_access_index", "cache_pack",
+       "cached_file", "compact_directory_container", "concurrency_limit",
+       "directory_container", "get_current_dir", "git_adapter",
+       "git_adapter_lowlevel", "git_cat_file", "gitlstree",
+       "gitlstree_fusemain", "scoped_timer", "stats_holder", "strutil",
+       "tree_index"});
+  n.CompileLink(
+      "gitlstree_benchmark",
+      {"basename", "blob_prefetcher", "cache_access_index", "cache_pack",
+       "cached_file", "concurrency_limit", "directory_container",
+       "get_current_dir", "git_cat_file", "gitlstree", "gitlstree_benchmark",
+       "scoped_timer", "stats_holder", "strutil", "tree_index"});
+  n.CompileLinkRunTest("blob_prefetcher_test",
+                       {"blob_prefetcher", "blob_prefetcher_test"});
 
   n.CompileLinkRunTest("strutil_test", {"strutil", "strutil_test"});
   n.CompileLink("ninjafs", {"basename", "directory_container",
@@ -75,32 +88,63 @@ int main() {
   n.CompileLinkRunTest("basename_test", {"basename_test", "basename"});
   n.CompileLinkRunTest(
       "git-githubfs_test",
-      {"base64decode", "basename", "cached_file", "concurrency_limit",
-       "directory_container", "get_current_dir", "git-githubfs_test",
-       "git-githubfs", "jsonparser", "scoped_timer", "stats_holder",
-       "strutil"});
+      {"base64decode", "basename", "cache_access_index", "cache_pack",
+       "cached_file", "compact_directory_container", "concurrency_limit",
+       "directory_container", "get_current_dir", "git-githubfs",
+       "git-githubfs_test", "http_fetcher", "jsonparser", "local_http_server",
+       "scoped_timer", "stats_holder", "strutil", "tree_index"})
+      .Cclink("cclinkwithcurl");
   n.CompileLink("git-githubfs",
-                {"base64decode", "basename", "cached_file", "concurrency_limit",
-                 "directory_container", "get_current_dir", "git_adapter",
-                 "git-githubfs_fusemain", "git-githubfs", "jsonparser",
-                 "scoped_timer", "stats_holder", "strutil"});
+                {"base64decode", "basename", "cache_access_index", "cache_pack",
+                 "cached_file", "compact_directory_container",
+                 "concurrency_limit", "directory_container", "get_current_dir",
+                 "git-githubfs", "git-githubfs_fusemain", "git_adapter",
+                 "git_adapter_lowlevel", "http_fetcher", "jsonparser",
+                 "scoped_timer", "stats_holder", "strutil", "tree_index"})
+      .Cclink("cclinkwithcurl");
+  n.CompileLinkRunTest("http_fetcher_test",
+                       {"http_fetcher", "http_fetcher_test",
+                        "local_http_server", "strutil"})
+      .Cclink("cclinkwithcurl");
   n.CompileLinkRunTest("concurrency_limit_test",
                        {"concurrency_limit_test", "concurrency_limit"});
+  n.CompileLinkRunTest("git_adapter_test",
+                       {"basename", "compact_directory_container",
+                        "directory_container", "git_adapter",
+                        "git_adapter_test"});
   n.CompileLinkRunTest(
       "directory_container_test",
       {"directory_container", "directory_container_test", "basename"});
+  n.CompileLinkRunTest(
+      "compact_directory_container_test",
+      {"basename", "compact_directory_container",
+       "compact_directory_container_test", "directory_container"});
+  n.CompileLink("directory_container_benchmark",
+                {"basename", "compact_directory_container",
+                 "directory_container", "directory_container_benchmark"});
 
   n.CompileLink("git_ioctl_client", {"git_ioctl_client"});
+  n.CompileLink("stat_benchmark", {"stat_benchmark"});
   n.CompileLinkRunTest("scoped_fd_test", {"scoped_fd_test"});
   n.CompileLinkRunTest("cached_file_test",
-                       {"cached_file", "cached_file_test", "stats_holder"});
+                       {"cache_access_index", "cache_pack", "cached_file",
+                        "cached_file_test", "stats_holder"});
+  n.CompileLink("cached_file_benchmark",
+                {"cache_access_index", "cache_pack", "cached_file",
+                 "cached_file_benchmark", "stats_holder"});
+  n.CompileLinkRunTest("cache_pack_test", {"cache_pack", "cache_pack_test"});
+  n.CompileLinkRunTest("cache_access_index_test",
+                       {"cache_access_index", "cache_access_index_test"});
+  n.CompileLinkRunTest("tree_index_test", {"tree_index", "tree_index_test"});
   n.CompileLink("cached_file_util", {
+                                        "cache_access_index",
+                                        "cache_pack",
                                         "cached_file",
                                         "cached_file_util",
                                         "stats_holder",
                                     });
   n.CompileLinkRunTest("base64decode_test",
-                       {"base64decode", "base64decode_test"});
+                       {"base64decode", "base64decode_test", "strutil"});
   n.CompileLinkRunTest("base64decode_benchmark",
                        {"base64decode", "base64decode_benchmark", "strutil"});
   n.CompileLinkRunTest("scoped_fileutil_test",
@@ -110,8 +154,9 @@ int main() {
                 {"jsonparser_util", "jsonparser", "strutil"});
   n.CompileLinkRunTest("scoped_timer_test",
                        {"scoped_timer", "scoped_timer_test", "stats_holder"});
-  n.CompileLinkRunTest("gitiles_test", {"base64decode", "gitiles_test",
-                                        "jsonparser", "strutil"});
+  n.CompileLinkRunTest("gitiles_test", {"base64decode", "gitiles",
+                                        "gitiles_test", "jsonparser",
+                                        "strutil"});
   n.CompileLinkRunTest("git_cat_file_test",
                        {"get_current_dir", "git_cat_file", "git_cat_file_test",
                         "scoped_timer", "stats_holder", "strutil"});
@@ -5,6 +5,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <memory>
@@ -16,7 +17,15 @@
 
 namespace directory_container {
 
-Directory::Directory() {}
+ino_t PathInode(std::string_view path) {
+  if (path == "/") return 1;
+  return std::max<ino_t>(std::hash<std::string_view>()(path), 2);
+}
+
+Directory::Directory() {
+  maps_.emplace_back(std::make_unique<FileElementMap>());
+  files_ = maps_.back().get();
+}
 Directory::~Directory() {}
 
 int Directory::Getattr(struct stat* stbuf) {
@@ -27,40 +36,206 @@ int Directory::Getattr(struct stat* stbuf) {
   return 0;
 };
 
-void Directory::dump(int indent) {
+void Directory::add(const std::string& path, std::unique_ptr<File> f) {
+  std::lock_guard<std::mutex> l(mutex_);
+  File* file = f.get();
+  owned_files_.emplace_back(move(f));
+  AddLocked(path, file);
+}
+
+void Directory::link(const std::string& name, File* f) {
+  std::lock_guard<std::mutex> l(mutex_);
+  AddLocked(name, f);
+}
+
+void Directory::AddLocked(const std::string& name, File* file) {
+  FileElementMap* files = maps_.back().get();
+  if (!frozen_) {
+    (*files)[name] = file;
+    return;
+  }
+  // Same as DirectoryContainer::InsertLocked. Readers keep using the
+  // old map.
+  const bool replace = files->find(name) != files->end();
+  if (!replace) {
+    overlay_[name] = file;
+    overlay_size_.store(overlay_.size(), std::memory_order_release);
+  }
+  if (replace || overlay_.size() >= files->size()) {
+    auto merged = std::make_unique<FileElementMap>(*files);
+    merged->insert(overlay_.begin(), overlay_.end());
+    (*merged)[name] = file;
+    files_.store(merged.get(), std::memory_order_release);
+    maps_.emplace_back(move(merged));
+    overlay_.clear();
+    overlay_size_.store(0, std::memory_order_release);
+  }
+}
+
+File* Directory::FindLocked(const std::string& name) const {
+  const FileElementMap* files = files_.load(std::memory_order_relaxed);
+  auto it = files->find(name);
+  if (it != files->end()) return it->second;
+  it = overlay_.find(name);
+  if (it != overlay_.end()) return it->second;
+  return nullptr;
+}
+
+const Directory::FileElementMap* Directory::LockFreeMap() const {
+  if (!frozen_.load(std::memory_order_acquire)) return nullptr;
+  const FileElementMap* files = files_.load(std::memory_order_acquire);
+  // A merge publishes the new map before emptying the overlay, so an
+  // unchanged map seen after an empty overlay is complete.
+  while (overlay_size_.load(std::memory_order_acquire) == 0) {
+    const FileElementMap* current = files_.load(std::memory_order_acquire);
+    if (current == files) return files;
+    files = current;
+  }
+  return nullptr;
+}
+
+File* Directory::get(const std::string& path) const {
+  if (frozen_.load(std::memory_order_acquire)) {
+    const FileElementMap* files = files_.load(std::memory_order_acquire);
+    while (true) {
+      auto it = files->find(path);
+      if (it != files->end()) return it->second;
+      if (overlay_size_.load(std::memory_order_acquire) != 0) break;
+      // A merge may have moved the entry from the overlay to a new map
+      // since the lookup.
+      const FileElementMap* current = files_.load(std::memory_order_acquire);
+      if (current == files) return nullptr;
+      files = current;
+    }
+  }
+  std::lock_guard<std::mutex> l(mutex_);
+  return FindLocked(path);
+}
+
+void Directory::for_each(
+    std::function<void(const std::string& filename, const File* f)> callback)
+    const {
+  MaybeLoad();
+  ForEachLoaded(callback);
+}
+
+void Directory::ForEachLoaded(
+    std::function<void(const std::string& filename, const File* f)> callback)
+    const {
+  if (const FileElementMap* files = LockFreeMap()) {
+    for (const auto& file : *files) {
+      callback(file.first, file.second);
+    }
+    return;
+  }
+  std::lock_guard<std::mutex> l(mutex_);
+  for (const FileElementMap* files : {files_.load(), &overlay_}) {
+    for (const auto& file : *files) {
+      callback(file.first, file.second);
+    }
+  }
+}
+
+Directory::Listing::Listing(const Directory& directory) {
+  directory.MaybeLoad();
+  files_ = directory.LockFreeMap();
+  if (!files_) {
+    std::lock_guard<std::mutex> l(directory.mutex_);
+    copy_ = std::make_unique<FileElementMap>(*directory.files_.load());
+    copy_->insert(directory.overlay_.begin(), directory.overlay_.end());
+    files_ = copy_.get();
+  }
+  it_ = files_->begin();
+}
+
+void Directory::Listing::Seek(size_t position) {
+  if (position < position_) {
+    it_ = files_->begin();
+    position_ = 0;
+  }
+  while (position_ < position && !done()) Next();
+}
+
+void Directory::set_loader(std::function<void()> loader) {
+  loader_ = [this, loader = move(loader)]() {
+    loader();
+    loaded_ = true;
+    Freeze();
+  };
+}
+
+void Directory::set_resolver(
+    std::function<bool(const std::string& name)> resolver) {
+  resolver_ = move(resolver);
+}
+
+void Directory::Freeze() {
+  // Loading would otherwise copy the map for every entry.
+  if (loader_ && !loaded_) return;
   std::lock_guard<std::mutex> l(mutex_);
-  for (const auto& file : files_) {
-    std::cout << std::string(indent, ' ') << file.first << std::endl;
-    Directory* d = dynamic_cast<Directory*>(file.second.get());
+  frozen_.store(true, std::memory_order_release);
+}
+
+void Directory::dump(int indent) const {
+  // Don't trigger loading, this may be called with locks held.
+  ForEachLoaded([indent](const std::string& name, const File* f) {
+    std::cout << std::string(indent, ' ') << name << std::endl;
+    const Directory* d = dynamic_cast<const Directory*>(f);
     if (d) {
       d->dump(indent + 1);
     }
-  }
+  });
 }
 
 DirectoryContainer::DirectoryContainer() {
-  files_["/"] = &root_;
+  path_maps_.emplace_back(std::make_unique<PathMap>());
+  files_ = path_maps_.back().get();
+  (*files_)["/"] = &root_;
   clock_gettime(CLOCK_REALTIME, &mount_time_);
 };
 
 DirectoryContainer::~DirectoryContainer() {}
 
 int DirectoryContainer::Getattr(const std::string& path, struct stat* stbuf) {
-  memset(stbuf, 0, sizeof(struct stat));
-  stbuf->st_atim = stbuf->st_mtim = stbuf->st_ctim = mount_time_;
   File* f = mutable_get(path);
   if (!f) return -ENOENT;
-  return f->Getattr(stbuf);
+  return Getattr(path, f, stbuf);
+}
+
+int DirectoryContainer::Getattr(const std::string& path, File* f,
+                                struct stat* stbuf) const {
+  int ret = Getattr(f, 0, stbuf);
+  if (ret == 0 && stbuf->st_ino == 0) stbuf->st_ino = PathInode(path);
+  return ret;
+}
+
+int DirectoryContainer::Getattr(File* f, ino_t ino, struct stat* stbuf) const {
+  memset(stbuf, 0, sizeof(struct stat));
+  stbuf->st_atim = stbuf->st_mtim = stbuf->st_ctim = mount_time_;
+  int ret = f->Getattr(stbuf);
+  if (ret == 0 && stbuf->st_ino == 0) stbuf->st_ino = ino;
+  return ret;
+}
+
+void DirectoryContainer::Freeze() {
+  std::lock_guard<std::mutex> l(path_mutex_);
+  for (const auto& file : *files_) {
+    Directory* d = dynamic_cast<Directory*>(file.second);
+    if (d) d->Freeze();
+  }
+  frozen_.store(true, std::memory_order_release);
 }
 
 void DirectoryContainer::dump() {
   std::lock_guard<std::mutex> l(path_mutex_);
   std::cout << "Files map" << std::endl;
-  for (const auto& file : files_) {
-    std::cout << file.first << " " << file.second << std::endl;
-    std::cout << "Is directory: "
-              << (dynamic_cast<Directory*>(file.second) != nullptr)
-              << std::endl;
+  for (const PathMap* files : {files_.load(), &overlay_}) {
+    for (const auto& file : *files) {
+      std::cout << file.first << " " << file.second << std::endl;
+      std::cout << "Is directory: "
+                << (dynamic_cast<Directory*>(file.second) != nullptr)
+                << std::endl;
+    }
   }
   std::cout << "Directory map" << std::endl;
   root_.dump();
@@ -71,46 +246,136 @@ void DirectoryContainer::add(const std::string& path,
   std::lock_guard<std::mutex> l(path_mutex_);
   std::string dirname(DirName(path));
   Directory* dir = MaybeCreateParentDir(dirname);
-  files_[path] = file.get();
+  InsertLocked(path, file.get());
   dir->add(BaseName(path), move(file));
 }
 
-const File* DirectoryContainer::get(const std::string& path) const {
+void DirectoryContainer::add_lazy_directory(const std::string& path,
+                                            std::function<void()> loader) {
+  auto directory = std::make_unique<Directory>();
+  directory->set_loader(move(loader));
+  has_lazy_directory_ = true;
+  add(path, move(directory));
+}
+
+void DirectoryContainer::link(const std::string& path, File* file) {
   std::lock_guard<std::mutex> l(path_mutex_);
-  auto it = files_.find(path);
-  if (it != files_.end())
-    return it->second;
-  else
-    return nullptr;
+  Directory* dir = MaybeCreateParentDir(DirName(path));
+  InsertLocked(path, file);
+  dir->link(BaseName(path), file);
+  has_lazy_directory_ = true;
 }
 
-File* DirectoryContainer::mutable_get(const std::string& path) {
+File* DirectoryContainer::FindLocked(const std::string& path) const {
+  const PathMap* files = files_.load(std::memory_order_relaxed);
+  auto it = files->find(path);
+  if (it != files->end()) return it->second;
+  if (!overlay_.empty()) {
+    it = overlay_.find(path);
+    if (it != overlay_.end()) return it->second;
+  }
+  return nullptr;
+}
+
+void DirectoryContainer::InsertLocked(const std::string& path, File* file) {
+  PathMap* files = files_.load(std::memory_order_relaxed);
+  if (!frozen_) {
+    (*files)[path] = file;
+    return;
+  }
+  // Replacing an existing path can't go to the overlay since readers
+  // look at files_ first. That should be rare, so merge right away.
+  bool replace = files->find(path) != files->end();
+  if (!replace) {
+    overlay_[path] = file;
+    overlay_size_.store(overlay_.size(), std::memory_order_release);
+  }
+  if (replace || overlay_.size() >= files->size()) {
+    auto merged = std::make_unique<PathMap>(*files);
+    for (const auto& p : overlay_) {
+      (*merged)[p.first] = p.second;
+    }
+    (*merged)[path] = file;
+    files_.store(merged.get(), std::memory_order_release);
+    path_maps_.emplace_back(move(merged));
+    overlay_.clear();
+    overlay_size_.store(0, std::memory_order_release);
+  }
+}
+
+File* DirectoryContainer::find(const std::string& path) const {
+  if (frozen_.load(std::memory_order_acquire)) {
+    const PathMap* files = files_.load(std::memory_order_acquire);
+    while (true) {
+      auto it = files->find(path);
+      if (it != files->end()) return it->second;
+      if (overlay_size_.load(std::memory_order_acquire) != 0) break;
+      // InsertLocked publishes a merged map before emptying the
+      // overlay, so a path that was in the overlay during the lookup
+      // above is in the new map.
+      const PathMap* current = files_.load(std::memory_order_acquire);
+      if (current == files) return nullptr;
+      files = current;
+    }
+  }
+  // files_ may have been replaced in the meantime, FindLocked looks at
+  // the current one.
   std::lock_guard<std::mutex> l(path_mutex_);
-  auto it = files_.find(path);
-  if (it != files_.end())
-    return it->second;
-  else
-    return nullptr;
+  return FindLocked(path);
+}
+
+File* DirectoryContainer::Walk(const std::string& path) const {
+  if (path.empty() || path[0] != '/') return nullptr;
+  // Not in the path map either.
+  if (path.size() > 1 && path.back() == '/') return nullptr;
+  // Files in the path map are mutable, so is the root.
+  File* f = const_cast<Directory*>(&root_);
+  for (size_t begin = 1; begin < path.size();) {
+    const Directory* d = dynamic_cast<const Directory*>(f);
+    if (!d) return nullptr;
+    size_t end = path.find('/', begin);
+    if (end == std::string::npos) end = path.size();
+    if (end == begin) return nullptr;
+    const std::string name(path, begin, end - begin);
+    d->MaybeLoad();
+    f = d->get(name);
+    if (!f && d->MaybeResolve(name)) f = d->get(name);
+    if (!f) return nullptr;
+    begin = end + 1;
+  }
+  return f;
+}
+
+const File* DirectoryContainer::get(const std::string& path) const {
+  File* f = find(path);
+  if (!f && has_lazy_directory_) f = Walk(path);
+  return f;
+}
+
+File* DirectoryContainer::mutable_get(const std::string& path) {
+  File* f = find(path);
+  if (!f && has_lazy_directory_) f = Walk(path);
+  return f;
+}
+
+void DirectoryContainer::set_root_resolver(
+    std::function<bool(const std::string& name)> resolver) {
+  root_.set_resolver(move(resolver));
+  has_lazy_directory_ = true;
 }
 
 Directory* DirectoryContainer::MaybeCreateParentDir(
     const std::string& dirname) {
   if (dirname == "") return &root_;
-  auto it = files_.find(dirname);
-  if (it != files_.end()) {
-    return static_cast<Directory*>(it->second);
+  File* existing = FindLocked(dirname);
+  if (existing) {
+    return static_cast<Directory*>(existing);
   }
 
   Directory* directory = new Directory();
   std::string parent(DirName(dirname));
-  auto parent_it = files_.find(parent);
-  Directory* parent_directory;
-  if (parent_it != files_.end()) {
-    parent_directory = static_cast<Directory*>(parent_it->second);
-  } else {
-    parent_directory = MaybeCreateParentDir(parent);
-  }
-  files_[dirname] = directory;
+  Directory* parent_directory = MaybeCreateParentDir(parent);
+  InsertLocked(dirname, directory);
   parent_directory->add(BaseName(dirname), std::unique_ptr<File>(directory));
   return directory;
 }
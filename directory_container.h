@@ -3,9 +3,12 @@
 
 #include <sys/stat.h>
 
+#include <atomic>
 #include <functional>
 #include <memory>
 #include <mutex>
+#include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
@@ -30,16 +33,39 @@ class File {
    */
   virtual ssize_t Read(char* buf, size_t size, off_t offset) = 0;
   virtual ssize_t Readlink(char* buf, size_t size) { return -ENOSYS; }
+  /**
+   * Where Read() would read |size| bytes at |offset| from, so that they
+   * can be spliced instead of copied: |*fd| at |*fd_offset|. The fd
+   * stays valid until Release().
+   *
+   * @return number of bytes available, -ENOSYS if Read() should be
+   * used instead, -errno on fail.
+   */
+  virtual ssize_t ReadFd(size_t size, off_t offset, int* fd,
+                         off_t* fd_offset) {
+    return -ENOSYS;
+  }
 
   virtual int Open() = 0;
   virtual int Release() = 0;
 
+  // Whether the content may change while mounted, so that the kernel
+  // should not cache it even when the rest of the tree is immutable.
+  virtual bool Volatile() const { return false; }
+
  private:
   DISALLOW_COPY_AND_ASSIGN(File);
 };
 
+// Inode number derived from |path|, stable across mounts: 1 for the
+// root and a hash of the path otherwise. Each path has its own, like
+// files with one link.
+ino_t PathInode(std::string_view path);
+
 class Directory : public File {
  public:
+  class Listing;
+
   Directory();
   virtual ~Directory();
 
@@ -62,56 +88,148 @@ class Directory : public File {
 
   virtual ssize_t Readlink(char* buf, size_t size) { return -EINVAL; }
 
-  void add(const std::string& path, std::unique_ptr<File> f) {
-    std::lock_guard<std::mutex> l(mutex_);
-    files_[path] = move(f);
-  }
+  void add(const std::string& path, std::unique_ptr<File> f);
+  // Add |f| owned elsewhere, which may be in other directories too.
+  // Paths under it are not in the DirectoryContainer path map, and are
+  // found by walking down directories instead.
+  void link(const std::string& name, File* f);
+  File* get(const std::string& path) const;
+  void for_each(std::function<void(const std::string& filename, const File* f)>
+                    callback) const;
 
-  File* get(const std::string& path) {
-    std::lock_guard<std::mutex> l(mutex_);
-    auto it = files_.find(path);
-    if (it != files_.end()) {
-      return it->second.get();
-    }
-    return nullptr;
+  void dump(int indent = 0) const;
+
+  // Set a callback that populates the directory on first access. Used
+  // by file systems that load their content lazily. The directory is
+  // frozen once loaded.
+  void set_loader(std::function<void()> loader);
+
+  // Run the loader if there is one and it has not run yet. Concurrent
+  // callers wait for the loading to complete.
+  void MaybeLoad() const {
+    if (loader_) std::call_once(load_once_, loader_);
   }
 
-  void for_each(std::function<void(const std::string& filename, const File* f)>
-                    callback) const {
-    std::lock_guard<std::mutex> l(mutex_);
-    for (const auto& file : files_) {
-      callback(file.first, file.second.get());
-    }
+  // Set a callback to ask for |name| that is not in the directory,
+  // which returns true if it added it. For entries that can't be
+  // listed up front. Set before the directory is used.
+  void set_resolver(std::function<bool(const std::string& name)> resolver);
+  bool MaybeResolve(const std::string& name) const {
+    return resolver_ && resolver_(name);
   }
+  // Whether a name that is not found now may be found later, so that
+  // the failed lookup should not be cached.
+  bool has_resolver() const { return resolver_ != nullptr; }
 
-  void dump(int indent = 0);
+  // Stop modifying the entry map in place so that readers don't need
+  // to take the lock. Later additions go to an overlay that is merged
+  // into a new copy of the map once it is as large as the map. A lazy
+  // directory that is not loaded yet is frozen when loading completes
+  // instead.
+  void Freeze();
 
  private:
-  typedef std::unordered_map<std::string, std::unique_ptr<File> >
-      FileElementMap;
+  typedef std::unordered_map<std::string, File*> FileElementMap;
+
+  // for_each without loading.
+  void ForEachLoaded(
+      std::function<void(const std::string& filename, const File* f)> callback)
+      const;
+  void AddLocked(const std::string& name, File* f);
+  File* FindLocked(const std::string& name) const;
+  // The current map if there is nothing in the overlay, for reading
+  // without the lock. nullptr if the lock is needed.
+  const FileElementMap* LockFreeMap() const;
+
+  // Serializes writers, and readers until frozen.
   mutable std::mutex mutex_{};
+  mutable std::once_flag load_once_{};
+  std::function<void()> loader_{};
+  std::function<bool(const std::string& name)> resolver_{};
+  std::atomic<bool> loaded_{false};
 
-  FileElementMap files_{};
+  std::atomic<bool> frozen_{false};
+  // The current entry map, one of maps_.
+  std::atomic<const FileElementMap*> files_{};
+  // The current map and the ones that were replaced after freezing,
+  // which lock-free readers may still be using. Each is at least twice
+  // the size of the previous one, so they add up to O(entries).
+  std::vector<std::unique_ptr<FileElementMap> > maps_{};
+  // Entries added after freezing, not in files_ yet.
+  FileElementMap overlay_{};
+  std::atomic<size_t> overlay_size_{0};
+  // All files added, including replaced ones which readers may still
+  // be using.
+  std::vector<std::unique_ptr<File> > owned_files_{};
   DISALLOW_COPY_AND_ASSIGN(Directory);
 };
 
+// The entries of a Directory as of creation, for listing it in pages
+// with readdir. Continuing from the current position is O(1).
+class Directory::Listing {
+ public:
+  // Loads |directory| if it is lazy.
+  explicit Listing(const Directory& directory);
+
+  // Index of the current entry.
+  size_t position() const { return position_; }
+  // Move to the |position|th entry, starting over if that is behind.
+  void Seek(size_t position);
+  bool done() const { return it_ == files_->end(); }
+  const std::string& name() const { return it_->first; }
+  File* file() const { return it_->second; }
+  void Next() {
+    ++it_;
+    ++position_;
+  }
+
+ private:
+  // A copy if the directory is not frozen and its map may change in
+  // place, or has entries in its overlay. Frozen maps are never
+  // modified or freed.
+  std::unique_ptr<FileElementMap> copy_{};
+  const FileElementMap* files_{};
+  FileElementMap::const_iterator it_{};
+  size_t position_{};
+  DISALLOW_COPY_AND_ASSIGN(Listing);
+};
+
 class DirectoryContainer {
  public:
   DirectoryContainer();
   ~DirectoryContainer();
 
   void add(const std::string& path, std::unique_ptr<File> file);
+  // Add a directory whose content is added by |loader| on first
+  // access, either listing the directory or looking up a path under
+  // it.
+  void add_lazy_directory(const std::string& path,
+                          std::function<void()> loader);
+  // Add |file| owned elsewhere at |path|, see Directory::link. For
+  // sharing one directory between several paths.
+  void link(const std::string& path, File* file);
   const File* get(const std::string& path) const;
   File* mutable_get(const std::string& path);
+  // Set the resolver of the root directory, see Directory::set_resolver.
+  void set_root_resolver(
+      std::function<bool(const std::string& name)> resolver);
   bool is_directory(const std::string& path) const {
-    std::lock_guard<std::mutex> l(path_mutex_);
-    auto it = files_.find(path);
-    if (it != files_.end())
-      return dynamic_cast<Directory*>(it->second) != nullptr;
-    return false;
+    return dynamic_cast<const Directory*>(get(path)) != nullptr;
   }
 
+  // Files that don't set st_ino get one derived from |path|.
   int Getattr(const std::string& path, struct stat* stbuf);
+  // Same, for |f| that is already looked up, as when listing a
+  // directory with attributes.
+  int Getattr(const std::string& path, File* f, struct stat* stbuf) const;
+  // Same, with |ino| for files that don't set st_ino, for frontends
+  // that number inodes themselves.
+  int Getattr(File* f, ino_t ino, struct stat* stbuf) const;
+
+  // Call once the initial tree is loaded. After this lookups don't take
+  // locks; later additions are published as new copies, RCU style, and
+  // replaced objects are kept alive until the container is destroyed.
+  void Freeze();
 
   void dump();
 
@@ -131,9 +249,36 @@ class DirectoryContainer {
   // object.
   Directory* MaybeCreateParentDir(const std::string& dirname);
 
-  std::unordered_map<std::string /* fullpath */, File*> files_{};
+  File* find(const std::string& path) const;
+  File* FindLocked(const std::string& path) const;
+  void InsertLocked(const std::string& path, File* file);
+
+  // Find |path| by walking down from the root directory by directory,
+  // loading lazy directories and resolving names on the way. For paths
+  // that are not in the path map yet, or never are because they are
+  // under linked directories.
+  File* Walk(const std::string& path) const;
+
+  typedef std::unordered_map<std::string /* fullpath */, File*> PathMap;
+  // The current path map. Modified in place until Freeze(), replaced by
+  // a merged copy with overlay_ afterwards.
+  std::atomic<PathMap*> files_{};
+  // The current path map and the replaced ones, which lock-free
+  // readers may still be using.
+  std::vector<std::unique_ptr<PathMap> > path_maps_{};
+  // Paths added after Freeze(), not in files_ yet. Merged into a new
+  // files_ when it grows as big as files_, so that the cost of copying
+  // is amortized.
+  PathMap overlay_{};
+  std::atomic<size_t> overlay_size_{0};
+  std::atomic<bool> frozen_{false};
+
   Directory root_{};
+  // Serializes writers, and readers until frozen or on overlay_.
   mutable std::mutex path_mutex_{};
+  // Set once there is a lazily loaded, resolved or linked directory, to
+  // avoid the cost of Walk on lookup failures otherwise.
+  std::atomic<bool> has_lazy_directory_{false};
 
   struct timespec mount_time_ {};
   DISALLOW_COPY_AND_ASSIGN(DirectoryContainer);
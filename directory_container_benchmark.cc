@@ -0,0 +1,122 @@
+// Memory and lookup benchmark of DirectoryContainer and
+// CompactDirectoryContainer on a synthetic tree, and scaling of
+// concurrent Getattr on DirectoryContainer before and after Freeze().
+//
+// $ ./out/directory_container_benchmark 1000000
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "compact_directory_container.h"
+#include "directory_container.h"
+
+namespace {
+class EmptyFile : public directory_container::File {
+ public:
+  EmptyFile() {}
+  virtual ~EmptyFile() {}
+  virtual int Getattr(struct stat* stbuf) override { return 0; }
+  virtual ssize_t Read(char* buf, size_t size, off_t offset) override {
+    return -EINVAL;
+  }
+  virtual int Open() override { return -EINVAL; };
+  virtual int Release() override { return -EINVAL; };
+};
+
+std::vector<std::string> SyntheticPaths(size_t entries) {
+  std::vector<std::string> paths;
+  char path[256];
+  for (size_t i = 0; i < entries; ++i) {
+    snprintf(path, sizeof(path), "/src/module%zu/sub%zu/file%zu.cc", i / 10000,
+             (i / 100) % 100, i % 100);
+    paths.emplace_back(path);
+  }
+  return paths;
+}
+
+size_t HeapInUse() {
+  struct mallinfo2 m = mallinfo2();
+  return m.uordblks + m.hblkhd;
+}
+
+template <class Container>
+void Run(const char* name, const std::vector<std::string>& paths) {
+  const size_t heap_before = HeapInUse();
+  auto begin = std::chrono::steady_clock::now();
+  auto container = std::make_unique<Container>();
+  for (const auto& path : paths) {
+    container->add(path, std::make_unique<EmptyFile>());
+  }
+  auto loaded = std::chrono::steady_clock::now();
+  const size_t heap_after = HeapInUse();
+  for (const auto& path : paths) {
+    if (!container->get(path)) abort();
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  const size_t entries = paths.size();
+  const double lookup_seconds =
+      std::chrono::duration<double>(end - loaded).count();
+  const size_t file_bytes = entries * malloc_usable_size(
+                                          std::make_unique<EmptyFile>().get());
+  const size_t bytes = heap_after - heap_before;
+  std::cout << name << ": " << entries << " entries, "
+            << (bytes / entries) << " bytes/entry, "
+            << ((bytes - file_bytes) / entries)
+            << " bytes/entry excluding File objects, add "
+            << std::chrono::duration<double>(loaded - begin).count()
+            << " s, lookup " << static_cast<size_t>(entries / lookup_seconds)
+            << " lookups/s" << std::endl;
+}
+void StatScaling(const std::vector<std::string>& paths) {
+  constexpr size_t kStatsPerThread = 1000000;
+  for (bool freeze : {false, true}) {
+    directory_container::DirectoryContainer container;
+    for (const auto& path : paths) {
+      container.add(path, std::make_unique<EmptyFile>());
+    }
+    if (freeze) container.Freeze();
+    for (size_t num_threads : {1, 2, 4, 8}) {
+      auto begin = std::chrono::steady_clock::now();
+      std::vector<std::thread> threads;
+      for (size_t t = 0; t < num_threads; ++t) {
+        threads.emplace_back([&container, &paths, t]() {
+          struct stat st;
+          for (size_t i = 0; i < kStatsPerThread; ++i) {
+            const auto& path = paths[(i * 7919 + t) % paths.size()];
+            if (container.Getattr(path, &st) != 0) abort();
+          }
+        });
+      }
+      for (auto& thread : threads) {
+        thread.join();
+      }
+      const double seconds = std::chrono::duration<double>(
+                                 std::chrono::steady_clock::now() - begin)
+                                 .count();
+      std::cout << "Getattr " << (freeze ? "frozen" : "unfrozen") << " "
+                << num_threads << " threads: "
+                << static_cast<size_t>(num_threads * kStatsPerThread / seconds)
+                << " stats/s" << std::endl;
+    }
+  }
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  const size_t entries = argc > 1 ? atoi(argv[1]) : 100000;
+  const std::vector<std::string> paths = SyntheticPaths(entries);
+  Run<directory_container::DirectoryContainer>("DirectoryContainer", paths);
+  Run<directory_container::CompactDirectoryContainer>(
+      "CompactDirectoryContainer", paths);
+  StatScaling(paths);
+  return 0;
+}
@@ -4,11 +4,13 @@
 
 #include <assert.h>
 
+#include <atomic>
 #include <functional>
 #include <iostream>
 #include <map>
 #include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
 using std::cout;
@@ -34,6 +36,166 @@ class GitFile : public directory_container::File {
   virtual int Release() override { return -EINVAL; };
 };
 
+void LazyDirectoryTest() {
+  directory_container::DirectoryContainer d;
+  int load_count = 0;
+  d.add_lazy_directory("/lazy", [&]() {
+    load_count++;
+    d.add("/lazy/file", std::make_unique<GitFile>());
+    d.add_lazy_directory("/lazy/subdir", [&]() {
+      load_count++;
+      d.add("/lazy/subdir/deep", std::make_unique<GitFile>());
+    });
+  });
+  assert(d.is_directory("/lazy"));
+  assert(load_count == 0);
+
+  // Looking up a path under the directory loads it, but nothing deeper.
+  assert(d.get("/lazy/file"));
+  assert(load_count == 1);
+  assert(!d.get("/lazy/nonexistent"));
+  assert(load_count == 1);
+
+  // Listing a directory loads it.
+  int count_subdir = 0;
+  d.for_each("/lazy/subdir",
+             [&count_subdir](const string& name,
+                             const directory_container::File* f) {
+               count_subdir++;
+             });
+  assert(count_subdir == 1);
+  assert(load_count == 2);
+  assert(d.get("/lazy/subdir/deep"));
+  assert(load_count == 2);
+}
+
+void FreezeTest() {
+  directory_container::DirectoryContainer d;
+  d.add("/hoge/bbb", std::make_unique<GitFile>());
+  d.add("/hoge/ccc", std::make_unique<GitFile>());
+  d.Freeze();
+  assert(d.get("/hoge/bbb"));
+
+  // Additions after freezing are visible.
+  for (int i = 0; i < 100; ++i) {
+    d.add("/late/file" + std::to_string(i), std::make_unique<GitFile>());
+  }
+  for (int i = 0; i < 100; ++i) {
+    assert(d.get("/late/file" + std::to_string(i)));
+  }
+  d.add("/hoge/ddd", std::make_unique<GitFile>());
+  assert(d.get("/hoge/ddd"));
+
+  // Replacing keeps the old object alive for readers.
+  const directory_container::File* old = d.get("/hoge/bbb");
+  d.add("/hoge/bbb", std::make_unique<GitFile>());
+  assert(d.get("/hoge/bbb") != old);
+
+  int count_hoge = 0;
+  d.for_each("/hoge", [&count_hoge](const string& name,
+                                    const directory_container::File* f) {
+    count_hoge++;
+  });
+  assert(count_hoge == 3);
+
+  // Lazy directories still get loaded.
+  d.add_lazy_directory("/lazy", [&d]() {
+    d.add("/lazy/file", std::make_unique<GitFile>());
+  });
+  assert(d.get("/lazy/file"));
+  assert(!d.get("/nonexistent"));
+}
+
+// Paths added after freezing are found by lock-free readers as soon as
+// the add returns, including while the overlays are merged.
+void ConcurrentAddTest() {
+  constexpr int kFiles = 20000;
+  directory_container::DirectoryContainer d;
+  d.add("/c/first", std::make_unique<GitFile>());
+  d.Freeze();
+  auto dir = dynamic_cast<const directory_container::Directory*>(d.get("/c"));
+  std::atomic<int> added{-1};
+  std::atomic<bool> done{false};
+  vector<std::thread> readers;
+  for (int t = 0; t < 4; ++t) {
+    readers.emplace_back([&]() {
+      while (!done) {
+        const int i = added.load();
+        if (i < 0) continue;
+        const string name = "file" + std::to_string(i);
+        assert(d.get("/c/" + name));
+        assert(dir->get(name));
+      }
+    });
+  }
+  for (int i = 0; i < kFiles; ++i) {
+    d.add("/c/file" + std::to_string(i), std::make_unique<GitFile>());
+    added = i;
+  }
+  done = true;
+  for (auto& reader : readers) {
+    reader.join();
+  }
+  int count = 0;
+  d.for_each("/c", [&count](const string& name,
+                            const directory_container::File* f) { count++; });
+  assert(count == kFiles + 1);
+  directory_container::Directory::Listing listing(*dir);
+  listing.Seek(kFiles);
+  assert(!listing.done());
+}
+
+void ListingTest() {
+  directory_container::DirectoryContainer d;
+  for (int i = 0; i < 100; ++i) {
+    d.add("/dir/" + std::to_string(i), std::make_unique<GitFile>());
+  }
+  d.Freeze();
+  auto dir = dynamic_cast<const directory_container::Directory*>(d.get("/dir"));
+  directory_container::Directory::Listing listing(*dir);
+  // Added after the listing started, not seen.
+  d.add("/dir/new", std::make_unique<GitFile>());
+
+  vector<string> names;
+  for (; !listing.done(); listing.Next()) {
+    names.push_back(listing.name());
+    assert(listing.file() == d.get("/dir/" + listing.name()));
+  }
+  assert(names.size() == 100);
+  assert(listing.position() == 100);
+
+  // Continuing from a page boundary, and going back.
+  listing.Seek(42);
+  assert(listing.position() == 42 && listing.name() == names[42]);
+  listing.Seek(43);
+  assert(listing.name() == names[43]);
+  listing.Seek(1000);
+  assert(listing.done());
+
+  directory_container::Directory::Listing new_listing(*dir);
+  new_listing.Seek(100);
+  assert(!new_listing.done());
+}
+
+void InodeTest() {
+  directory_container::DirectoryContainer d;
+  d.add("/dir/file", std::make_unique<GitFile>());
+  d.add("/dir/copy", std::make_unique<GitFile>());
+  struct stat root, dir, file, copy, dir_again;
+  assert(d.Getattr("/", &root) == 0);
+  assert(d.Getattr("/dir", &dir) == 0);
+  assert(d.Getattr("/dir/file", &file) == 0);
+  assert(d.Getattr("/dir/copy", &copy) == 0);
+  assert(d.Getattr("/dir", &dir_again) == 0);
+  assert(root.st_ino == 1);
+  assert(dir.st_ino > 1 && dir.st_ino == dir_again.st_ino);
+  assert(file.st_ino != dir.st_ino && file.st_ino > 1);
+  // Each path has its own, as files have one link.
+  assert(file.st_ino != copy.st_ino);
+  // The same in another mount.
+  assert(file.st_ino == directory_container::PathInode("/dir/file"));
+}
+
 int main() {
   directory_container::DirectoryContainer d;
   d.add("/this/dir", std::make_unique<GitFile>());
@@ -62,4 +224,10 @@ int main() {
     count_hoge++;
   });
   assert(count_hoge == 3);
+
+  LazyDirectoryTest();
+  FreezeTest();
+  ConcurrentAddTest();
+  InodeTest();
+  ListingTest();
 }
@@ -4,6 +4,7 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 
@@ -22,6 +23,7 @@
 #include "jsonparser.h"
 #include "scoped_timer.h"
 #include "strutil.h"
+#include "tree_index.h"
 
 using std::async;
 using std::cout;
@@ -39,15 +41,6 @@ using std::vector;
 namespace githubfs {
 
 namespace {
-string HttpFetch(const string& url, const string& key) {
-  ScopedConcurrencyLimit l(url);
-  scoped_timer::ScopedTimer timer(key);
-  vector<string> request{"curl", "-s", "-A",
-                         "git-githubfs(https://github.com/dancerj/gitlstreefs)",
-                         url};
-  return PopenAndReadOrDie2(request);
-}
-
 #define TYPE(a) \
   { #a, GitFileType::a }
 const static unordered_map<string, GitFileType> file_type_map{
@@ -61,9 +54,9 @@ GitFileType FileTypeStringToFileType(const string& file_type_string) {
 
 string ParseCommits(const string& commits_string) {
   // Try parsing github api v3 commits output.
-  unique_ptr<jjson::Value> commits = jjson::Parse(commits_string);
+  auto commits = jjson::Parse(commits_string);
   for (const auto& commit : commits->get_array()) {
-    string hash = commit->get("commit")["tree"]["sha"].get_string();
+    string hash(commit.get("commit")["tree"]["sha"].get_string());
     cout << "hash: " << hash << endl;
     return hash;
   }
@@ -72,56 +65,110 @@ string ParseCommits(const string& commits_string) {
 
 string ParseCommit(const string& commit_string) {
   // Try parsing github api v3 commit output.
-  unique_ptr<jjson::Value> commit = jjson::Parse(commit_string);
-  string hash = commit->get("commit")["tree"]["sha"].get_string();
+  auto commit = jjson::Parse(commit_string);
+  string hash(commit->get("commit")["tree"]["sha"].get_string());
   cout << "hash: " << hash << endl;
   return hash;
 }
 
 string ParseBlob(const string& blob_string) {
   // Try parsing github api v3 blob output.
-  unique_ptr<jjson::Value> blob = jjson::Parse(blob_string);
+  auto blob = jjson::Parse(blob_string);
   assert(blob->get("encoding").get_string() == "base64");
-  string base64 = blob->get("content").get_string();
-  return base64decode(base64);
+  return base64decode(blob->get("content").get_string());
 }
 
-// Parses tree object from json, returns false if it was truncated and
-// needs retry.
-bool ParseTrees(
-    const string& trees_string,
-    function<void(const string& path, int mode, GitFileType fstype,
-                  const string& sha, const int size, const string& url)>
-        file_handler) {
-  // Try parsing github api v3 trees output.
-  unique_ptr<jjson::Value> value = jjson::Parse(trees_string);
-
-  bool truncated = value->get("truncated").is_true();
-  if (truncated) return false;
-
-  for (const auto& file : (*value)["tree"].get_array()) {
-    // "path": ".gitignore",
-    // "mode": "100644",
-    // "type": "blob",
-    // "sha": "0eca3e92941236b77ad23a02dc0c000cd0da7a18",
-    // "size": 46,
-    // "url":
-    // "https://api.github.com/repos/dancerj/gitlstreefs/git/blobs/0eca3e92941236b77ad23a02dc0c000cd0da7a18"
-
-    // TODO: this is not the most efficient way to parse this
-    // structure.
-    size_t file_size = 0;
-    if (file->get("type").get_string() == "blob") {
-      file_size = file->get("size").get_number();
+bool ParseBlobToFd(const string& blob_string, int fd) {
+  auto blob = jjson::Parse(blob_string);
+  assert(blob->get("encoding").get_string() == "base64");
+  return base64decode_to_fd(blob->get("content").get_string(), fd);
+}
+
+// Picks the entries out of the trees response:
+// {
+//   "sha": "4ed9b4ae12ab16975b137a6be5611601cd9684af",
+//   "url": "...",
+//   "tree": [
+//     {
+//       "path": ".gitignore",
+//       "mode": "100644",
+//       "type": "blob",
+//       "sha": "0eca3e92941236b77ad23a02dc0c000cd0da7a18",
+//       "size": 46,
+//       "url":
+//       "https://api.github.com/repos/dancerj/gitlstreefs/git/blobs/0eca3e92941236b77ad23a02dc0c000cd0da7a18"
+//     }, ...
+//   ],
+//   "truncated": false
+// }
+class TreesParser::Handler : public jjson::EntriesHandler {
+ public:
+  explicit Handler(TreeFileHandler file_handler)
+      : jjson::EntriesHandler("tree"), file_handler_(file_handler) {}
+  virtual ~Handler() {}
+
+  bool truncated() const { return truncated_; }
+
+  virtual void StartEntry() override { entry_ = Entry(); }
+  virtual void EndEntry() override {
+    // Only blobs have size.
+    file_handler_(entry_.path, strtol(entry_.mode.c_str(), nullptr, 8),
+                  FileTypeStringToFileType(entry_.type), entry_.sha,
+                  entry_.type == "blob" ? entry_.size : 0, entry_.url);
+  }
+  virtual void EntryString(std::string_view key,
+                           std::string_view value) override {
+    if (key == "path") {
+      entry_.path = value;
+    } else if (key == "mode") {
+      entry_.mode = value;
+    } else if (key == "type") {
+      entry_.type = value;
+    } else if (key == "sha") {
+      entry_.sha = value;
+    } else if (key == "url") {
+      entry_.url = value;
     }
-    GitFileType fstype =
-        FileTypeStringToFileType(file->get("type").get_string());
-    file_handler(file->get("path").get_string(),
-                 strtol(file->get("mode").get_string().c_str(), nullptr, 8),
-                 fstype, file->get("sha").get_string(), file_size,
-                 file->get("url").get_string());
   }
-  return true;
+  virtual void EntryNumber(std::string_view key, double value) override {
+    if (key == "size") entry_.size = value;
+  }
+  virtual void TopBool(std::string_view key, bool value) override {
+    if (key == "truncated") truncated_ = value;
+  }
+
+ private:
+  struct Entry {
+    string path{};
+    string mode{};
+    string type{};
+    string sha{};
+    int size{};
+    string url{};
+  };
+
+  const TreeFileHandler file_handler_;
+  Entry entry_{};
+  bool truncated_{};
+};
+
+TreesParser::TreesParser(TreeFileHandler file_handler)
+    : handler_(std::make_unique<Handler>(file_handler)),
+      parser_(handler_.get()) {}
+
+TreesParser::~TreesParser() {}
+
+bool TreesParser::Feed(std::string_view chunk) { return parser_.Feed(chunk); }
+
+bool TreesParser::Finish() { return parser_.Finish(); }
+
+bool TreesParser::truncated() const { return handler_->truncated(); }
+
+// Parses tree object from json, returns false if it was malformed, or
+// truncated and needs retry.
+bool ParseTrees(const string& trees_string, TreeFileHandler file_handler) {
+  TreesParser parser(file_handler);
+  return parser.Feed(trees_string) && parser.Finish() && !parser.truncated();
 }
 
 // Convert from Git attributes to filesystem attributes.
@@ -162,6 +209,15 @@ ssize_t FileElement::Read(char* target, size_t size, off_t offset) {
   return size;
 }
 
+ssize_t FileElement::ReadFd(size_t size, off_t offset, int* fd,
+                            off_t* fd_offset) {
+  lock_guard<mutex> l(buf_mutex_);
+  // Without an open reference the descriptor could go away before the
+  // data is spliced.
+  if (open_count_ == 0 || !memory_) return -ENOSYS;
+  return memory_->ReadFd(size, offset, fd, fd_offset);
+}
+
 ssize_t FileElement::Readlink(char* target, size_t size) {
   lock_guard<mutex> l(buf_mutex_);
   int e = maybe_cat_file_locked();
@@ -177,17 +233,19 @@ ssize_t FileElement::Readlink(char* target, size_t size) {
   const char* source = memory_->memory_charp();
 
   memcpy(target, source, size);
+  maybe_release_locked();
   return 0;
 }
 
 ssize_t FileElement::maybe_cat_file_locked() {
   if (!memory_) {
-    memory_ = parent_->cache().get(sha1_, [this](string* ret) -> bool {
+    // Decoded straight into the cache file.
+    memory_ = parent_->cache().GetStreaming(sha1_, [this](int fd) -> bool {
       const string url =
           parent_->get_github_api_prefix() + "/git/blobs/" + sha1_;
-      string blob_string = HttpFetch(url, "blob");
-      *ret = ParseBlob(blob_string);
-      return true;
+      string blob_string;
+      if (!parent_->HttpFetch(url, "blob", &blob_string)) return false;
+      return ParseBlobToFd(blob_string, fd);
     });
     if (!memory_) {
       // If still failed, something failed in the process.
@@ -197,15 +255,24 @@ ssize_t FileElement::maybe_cat_file_locked() {
   return 0;
 }
 
+void FileElement::maybe_release_locked() {
+  if (open_count_ == 0 && memory_) {
+    parent_->cache().release(sha1_, memory_);
+    memory_ = nullptr;
+  }
+}
+
 int FileElement::Open() {
   lock_guard<mutex> l(buf_mutex_);
-  return maybe_cat_file_locked();
+  ssize_t e = maybe_cat_file_locked();
+  if (e == 0) open_count_++;
+  return e;
 }
 
 int FileElement::Release() {
   lock_guard<mutex> l(buf_mutex_);
-  parent_->cache().release(sha1_, memory_);
-  memory_ = nullptr;
+  if (open_count_ > 0) open_count_--;
+  maybe_release_locked();
   return 0;
 }
 
@@ -218,47 +285,173 @@ void GitTree::LoadDirectoryInternal(const string& subdir,
     // Let the remote system recurse.
     fetch_url += "?recursive=true";
   }
-  const string github_tree = HttpFetch(fetch_url, "lstree");
+  // Only a complete listing of the whole tree is worth saving.
+  TreeIndex::Writer writer;
+  // Entries are added while the response is still arriving.
+  TreesParser parser([&](const string& path, int mode, GitFileType fstype,
+                         const string& sha, const int size,
+                         const string& url) {
+    const std::string slash_path = "/" + subdir + path;
+    if (!remote_recurse && Exists(slash_path)) {
+      // Already added from a truncated recursive listing, but there
+      // may be more in a directory.
+      if (fstype == GitFileType::tree) {
+        jobs.emplace_back(async([this, subdir, path, sha]() {
+          LoadDirectoryInternal(subdir + path + "/", sha, false);
+        }));
+      }
+      return;
+    }
+    if (remote_recurse && fstype != GitFileType::commit) {
+      writer.Add(TreeIndex::Entry{
+          static_cast<mode_t>(mode),
+          fstype == GitFileType::blob ? "blob" : "tree", sha,
+          static_cast<size_t>(size), path});
+    }
+    if (fstype == GitFileType::blob) {
+      AddFile(slash_path, std::make_unique<FileElement>(mode, sha, size, this));
+    } else if (fstype == GitFileType::tree) {
+      // Nonempty directories get auto-created, but maybe do it here?
+      AddDirectory(slash_path);
+      if (remote_recurse == false) {
+        // If remote side recursion didn't work, do recursion here.
+        jobs.emplace_back(async([this, subdir, path, sha]() {
+          LoadDirectoryInternal(subdir + path + "/", sha, false);
+        }));
+      }
+    }
+  });
+  bool parsed = true;
+  HttpFetchOrDie(fetch_url, "lstree", [&](std::string_view data) {
+    if (parsed) parsed = parser.Feed(data);
+  });
+  if (!parsed || !parser.Finish()) {
+    std::cerr << "Malformed tree listing from " << fetch_url << endl;
+    exit(1);
+  }
   cout << "Loaded directory " << subdir << endl;
-  if (ParseTrees(github_tree, [&](const string& path, int mode,
-                                  GitFileType fstype, const string& sha,
-                                  const int size, const string& url) {
-        const std::string slash_path = string("/") + path;
-        if (fstype == GitFileType::blob) {
-          container_->add(slash_path,
-                          std::make_unique<FileElement>(mode, sha, size, this));
-        } else if (fstype == GitFileType::tree) {
-          // Nonempty directories get auto-created, but maybe do it here?
-          container_->add(slash_path,
-                          std::make_unique<directory_container::Directory>());
-          if (remote_recurse == false) {
-            // If remote side recursion didn't work, do recursion here.
-            jobs.emplace_back(async([this, subdir, path, sha]() {
-              LoadDirectoryInternal(subdir + path + "/", sha, false);
-            }));
-          }
-        }
-      })) {
-  } else {
+  if (!parser.truncated()) {
+    if (remote_recurse) writer.Commit(tree_index_dir_, tree_hash);
+  } else if (remote_recurse) {
     cout << "Retry with remote recursion off." << endl;
     LoadDirectoryInternal(subdir, tree_hash, false);
+  } else {
+    std::cerr << "Listing of " << subdir << " is truncated." << endl;
   }
 }
 
+bool GitTree::LoadTreeIndex(const string& tree_hash) {
+  tree_index_ = TreeIndex::Open(tree_index_dir_, tree_hash);
+  if (!tree_index_) return false;
+  scoped_timer::ScopedTimer timer("tree-index");
+  LoadIndexDirectory(TreeIndex::kRoot, "");
+  return true;
+}
+
+void GitTree::LoadIndexDirectory(uint64_t position, const string& dir_path) {
+  tree_index_->for_each_child(position, [&](const TreeIndex::Entry& entry) {
+    const string slash_path =
+        dir_path + "/" + string(entry.path.substr(entry.path.rfind('/') + 1));
+    if (entry.type == "blob") {
+      AddFile(slash_path,
+              std::make_unique<FileElement>(entry.mode, string(entry.sha1),
+                                            entry.size, this));
+    } else if (compact_container_) {
+      // The compact container has no lazy directories, so it gets a
+      // copy of every entry.
+      AddDirectory(slash_path);
+      LoadIndexDirectory(entry.position, slash_path);
+    } else {
+      container_->add_lazy_directory(
+          slash_path, [this, position = entry.position, slash_path]() {
+            LoadIndexDirectory(position, slash_path);
+          });
+    }
+  });
+}
+
+bool GitTree::HttpFetch(const string& url, const string& key,
+                        function<void(std::string_view data)> on_data) {
+  ScopedConcurrencyLimit l(url);
+  scoped_timer::ScopedTimer timer(key);
+  return http_fetcher_->FetchStreaming(url, on_data);
+}
+
+bool GitTree::HttpFetch(const string& url, const string& key, string* body) {
+  body->clear();
+  return HttpFetch(url, key,
+                   [body](std::string_view data) { body->append(data); });
+}
+
+void GitTree::HttpFetchOrDie(const string& url, const string& key,
+                             function<void(std::string_view data)> on_data) {
+  if (!HttpFetch(url, key, on_data)) {
+    std::cerr << "Failed to fetch " << url << endl;
+    exit(1);
+  }
+}
+
+void GitTree::AddFile(const string& path,
+                      std::unique_ptr<directory_container::File> file) {
+  if (compact_container_) {
+    compact_container_->add(path, std::move(file));
+  } else {
+    container_->add(path, std::move(file));
+  }
+}
+
+void GitTree::AddDirectory(const string& path) {
+  if (compact_container_) {
+    compact_container_->add_directory(path);
+  } else {
+    container_->add(path, std::make_unique<directory_container::Directory>());
+  }
+}
+
+bool GitTree::Exists(const string& path) const {
+  return compact_container_ ? compact_container_->exists(path)
+                            : container_->get(path) != nullptr;
+}
+
+GitTree::GitTree(const char* hash, const char* github_api_prefix,
+                 directory_container::DirectoryContainer* container,
+                 const std::string& cache_dir,
+                 std::unique_ptr<HttpFetcher> http_fetcher)
+    : GitTree(hash, github_api_prefix, container, nullptr, cache_dir,
+              std::move(http_fetcher)) {}
+
+GitTree::GitTree(const char* hash, const char* github_api_prefix,
+                 directory_container::CompactDirectoryContainer* container,
+                 const std::string& cache_dir,
+                 std::unique_ptr<HttpFetcher> http_fetcher)
+    : GitTree(hash, github_api_prefix, nullptr, container, cache_dir,
+              std::move(http_fetcher)) {}
+
 GitTree::GitTree(const char* hash, const char* github_api_prefix,
                  directory_container::DirectoryContainer* container,
-                 const std::string& cache_dir)
+                 directory_container::CompactDirectoryContainer* compact,
+                 const std::string& cache_dir,
+                 std::unique_ptr<HttpFetcher> http_fetcher)
     : github_api_prefix_(github_api_prefix),
       container_(container),
+      compact_container_(compact),
+      http_fetcher_(http_fetcher ? std::move(http_fetcher)
+                                 : HttpFetcher::New()),
+      tree_index_dir_(cache_dir + "trees/"),
       cache_(cache_dir) {
-  cache_.Gc();
-  string commit = HttpFetch(github_api_prefix_ + "/commits/" + hash, "commit");
+  string commit;
+  HttpFetchOrDie(github_api_prefix_ + "/commits/" + hash, "commit",
+                 [&commit](std::string_view data) { commit.append(data); });
   const string tree_hash = ParseCommit(commit);
 
-  LoadDirectoryInternal("", tree_hash, true /* remote recurse*/);
-  container->add("/.status", std::make_unique<scoped_timer::StatusHandler>());
+  if (!LoadTreeIndex(tree_hash)) {
+    LoadDirectoryInternal("", tree_hash, true /* remote recurse*/);
+  }
+  AddFile("/.status", std::make_unique<scoped_timer::StatusHandler>());
 }
 
 GitTree::~GitTree() {}
 
+void GitTree::StartBackgroundWork() { cache_.StartBackgroundGc(); }
+
 }  // namespace githubfs
@@ -1,25 +1,57 @@
 #ifndef GIT_GITHUBFS_H_
 #define GIT_GITHUBFS_H_
 
+#include <functional>
+#include <memory>
 #include <mutex>
+#include <string>
+#include <string_view>
 #include <unordered_map>
 
 #include "cached_file.h"
+#include "compact_directory_container.h"
 #include "directory_container.h"
 #include "disallow.h"
+#include "http_fetcher.h"
+#include "jsonparser.h"
+#include "tree_index.h"
 
 namespace githubfs {
 
 enum class GitFileType { blob, tree, commit };
 
+typedef std::function<void(const std::string& path, int mode,
+                           const GitFileType type, const std::string& sha,
+                           const int size, const std::string& url)>
+    TreeFileHandler;
+
 // Github api v3 response parsers.
 // Parse tree content.
-bool ParseTrees(
-    const std::string& trees_string,
-    std::function<void(const std::string& path, int mode,
-                       const GitFileType type, const std::string& sha,
-                       const int size, const std::string& url)>
-        file_handler);
+bool ParseTrees(const std::string& trees_string,
+                TreeFileHandler file_handler);
+
+// Parse tree content in pieces as it arrives, calling |file_handler|
+// for each entry as soon as it has been parsed.
+class TreesParser {
+ public:
+  explicit TreesParser(TreeFileHandler file_handler);
+  ~TreesParser();
+
+  // Returns false on error.
+  bool Feed(std::string_view chunk);
+  // Returns false if the response was malformed.
+  bool Finish();
+  // Whether the response said it was truncated, after Finish(). Entries
+  // of a truncated response have been passed on anyway, as that is
+  // only known at the end.
+  bool truncated() const;
+
+ private:
+  class Handler;
+  const std::unique_ptr<Handler> handler_;
+  jjson::StreamParser parser_;
+  DISALLOW_COPY_AND_ASSIGN(TreesParser);
+};
 
 // Parse github commits list and return the tree hash.
 // for /commits endpoint.
@@ -29,6 +61,8 @@ std::string ParseCommit(const std::string& commit_string);
 
 // Parse blob.
 std::string ParseBlob(const std::string& blob_string);
+// Same, writing the content to |fd|. Returns false if writing failed.
+bool ParseBlobToFd(const std::string& blob_string, int fd);
 
 class GitTree;
 
@@ -38,12 +72,16 @@ struct FileElement : public directory_container::File {
               GitTree* parent);
   virtual int Open() override;
   virtual ssize_t Read(char* buf, size_t size, off_t offset) override;
+  virtual ssize_t ReadFd(size_t size, off_t offset, int* fd,
+                         off_t* fd_offset) override;
   virtual ssize_t Readlink(char* buf, size_t size) override;
   virtual int Getattr(struct stat* stbuf) override;
   virtual int Release() override;
 
  private:
   ssize_t maybe_cat_file_locked();
+  // Drop the reference to the cached content when no longer open.
+  void maybe_release_locked();
 
   int attribute_;
   std::string sha1_;
@@ -52,28 +90,73 @@ struct FileElement : public directory_container::File {
   GitTree* parent_;
   const Cache::Memory* memory_{};
   std::mutex buf_mutex_{};
+  // Number of Open() without matching Release().
+  int open_count_{};
   DISALLOW_COPY_AND_ASSIGN(FileElement);
 };
 
 class GitTree {
  public:
+  // Requests go through |http_fetcher|, or a default HttpFetcher if
+  // null.
   GitTree(const char* hash, const char* github_api_prefix,
           directory_container::DirectoryContainer* c,
-          const std::string& cache_dir);
+          const std::string& cache_dir,
+          std::unique_ptr<HttpFetcher> http_fetcher = nullptr);
+  // Same, loading into a CompactDirectoryContainer.
+  GitTree(const char* hash, const char* github_api_prefix,
+          directory_container::CompactDirectoryContainer* c,
+          const std::string& cache_dir,
+          std::unique_ptr<HttpFetcher> http_fetcher = nullptr);
   ~GitTree();
+  // Start cache garbage collection. Threads don't survive fork, so
+  // call this after daemonizing.
+  void StartBackgroundWork();
   const std::string& get_github_api_prefix() const {
     return github_api_prefix_;
   }
   Cache& cache() { return cache_; }
+  // Fetch |url|, timed as |key|, passing the body to |on_data| as it
+  // arrives. Returns false if there was no complete response.
+  bool HttpFetch(const std::string& url, const std::string& key,
+                 std::function<void(std::string_view data)> on_data);
+  bool HttpFetch(const std::string& url, const std::string& key,
+                 std::string* body);
 
  private:
+  // Exactly one of |c| and |compact| is set.
+  GitTree(const char* hash, const char* github_api_prefix,
+          directory_container::DirectoryContainer* c,
+          directory_container::CompactDirectoryContainer* compact,
+          const std::string& cache_dir,
+          std::unique_ptr<HttpFetcher> http_fetcher);
+  // Add to whichever container is loaded.
+  void AddFile(const std::string& path,
+               std::unique_ptr<directory_container::File> file);
+  void AddDirectory(const std::string& path);
+  bool Exists(const std::string& path) const;
+  // Same, for responses that can't be done without.
+  void HttpFetchOrDie(const std::string& url, const std::string& key,
+                      std::function<void(std::string_view data)> on_data);
   void LoadDirectoryInternal(const std::string& subdir,
                              const std::string& tree_hash, bool remote_recurse);
+  // Load the tree saved by an earlier mount, returns false if there is
+  // none. Directories are loaded from it as they are looked up.
+  bool LoadTreeIndex(const std::string& tree_hash);
+  // Add the entries of the tree at |position| in tree_index_ under
+  // |dir_path|, "" for the root.
+  void LoadIndexDirectory(uint64_t position, const std::string& dir_path);
 
   // Directory for git directory. Needed because fuse chdir to / on
   // becoming a daemon.
   const std::string github_api_prefix_;
   directory_container::DirectoryContainer* container_;
+  directory_container::CompactDirectoryContainer* compact_container_;
+  const std::unique_ptr<HttpFetcher> http_fetcher_;
+  // Tree indexes by tree hash, in the cache directory.
+  const std::string tree_index_dir_;
+  // The tree index that the tree is served from, if it had one.
+  std::unique_ptr<TreeIndex> tree_index_{};
   Cache cache_;
   DISALLOW_COPY_AND_ASSIGN(GitTree);
 };
@@ -10,6 +10,7 @@
 #include "get_current_dir.h"
 #include "git-githubfs.h"
 #include "git_adapter.h"
+#include "git_adapter_lowlevel.h"
 
 using std::cerr;
 using std::endl;
@@ -21,6 +22,9 @@ struct githubfs_config {
   char* project{nullptr};
   char* revision{nullptr};
   char* cache_path{nullptr};
+  int immutable{0};
+  int lowlevel{0};
+  int compact_directory{0};
 };
 
 #define MYFS_OPT(t, p, v) \
@@ -29,12 +33,12 @@ struct githubfs_config {
 static struct fuse_opt githubfs_opts[] = {
     MYFS_OPT("--user=%s", user, 0), MYFS_OPT("--project=%s", project, 0),
     MYFS_OPT("--revision=%s", revision, 0),
-    MYFS_OPT("--cache_path=%s", cache_path, 0), FUSE_OPT_END};
+    MYFS_OPT("--cache_path=%s", cache_path, 0),
+    MYFS_OPT("--immutable", immutable, 1),
+    MYFS_OPT("--lowlevel", lowlevel, 1),
+    MYFS_OPT("--compact_directory", compact_directory, 1), FUSE_OPT_END};
 
 int main(int argc, char* argv[]) {
-  // Initialize fuse operations.
-  struct fuse_operations o = git_adapter::GetFuseOperations();
-
   fuse_args args = FUSE_ARGS_INIT(argc, argv);
   githubfs_config conf{};
   fuse_opt_parse(&args, &conf, githubfs_opts, nullptr);
@@ -45,16 +49,42 @@ int main(int argc, char* argv[]) {
          << " --user=dancerj --project=gitlstreefs mountpoint/" << endl;
     return EXIT_FAILURE;
   }
+  if (conf.compact_directory && conf.lowlevel) {
+    cerr << "--compact_directory is not supported with --lowlevel" << endl;
+    return EXIT_FAILURE;
+  }
 
   const string cache_path(conf.cache_path ? conf.cache_path
                                           : GetCurrentDir() + "/.cache/");
 
   const string github_api_prefix =
       string("https://api.github.com/repos/") + conf.user + "/" + conf.project;
-  auto git_tree = std::make_unique<githubfs::GitTree>(
-      conf.revision ? conf.revision : "HEAD", github_api_prefix.c_str(),
-      git_adapter::GetDirectoryContainer(), cache_path);
-  int ret = fuse_main(args.argc, args.argv, &o, nullptr);
+  const char* revision = conf.revision ? conf.revision : "HEAD";
+  unique_ptr<githubfs::GitTree> git_tree;
+  if (conf.compact_directory) {
+    git_tree = std::make_unique<githubfs::GitTree>(
+        revision, github_api_prefix.c_str(),
+        git_adapter::GetCompactDirectoryContainer(), cache_path);
+  } else {
+    git_tree = std::make_unique<githubfs::GitTree>(
+        revision, github_api_prefix.c_str(),
+        git_adapter::GetDirectoryContainer(), cache_path);
+    git_adapter::GetDirectoryContainer()->Freeze();
+  }
+
+  // Initialize fuse operations.
+  git_adapter::Config adapter_config;
+  adapter_config.immutable = conf.immutable;
+  adapter_config.compact = conf.compact_directory;
+  adapter_config.on_init = [&git_tree]() { git_tree->StartBackgroundWork(); };
+  int ret;
+  if (conf.lowlevel) {
+    ret = git_adapter::LowlevelMain(
+        &args, git_adapter::GetFuseLowlevelOperations(adapter_config));
+  } else {
+    struct fuse_operations o = git_adapter::GetFuseOperations(adapter_config);
+    ret = fuse_main(args.argc, args.argv, &o, nullptr);
+  }
   fuse_opt_free_args(&args);
   return ret;
 }
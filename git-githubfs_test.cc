@@ -1,15 +1,20 @@
 #include "git-githubfs.h"
 
 #include "get_current_dir.h"
+#include "local_http_server.h"
 #include "strutil.h"
 
 #include <assert.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <unistd.h>
+
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 
 using githubfs::GitFileType;
@@ -47,6 +52,69 @@ void ParserTest() {
   });
   string ret = ParseBlob(blob);
   cout << "blob content: " << ret << endl;
+
+  const char kPath[] = "out/git-githubfs_test_blob.tmp";
+  int fd = open(kPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  assert(fd != -1);
+  assert(githubfs::ParseBlobToFd(blob, fd));
+  close(fd);
+  assert(ReadFromFileOrDie(AT_FDCWD, kPath) == ret);
+  unlink(kPath);
+}
+
+void StreamingTreesParserTest() {
+  const string trees(ReadFromFileOrDie(AT_FDCWD, "testdata/trees.json"));
+  size_t total = 0;
+  assert(ParseTrees(trees, [&total](const string& path, int mode,
+                                    const GitFileType fstype, const string& sha,
+                                    const int size, const string& url) {
+    total++;
+  }));
+  assert(total == 27);
+
+  // Entries are passed on as they arrive.
+  size_t count = 0;
+  string last_path;
+  githubfs::TreesParser parser(
+      [&count, &last_path](const string& path, int mode,
+                           const GitFileType fstype, const string& sha,
+                           const int size, const string& url) {
+        count++;
+        last_path = path;
+      });
+  const size_t half = trees.size() / 2;
+  for (size_t i = 0; i < half; i += 7) {
+    assert(parser.Feed(std::string_view(trees).substr(i, std::min<size_t>(
+                                                            7, half - i))));
+  }
+  assert(count > 0 && count < total);
+  assert(parser.Feed(std::string_view(trees).substr(half)));
+  assert(parser.Finish());
+  assert(count == total);
+  assert(!parser.truncated());
+
+  // Truncation is not a parse error.
+  githubfs::TreesParser truncated(
+      [](const string& path, int mode, const GitFileType fstype,
+         const string& sha, const int size, const string& url) {});
+  assert(truncated.Feed(R"({"tree": [], "truncated": true})"));
+  assert(truncated.Finish());
+  assert(truncated.truncated());
+  githubfs::TreesParser malformed(
+      [](const string& path, int mode, const GitFileType fstype,
+         const string& sha, const int size, const string& url) {});
+  malformed.Feed(R"({"tree": [)");
+  assert(!malformed.Finish());
+
+  // A truncated listing needs retry.
+  assert(!ParseTrees(R"({"tree": [], "truncated": true})",
+                     [](const string& path, int mode, const GitFileType fstype,
+                        const string& sha, const int size,
+                        const string& url) {}));
+  assert(ParseTrees(R"({"tree": [], "truncated": false})",
+                    [](const string& path, int mode, const GitFileType fstype,
+                       const string& sha, const int size,
+                       const string& url) {}));
 }
 
 void TryReadFileTest(directory_container::DirectoryContainer* container,
@@ -92,10 +160,187 @@ void ScenarioTest() {
   TryReadFileTest(container.get(), "/dummytestdirectory/README");
 }
 
+// Against a local server standing in for the GitHub API, serving the
+// responses in testdata/.
+void LocalServerScenarioTest() {
+  const string repo = "/repos/dancerj/gitlstreefs";
+  LocalHttpServer server([&repo](const string& target, string* body) {
+    string file;
+    if (target == repo + "/commits/HEAD") {
+      file = "testdata/commit.json";
+    } else if (target.find(repo + "/git/trees/") == 0) {
+      file = "testdata/trees.json";
+    } else if (target.find(repo + "/git/blobs/") == 0) {
+      file = "testdata/blob.json";
+    } else {
+      return 404;
+    }
+    *body = ReadFromFileOrDie(AT_FDCWD, file);
+    return 200;
+  });
+  const string cache_dir =
+      GetCurrentDir() + "/out/git-githubfs_test_local_cache/";
+  assert(system(("rm -rf " + cache_dir).c_str()) == 0);
+  auto container = std::make_unique<directory_container::DirectoryContainer>();
+  auto fs = std::make_unique<githubfs::GitTree>(
+      "HEAD", (server.url() + repo).c_str(), container.get(), cache_dir);
+  assert(container->get("/README.md") != nullptr);
+  assert(container->is_directory("/dummytestdirectory"));
+
+  auto file = dynamic_cast<githubfs::FileElement*>(
+      container->mutable_get("/README.md"));
+  assert(file->Open() == 0);
+  char buf[4096];
+  const string expected =
+      ParseBlob(ReadFromFileOrDie(AT_FDCWD, "testdata/blob.json"));
+  assert(file->Read(buf, sizeof(buf), 0) ==
+         static_cast<ssize_t>(expected.size()));
+  assert(string(buf, expected.size()) == expected);
+  assert(file->Release() == 0);
+
+  // The commit, the tree and the blob over one connection.
+  assert(server.requests() == 3);
+  assert(server.connections() == 1);
+}
+
+// The same tree loaded into a CompactDirectoryContainer.
+void CompactScenarioTest() {
+  const string repo = "/repos/dancerj/gitlstreefs";
+  LocalHttpServer server([&repo](const string& target, string* body) {
+    string file;
+    if (target == repo + "/commits/HEAD") {
+      file = "testdata/commit.json";
+    } else if (target.find(repo + "/git/trees/") == 0) {
+      file = "testdata/trees.json";
+    } else {
+      return 404;
+    }
+    *body = ReadFromFileOrDie(AT_FDCWD, file);
+    return 200;
+  });
+  const string cache_dir =
+      GetCurrentDir() + "/out/git-githubfs_test_compact_cache/";
+  assert(system(("rm -rf " + cache_dir).c_str()) == 0);
+  directory_container::CompactDirectoryContainer container;
+  auto fs = std::make_unique<githubfs::GitTree>(
+      "HEAD", (server.url() + repo).c_str(), &container, cache_dir);
+  assert(container.get("/README.md") != nullptr);
+  assert(container.get("/.status") != nullptr);
+  assert(container.is_directory("/dummytestdirectory"));
+  assert(container.get("/gitlstree.cc") != nullptr);
+  struct stat st;
+  assert(container.Getattr("/README.md", &st) == 0);
+  assert(S_ISREG(st.st_mode));
+}
+
+// A truncated recursive listing is completed by listing each directory.
+void TruncatedListingTest() {
+  const string repo = "/repos/dancerj/gitlstreefs";
+  const string commit = ReadFromFileOrDie(AT_FDCWD, "testdata/commit.json");
+  const string trees = repo + "/git/trees/";
+  const string root = trees + ParseCommit(commit);
+  const std::map<string, string> responses{
+      {repo + "/commits/HEAD", commit},
+      {root + "?recursive=true",
+       R"({"tree": [
+            {"path": "a", "mode": "040000", "type": "tree", "sha": "t1"},
+            {"path": "a/x", "mode": "100644", "type": "blob", "sha": "b1",
+             "size": 1}],
+           "truncated": true})"},
+      {root,
+       R"({"tree": [
+            {"path": "a", "mode": "040000", "type": "tree", "sha": "t1"},
+            {"path": "top", "mode": "100644", "type": "blob", "sha": "b2",
+             "size": 2}],
+           "truncated": false})"},
+      {trees + "t1",
+       R"({"tree": [
+            {"path": "x", "mode": "100644", "type": "blob", "sha": "b1",
+             "size": 1},
+            {"path": "y", "mode": "100644", "type": "blob", "sha": "b3",
+             "size": 3}],
+           "truncated": false})"},
+  };
+  LocalHttpServer server([&responses](const string& target, string* body) {
+    auto it = responses.find(target);
+    if (it == responses.end()) return 404;
+    *body = it->second;
+    return 200;
+  });
+  const string cache_dir =
+      GetCurrentDir() + "/out/git-githubfs_test_truncated_cache/";
+  assert(system(("rm -rf " + cache_dir).c_str()) == 0);
+  auto container = std::make_unique<directory_container::DirectoryContainer>();
+  auto fs = std::make_unique<githubfs::GitTree>(
+      "HEAD", (server.url() + repo).c_str(), container.get(), cache_dir);
+  const directory_container::File* x = container->get("/a/x");
+  assert(x != nullptr);
+  assert(container->get("/a/y") != nullptr);
+  assert(container->get("/top") != nullptr);
+  // Entries of subdirectories are under them.
+  assert(container->get("/x") == nullptr);
+  assert(container->get("/y") == nullptr);
+  // Each listing once.
+  assert(server.requests() == 4);
+}
+
+// A tree mounted before is loaded from its tree index, without listing
+// it again.
+void TreeIndexTest() {
+  const string repo = "/repos/dancerj/gitlstreefs";
+  const string commit = ReadFromFileOrDie(AT_FDCWD, "testdata/commit.json");
+  const std::map<string, string> responses{
+      {repo + "/commits/HEAD", commit},
+      {repo + "/git/trees/" + ParseCommit(commit) + "?recursive=true",
+       R"({"tree": [
+            {"path": "a", "mode": "040000", "type": "tree", "sha": "t1"},
+            {"path": "a/x", "mode": "100644", "type": "blob", "sha": "b1",
+             "size": 1},
+            {"path": "b", "mode": "040000", "type": "tree", "sha": "t1"},
+            {"path": "b/x", "mode": "100644", "type": "blob", "sha": "b1",
+             "size": 1},
+            {"path": "top", "mode": "100644", "type": "blob", "sha": "b2",
+             "size": 2}],
+           "truncated": false})"},
+  };
+  LocalHttpServer server([&responses](const string& target, string* body) {
+    auto it = responses.find(target);
+    if (it == responses.end()) return 404;
+    *body = it->second;
+    return 200;
+  });
+  const string cache_dir =
+      GetCurrentDir() + "/out/git-githubfs_test_tree_index_cache/";
+  assert(system(("rm -rf " + cache_dir).c_str()) == 0);
+  for (int i = 0; i < 2; ++i) {
+    auto container =
+        std::make_unique<directory_container::DirectoryContainer>();
+    auto fs = std::make_unique<githubfs::GitTree>(
+        "HEAD", (server.url() + repo).c_str(), container.get(), cache_dir);
+    assert(container->get("/a/x") != nullptr);
+    assert(container->get("/b/x") != nullptr);
+    assert(container->get("/top") != nullptr);
+    assert(container->get("/x") == nullptr);
+  }
+  directory_container::CompactDirectoryContainer compact;
+  auto fs = std::make_unique<githubfs::GitTree>(
+      "HEAD", (server.url() + repo).c_str(), &compact, cache_dir);
+  assert(compact.get("/a/x") != nullptr);
+  assert(compact.get("/b/x") != nullptr);
+  assert(compact.is_directory("/b"));
+  // The tree is listed the first time only.
+  assert(server.requests() == 4);
+}
+
 }  // namespace
 
 int main(int argc, char** argv) {
   ParserTest();
+  StreamingTreesParserTest();
+  LocalServerScenarioTest();
+  TruncatedListingTest();
+  CompactScenarioTest();
+  TreeIndexTest();
   int iter = argv[1] ? atoi(argv[1]) : 0;
   for (int i = 0; i < iter; ++i) {
     // TODO: This uses up quota, so don't run by default.
@@ -4,51 +4,155 @@
 #include "git-githubfs.h"
 
 #include <fuse.h>
+#include <stdlib.h>
 
+#include <algorithm>
 #include <memory>
+#include <string>
+#include <utility>
+#include <vector>
 
 namespace git_adapter {
 namespace {
 // Global scope to make it accessible from callback.
 auto fs = std::make_unique<directory_container::DirectoryContainer>();
+auto compact_fs =
+    std::make_unique<directory_container::CompactDirectoryContainer>();
+Config adapter_config;
+
+// The entries of an open directory, and its path for the attributes of
+// the entries, as readdir gets no path with nullpath_ok.
+struct OpenDirectory {
+  OpenDirectory(const char *p, const directory_container::Directory &d)
+      : path(p),
+        listing(std::make_unique<directory_container::Directory::Listing>(
+            d)) {}
+  explicit OpenDirectory(const char *p) : path(p) {}
+  const std::string path;
+  std::unique_ptr<directory_container::Directory::Listing> listing{};
+  // Instead of |listing| for CompactDirectoryContainer, names and files
+  // in name order, nullptr for directories.
+  std::vector<std::pair<std::string, directory_container::File *>> entries{};
+};
+
+// An open file, and its path for the attributes, as getattr of an open
+// file gets no path with nullpath_ok.
+struct OpenFile {
+  OpenFile(const char *p, directory_container::File *f) : path(p), file(f) {}
+  const std::string path;
+  directory_container::File *const file;
+};
+
+static directory_container::File *OpenedFile(fuse_file_info *fi) {
+  return fi->fh ? reinterpret_cast<OpenFile *>(fi->fh)->file : nullptr;
+}
 
 static int fs_getattr(const char *path, struct stat *stbuf,
                       fuse_file_info *fi) {
   if (fi) {
-    auto fe = reinterpret_cast<directory_container::File *>(fi->fh);
-    return fe->Getattr(stbuf);
+    // Same attributes as by path, including the inode number.
+    auto open_file = reinterpret_cast<OpenFile *>(fi->fh);
+    return adapter_config.compact
+               ? compact_fs->Getattr(open_file->path, stbuf)
+               : fs->Getattr(open_file->path, open_file->file, stbuf);
+  } else if (adapter_config.compact) {
+    return compact_fs->Getattr(path, stbuf);
   } else {
     return fs->Getattr(path, stbuf);
   }
 }
 
+static directory_container::File *MutableGet(const char *path) {
+  return adapter_config.compact ? compact_fs->mutable_get(path)
+                                : fs->mutable_get(path);
+}
+
 static int fs_opendir(const char *path, struct fuse_file_info *fi) {
   if (path == 0 || *path != '/') {
     return -ENOENT;
   }
+  if (adapter_config.compact) {
+    if (!compact_fs->is_directory(path)) return -ENOENT;
+    auto directory = std::make_unique<OpenDirectory>(path);
+    compact_fs->for_each(
+        path, [&directory](std::string_view name,
+                           const directory_container::File *f) {
+          directory->entries.emplace_back(
+              name, const_cast<directory_container::File *>(f));
+        });
+    fi->fh = reinterpret_cast<uint64_t>(directory.release());
+    return 0;
+  }
   const auto d =
       dynamic_cast<directory_container::Directory *>(fs->mutable_get(path));
   if (!d) return -ENOENT;
-  fi->fh = reinterpret_cast<uint64_t>(d);
+  fi->fh = reinterpret_cast<uint64_t>(new OpenDirectory(path, *d));
   return 0;
 }
 
 static int fs_releasedir(const char *, struct fuse_file_info *fi) {
   if (fi->fh == 0) return -EBADF;
+  delete reinterpret_cast<OpenDirectory *>(fi->fh);
   return 0;
 }
 
+// Offsets passed to |filler| are those of the next entry, with "." and
+// ".." at 0 and 1, so that the listing can be continued from there.
 static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                       off_t offset, struct fuse_file_info *fi,
-                      fuse_readdir_flags) {
-  filler(buf, ".", nullptr, 0, fuse_fill_dir_flags{});
-  filler(buf, "..", nullptr, 0, fuse_fill_dir_flags{});
-  auto *d = reinterpret_cast<const directory_container::Directory *>(fi->fh);
-  if (!d) return -ENOENT;
-  d->for_each(
-      [&](const std::string &s, const directory_container::File *unused) {
-        filler(buf, s.c_str(), nullptr, 0, fuse_fill_dir_flags{});
-      });
+                      fuse_readdir_flags flags) {
+  auto *directory = reinterpret_cast<OpenDirectory *>(fi->fh);
+  if (!directory) return -ENOENT;
+  constexpr off_t kFirstEntryOffset = 2;
+  if (offset < 1 && filler(buf, ".", nullptr, 1, fuse_fill_dir_flags{})) {
+    return 0;
+  }
+  if (offset < 2 && filler(buf, "..", nullptr, 2, fuse_fill_dir_flags{})) {
+    return 0;
+  }
+
+  // Fill in attributes to save a getattr per entry.
+  const bool plus = flags & FUSE_READDIR_PLUS;
+  std::string child_path;
+  if (plus) {
+    child_path = directory->path;
+    if (child_path.back() != '/') child_path += '/';
+  }
+  const size_t prefix_size = child_path.size();
+  struct stat st;
+  // Returns true once the buffer is full.
+  auto fill = [&](const std::string &name, directory_container::File *f,
+                  off_t next_offset) {
+    if (plus) {
+      child_path.resize(prefix_size);
+      child_path += name;
+      const int ret = adapter_config.compact
+                          ? compact_fs->Getattr(child_path, &st)
+                          : fs->Getattr(child_path, f, &st);
+      if (ret == 0) {
+        return filler(buf, name.c_str(), &st, next_offset,
+                      FUSE_FILL_DIR_PLUS) != 0;
+      }
+    }
+    return filler(buf, name.c_str(), nullptr, next_offset,
+                  fuse_fill_dir_flags{}) != 0;
+  };
+  const size_t first = std::max(offset, kFirstEntryOffset) - kFirstEntryOffset;
+  if (!directory->listing) {
+    for (size_t i = first; i < directory->entries.size(); ++i) {
+      const auto &[name, f] = directory->entries[i];
+      if (fill(name, f, i + kFirstEntryOffset + 1)) break;
+    }
+    return 0;
+  }
+  auto *listing = directory->listing.get();
+  listing->Seek(first);
+  for (; !listing->done(); listing->Next()) {
+    if (fill(listing->name(), listing->file(),
+             listing->position() + kFirstEntryOffset + 1)) {
+      break;
+    }
+  }
   return 0;
 }
 
@@ -57,9 +161,11 @@ static int fs_open(const char *path, struct fuse_file_info *fi) {
     return -ENOENT;
   }
 
-  auto f = fs->mutable_get(path);
+  auto f = MutableGet(path);
   if (!f) return -ENOENT;
-  fi->fh = reinterpret_cast<uint64_t>(f);
+  fi->fh = reinterpret_cast<uint64_t>(new OpenFile(path, f));
+  // Don't let kernel_cache serve stale content.
+  if (adapter_config.immutable && f->Volatile()) fi->direct_io = 1;
 
   f->Open();
   return 0;
@@ -67,38 +173,98 @@ static int fs_open(const char *path, struct fuse_file_info *fi) {
 
 static int fs_read(const char *path, char *buf, size_t size, off_t offset,
                    struct fuse_file_info *fi) {
-  auto fe = reinterpret_cast<directory_container::File *>(fi->fh);
+  auto fe = OpenedFile(fi);
   if (!fe) {
     return -ENOENT;
   }
   return fe->Read(buf, size, offset);
 }
 
+static int fs_read_buf(const char *path, struct fuse_bufvec **bufp,
+                       size_t size, off_t offset, struct fuse_file_info *fi) {
+  auto fe = OpenedFile(fi);
+  if (!fe) {
+    return -ENOENT;
+  }
+  // libfuse releases these with free().
+  auto buf = *bufp =
+      static_cast<struct fuse_bufvec *>(malloc(sizeof(struct fuse_bufvec)));
+  if (!buf) return -ENOMEM;
+  *buf = FUSE_BUFVEC_INIT(size);
+
+  // Let libfuse splice from the cache file when possible.
+  int fd;
+  off_t fd_offset;
+  ssize_t res = fe->ReadFd(size, offset, &fd, &fd_offset);
+  if (res >= 0) {
+    // enum with | becomes int.
+    buf->buf[0].flags =
+        static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+    buf->buf[0].fd = fd;
+    buf->buf[0].pos = fd_offset;
+    buf->buf[0].size = res;
+    return 0;
+  }
+  if (res != -ENOSYS) return res;
+
+  buf->buf[0].mem = malloc(size);
+  if (!buf->buf[0].mem) return -ENOMEM;
+  res = fe->Read(static_cast<char *>(buf->buf[0].mem), size, offset);
+  if (res < 0) return res;
+  buf->buf[0].size = res;
+  return 0;
+}
+
 static int fs_readlink(const char *path, char *buf, size_t size) {
   if (path == 0 || *path != '/') {
     return -ENOENT;
   }
 
-  auto f = fs->mutable_get(path);
+  auto f = MutableGet(path);
+  if (!f) return -ENOENT;
   return f->Readlink(buf, size);
 }
 
 static int fs_release(const char *path, struct fuse_file_info *fi) {
-  auto fe = reinterpret_cast<directory_container::File *>(fi->fh);
+  auto fe = OpenedFile(fi);
   if (!fe) {
     return -ENOENT;
   }
-  return fe->Release();
+  const int ret = fe->Release();
+  delete reinterpret_cast<OpenFile *>(fi->fh);
+  return ret;
 }
 
-void *fs_init(fuse_conn_info *, fuse_config *config) {
+void *fs_init(fuse_conn_info *conn, fuse_config *config) {
   config->nullpath_ok = 1;
+  // Not on by default; needed for read_buf to splice file descriptors
+  // to the kernel instead of reading them into a buffer first.
+  conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+  if (adapter_config.immutable) {
+    config->use_ino = 1;
+    config->kernel_cache = 1;
+    config->entry_timeout = adapter_config.cache_timeout;
+    // Names under a resolving root, such as revisions pushed after a
+    // failed lookup, may appear later.
+    auto root = dynamic_cast<directory_container::Directory *>(MutableGet("/"));
+    if (!root || !root->has_resolver()) {
+      config->negative_timeout = adapter_config.cache_timeout;
+    }
+    config->attr_timeout = adapter_config.cache_timeout;
+#ifdef FUSE_CAP_CACHE_SYMLINKS
+    if (conn->capable & FUSE_CAP_CACHE_SYMLINKS) {
+      conn->want |= FUSE_CAP_CACHE_SYMLINKS;
+    }
+#endif
+  }
+  if (adapter_config.on_init) adapter_config.on_init();
   return nullptr;
 }
 
 }  // namespace
 
-struct fuse_operations GetFuseOperations() {
+struct fuse_operations GetFuseOperations(const Config &config) {
+  adapter_config = config;
   struct fuse_operations o = {};
 #define DEFINE_HANDLER(n) o.n = &fs_##n
   DEFINE_HANDLER(getattr);
@@ -106,6 +272,7 @@ struct fuse_operations GetFuseOperations() {
   DEFINE_HANDLER(open);
   DEFINE_HANDLER(opendir);
   DEFINE_HANDLER(read);
+  DEFINE_HANDLER(read_buf);
   DEFINE_HANDLER(readdir);
   DEFINE_HANDLER(readlink);
   DEFINE_HANDLER(release);
@@ -117,4 +284,8 @@ struct fuse_operations GetFuseOperations() {
 directory_container::DirectoryContainer *GetDirectoryContainer() {
   return fs.get();
 }
+
+directory_container::CompactDirectoryContainer *GetCompactDirectoryContainer() {
+  return compact_fs.get();
+}
 }  // namespace git_adapter
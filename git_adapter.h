@@ -5,10 +5,32 @@
 #ifndef GIT_ADAPTER_H_
 #define GIT_ADAPTER_H_
 #include <fuse.h>
+
+#include <functional>
+
+#include "compact_directory_container.h"
 #include "directory_container.h"
 
 namespace git_adapter {
+struct Config {
+  Config() {}
+
+  // The tree does not change while mounted: report stable inode
+  // numbers, and let the kernel cache lookups, attributes and file
+  // content for |cache_timeout| seconds.
+  bool immutable{false};
+  double cache_timeout{24 * 60 * 60};
+  // Called from the init handler, which runs after daemonizing, to
+  // start background threads.
+  std::function<void()> on_init{};
+  // Serve GetCompactDirectoryContainer() instead of
+  // GetDirectoryContainer(), for trees too large to keep a full path
+  // per entry.
+  bool compact{false};
+};
+
 directory_container::DirectoryContainer* GetDirectoryContainer();
-fuse_operations GetFuseOperations();
+directory_container::CompactDirectoryContainer* GetCompactDirectoryContainer();
+fuse_operations GetFuseOperations(const Config& config = Config());
 }  // namespace git_adapter
 #endif
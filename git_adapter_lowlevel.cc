@@ -0,0 +1,338 @@
+#define FUSE_USE_VERSION 35
+
+#include "git_adapter_lowlevel.h"
+
+#include <fuse_lowlevel.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "directory_container.h"
+
+using directory_container::Directory;
+using directory_container::File;
+
+namespace git_adapter {
+namespace {
+Config adapter_config;
+
+// Directories may be linked under several parents, and the kernel can't
+// have one directory inode in several places. So they get a nodeid for
+// each parent and name, an odd number from their index in
+// directory_nodes. Other files are their File pointers, which are even.
+// Nodes are never freed: they are kept for the whole mount like the
+// Files, so lookup counts are not tracked and forget is a no-op.
+std::mutex nodes_mutex;
+std::vector<Directory *> directory_nodes;
+std::map<std::pair<fuse_ino_t, std::string>, fuse_ino_t> directory_node_ids;
+static_assert(alignof(File) > 1);
+
+File *InodeToFile(fuse_ino_t ino) {
+  if (ino & 1) {
+    std::lock_guard<std::mutex> l(nodes_mutex);
+    return directory_nodes.at(ino >> 1);
+  }
+  return reinterpret_cast<File *>(ino);
+}
+
+// The nodeid of |f| as |name| in the directory |parent|.
+fuse_ino_t FileToInode(fuse_ino_t parent, const std::string &name, File *f) {
+  auto d = dynamic_cast<Directory *>(f);
+  if (!d) return reinterpret_cast<fuse_ino_t>(f);
+  std::lock_guard<std::mutex> l(nodes_mutex);
+  auto [it, inserted] = directory_node_ids.emplace(std::pair(parent, name), 0);
+  if (inserted) {
+    it->second = directory_nodes.size() << 1 | 1;
+    directory_nodes.push_back(d);
+  }
+  return it->second;
+}
+
+double AttrTimeout() {
+  // Same as the high-level API default otherwise.
+  return adapter_config.immutable ? adapter_config.cache_timeout : 1.0;
+}
+
+// Fill |e| for |f| found as |name| in |parent|. The nodeid is also the
+// inode number, in getattr and readdir alike.
+int MakeEntry(fuse_ino_t parent, const std::string &name, File *f,
+              fuse_entry_param *e) {
+  *e = {};
+  e->ino = FileToInode(parent, name, f);
+  int ret = GetDirectoryContainer()->Getattr(f, e->ino, &e->attr);
+  if (ret != 0) return ret;
+  e->attr_timeout = e->entry_timeout = AttrTimeout();
+  return 0;
+}
+
+void ll_init(void *, fuse_conn_info *conn) {
+  {
+    std::lock_guard<std::mutex> l(nodes_mutex);
+    // FUSE_ROOT_ID.
+    directory_nodes = {
+        dynamic_cast<Directory *>(GetDirectoryContainer()->mutable_get("/"))};
+  }
+  // See git_adapter fs_init.
+  conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+#ifdef FUSE_CAP_CACHE_SYMLINKS
+  if (adapter_config.immutable) {
+    conn->want |= conn->capable & FUSE_CAP_CACHE_SYMLINKS;
+  }
+#endif
+  if (adapter_config.on_init) adapter_config.on_init();
+}
+
+void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  auto d = dynamic_cast<Directory *>(InodeToFile(parent));
+  if (!d) {
+    fuse_reply_err(req, ENOTDIR);
+    return;
+  }
+  d->MaybeLoad();
+  File *f = d->get(name);
+  if (!f && d->MaybeResolve(name)) f = d->get(name);
+  if (!f) {
+    if (!adapter_config.immutable || d->has_resolver()) {
+      fuse_reply_err(req, ENOENT);
+      return;
+    }
+    // Cache the negative lookup.
+    fuse_entry_param e{};
+    e.entry_timeout = adapter_config.cache_timeout;
+    fuse_reply_entry(req, &e);
+    return;
+  }
+  fuse_entry_param e;
+  int ret = MakeEntry(parent, name, f, &e);
+  if (ret != 0) {
+    fuse_reply_err(req, -ret);
+    return;
+  }
+  fuse_reply_entry(req, &e);
+}
+
+// Nodes are never freed, see directory_nodes.
+void ll_forget(fuse_req_t req, fuse_ino_t, uint64_t) { fuse_reply_none(req); }
+
+void ll_forget_multi(fuse_req_t req, size_t, struct fuse_forget_data *) {
+  fuse_reply_none(req);
+}
+
+void ll_getattr(fuse_req_t req, fuse_ino_t ino, fuse_file_info *) {
+  struct stat st;
+  int ret = GetDirectoryContainer()->Getattr(InodeToFile(ino), ino, &st);
+  if (ret != 0) {
+    fuse_reply_err(req, -ret);
+    return;
+  }
+  fuse_reply_attr(req, &st, AttrTimeout());
+}
+
+void ll_readlink(fuse_req_t req, fuse_ino_t ino) {
+  char target[PATH_MAX + 1];
+  int ret = InodeToFile(ino)->Readlink(target, sizeof(target));
+  if (ret < 0) {
+    fuse_reply_err(req, -ret);
+    return;
+  }
+  target[PATH_MAX] = 0;
+  fuse_reply_readlink(req, target);
+}
+
+void ll_open(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi) {
+  File *f = InodeToFile(ino);
+  int ret = f->Open();
+  if (ret < 0) {
+    fuse_reply_err(req, -ret);
+    return;
+  }
+  fi->fh = reinterpret_cast<uint64_t>(f);
+  if (adapter_config.immutable) {
+    if (f->Volatile()) {
+      fi->direct_io = 1;
+    } else {
+      fi->keep_cache = 1;
+    }
+  }
+  fuse_reply_open(req, fi);
+}
+
+void ll_read(fuse_req_t req, fuse_ino_t, size_t size, off_t offset,
+             fuse_file_info *fi) {
+  auto f = reinterpret_cast<File *>(fi->fh);
+  // Splice from the cache file when possible, as git_adapter read_buf.
+  int fd;
+  off_t fd_offset;
+  ssize_t res = f->ReadFd(size, offset, &fd, &fd_offset);
+  if (res >= 0) {
+    struct fuse_bufvec buf = FUSE_BUFVEC_INIT(static_cast<size_t>(res));
+    // enum with | becomes int.
+    buf.buf[0].flags =
+        static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+    buf.buf[0].fd = fd;
+    buf.buf[0].pos = fd_offset;
+    fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+    return;
+  }
+  if (res != -ENOSYS) {
+    fuse_reply_err(req, -res);
+    return;
+  }
+  std::unique_ptr<char[]> buf(new char[size]);
+  res = f->Read(buf.get(), size, offset);
+  if (res < 0) {
+    fuse_reply_err(req, -res);
+    return;
+  }
+  fuse_reply_buf(req, buf.get(), res);
+}
+
+void ll_release(fuse_req_t req, fuse_ino_t, fuse_file_info *fi) {
+  int ret = reinterpret_cast<File *>(fi->fh)->Release();
+  fuse_reply_err(req, ret < 0 ? -ret : 0);
+}
+
+void ll_opendir(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi) {
+  auto d = dynamic_cast<Directory *>(InodeToFile(ino));
+  if (!d) {
+    fuse_reply_err(req, ENOTDIR);
+    return;
+  }
+  fi->fh = reinterpret_cast<uint64_t>(new Directory::Listing(*d));
+  if (adapter_config.immutable) {
+    fi->cache_readdir = 1;
+    fi->keep_cache = 1;
+  }
+  fuse_reply_open(req, fi);
+}
+
+void ll_releasedir(fuse_req_t req, fuse_ino_t, fuse_file_info *fi) {
+  delete reinterpret_cast<Directory::Listing *>(fi->fh);
+  fuse_reply_err(req, 0);
+}
+
+// Offsets are those of the next entry, with "." and ".." at 0 and 1, as
+// in git_adapter fs_readdir.
+void ReaddirCommon(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                   fuse_file_info *fi, bool plus) {
+  auto listing = reinterpret_cast<Directory::Listing *>(fi->fh);
+  std::vector<char> buf(size);
+  size_t used = 0;
+  // Returns false if it didn't fit.
+  auto add = [&](const char *name, fuse_entry_param *e, off_t next_offset) {
+    const size_t remaining = size - used;
+    const size_t entry_size =
+        plus ? fuse_add_direntry_plus(req, buf.data() + used, remaining, name,
+                                      e, next_offset)
+             : fuse_add_direntry(req, buf.data() + used, remaining, name,
+                                 &e->attr, next_offset);
+    if (entry_size > remaining) return false;
+    used += entry_size;
+    return true;
+  };
+
+  fuse_entry_param e{};
+  // The kernel doesn't look these up, so no inode.
+  e.attr.st_mode = S_IFDIR;
+  e.attr.st_ino = ino;
+  if ((offset < 1 && !add(".", &e, 1)) || (offset < 2 && !add("..", &e, 2))) {
+    fuse_reply_buf(req, buf.data(), used);
+    return;
+  }
+
+  constexpr off_t kFirstEntryOffset = 2;
+  listing->Seek(std::max(offset, kFirstEntryOffset) - kFirstEntryOffset);
+  for (; !listing->done(); listing->Next()) {
+    File *f = listing->file();
+    // Only readdirplus counts as a lookup, but both report the same
+    // inode as getattr.
+    if (MakeEntry(ino, listing->name(), f, &e) != 0) continue;
+    if (!add(listing->name().c_str(), &e,
+             listing->position() + kFirstEntryOffset + 1)) {
+      break;
+    }
+  }
+  fuse_reply_buf(req, buf.data(), used);
+}
+
+void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                fuse_file_info *fi) {
+  ReaddirCommon(req, ino, size, offset, fi, false);
+}
+
+void ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                    fuse_file_info *fi) {
+  ReaddirCommon(req, ino, size, offset, fi, true);
+}
+
+}  // namespace
+
+fuse_lowlevel_ops GetFuseLowlevelOperations(const Config &config) {
+  adapter_config = config;
+  fuse_lowlevel_ops o = {};
+#define DEFINE_HANDLER(n) o.n = &ll_##n
+  DEFINE_HANDLER(forget);
+  DEFINE_HANDLER(forget_multi);
+  DEFINE_HANDLER(getattr);
+  DEFINE_HANDLER(init);
+  DEFINE_HANDLER(lookup);
+  DEFINE_HANDLER(open);
+  DEFINE_HANDLER(opendir);
+  DEFINE_HANDLER(read);
+  DEFINE_HANDLER(readdir);
+  DEFINE_HANDLER(readdirplus);
+  DEFINE_HANDLER(readlink);
+  DEFINE_HANDLER(release);
+  DEFINE_HANDLER(releasedir);
+#undef DEFINE_HANDLER
+  return o;
+}
+
+int LowlevelMain(fuse_args *args, const fuse_lowlevel_ops &ops) {
+  struct fuse_cmdline_opts opts;
+  if (fuse_parse_cmdline(args, &opts) != 0) return EXIT_FAILURE;
+  std::unique_ptr<char, decltype(&free)> mountpoint(opts.mountpoint, &free);
+  if (opts.show_help) {
+    printf("usage: %s [options] <mountpoint>\n\n", args->argv[0]);
+    fuse_cmdline_help();
+    fuse_lowlevel_help();
+    return EXIT_SUCCESS;
+  }
+  if (opts.show_version) {
+    fuse_lowlevel_version();
+    return EXIT_SUCCESS;
+  }
+  if (!mountpoint) {
+    fprintf(stderr, "usage: %s [options] <mountpoint>\n", args->argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  std::unique_ptr<fuse_session, decltype(&fuse_session_destroy)> se(
+      fuse_session_new(args, &ops, sizeof(ops), nullptr),
+      &fuse_session_destroy);
+  if (!se) return EXIT_FAILURE;
+  if (fuse_set_signal_handlers(se.get()) != 0) return EXIT_FAILURE;
+  int ret = -1;
+  if (fuse_session_mount(se.get(), mountpoint.get()) == 0) {
+    fuse_daemonize(opts.foreground);
+    if (opts.singlethread) {
+      ret = fuse_session_loop(se.get());
+    } else {
+      struct fuse_loop_config config {};
+      config.clone_fd = opts.clone_fd;
+      config.max_idle_threads = opts.max_idle_threads;
+      ret = fuse_session_loop_mt(se.get(), &config);
+    }
+    fuse_session_unmount(se.get());
+  }
+  fuse_remove_signal_handlers(se.get());
+  return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+}  // namespace git_adapter
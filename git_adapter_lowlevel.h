@@ -0,0 +1,22 @@
+/*
+ * Low-level FUSE frontend for the directory_container of git_adapter.
+ *
+ * Requests refer to inodes, which are the File objects themselves, or
+ * for directories a number per place they appear in, so libfuse
+ * doesn't rebuild paths and lookups are by parent directory and name
+ * instead of hashing full paths.
+ */
+
+#ifndef GIT_ADAPTER_LOWLEVEL_H_
+#define GIT_ADAPTER_LOWLEVEL_H_
+#include <fuse_lowlevel.h>
+
+#include "git_adapter.h"
+
+namespace git_adapter {
+fuse_lowlevel_ops GetFuseLowlevelOperations(const Config& config = Config());
+// Parse the command line, mount and serve requests, like fuse_main.
+// Returns the exit code.
+int LowlevelMain(fuse_args* args, const fuse_lowlevel_ops& ops);
+}  // namespace git_adapter
+#endif
@@ -0,0 +1,113 @@
+#include "git_adapter.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <map>
+#include <memory>
+#include <string>
+
+namespace {
+class TestFile : public directory_container::File {
+ public:
+  explicit TestFile(size_t size) : size_(size) {}
+  virtual ~TestFile() {}
+  virtual int Getattr(struct stat* stbuf) override {
+    stbuf->st_mode = S_IFREG | 0644;
+    stbuf->st_size = size_;
+    return 0;
+  }
+  virtual ssize_t Read(char* buf, size_t size, off_t offset) override {
+    return 0;
+  }
+  virtual int Open() override { return 0; }
+  virtual int Release() override { return 0; }
+
+ private:
+  const size_t size_;
+};
+
+struct Entry {
+  bool plus;
+  off_t size;
+  mode_t mode;
+};
+
+int Fill(void* buf, const char* name, const struct stat* stbuf, off_t off,
+         fuse_fill_dir_flags flags) {
+  auto* entries = static_cast<std::map<std::string, Entry>*>(buf);
+  const bool plus = flags & FUSE_FILL_DIR_PLUS;
+  assert(!plus || stbuf);
+  (*entries)[name] =
+      Entry{plus, plus ? stbuf->st_size : -1, plus ? stbuf->st_mode : 0};
+  return 0;
+}
+
+// With nullpath_ok, libfuse passes no path to readdir. Attributes are
+// still filled in for readdirplus.
+void ReaddirPlusTest() {
+  fuse_operations operations = git_adapter::GetFuseOperations();
+  auto* fs = git_adapter::GetDirectoryContainer();
+  fs->add("/dir/a", std::make_unique<TestFile>(10));
+  fs->add("/dir/b", std::make_unique<TestFile>(20));
+  fs->add("/dir/sub/c", std::make_unique<TestFile>(30));
+
+  fuse_file_info fi{};
+  assert(operations.opendir("/dir", &fi) == 0);
+  std::map<std::string, Entry> entries;
+  assert(operations.readdir(nullptr, &entries, Fill, 0, &fi,
+                            FUSE_READDIR_PLUS) == 0);
+  assert(entries.size() == 5);
+  assert(entries["a"].plus && entries["a"].size == 10);
+  assert(entries["b"].plus && entries["b"].size == 20);
+  assert(entries["sub"].plus && S_ISDIR(entries["sub"].mode));
+
+  // Without readdirplus, only names.
+  entries.clear();
+  assert(operations.readdir(nullptr, &entries, Fill, 0, &fi,
+                            fuse_readdir_flags{}) == 0);
+  assert(entries.size() == 5);
+  assert(!entries["a"].plus);
+  assert(operations.releasedir(nullptr, &fi) == 0);
+}
+// The same operations served from CompactDirectoryContainer.
+void CompactTest() {
+  git_adapter::Config config;
+  config.compact = true;
+  fuse_operations operations = git_adapter::GetFuseOperations(config);
+  auto* fs = git_adapter::GetCompactDirectoryContainer();
+  fs->add("/dir/a", std::make_unique<TestFile>(10));
+  fs->add("/dir/sub/c", std::make_unique<TestFile>(30));
+  fs->add_directory("/dir/empty");
+
+  struct stat st;
+  assert(operations.getattr("/dir/a", &st, nullptr) == 0);
+  assert(st.st_size == 10);
+  assert(operations.getattr("/dir/sub", &st, nullptr) == 0);
+  assert(S_ISDIR(st.st_mode));
+  assert(operations.getattr("/dir/missing", &st, nullptr) == -ENOENT);
+
+  fuse_file_info fi{};
+  assert(operations.opendir("/dir/a", &fi) == -ENOENT);
+  assert(operations.opendir("/dir", &fi) == 0);
+  std::map<std::string, Entry> entries;
+  assert(operations.readdir(nullptr, &entries, Fill, 0, &fi,
+                            FUSE_READDIR_PLUS) == 0);
+  assert(entries.size() == 5);
+  assert(entries["a"].plus && entries["a"].size == 10);
+  assert(entries["empty"].plus && S_ISDIR(entries["empty"].mode));
+  assert(operations.releasedir(nullptr, &fi) == 0);
+
+  fuse_file_info file_fi{};
+  assert(operations.open("/dir/sub", &file_fi) == -ENOENT);
+  assert(operations.open("/dir/sub/c", &file_fi) == 0);
+  assert(operations.release(nullptr, &file_fi) == 0);
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  ReaddirPlusTest();
+  CompactTest();
+  return 0;
+}
@@ -1,15 +1,21 @@
 #include "git_cat_file.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <syslog.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <condition_variable>
 #include <iostream>
 #include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "disallow.h"
@@ -94,10 +100,34 @@ BidirectionalPopen::~BidirectionalPopen() {
   }
 }
 
-void BidirectionalPopen::Write(const std::string& s) const {
-  write(write_fd_.get(), s.data(), s.size());
+bool BidirectionalPopen::Write(const std::string& s) const {
+  const char* data = s.data();
+  size_t size = s.size();
+  while (size > 0) {
+    ssize_t written = write(write_fd_.get(), data, size);
+    if (written == -1) {
+      if (errno == EINTR) continue;
+      perror("write to git cat-file");
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+ssize_t BidirectionalPopen::Read(char* buf, size_t max_size) const {
+  ssize_t size;
+  ABORT_ON_ERROR(size = read(read_fd_.get(), buf, max_size));
+  return size;
+}
+
+ssize_t BidirectionalPopen::Splice(int fd, size_t max_size) const {
+  return splice(read_fd_.get(), nullptr, fd, nullptr, max_size, SPLICE_F_MOVE);
 }
 
+void BidirectionalPopen::Terminate() const { kill(pid_, SIGTERM); }
+
 std::string BidirectionalPopen::Read(int max_size) const {
   std::string buf;
   buf.resize(max_size);
@@ -137,45 +167,361 @@ GitCatFileMetadata::GitCatFileMetadata(const std::string& header) {
   assert(space2 < newline);
   ASSERT_NE(space1, space2, header);
   type_ = header.substr(space1 + 1, space2 - space1 - 1);
-  size_ = atoi(header.c_str() + space2 + 1);
+  size_ = strtoll(header.c_str() + space2 + 1, nullptr, 10);
 }
 
 GitCatFileMetadata::~GitCatFileMetadata() {}
 
-GitCatFileProcess::GitCatFileProcess(const std::string* cwd)
-    : process_({"/usr/bin/git", "cat-file", "--batch"}, cwd) {}
+class GitCatFileProcess::ResponseReader {
+ public:
+  explicit ResponseReader(const BidirectionalPopen* process)
+      : process_(process) {}
+
+  // Read one line including the terminating newline. May read ahead
+  // into read_buffer_.
+  std::string ReadLine() {
+    constexpr int kReadSize = 4096;
+    size_t newline;
+    while ((newline = read_buffer_.find('\n')) == std::string::npos) {
+      std::string chunk = process_->Read(kReadSize);
+      if (chunk.empty()) {
+        std::cerr << "git cat-file terminated unexpectedly" << std::endl;
+        abort();
+      }
+      read_buffer_ += chunk;
+    }
+    std::string line = read_buffer_.substr(0, newline + 1);
+    read_buffer_.erase(0, newline + 1);
+    return line;
+  }
+
+  // Append exactly |size| bytes to |out|, without reading ahead.
+  void ReadExactly(size_t size, std::string* out) {
+    const size_t buffered = std::min(size, read_buffer_.size());
+    out->append(read_buffer_, 0, buffered);
+    read_buffer_.erase(0, buffered);
+    size_t position = out->size();
+    out->resize(position + size - buffered);
+    while (position < out->size()) {
+      ssize_t read_size =
+          process_->Read(&(*out)[position], out->size() - position);
+      if (read_size == 0) {
+        std::cerr << "git cat-file terminated unexpectedly" << std::endl;
+        abort();
+      }
+      position += read_size;
+    }
+  }
+
+  // Write exactly |size| bytes to |fd|, without reading ahead. The
+  // bytes are consumed even if writing fails, which returns false.
+  // |progress|, if set, is told the bytes written so far.
+  bool CopyExactly(size_t size, int fd,
+                   const std::function<void(size_t written)>& progress) {
+    const size_t buffered = std::min(size, read_buffer_.size());
+    bool ok = WriteAll(fd, read_buffer_.data(), buffered);
+    read_buffer_.erase(0, buffered);
+    size -= buffered;
+    size_t written = buffered;
+    if (ok && written && progress) progress(written);
+    // Moved without copying to user space where the kernel can.
+    bool use_splice = ok;
+    std::string buffer;
+    while (size > 0) {
+      ssize_t read_size;
+      if (use_splice) {
+        read_size = process_->Splice(fd, size);
+        if (read_size == -1) {
+          if (errno == EINTR) continue;
+          // EINVAL if |fd| does not support splice; any other error is
+          // from writing.
+          ok = errno == EINVAL;
+          use_splice = false;
+          continue;
+        }
+      } else {
+        constexpr size_t kCopySize = 1 << 20;
+        buffer.resize(std::min(size, kCopySize));
+        read_size = process_->Read(&buffer[0], buffer.size());
+        ok = ok && WriteAll(fd, buffer.data(), read_size);
+      }
+      if (read_size == 0) {
+        std::cerr << "git cat-file terminated unexpectedly" << std::endl;
+        abort();
+      }
+      size -= read_size;
+      written += read_size;
+      if (ok && progress) progress(written);
+    }
+    return ok;
+  }
+
+  // Read the content following |metadata| from `--batch`, and the
+  // terminating newline.
+  void ReadContent(const GitCatFileMetadata& metadata, std::string* content) {
+    ReadExactly(metadata.size_, content);
+    ReadClosingNewline();
+  }
+  // Same, writing it to |fd|.
+  bool CopyContent(const GitCatFileMetadata& metadata, int fd,
+                   const std::function<void(size_t written)>& progress) {
+    const bool ok = CopyExactly(metadata.size_, fd, progress);
+    ReadClosingNewline();
+    return ok;
+  }
+
+ private:
+  void ReadClosingNewline() {
+    std::string closing_lf;
+    ReadExactly(1, &closing_lf);
+    assert(closing_lf == "\n");
+  }
+
+  static bool WriteAll(int fd, const char* data, size_t size) {
+    while (size > 0) {
+      ssize_t written = write(fd, data, size);
+      if (written == -1) {
+        if (errno == EINTR) continue;
+        perror("write");
+        return false;
+      }
+      data += written;
+      size -= written;
+    }
+    return true;
+  }
+
+  const BidirectionalPopen* const process_;
+  // Bytes read ahead from the process.
+  std::string read_buffer_{};
+  DISALLOW_COPY_AND_ASSIGN(ResponseReader);
+};
+
+class GitCatFileProcess::Channel {
+ public:
+  Channel(const std::vector<std::string>& command, const std::string* cwd)
+      : process_(command, cwd) {}
+  ~Channel() {}
+
+  std::string Request(const std::string& ref) {
+    std::string content;
+    Request(ref, [this, &content](const GitCatFileMetadata& metadata) {
+      reader_.ReadContent(metadata, &content);
+    });
+    return content;
+  }
+
+  bool RequestToFd(const std::string& ref, int fd,
+                   const std::function<void(size_t written)>& progress) {
+    bool ok;
+    Request(ref,
+            [this, &ok, fd, &progress](const GitCatFileMetadata& metadata) {
+              ok = reader_.CopyContent(metadata, fd, progress);
+            });
+    return ok;
+  }
+
+  int in_flight() const { return in_flight_; }
+
+ private:
+  // Send |ref| and wait for our turn to read the response, then pass
+  // its header to |read_content|.
+  void Request(const std::string& ref,
+               std::function<void(const GitCatFileMetadata& metadata)>
+                   read_content) {
+    in_flight_++;
+    uint64_t ticket;
+    {
+      std::lock_guard<std::mutex> l(write_mutex_);
+      ticket = next_write_ticket_++;
+      if (!process_.Write(ref + "\n")) {
+        std::cerr << "git cat-file terminated unexpectedly" << std::endl;
+        abort();
+      }
+    }
+    {
+      // Responses come in the order of requests, wait for ours.
+      std::unique_lock<std::mutex> l(read_mutex_);
+      read_turn_.wait(l,
+                      [this, ticket] { return next_read_ticket_ == ticket; });
+    }
+
+    const GitCatFileMetadata metadata{reader_.ReadLine()};
+    if (metadata.type_ == "missing") {
+      EndTurn();
+      std::cout << "Object response for " << ref << " was missing."
+                << std::endl;
+      throw ObjectNotFoundException();
+    }
+    read_content(metadata);
+    EndTurn();
+  }
+
+  void EndTurn() {
+    {
+      std::lock_guard<std::mutex> l(read_mutex_);
+      next_read_ticket_++;
+    }
+    in_flight_--;
+    read_turn_.notify_all();
+  }
+
+  const BidirectionalPopen process_;
+  std::mutex write_mutex_{};
+  uint64_t next_write_ticket_{0};
+
+  std::mutex read_mutex_{};
+  std::condition_variable read_turn_{};
+  uint64_t next_read_ticket_{0};
+  // Only used by the thread whose turn it is to read.
+  ResponseReader reader_{&process_};
+
+  std::atomic<int> in_flight_{0};
+  DISALLOW_COPY_AND_ASSIGN(Channel);
+};
+
+GitCatFileProcess::GitCatFileProcess(const std::string* cwd,
+                                     int num_processes)
+    : command_{"/usr/bin/git", "cat-file"}, cwd_(cwd ? *cwd : "") {
+  assert(num_processes > 0);
+  std::vector<std::string> command = command_;
+  command.push_back("--batch");
+  for (int i = 0; i < num_processes; ++i) {
+    channels_.emplace_back(std::make_unique<Channel>(command, cwd));
+  }
+}
 
 GitCatFileProcess::GitCatFileProcess(const std::string& cwd,
-                                     const std::string& ssh)
-    : process_({"/usr/bin/ssh", ssh, "cd", cwd, "&&", "/usr/bin/git",
-                "cat-file", "--batch"},
-               nullptr /* local cwd should not matter */) {}
+                                     const std::string& ssh,
+                                     int num_processes)
+    : command_{"/usr/bin/ssh", ssh, "cd", cwd, "&&", "/usr/bin/git",
+               "cat-file"} {
+  assert(num_processes > 0);
+  std::vector<std::string> command = command_;
+  command.push_back("--batch");
+  for (int i = 0; i < num_processes; ++i) {
+    channels_.emplace_back(std::make_unique<Channel>(
+        command, nullptr /* local cwd should not matter */));
+  }
+}
 
 GitCatFileProcess::~GitCatFileProcess() {}
 
+GitCatFileProcess::Channel& GitCatFileProcess::PickChannel() const {
+  Channel* best = channels_[0].get();
+  for (const auto& channel : channels_) {
+    if (channel->in_flight() < best->in_flight()) {
+      best = channel.get();
+    }
+  }
+  return *best;
+}
+
 std::string GitCatFileProcess::Request(const std::string& ref) const {
-  constexpr int kMaxHeaderSize = 4096;
-  std::lock_guard<std::mutex> l(m_);
+  return PickChannel().Request(ref);
+}
+
+bool GitCatFileProcess::RequestToFd(
+    const std::string& ref, int fd,
+    std::function<void(size_t written)> progress) const {
+  return PickChannel().RequestToFd(ref, fd, progress);
+}
+
+namespace {
+// Writes |input| to |process| on another thread, so that the responses
+// can be read meanwhile without either side blocking on a full pipe.
+// Joined when destroyed, also when unwinding from an exception.
+class BackgroundWriter {
+ public:
+  BackgroundWriter(const BidirectionalPopen* process, std::string input)
+      : thread_([this, process, input = std::move(input)]() {
+          ok_ = process->Write(input);
+        }) {}
+  ~BackgroundWriter() {
+    if (thread_.joinable()) thread_.join();
+  }
+
+  // Wait for the writing to end. Returns whether it succeeded.
+  bool Join() {
+    thread_.join();
+    return ok_;
+  }
 
-  process_.Write(ref + "\n");
-  std::string response = process_.Read(kMaxHeaderSize);
+ private:
+  bool ok_{};
+  std::thread thread_;
+  DISALLOW_COPY_AND_ASSIGN(BackgroundWriter);
+};
+}  // namespace
 
-  const GitCatFileMetadata metadata{response};
-  if (metadata.type_ == "missing") {
-    std::cout << "Object response for " << ref << " was missing." << std::endl;
-    throw ObjectNotFoundException();
+void GitCatFileProcess::RunBatch(
+    const std::string& command, const std::vector<std::string>& refs,
+    std::function<void(ResponseReader* reader)> read) const {
+  std::string input;
+  for (const auto& ref : refs) {
+    input += command;
+    input += ' ';
+    input += ref;
+    input += '\n';
   }
+  // With --buffer, nothing is output until asked to.
+  input += "flush\n";
 
-  int remaining;
-  while (
-      (remaining = (metadata.size_ + metadata.first_line_size_ +
-                    1 /* closing LF */) /* The size of what we want to read */
-                   - response.size()    /* What we've already read */
-       ) > 0) {
-    response += process_.Read(remaining);
+  std::lock_guard<std::mutex> l(batch_mutex_);
+  if (!batch_process_) {
+    std::vector<std::string> command_line = command_;
+    command_line.push_back("--batch-command");
+    command_line.push_back("--buffer");
+    batch_process_ = std::make_unique<BidirectionalPopen>(
+        command_line, cwd_.empty() ? nullptr : &cwd_);
+    batch_reader_ = std::make_unique<ResponseReader>(batch_process_.get());
+  }
+  BackgroundWriter writer(batch_process_.get(), std::move(input));
+  try {
+    read(batch_reader_.get());
+  } catch (...) {
+    // The rest of the responses are not read, so the process can't be
+    // used again. Stop it so that the writer can't block on it, and
+    // start another one next time.
+    batch_process_->Terminate();
+    writer.Join();
+    batch_reader_.reset();
+    batch_process_.reset();
+    throw;
+  }
+  if (!writer.Join()) {
+    std::cerr << "git cat-file terminated unexpectedly" << std::endl;
+    abort();
   }
-  assert(response[response.size() - 1] == '\n');
-  return response.substr(metadata.first_line_size_, metadata.size_);
+}
+
+void GitCatFileProcess::RequestBatch(
+    const std::vector<std::string>& refs,
+    std::function<void(size_t index, const GitCatFileMetadata& metadata,
+                       std::string* content)>
+        callback) const {
+  RunBatch("contents", refs, [&refs, &callback](ResponseReader* reader) {
+    std::string content;
+    for (size_t i = 0; i < refs.size(); ++i) {
+      const GitCatFileMetadata metadata{reader->ReadLine()};
+      content.clear();
+      // Without size for "missing" and the like.
+      if (metadata.size_ >= 0) reader->ReadContent(metadata, &content);
+      callback(i, metadata, &content);
+    }
+  });
+}
+
+std::vector<GitCatFileMetadata> GitCatFileProcess::RequestMetadata(
+    const std::vector<std::string>& refs) const {
+  std::vector<GitCatFileMetadata> metadata;
+  metadata.reserve(refs.size());
+  RunBatch("info", refs, [&refs, &metadata](ResponseReader* reader) {
+    for (size_t i = 0; i < refs.size(); ++i) {
+      metadata.emplace_back(reader->ReadLine());
+    }
+  });
+  return metadata;
 }
 
 }  // namespace GitCatFile
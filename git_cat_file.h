@@ -1,6 +1,10 @@
 #ifndef GIT_CAT_FILE_H
 #define GIT_CAT_FILE_H
 
+#include <sys/types.h>
+
+#include <functional>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <vector>
@@ -19,8 +23,8 @@ class GitCatFileMetadata {
   // The header size, including the terminating newline.
   int first_line_size_{-1};
 
-  // The size of the message content.
-  int size_{-1};
+  // The size of the message content, -1 if there is none.
+  ssize_t size_{-1};
   std::string sha1_{};
   std::string type_{};
 };
@@ -31,8 +35,19 @@ class BidirectionalPopen {
   BidirectionalPopen(const std::vector<std::string>& command,
                      const std::string* cwd);
   ~BidirectionalPopen();
-  void Write(const std::string& s) const;
+  // Write all of |s|. Returns false on failure, such as when the
+  // process has exited.
+  bool Write(const std::string& s) const;
   std::string Read(int max_size) const;
+  // Returns the number of bytes read, 0 on EOF.
+  ssize_t Read(char* buf, size_t max_size) const;
+  // Move up to |max_size| bytes of output to |fd| with splice(2).
+  // Returns the number of bytes moved, 0 on EOF, -1 with errno set on
+  // failure.
+  ssize_t Splice(int fd, size_t max_size) const;
+  // Ask the process to exit, without closing the pipes that other
+  // threads may be using.
+  void Terminate() const;
 
  private:
   ScopedFd read_fd_{-1};
@@ -42,18 +57,66 @@ class BidirectionalPopen {
   DISALLOW_COPY_AND_ASSIGN(BidirectionalPopen);
 };
 
+// Client for `git cat-file --batch`, with a pool of |num_processes|
+// processes. Thread safe; requests from concurrent threads are written
+// to a process without waiting for earlier responses, and each thread
+// reads its own response in order.
 class GitCatFileProcess {
  public:
-  explicit GitCatFileProcess(const std::string* cwd);
-  GitCatFileProcess(const std::string& cwd, const std::string& ssh);
+  explicit GitCatFileProcess(const std::string* cwd, int num_processes = 1);
+  GitCatFileProcess(const std::string& cwd, const std::string& ssh,
+                    int num_processes = 1);
   ~GitCatFileProcess();
 
   std::string Request(const std::string& ref) const;
+  // Same, writing the content to |fd| as it arrives instead of holding
+  // it in memory. Returns false if writing failed. |progress| is called
+  // with the number of bytes written so far as they are written.
+  bool RequestToFd(const std::string& ref, int fd,
+                   std::function<void(size_t written)> progress =
+                       nullptr) const;
   struct ObjectNotFoundException {};
 
+  // Fetch all of |refs| through a separate `git cat-file
+  // --batch-command --buffer` process, which does not flush after each
+  // object, so that a large set of objects moves in one pipelined pass.
+  // The process is kept for later batches. Needs git 2.36 or later.
+  // |callback| is called for each in order with its index in |refs|;
+  // objects that don't exist have type "missing", size -1 and no
+  // content. The callback may take over |content|.
+  void RequestBatch(
+      const std::vector<std::string>& refs,
+      std::function<void(size_t index, const GitCatFileMetadata& metadata,
+                         std::string* content)>
+          callback) const;
+  // Types and sizes of |refs|, in order, through the same process.
+  std::vector<GitCatFileMetadata> RequestMetadata(
+      const std::vector<std::string>& refs) const;
+
  private:
-  const BidirectionalPopen process_;
-  mutable std::mutex m_;
+  // Reads responses from a git cat-file process.
+  class ResponseReader;
+  // One pipelined git cat-file process.
+  class Channel;
+  // The channel with the least requests in flight.
+  Channel& PickChannel() const;
+  // Send |command| for each of |refs| to the batch process, writing on
+  // another thread while |read| reads the responses.
+  void RunBatch(const std::string& command,
+                const std::vector<std::string>& refs,
+                std::function<void(ResponseReader* reader)> read) const;
+
+  // git cat-file command line without options.
+  std::vector<std::string> command_{};
+  // Where to run it, empty for ssh.
+  const std::string cwd_{};
+  std::vector<std::unique_ptr<Channel> > channels_{};
+  // The process of RunBatch(), started on first use, and its reader.
+  // One batch at a time.
+  mutable std::mutex batch_mutex_{};
+  mutable std::unique_ptr<BidirectionalPopen> batch_process_{};
+  mutable std::unique_ptr<ResponseReader> batch_reader_{};
+  DISALLOW_COPY_AND_ASSIGN(GitCatFileProcess);
 };
 }  // namespace GitCatFile
 
@@ -1,8 +1,12 @@
 #include "git_cat_file.h"
 
+#include <fcntl.h>
+
 #include <cassert>
 #include <iostream>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "get_current_dir.h"
 #include "scoped_timer.h"
@@ -67,6 +71,114 @@ void testFailureCase(const std::string& git_dir) {
   assert(0);
 }
 
+void testConcurrentRequests(const std::string& git_dir) {
+  std::string readme_hash =
+      PopenAndReadOrDie2({"git", "rev-parse", "HEAD:README.md"}, &git_dir);
+  readme_hash.resize(readme_hash.size() - 1);  // Remove newline.
+  const std::string expected = PopenAndReadOrDie2(
+      {"git", "cat-file", "blob", readme_hash}, &git_dir, nullptr);
+
+  // Requests are pipelined on two processes, responses must still go
+  // to the right thread, including the missing ones.
+  GitCatFileProcess d(&git_dir, 2);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; ++t) {
+    threads.emplace_back([&, t]() {
+      for (int i = 0; i < 50; ++i) {
+        if ((i + t) % 10 == 0) {
+          try {
+            d.Request("deadbeef");
+            assert(0);
+          } catch (GitCatFile::GitCatFileProcess::ObjectNotFoundException& e) {
+          }
+        } else {
+          std::string result = d.Request(readme_hash);
+          ASSERT_EQ(result, expected, "concurrent request");
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+void testBatch(const std::string& git_dir) {
+  // Every blob a few times over, enough to fill the pipes both ways.
+  const std::string listing =
+      PopenAndReadOrDie2({"git", "ls-tree", "-r", "HEAD"}, &git_dir);
+  std::vector<std::string> blobs;
+  for (const auto& line : SplitStringUsing(listing, '\n', true)) {
+    // 100644 blob 5c7b5c80891eee3ae35687f3706567544a149e73\tconfigure.js
+    if (line.size() > 52 && line.compare(7, 5, "blob ") == 0) {
+      blobs.push_back(line.substr(12, 40));
+    }
+  }
+  assert(blobs.size() > 10);
+  std::vector<std::string> refs;
+  for (int i = 0; i < 20; ++i) {
+    refs.insert(refs.end(), blobs.begin(), blobs.end());
+  }
+  refs.push_back("deadbeef");
+
+  GitCatFileProcess d(&git_dir);
+  const auto metadata = d.RequestMetadata(refs);
+  assert(metadata.size() == refs.size());
+  size_t count = 0;
+  d.RequestBatch(refs, [&](size_t index, const GitCatFileMetadata& m,
+                           std::string* content) {
+    ASSERT_EQ(index, count, "order");
+    count++;
+    ASSERT_EQ(m.type_, metadata[index].type_, refs[index]);
+    ASSERT_EQ(m.size_, metadata[index].size_, refs[index]);
+    if (index == refs.size() - 1) {
+      ASSERT_EQ(m.type_, "missing", "missing object");
+      assert(content->empty());
+    } else if (index < blobs.size()) {
+      ASSERT_EQ(m.sha1_, refs[index], "sha1");
+      assert(*content == d.Request(refs[index]));
+    }
+  });
+  ASSERT_EQ(count, refs.size(), "all responses");
+
+  // The batch process is reused, and replaced if a callback throws
+  // before reading all the responses.
+  struct Stop {};
+  try {
+    d.RequestBatch(refs, [](size_t index, const GitCatFileMetadata& m,
+                            std::string* content) { throw Stop(); });
+    assert(false);
+  } catch (const Stop&) {
+  }
+  count = 0;
+  d.RequestBatch(blobs, [&](size_t index, const GitCatFileMetadata& m,
+                            std::string* content) {
+    ASSERT_EQ(m.sha1_, blobs[index], "sha1 after a stopped batch");
+    count++;
+  });
+  ASSERT_EQ(count, blobs.size(), "all responses after a stopped batch");
+  ASSERT_EQ(d.RequestMetadata(blobs).size(), blobs.size(), "metadata again");
+}
+
+void testRequestToFd(const std::string& git_dir) {
+  GitCatFileProcess d(&git_dir);
+  const std::string path = GetCurrentDir() + "/out/git_cat_file_test.out";
+  for (const char* ref : {"HEAD:README.md", "HEAD:configure.cc"}) {
+    ScopedFd fd(open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600));
+    assert(fd.get() != -1);
+    assert(d.RequestToFd(ref, fd.get()));
+    ASSERT_EQ(ReadFromFileOrDie(AT_FDCWD, path), d.Request(ref), ref);
+  }
+  try {
+    d.RequestToFd("deadbeef", -1);
+    assert(0);
+  } catch (GitCatFile::GitCatFileProcess::ObjectNotFoundException& e) {
+  }
+  // The content is consumed even if it can't be written.
+  assert(!d.RequestToFd("HEAD:README.md", -1));
+  assert(!d.Request("HEAD:README.md").empty());
+}
+
 int main(int argc, char** argv) {
   int n = 2;
   if (argc == 2) {
@@ -84,5 +196,8 @@ int main(int argc, char** argv) {
   }
   testParseFirstLine();
   testFailureCase(git_dir);
+  testConcurrentRequests(git_dir);
+  testBatch(git_dir);
+  testRequestToFd(git_dir);
   return 0;
 }
@@ -0,0 +1,93 @@
+#include "gitiles.h"
+
+#include <assert.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <string_view>
+
+#include "base64decode.h"
+#include "jsonparser.h"
+
+namespace gitiles {
+namespace {
+
+// Picks the entries out of the gitiles tree response:
+// {"id": "...", "entries": [
+//   {
+//     "mode": 33188,  // an actual number.
+//     "type": "blob",
+//     "id": "0eca3e92941236b77ad23a02dc0c000cd0da7a18",
+//     "name": ".gitignore",
+//     "size": 1325
+//   }, ...]}
+// size can be none if mode is 40960, in which case 'target' contains the
+// symlink target.
+class GitilesTreeHandler : public jjson::EntriesHandler {
+ public:
+  GitilesTreeHandler(const std::string& host_project_branch_url,
+                     GitilesFileHandler file_handler)
+      : jjson::EntriesHandler("entries"),
+        host_project_branch_url_(host_project_branch_url),
+        file_handler_(file_handler) {}
+
+  virtual void StartEntry() override { entry_ = Entry(); }
+  virtual void EndEntry() override {
+    /*
+     * Gitiles API seems to require a commit revision+path for obtaining a blob.
+     * according to https://github.com/google/gitiles/issues/51
+     * Make sure we have one.
+     */
+    std::string url =
+        host_project_branch_url_ + "/" + entry_.name + "?format=TEXT";
+    file_handler_(entry_.name, entry_.mode, entry_.id,
+                  S_ISLNK(entry_.mode) ? 0 : entry_.size, entry_.target, url);
+  }
+  virtual void EntryString(std::string_view key,
+                           std::string_view value) override {
+    if (key == "id") {
+      entry_.id = value;
+    } else if (key == "name") {
+      entry_.name = value;
+    } else if (key == "target") {
+      entry_.target = value;
+    }
+  }
+  virtual void EntryNumber(std::string_view key, double value) override {
+    if (key == "mode") {
+      entry_.mode = value;
+    } else if (key == "size") {
+      entry_.size = value;
+    }
+  }
+
+ private:
+  struct Entry {
+    mode_t mode{};
+    std::string id{};
+    std::string name{};
+    int size{};
+    std::string target{};
+  };
+
+  const std::string host_project_branch_url_;
+  const GitilesFileHandler file_handler_;
+  Entry entry_{};
+};
+
+}  // namespace
+
+std::string FetchBlob(const std::string& blob_text_string) {
+  return base64decode(blob_text_string);
+}
+
+bool ParseTrees(const std::string& host_project_branch_url,
+                const std::string& trees_string,
+                GitilesFileHandler file_handler) {
+  // I assume the URL doesn't end at /.
+  assert(host_project_branch_url[host_project_branch_url.size() - 1] != '/');
+  GitilesTreeHandler handler(host_project_branch_url, file_handler);
+  return jjson::Parse(std::string_view(trees_string), &handler);
+}
+
+}  // namespace gitiles
@@ -0,0 +1,33 @@
+#ifndef GITILES_H_
+#define GITILES_H_
+/**
+ * Parsers for gitiles responses, which are similar to the GitHub API
+ * but not quite.
+ */
+#include <functional>
+#include <string>
+
+namespace gitiles {
+
+typedef std::function<void(const std::string& path, int mode,
+                           const std::string& sha, const int size,
+                           const std::string& target, const std::string& url)>
+    GitilesFileHandler;
+
+// Decode a blob fetched in text format, which is base64, as from
+// https://chromium.googlesource.com/chromiumos/third_party/kernel/+/chromeos-4.4/.gitignore?format=TEXT
+std::string FetchBlob(const std::string& blob_text_string);
+
+// Parses tree object from json, returns true on success.
+//
+// host_project_branch_url needs to not end with a /. Should contain
+// http://HOST/PROJECT/+/BRANCH that is used for the original tree
+// request which should have been
+// http://HOST/PROJECT/+/BRANCH/?format=JSON&recursive=TRUE&long=1
+bool ParseTrees(const std::string& host_project_branch_url,
+                const std::string& trees_string,
+                GitilesFileHandler file_handler);
+
+}  // namespace gitiles
+
+#endif
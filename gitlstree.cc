@@ -11,13 +11,17 @@ mount-able filesystem.
  */
 
 #include <assert.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
-#include <unordered_map>
 
+#include <algorithm>
+#include <charconv>
 #include <iostream>
 #include <memory>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
 #define FUSE_USE_VERSION 32
@@ -28,17 +32,24 @@ mount-able filesystem.
 #include "ostream_vector.h"
 #include "scoped_timer.h"
 #include "strutil.h"
+#include "tree_index.h"
 
 using std::lock_guard;
 using std::make_unique;
 using std::mutex;
 using std::string;
+using std::string_view;
+using std::unique_lock;
 using std::unique_ptr;
 using std::unordered_map;
 using std::vector;
 
 namespace gitlstree {
 namespace {
+// Blobs at least this large are written to the cache as they arrive
+// from git instead of being held in memory first.
+constexpr size_t kStreamingSize = 1 << 20;
+
 class GitHeadHandler : public directory_container::File {
  public:
   GitHeadHandler(const std::string& rev, GitTree* parent)
@@ -91,8 +102,10 @@ int FileElement::Getattr(struct stat* stbuf) {
 }
 
 // Maybe run remote command if ssh spec is available.
-string GitTree::RunGitCommand(const vector<string>& commands, int* exit_code,
-                              const std::string& log_tag) {
+void GitTree::PopenGitCommand(const vector<string>& commands, int* exit_code,
+                              const std::string& log_tag,
+                              std::function<void(string_view chunk)>
+                                  chunk_handler) {
   constexpr bool verbose = false;
   if (verbose) {
     std::cout << "Command: " << commands << std::endl;
@@ -104,53 +117,353 @@ string GitTree::RunGitCommand(const vector<string>& commands, int* exit_code,
       command += s + " ";
     }
     ScopedConcurrencyLimit l(command);
-    return PopenAndReadOrDie2(
+    PopenAndStreamOrDie(
         {"ssh", ssh_, string("cd ") + gitdir_ + " && " + command}, nullptr,
-        exit_code);
+        exit_code, chunk_handler);
   } else {
-    return PopenAndReadOrDie2(commands, &gitdir_, exit_code);
+    PopenAndStreamOrDie(commands, &gitdir_, exit_code, chunk_handler);
+  }
+}
+
+string GitTree::RunGitCommand(const vector<string>& commands, int* exit_code,
+                              const std::string& log_tag) {
+  string result;
+  PopenGitCommand(commands, exit_code, log_tag,
+                  [&result](string_view chunk) { result += chunk; });
+  return result;
+}
+
+void GitTree::RunGitCommandStreaming(
+    const vector<string>& commands, int* exit_code, const std::string& log_tag,
+    char delimiter, std::function<void(string_view line)> line_handler) {
+  LineSplitter splitter(delimiter, line_handler);
+  PopenGitCommand(commands, exit_code, log_tag,
+                  [&splitter](string_view chunk) { splitter.Feed(chunk); });
+  splitter.Flush();
+}
+
+bool ParseLsTreeLine(string_view line, LsTreeEntry* entry) {
+  // <mode> SP <type> SP <object> SP+ <size> TAB <path>
+  const size_t tab = line.find('\t');
+  if (tab == string_view::npos) return false;
+  entry->path = line.substr(tab + 1);
+  const string_view header = line.substr(0, tab);
+
+  const size_t space1 = header.find(' ');
+  if (space1 == string_view::npos) return false;
+  const size_t space2 = header.find(' ', space1 + 1);
+  if (space2 == string_view::npos) return false;
+  const size_t space3 = header.find(' ', space2 + 1);
+  if (space3 == string_view::npos) return false;
+
+  unsigned int mode;
+  if (std::from_chars(header.data(), header.data() + space1, mode, 8).ec !=
+      std::errc()) {
+    return false;
+  }
+  entry->mode = mode;
+  entry->type = header.substr(space1 + 1, space2 - space1 - 1);
+  entry->sha1 = header.substr(space2 + 1, space3 - space2 - 1);
+
+  // Size is right-aligned with padding spaces, and is '-' for
+  // non-blobs.
+  const size_t size_begin = header.find_first_not_of(' ', space3);
+  if (size_begin == string_view::npos) return false;
+  entry->size = 0;
+  std::from_chars(header.data() + size_begin, header.data() + header.size(),
+                  entry->size);
+  return true;
+}
+
+bool GitTree::LoadTreeLazily(
+    const string& tree_hash,
+    directory_container::DirectoryContainer* container) {
+  int exit_code;
+  string file_path;
+  RunGitCommandStreaming(
+      {"git", "ls-tree", "-l", "-z", tree_hash}, &exit_code, "lstree-lazy",
+      '\0', [&](string_view line) {
+        LsTreeEntry entry;
+        if (!ParseLsTreeLine(line, &entry)) {
+          return;
+        }
+        file_path = '/';
+        file_path.append(entry.path);
+        if (entry.type == "tree") {
+          container->link(file_path,
+                          TreeDirectory(string(entry.sha1), file_path));
+        } else {
+          MaybePrefetch(entry, file_path);
+          container->add(file_path, make_unique<FileElement>(
+                                        entry.mode, string(entry.sha1),
+                                        entry.size, this));
+        }
+      });
+  return exit_code == 0;
+}
+
+bool GitTree::ResolveRevision(
+    const string& revision,
+    directory_container::DirectoryContainer* container) {
+  // The name may come from any lookup under the mount point, and goes
+  // to a shell for ssh. Let through names like HEAD~2, v1.0 and hashes.
+  if (revision.empty() || !isalnum(static_cast<unsigned char>(revision[0]))) {
+    return false;
+  }
+  for (unsigned char c : revision) {
+    if (!isalnum(c) && !strchr("._-@~^", c)) return false;
+  }
+  // Names that are not revisions are looked up again after this, such
+  // as a branch created after mounting. Most are shell completion
+  // probing for names, so don't keep many.
+  static constexpr auto kUnresolvedTimeout = std::chrono::seconds(10);
+  static constexpr size_t kMaxUnresolved = 1000;
+  auto root =
+      static_cast<directory_container::Directory*>(container->mutable_get("/"));
+  std::promise<bool> promise;
+  {
+    std::unique_lock<mutex> l(revisions_mutex_);
+    const auto now = std::chrono::steady_clock::now();
+    auto unresolved = unresolved_revisions_.find(revision);
+    if (unresolved != unresolved_revisions_.end()) {
+      if (now - unresolved->second < kUnresolvedTimeout) return false;
+      unresolved_revisions_.erase(unresolved);
+    }
+    // Maybe resolved while waiting for the lock.
+    if (root->get(revision)) return true;
+    auto resolving = resolving_revisions_.find(revision);
+    if (resolving != resolving_revisions_.end()) {
+      // Wait for the lookup in progress.
+      std::shared_future<bool> result = resolving->second;
+      l.unlock();
+      return result.get();
+    }
+    resolving_revisions_.emplace(revision, promise.get_future().share());
+  }
+
+  // git runs without the lock, so that other revisions are resolved
+  // meanwhile.
+  int exit_code;
+  string tree{RunGitCommand(
+      {"git", "rev-parse", "--verify", "--quiet", revision + "^{tree}"},
+      &exit_code, "rev-parse")};
+  const bool resolved = exit_code == 0 && !tree.empty();
+  if (resolved) {
+    // truncate the final newline.
+    tree.resize(tree.size() - 1);
+    root->link(revision, TreeDirectory(tree, "/" + revision));
+  }
+  {
+    lock_guard<mutex> l(revisions_mutex_);
+    resolving_revisions_.erase(revision);
+    if (!resolved) {
+      const auto now = std::chrono::steady_clock::now();
+      if (unresolved_revisions_.size() >= kMaxUnresolved) {
+        std::erase_if(unresolved_revisions_, [now](const auto& unresolved) {
+          return now - unresolved.second >= kUnresolvedTimeout;
+        });
+        if (unresolved_revisions_.size() >= kMaxUnresolved) {
+          unresolved_revisions_.clear();
+        }
+      }
+      unresolved_revisions_.emplace(revision, now);
+    }
+  }
+  promise.set_value(resolved);
+  return resolved;
+}
+
+directory_container::Directory* GitTree::TreeDirectory(
+    const string& sha1, const string& dir_path) {
+  lock_guard<mutex> l(trees_mutex_);
+  auto& directory = trees_[sha1];
+  if (!directory) {
+    directory = make_unique<directory_container::Directory>();
+    directory->set_loader([this, sha1, dir_path, d = directory.get()]() {
+      if (!LoadTreeDirectory(sha1, dir_path, d)) {
+        std::cerr << "Could not load tree " << sha1 << std::endl;
+      }
+    });
   }
+  return directory.get();
 }
 
-bool GitTree::LoadDirectory(
-    const string& ref, directory_container::DirectoryContainer* container) {
+bool GitTree::LoadTreeDirectory(const string& sha1, const string& dir_path,
+                                directory_container::Directory* directory) {
   int exit_code;
+  string file_path;
+  RunGitCommandStreaming(
+      {"git", "ls-tree", "-l", "-z", sha1}, &exit_code, "lstree-tree", '\0',
+      [&](string_view line) {
+        LsTreeEntry entry;
+        if (!ParseLsTreeLine(line, &entry)) {
+          return;
+        }
+        const string name(entry.path);
+        file_path = dir_path + '/' + name;
+        if (entry.type == "tree") {
+          directory->link(name, TreeDirectory(string(entry.sha1), file_path));
+        } else {
+          MaybePrefetch(entry, file_path);
+          directory->add(name, make_unique<FileElement>(entry.mode,
+                                                        string(entry.sha1),
+                                                        entry.size, this));
+        }
+      });
+  return exit_code == 0;
+}
+
+directory_container::Directory* GitTree::IndexDirectory(const string& sha1,
+                                                       uint64_t position) {
+  lock_guard<mutex> l(trees_mutex_);
+  auto& directory = trees_[sha1];
+  if (!directory) {
+    directory = make_unique<directory_container::Directory>();
+    directory->set_loader([this, position, d = directory.get()]() {
+      LoadIndexDirectory(position, d);
+    });
+  }
+  return directory.get();
+}
+
+void GitTree::LoadIndexDirectory(uint64_t position,
+                                 directory_container::Directory* directory) {
+  tree_index_->for_each_child(position, [&](const TreeIndex::Entry& entry) {
+    // The path of the entry, after that of the tree.
+    const string name(entry.path.substr(entry.path.rfind('/') + 1));
+    if (entry.type == "tree") {
+      directory->link(name, IndexDirectory(string(entry.sha1), entry.position));
+    } else {
+      directory->add(name, make_unique<FileElement>(entry.mode,
+                                                    string(entry.sha1),
+                                                    entry.size, this));
+    }
+  });
+}
+
+bool GitTree::LoadDirectory(const string& ref,
+                            directory_container::DirectoryContainer* container) {
   int exit_code_revparse;
-  string hash{RunGitCommand({"git", "rev-parse", ref}, &exit_code_revparse,
-                            "rev-parse")};
-  // truncate the final newline.
-  hash.resize(hash.size() - 1);
-  if (exit_code_revparse != 0) {
+  // The commit, and the tree which names the tree index.
+  const string hashes{RunGitCommand({"git", "rev-parse", ref, ref + "^{tree}"},
+                                    &exit_code_revparse, "rev-parse")};
+  const size_t newline = hashes.find('\n');
+  if (exit_code_revparse != 0 || newline == string::npos) {
     std::cerr << "Could not resolve " << ref << std::endl;
     return false;
   }
+  const string hash = hashes.substr(0, newline);
+  string tree_hash = hashes.substr(newline + 1);
+  // truncate the final newline.
+  if (!tree_hash.empty()) tree_hash.resize(tree_hash.size() - 1);
 
-  string git_ls_tree(RunGitCommand({"git", "ls-tree", "-l", "-r", hash},
-                                   &exit_code, "lstree"));
-  if (exit_code != 0) {
+  if (config_.lazy_tree) {
+    // Only the root directory is listed here.
+    if (!LoadTreeLazily(hash, container)) {
+      return false;
+    }
+  } else if (!LoadTreeRecursively(tree_hash, container)) {
     // Failed to load directory.
     return false;
   }
-  const vector<string> lines = SplitStringUsing(git_ls_tree, '\n', true);
-  for (const auto& line : lines) {
-    const vector<string> elements = SplitStringUsing(line, ' ', true);
-    // TODO split with tab too.
-    // TODO
-    if (elements.size() == 4) {
-      const vector<string> elements3 =
-          SplitStringUsing(elements[3], '\t', false);
-      assert(elements3.size() == 2);
-      const string& file_path = elements3[1];
-      const string& sha1 = elements[2];
-      mode_t attribute = strtol(elements[0].c_str(), nullptr, 8);
-      size_t size = atoi(elements3[0].c_str());
-      assert(file_path[0] != '/');  // git ls-tree do not start with /.
-      container->add(string("/") + file_path,
-                     make_unique<FileElement>(attribute, sha1, size, this));
+  container->add("/.status",
+                 make_unique<scoped_timer::StatusHandler>([this]() {
+                   return cache_.DumpStats() +
+                          (prefetcher_ ? prefetcher_->Status() : string());
+                 }));
+  container->add("/.git/HEAD", make_unique<GitHeadHandler>(hash, this));
+  return true;
+}
+
+bool GitTree::LoadTreeRecursively(
+    const string& tree_hash,
+    directory_container::DirectoryContainer* container) {
+  string file_path("/");
+  // The directory loaded for each tree hash. A tree seen before is
+  // linked to that directory, and the entries under it are skipped.
+  unordered_map<string, directory_container::Directory*> trees;
+  // "path/" of the subtree being skipped, entries follow their tree.
+  string skipped_prefix;
+  // Set while listing with git, to record the entries that are used.
+  TreeIndex::Writer* writer = nullptr;
+  auto add_entry = [&](const LsTreeEntry& entry) {
+    assert(entry.path[0] != '/');  // git ls-tree do not start with /.
+    if (!skipped_prefix.empty()) {
+      if (entry.path.substr(0, skipped_prefix.size()) == skipped_prefix) {
+        return;
+      }
+      skipped_prefix.clear();
+    }
+    if (writer) {
+      writer->Add(TreeIndex::Entry{entry.mode, entry.type, entry.sha1,
+                                   entry.size, entry.path});
+    }
+    file_path.resize(1);
+    file_path.append(entry.path);
+    if (entry.type == "tree") {
+      auto [it, inserted] = trees.emplace(string(entry.sha1), nullptr);
+      if (inserted) {
+        auto directory = make_unique<directory_container::Directory>();
+        it->second = directory.get();
+        container->add(file_path, move(directory));
+      } else {
+        container->link(file_path, it->second);
+        skipped_prefix.assign(entry.path);
+        skipped_prefix += '/';
+      }
+      return;
+    }
+    MaybePrefetch(entry, file_path);
+    container->add(file_path,
+                   make_unique<FileElement>(entry.mode, string(entry.sha1),
+                                            entry.size, this));
+  };
+
+  if (auto index = TreeIndex::Open(tree_index_dir_, tree_hash)) {
+    scoped_timer::ScopedTimer time("tree-index");
+    // Directories are served from the mapped index as they are looked
+    // up. Blobs are still all queued for prefetch here.
+    tree_index_ = std::move(index);
+    if (prefetcher_) {
+      tree_index_->for_each([this](const TreeIndex::Entry& entry) {
+        MaybePrefetch(LsTreeEntry{entry.mode, entry.type, entry.sha1,
+                                  entry.size, entry.path},
+                      "/" + string(entry.path));
+      });
     }
+    tree_index_->for_each_child(
+        TreeIndex::kRoot, [&](const TreeIndex::Entry& entry) {
+          file_path.resize(1);
+          file_path.append(entry.path);
+          if (entry.type == "tree") {
+            container->link(file_path, IndexDirectory(string(entry.sha1),
+                                                      entry.position));
+          } else {
+            container->add(file_path, make_unique<FileElement>(
+                                          entry.mode, string(entry.sha1),
+                                          entry.size, this));
+          }
+        });
+    return true;
   }
-  container->add("/.status", make_unique<scoped_timer::StatusHandler>());
-  container->add("/.git/HEAD", make_unique<GitHeadHandler>(hash, this));
+
+  TreeIndex::Writer index_writer;
+  writer = &index_writer;
+  int exit_code;
+  // Use NUL termination so that paths are not quoted.
+  RunGitCommandStreaming(
+      {"git", "ls-tree", "-l", "-r", "-t", "-z", tree_hash}, &exit_code,
+      "lstree", '\0', [&](string_view line) {
+        LsTreeEntry entry;
+        if (!ParseLsTreeLine(line, &entry)) {
+          // Probably an error message from git, which is checked
+          // with the exit code.
+          return;
+        }
+        add_entry(entry);
+      });
+  if (exit_code != 0) return false;
+  index_writer.Commit(tree_index_dir_, tree_hash);
   return true;
 }
 
@@ -158,8 +471,17 @@ bool GitTree::LoadDirectory(
 std::unique_ptr<GitTree> GitTree::NewGitTree(
     const string& my_gitdir, const string& hash, const string& maybe_ssh,
     const string& cached_dir,
-    directory_container::DirectoryContainer* container) {
-  unique_ptr<GitTree> g{new GitTree(my_gitdir, maybe_ssh, cached_dir)};
+    directory_container::DirectoryContainer* container, const Config& config) {
+  unique_ptr<GitTree> g{new GitTree(my_gitdir, maybe_ssh, cached_dir, config)};
+  if (config.multi_revision) {
+    container->set_root_resolver([g = g.get(), container](const string& name) {
+      return g->ResolveRevision(name, container);
+    });
+    container->add("/.status",
+                   make_unique<scoped_timer::StatusHandler>(
+                       [g = g.get()]() { return g->cache_.DumpStats(); }));
+    return g;
+  }
   if (g->LoadDirectory(hash, container)) {
     return g;
   } else {
@@ -168,36 +490,111 @@ std::unique_ptr<GitTree> GitTree::NewGitTree(
 }
 
 GitTree::GitTree(const string& my_gitdir, const string& maybe_ssh,
-                 const string& cached_dir)
+                 const string& cached_dir, const Config& config)
     : gitdir_(my_gitdir),
       ssh_(maybe_ssh),
-      cache_(cached_dir),
-      git_cat_file_(
-          maybe_ssh.empty()
-              ? std::make_unique<GitCatFile::GitCatFileProcess>(&my_gitdir)
-              : std::make_unique<GitCatFile::GitCatFileProcess>(my_gitdir,
-                                                                ssh_)) {
-  cache_.Gc();
+      config_(config),
+      tree_index_dir_(cached_dir + "trees/"),
+      cache_(cached_dir, config.cache_config),
+      git_cat_file_(maybe_ssh.empty()
+                        ? std::make_unique<GitCatFile::GitCatFileProcess>(
+                              &my_gitdir, config.cat_file_processes)
+                        : std::make_unique<GitCatFile::GitCatFileProcess>(
+                              my_gitdir, ssh_, config.cat_file_processes)) {
+  if (config.prefetch) {
+    prefetcher_ = make_unique<blob_prefetcher::BlobPrefetcher>(
+        config.prefetch_config, [this](const vector<string>& sha1s) {
+          vector<bool> ok(sha1s.size(), true);
+          // Only the ones not cached yet, as on a remount.
+          vector<string> missing;
+          vector<size_t> positions;
+          for (size_t i = 0; i < sha1s.size(); ++i) {
+            if (cache_.Contains(sha1s[i])) continue;
+            missing.push_back(sha1s[i]);
+            positions.push_back(i);
+          }
+          if (missing.empty()) return ok;
+          // Large blobs are fetched one by one in constant memory, the
+          // rest in one batch.
+          const auto metadata = git_cat_file_->RequestMetadata(missing);
+          vector<string> small;
+          vector<size_t> small_positions;
+          for (size_t i = 0; i < missing.size(); ++i) {
+            if (metadata[i].size_ < static_cast<ssize_t>(kStreamingSize)) {
+              small.push_back(missing[i]);
+              small_positions.push_back(positions[i]);
+              continue;
+            }
+            ok[positions[i]] = cache_.PrefetchStreaming(
+                missing[i], [this, &sha1 = missing[i]](int fd) {
+                  return git_cat_file_->RequestToFd(sha1, fd);
+                });
+          }
+          git_cat_file_->RequestBatch(
+              small,
+              [&](size_t index, const GitCatFile::GitCatFileMetadata& metadata,
+                  string* content) {
+                ok[small_positions[index]] =
+                    metadata.size_ >= 0 &&
+                    cache_.Prefetch(small[index], [content](string* ret) {
+                      ret->swap(*content);
+                      return true;
+                    });
+              });
+          return ok;
+        });
+  }
+}
+
+void GitTree::StartBackgroundWork() {
+  cache_.StartBackgroundGc();
+  if (prefetcher_) prefetcher_->Start();
+}
+
+void GitTree::MaybePrefetch(const LsTreeEntry& entry,
+                            const string& file_path) {
+  if (prefetcher_ && entry.type == "blob") {
+    prefetcher_->Add(string(entry.sha1), entry.size, file_path);
+  }
 }
 
-GitTree::~GitTree() {}
+GitTree::~GitTree() {
+  // Background fetches use git_cat_file_.
+  cache_.WaitProgressive();
+}
 
-FileElement::FileElement(int attribute, const string& sha1, int size,
+FileElement::FileElement(int attribute, const string& sha1, size_t size,
                          GitTree* parent)
     : attribute_(attribute), sha1_(sha1), size_(size), parent_(parent) {}
 
 int FileElement::maybe_cat_file_locked() {
   if (!memory_) {
-    memory_ = parent_->cache().get(sha1_, [this](string* ret) -> bool {
-      try {
-        *ret = parent_->git_cat_file()->Request(sha1_);
-      } catch (GitCatFile::GitCatFileProcess::ObjectNotFoundException& e) {
-        // If the object was not found, caching the result is not useful.
-        abort();
-        return false;
-      }
-      return true;
-    });
+    if (size_ >= kStreamingSize) {
+      memory_ = parent_->cache().GetStreaming(sha1_, [this](int fd) -> bool {
+        blob_prefetcher::BlobPrefetcher::ForegroundScope foreground(
+            parent_->prefetcher());
+        try {
+          return parent_->git_cat_file()->RequestToFd(sha1_, fd);
+        } catch (GitCatFile::GitCatFileProcess::ObjectNotFoundException& e) {
+          abort();
+          return false;
+        }
+      });
+    } else {
+      memory_ = parent_->cache().get(sha1_, [this](string* ret) -> bool {
+        blob_prefetcher::BlobPrefetcher::ForegroundScope foreground(
+            parent_->prefetcher());
+        try {
+          *ret = parent_->git_cat_file()->Request(sha1_);
+        } catch (GitCatFile::GitCatFileProcess::ObjectNotFoundException& e) {
+          // If the object was not found, caching the result is not
+          // useful.
+          abort();
+          return false;
+        }
+        return true;
+      });
+    }
     if (!memory_) {
       // If still failed, something failed in the process.
       abort();
@@ -208,13 +605,58 @@ int FileElement::maybe_cat_file_locked() {
   return 0;
 }
 
+void FileElement::maybe_start_progressive_locked() {
+  if (memory_ || progressive_ || size_ < kStreamingSize ||
+      !parent_->progressive_reads()) {
+    return;
+  }
+  GitTree* parent = parent_;
+  const string sha1 = sha1_;
+  // Runs on a background thread, possibly after this is gone.
+  progressive_ = parent_->cache().StartProgressive(
+      sha1_,
+      [parent, sha1](int fd,
+                     const std::function<void(size_t)>& progress) -> bool {
+        blob_prefetcher::BlobPrefetcher::ForegroundScope foreground(
+            parent->prefetcher());
+        try {
+          return parent->git_cat_file()->RequestToFd(sha1, fd, progress);
+        } catch (GitCatFile::GitCatFileProcess::ObjectNotFoundException& e) {
+          abort();
+          return false;
+        }
+      });
+}
+
+void FileElement::maybe_release_locked() {
+  if (open_count_ == 0) {
+    progressive_.reset();
+    if (memory_) {
+      parent_->cache().release(sha1_, memory_);
+      memory_ = nullptr;
+    }
+  }
+}
+
 int FileElement::Open() {
   lock_guard<mutex> l(buf_mutex_);
-  return maybe_cat_file_locked();
+  maybe_start_progressive_locked();
+  int e = progressive_ ? 0 : maybe_cat_file_locked();
+  if (e == 0) open_count_++;
+  return e;
 }
 
 ssize_t FileElement::Read(char* target, size_t size, off_t offset) {
-  lock_guard<mutex> l(buf_mutex_);
+  unique_lock<mutex> l(buf_mutex_);
+  if (progressive_) {
+    // Wait without the lock, so that reads of parts that have arrived
+    // are not held up by reads of parts that have not.
+    std::shared_ptr<Cache::Progressive> progressive = progressive_;
+    l.unlock();
+    if (offset >= static_cast<off_t>(size_)) return 0;
+    return progressive->Read(target, std::min<size_t>(size, size_ - offset),
+                             offset);
+  }
   if (!memory_) {
     // Dump some debug information.
     std::cout << "file: " << sha1_ << std::endl;
@@ -228,9 +670,34 @@ ssize_t FileElement::Read(char* target, size_t size, off_t offset) {
     memcpy(target, memory_->memory_charp() + offset, size);
   } else
     size = 0;
+  maybe_release_locked();
   return size;
 }
 
+ssize_t FileElement::ReadFd(size_t size, off_t offset, int* fd,
+                            off_t* fd_offset) {
+  unique_lock<mutex> l(buf_mutex_);
+  if (open_count_ > 0 && progressive_) {
+    std::shared_ptr<Cache::Progressive> progressive = progressive_;
+    l.unlock();
+    if (offset >= static_cast<off_t>(size_)) {
+      size = 0;
+    } else {
+      size = std::min<size_t>(size, size_ - offset);
+      const ssize_t available = progressive->Wait(offset + size);
+      if (available < 0) return available;
+      size = std::min<size_t>(size, std::max<ssize_t>(available - offset, 0));
+    }
+    *fd = progressive->fd();
+    *fd_offset = offset;
+    return size;
+  }
+  // Without an open reference the descriptor could go away before the
+  // data is spliced.
+  if (open_count_ == 0 || !memory_) return -ENOSYS;
+  return memory_->ReadFd(size, offset, fd, fd_offset);
+}
+
 ssize_t FileElement::Readlink(char* target, size_t size) {
   lock_guard<mutex> l(buf_mutex_);
   int e = maybe_cat_file_locked();
@@ -244,6 +711,7 @@ ssize_t FileElement::Readlink(char* target, size_t size) {
   }
 
   memcpy(target, memory_->memory_charp(), size);
+  maybe_release_locked();
   return 0;
 }
 
@@ -251,11 +719,8 @@ void FileElement::GetHash(char* hash) const { memcpy(hash, sha1_.data(), 40); }
 
 int FileElement::Release() {
   lock_guard<mutex> l(buf_mutex_);
-  // When your file name based map is destroyed that is not a good timing to
-  // destroy the cache.
-  // TODO add refcounting.
-  // parent_->cache().release(sha1_, memory_);
-  memory_ = nullptr;
+  if (open_count_ > 0) open_count_--;
+  maybe_release_locked();
   return 0;
 }
 
@@ -4,11 +4,18 @@
 #include <assert.h>
 #include <sys/ioctl.h>
 
+#include <chrono>
+#include <functional>
+#include <future>
 #include <mutex>
+#include <string_view>
+#include <unordered_map>
 
+#include "blob_prefetcher.h"
 #include "cached_file.h"
 #include "directory_container.h"
 #include "disallow.h"
+#include "tree_index.h"
 
 namespace GitCatFile {
 class GitCatFileProcess;
@@ -18,12 +25,30 @@ namespace gitlstree {
 
 class GitTree;
 
+// One record of `git ls-tree -l -r -t -z` output. Views point into the
+// record that was parsed.
+struct LsTreeEntry {
+  mode_t mode{};
+  std::string_view type{};
+  std::string_view sha1{};
+  // 0 for entries without size, such as submodule commits.
+  size_t size{};
+  std::string_view path{};
+};
+
+// Parse one record without the terminating delimiter, e.g.
+// "100644 blob f313668af32ea3447a594ae1e7d8ac9841fbae7b    1234\tsound/README"
+// Returns false if the record is malformed.
+bool ParseLsTreeLine(std::string_view line, LsTreeEntry* entry);
+
 class FileElement : public directory_container::File {
  public:
-  FileElement(int attribute, const std::string& sha1, int size,
+  FileElement(int attribute, const std::string& sha1, size_t size,
               GitTree* parent);
   virtual int Open() override;
   virtual ssize_t Read(char* buf, size_t size, off_t offset) override;
+  virtual ssize_t ReadFd(size_t size, off_t offset, int* fd,
+                         off_t* fd_offset) override;
   virtual ssize_t Readlink(char* buf, size_t size) override;
   virtual int Getattr(struct stat* stbuf) override;
   int Release();
@@ -31,14 +56,22 @@ class FileElement : public directory_container::File {
 
  private:
   int maybe_cat_file_locked();
+  // Start reading a large uncached blob while it arrives, if enabled.
+  void maybe_start_progressive_locked();
+  // Drop the reference to the cached content when no longer open.
+  void maybe_release_locked();
 
   // If file content is read, this should be populated.
   const Cache::Memory* memory_{};
+  // Instead of memory_, while the content is being fetched.
+  std::shared_ptr<Cache::Progressive> progressive_{};
   std::mutex buf_mutex_{};
+  // Number of Open() without matching Release().
+  int open_count_{};
 
   int attribute_;
   std::string sha1_;
-  int size_;
+  size_t size_;
 
   GitTree* parent_;
   DISALLOW_COPY_AND_ASSIGN(FileElement);
@@ -46,30 +79,118 @@ class FileElement : public directory_container::File {
 
 class GitTree {
  public:
+  struct Config {
+    Config() {}
+
+    // Load subdirectories when they are first accessed.
+    bool lazy_tree{false};
+    // Number of git cat-file processes to spread blob requests over.
+    int cat_file_processes{1};
+    // Fetch all blobs into the cache in the background after loading.
+    bool prefetch{false};
+    blob_prefetcher::BlobPrefetcher::Config prefetch_config{};
+    Cache::Config cache_config{};
+    // Serve any revision as /<revision>/, resolved when first looked
+    // up, instead of one revision at the root. Revisions share tree
+    // directories by tree hash, and the cache and cat-file processes.
+    // With prefetch, the blobs of each directory are queued when the
+    // directory is loaded.
+    bool multi_revision{false};
+    // Let reads of large uncached blobs return as soon as the range
+    // they need has arrived, instead of waiting for the whole blob.
+    bool progressive_reads{false};
+  };
+
   static std::unique_ptr<GitTree> NewGitTree(
       const std::string& gitdir, const std::string& hash,
       const std::string& maybe_ssh, const std::string& cache_dir,
-      directory_container::DirectoryContainer* container);
+      directory_container::DirectoryContainer* container,
+      const Config& config = Config());
   ~GitTree();
 
   std::string RunGitCommand(const std::vector<std::string>& commands,
                             int* exit_code, const std::string& log_tag);
+  // Run git command and pass each |delimiter| terminated record of the
+  // output to |line_handler| as it arrives.
+  void RunGitCommandStreaming(
+      const std::vector<std::string>& commands, int* exit_code,
+      const std::string& log_tag, char delimiter,
+      std::function<void(std::string_view line)> line_handler);
 
   Cache& cache() { return cache_; }
   const GitCatFile::GitCatFileProcess* git_cat_file() const {
     return git_cat_file_.get();
   }
+  bool progressive_reads() const { return config_.progressive_reads; }
+  // nullptr if prefetching is disabled.
+  blob_prefetcher::BlobPrefetcher* prefetcher() { return prefetcher_.get(); }
+
+  // Start cache garbage collection and prefetching threads. Threads
+  // don't survive fork, so call this after daemonizing.
+  void StartBackgroundWork();
 
  private:
   GitTree(const std::string& gitdir, const std::string& maybe_ssh,
-          const std::string& cache_dir);
+          const std::string& cache_dir, const Config& config);
   bool LoadDirectory(const std::string& hash,
                      directory_container::DirectoryContainer* container);
+  // Load the whole tree from git and write the tree index, or serve it
+  // from the tree index written before.
+  bool LoadTreeRecursively(
+      const std::string& tree_hash,
+      directory_container::DirectoryContainer* container);
+  // Load the top level of |tree_hash|, subdirectories are loaded when
+  // they are first accessed.
+  bool LoadTreeLazily(const std::string& tree_hash,
+                      directory_container::DirectoryContainer* container);
+  // Add /|revision| for multi_revision. Returns false if it is not a
+  // revision.
+  bool ResolveRevision(const std::string& revision,
+                       directory_container::DirectoryContainer* container);
+  // The shared directory for tree object |sha1|, loaded on first
+  // access. |dir_path| is where it was first found, for prefetch
+  // priorities.
+  directory_container::Directory* TreeDirectory(const std::string& sha1,
+                                                 const std::string& dir_path);
+  bool LoadTreeDirectory(const std::string& sha1, const std::string& dir_path,
+                         directory_container::Directory* directory);
+  // The shared directory for tree object |sha1| at |position| in
+  // tree_index_, loaded from it on first access.
+  directory_container::Directory* IndexDirectory(const std::string& sha1,
+                                                 uint64_t position);
+  void LoadIndexDirectory(uint64_t position,
+                          directory_container::Directory* directory);
+  // Queue the blob for prefetching, if enabled.
+  void MaybePrefetch(const LsTreeEntry& entry, const std::string& file_path);
+  void PopenGitCommand(const std::vector<std::string>& commands,
+                       int* exit_code, const std::string& log_tag,
+                       std::function<void(std::string_view chunk)>
+                           chunk_handler);
 
   const std::string gitdir_;
   const std::string ssh_;
+  const Config config_;
+  // Tree indexes by tree hash, in the cache directory.
+  const std::string tree_index_dir_;
   Cache cache_;
   const std::unique_ptr<GitCatFile::GitCatFileProcess> git_cat_file_;
+  // The tree index that the mounted tree is served from, if it had one.
+  std::unique_ptr<TreeIndex> tree_index_{};
+  // For multi_revision: revisions being resolved, so that concurrent
+  // lookups run git once, and revisions that failed to resolve and
+  // when, so that git is not asked again for a while.
+  std::mutex revisions_mutex_{};
+  std::unordered_map<std::string, std::shared_future<bool>>
+      resolving_revisions_{};
+  std::unordered_map<std::string, std::chrono::steady_clock::time_point>
+      unresolved_revisions_{};
+  // Directories of tree objects by sha1.
+  std::mutex trees_mutex_{};
+  std::unordered_map<std::string,
+                     std::unique_ptr<directory_container::Directory>>
+      trees_{};
+  // Uses cache_ and git_cat_file_, so it needs to be destroyed first.
+  std::unique_ptr<blob_prefetcher::BlobPrefetcher> prefetcher_{};
 
   DISALLOW_COPY_AND_ASSIGN(GitTree);
 };
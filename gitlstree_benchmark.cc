@@ -0,0 +1,164 @@
+// Benchmark for parsing `git ls-tree -l -r -z` output into
+// DirectoryContainer, using a synthetic listing, compared with loading
+// the same entries from a tree index. With a git directory, also
+// compare loading its HEAD without (cold) and with (warm) a tree index.
+//
+// $ ./out/gitlstree_benchmark 1000000 [gitdir]
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#define FUSE_USE_VERSION 32
+
+#include "directory_container.h"
+#include "gitlstree.h"
+#include "get_current_dir.h"
+#include "strutil.h"
+#include "tree_index.h"
+
+namespace {
+// Something resembling a source tree, 100 files per directory, 3
+// levels deep. |entries| files, each directory listed before the
+// entries under it as `git ls-tree -r -t` does.
+std::string SyntheticListing(size_t entries) {
+  std::string listing;
+  char line[256];
+  size_t trees = 0;
+  auto add_tree = [&](const char* format, size_t module, size_t sub) {
+    int length = snprintf(line, sizeof(line), "040000 tree f%039zx       -\t",
+                          trees++);
+    length += snprintf(line + length, sizeof(line) - length, format, module,
+                       sub);
+    listing.append(line, length);
+    listing.push_back('\0');
+  };
+  for (size_t i = 0; i < entries; ++i) {
+    if (i == 0) add_tree("src", 0, 0);
+    if (i % 10000 == 0) add_tree("src/module%zu", i / 10000, 0);
+    if (i % 100 == 0) {
+      add_tree("src/module%zu/sub%zu", i / 10000, (i / 100) % 100);
+    }
+    int length =
+        snprintf(line, sizeof(line),
+                 "100644 blob %040zx %7zu\tsrc/module%zu/sub%zu/file%zu.cc", i,
+                 i % 65536, i / 10000, (i / 100) % 100, i % 100);
+    listing.append(line, length);
+    listing.push_back('\0');
+  }
+  return listing;
+}
+
+// Unlike assert, also checked with NDEBUG, for calls that have to run.
+void Check(bool ok, const char* what) {
+  if (!ok) {
+    std::cerr << what << " failed" << std::endl;
+    exit(1);
+  }
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  const size_t entries = argc > 1 ? atoi(argv[1]) : 1000000;
+  const std::string listing = SyntheticListing(entries);
+
+  auto begin = std::chrono::steady_clock::now();
+  auto container = std::make_unique<directory_container::DirectoryContainer>();
+  size_t count = 0;
+  std::string file_path("/");
+  LineSplitter splitter('\0', [&](std::string_view line) {
+    gitlstree::LsTreeEntry entry;
+    const bool parsed = gitlstree::ParseLsTreeLine(line, &entry);
+    Check(parsed, "ParseLsTreeLine");
+    // Directories are created for the files.
+    if (entry.type != "blob") return;
+    file_path.resize(1);
+    file_path.append(entry.path);
+    container->add(file_path, std::make_unique<gitlstree::FileElement>(
+                                  entry.mode, std::string(entry.sha1),
+                                  entry.size, nullptr));
+    ++count;
+  });
+  // Feed in pipe sized chunks.
+  constexpr size_t kChunkSize = 65536;
+  std::string_view input(listing);
+  for (size_t i = 0; i < input.size(); i += kChunkSize) {
+    splitter.Feed(input.substr(i, kChunkSize));
+  }
+  splitter.Flush();
+  auto end = std::chrono::steady_clock::now();
+  assert(count == entries);
+
+  double seconds = std::chrono::duration<double>(end - begin).count();
+  std::cout << count << " entries in " << seconds << " s, "
+            << static_cast<size_t>(count / seconds) << " entries/s"
+            << std::endl;
+
+  // The same entries from a tree index.
+  const std::string index_dir = GetCurrentDir() + "/out/gitlstree_benchmark_dir/";
+  const char kTree[] = "0000000000000000000000000000000000000000";
+  {
+    TreeIndex::Writer writer;
+    LineSplitter index_splitter('\0', [&writer](std::string_view line) {
+      gitlstree::LsTreeEntry entry;
+      const bool parsed = gitlstree::ParseLsTreeLine(line, &entry);
+      Check(parsed, "ParseLsTreeLine");
+      writer.Add(TreeIndex::Entry{entry.mode, entry.type, entry.sha1,
+                                  entry.size, entry.path});
+    });
+    index_splitter.Feed(listing);
+    index_splitter.Flush();
+    const bool committed = writer.Commit(index_dir, kTree);
+    Check(committed, "TreeIndex::Writer::Commit");
+  }
+  // Not timing the destruction.
+  container.reset();
+  begin = std::chrono::steady_clock::now();
+  container = std::make_unique<directory_container::DirectoryContainer>();
+  count = 0;
+  auto index = TreeIndex::Open(index_dir, kTree);
+  Check(index != nullptr, "TreeIndex::Open");
+  index->for_each([&](const TreeIndex::Entry& entry) {
+    if (entry.type != "blob") return;
+    file_path.resize(1);
+    file_path.append(entry.path);
+    container->add(file_path, std::make_unique<gitlstree::FileElement>(
+                                  entry.mode, std::string(entry.sha1),
+                                  entry.size, nullptr));
+    ++count;
+  });
+  end = std::chrono::steady_clock::now();
+  assert(count == entries);
+  seconds = std::chrono::duration<double>(end - begin).count();
+  std::cout << count << " entries from tree index in " << seconds << " s, "
+            << static_cast<size_t>(count / seconds) << " entries/s"
+            << std::endl;
+
+  if (argc > 2) {
+    const std::string cache_dir = index_dir + "cache/";
+    for (const char* state : {"cold", "warm"}) {
+      if (state == std::string("cold")) {
+        // Remove the tree index left from earlier runs.
+        const int removed = system(("rm -rf " + cache_dir + "trees/").c_str());
+        Check(removed == 0, "rm");
+      }
+      container.reset();
+      begin = std::chrono::steady_clock::now();
+      container = std::make_unique<directory_container::DirectoryContainer>();
+      auto git = gitlstree::GitTree::NewGitTree(argv[2], "HEAD", "", cache_dir,
+                                                container.get());
+      Check(git != nullptr, "NewGitTree");
+      end = std::chrono::steady_clock::now();
+      std::cout << state << " mount of " << argv[2] << " in "
+                << std::chrono::duration<double>(end - begin).count() << " s"
+                << std::endl;
+    }
+  }
+  return 0;
+}
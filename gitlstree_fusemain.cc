@@ -3,11 +3,14 @@
 #include <fuse.h>
 #include <stddef.h>
 
+#include <algorithm>
 #include <memory>
 
 #include "get_current_dir.h"
 #include "git_adapter.h"
+#include "git_adapter_lowlevel.h"
 #include "gitlstree.h"
+#include "strutil.h"
 
 using std::string;
 
@@ -16,6 +19,8 @@ namespace gitlstree {
 static int fs_ioctl(const char *path, unsigned int cmd, void *arg,
                     struct fuse_file_info *fi, unsigned int flags, void *data) {
   if (flags & FUSE_IOCTL_COMPAT) return -ENOSYS;
+  // Directory handles are not Files.
+  if (flags & FUSE_IOCTL_DIR) return -ENOENT;
 
   const auto fe = dynamic_cast<FileElement *>(
       reinterpret_cast<directory_container::File *>(fi->fh));
@@ -32,6 +37,18 @@ static int fs_ioctl(const char *path, unsigned int cmd, void *arg,
   return -EINVAL;
 }
 
+static void fs_ll_ioctl(fuse_req_t req, fuse_ino_t ino, unsigned int cmd,
+                        void *arg, struct fuse_file_info *fi, unsigned flags,
+                        const void *in_buf, size_t in_bufsz, size_t out_bufsz) {
+  GetHashIoctlArg data;
+  int ret = fs_ioctl(nullptr, cmd, arg, fi, flags, &data);
+  if (ret < 0) {
+    fuse_reply_err(req, -ret);
+    return;
+  }
+  fuse_reply_ioctl(req, ret, &data, std::min(sizeof(data), out_bufsz));
+}
+
 }  // namespace gitlstree
 
 struct gitlstree_config {
@@ -39,6 +56,19 @@ struct gitlstree_config {
   char *path{nullptr};
   char *revision{nullptr};
   char *cache_path{nullptr};
+  int lazy_tree{0};
+  int cat_file_processes{1};
+  int prefetch{0};
+  int prefetch_rate_kib{0};
+  char *prefetch_priority{nullptr};
+  int max_mapped_mib{0};
+  int max_mappings{0};
+  int packed_cache{0};
+  int max_cache_mib{0};
+  int immutable{0};
+  int lowlevel{0};
+  int multi_revision{0};
+  int progressive_reads{0};
 };
 
 #define MYFS_OPT(t, p, v) \
@@ -47,15 +77,22 @@ struct gitlstree_config {
 static struct fuse_opt gitlstree_opts[] = {
     MYFS_OPT("--ssh=%s", ssh, 0), MYFS_OPT("--path=%s", path, 0),
     MYFS_OPT("--revision=%s", revision, 0),
-    MYFS_OPT("--cache_path=%s", cache_path, 0), FUSE_OPT_END};
+    MYFS_OPT("--cache_path=%s", cache_path, 0),
+    MYFS_OPT("--lazy_tree", lazy_tree, 1),
+    MYFS_OPT("--cat_file_processes=%d", cat_file_processes, 0),
+    MYFS_OPT("--prefetch", prefetch, 1),
+    MYFS_OPT("--prefetch_rate_kib=%d", prefetch_rate_kib, 0),
+    MYFS_OPT("--prefetch_priority=%s", prefetch_priority, 0),
+    MYFS_OPT("--max_mapped_mib=%d", max_mapped_mib, 0),
+    MYFS_OPT("--max_mappings=%d", max_mappings, 0),
+    MYFS_OPT("--packed_cache", packed_cache, 1),
+    MYFS_OPT("--max_cache_mib=%d", max_cache_mib, 0),
+    MYFS_OPT("--immutable", immutable, 1),
+    MYFS_OPT("--lowlevel", lowlevel, 1),
+    MYFS_OPT("--multi_revision", multi_revision, 1),
+    MYFS_OPT("--progressive_reads", progressive_reads, 1), FUSE_OPT_END};
 
 int main(int argc, char *argv[]) {
-  struct fuse_operations o = git_adapter::GetFuseOperations();
-
-#define DEFINE_HANDLER(n) o.n = &gitlstree::fs_##n
-  DEFINE_HANDLER(ioctl);
-#undef DEFINE_HANDLER
-
   fuse_args args = FUSE_ARGS_INIT(argc, argv);
   gitlstree_config conf{};
   fuse_opt_parse(&args, &conf, gitlstree_opts, nullptr);
@@ -66,14 +103,57 @@ int main(int argc, char *argv[]) {
   string cache_path(conf.cache_path ? conf.cache_path
                                     : GetCurrentDir() + "/.cache/");
 
+  gitlstree::GitTree::Config git_config;
+  git_config.lazy_tree = conf.lazy_tree;
+  git_config.multi_revision = conf.multi_revision;
+  git_config.progressive_reads = conf.progressive_reads;
+  git_config.cat_file_processes = std::max(conf.cat_file_processes, 1);
+  git_config.prefetch = conf.prefetch;
+  git_config.prefetch_config.bytes_per_second =
+      std::max(conf.prefetch_rate_kib, 0) * 1024;
+  if (conf.prefetch_priority) {
+    git_config.prefetch_config.priority_paths =
+        SplitStringUsing(conf.prefetch_priority, ',', true);
+  }
+  if (conf.max_mapped_mib > 0) {
+    git_config.cache_config.max_mapped_bytes =
+        static_cast<size_t>(conf.max_mapped_mib) << 20;
+  }
+  if (conf.max_mappings > 0) {
+    git_config.cache_config.max_mappings = conf.max_mappings;
+  }
+  git_config.cache_config.packed = conf.packed_cache;
+  if (conf.max_cache_mib > 0) {
+    git_config.cache_config.max_cache_bytes =
+        static_cast<size_t>(conf.max_cache_mib) << 20;
+  }
   auto git = gitlstree::GitTree::NewGitTree(
-      path, revision, ssh, cache_path, git_adapter::GetDirectoryContainer());
+      path, revision, ssh, cache_path, git_adapter::GetDirectoryContainer(),
+      git_config);
   if (!git.get()) {
     fprintf(stderr, "Loading directory %s failed\n", path.c_str());
     return EXIT_FAILURE;
   }
+  git_adapter::GetDirectoryContainer()->Freeze();
+
+  git_adapter::Config adapter_config;
+  adapter_config.immutable = conf.immutable;
+  adapter_config.on_init = [&git]() { git->StartBackgroundWork(); };
+  int ret;
+  if (conf.lowlevel) {
+    fuse_lowlevel_ops o =
+        git_adapter::GetFuseLowlevelOperations(adapter_config);
+    o.ioctl = &gitlstree::fs_ll_ioctl;
+    ret = git_adapter::LowlevelMain(&args, o);
+  } else {
+    struct fuse_operations o = git_adapter::GetFuseOperations(adapter_config);
 
-  int ret = fuse_main(args.argc, args.argv, &o, nullptr);
+#define DEFINE_HANDLER(n) o.n = &gitlstree::fs_##n
+    DEFINE_HANDLER(ioctl);
+#undef DEFINE_HANDLER
+
+    ret = fuse_main(args.argc, args.argv, &o, nullptr);
+  }
   fuse_opt_free_args(&args);
   return ret;
 }
@@ -1,8 +1,13 @@
 #include <assert.h>
+#include <stdlib.h>
 #include <sys/stat.h>
+#include <unistd.h>
+
+#include <future>
 #include <iostream>
 #include <memory>
 #include <string>
+#include <vector>
 
 #define FUSE_USE_VERSION 32
 
@@ -32,11 +37,11 @@ void TryReadFileTest(directory_container::DirectoryContainer* fs,
   cout << f << endl;
 }
 
-void ScenarioTest() {
+void ScenarioTest(const gitlstree::GitTree::Config& config) {
   auto fs = std::make_unique<directory_container::DirectoryContainer>();
   auto git = gitlstree::GitTree::NewGitTree(
       GetCurrentDir() + "/out/fetch_test_repo/gitlstreefs", "HEAD", "",
-      GetCurrentDir() + "/out/gitlstree_test_cache/", fs.get());
+      GetCurrentDir() + "/out/gitlstree_test_cache/", fs.get(), config);
   fs->dump();
 
   assert(fs->get("/dummytestdirectory/README") != nullptr);
@@ -56,9 +61,202 @@ void ScenarioTest() {
   TryReadFileTest(fs.get(), "/dummytestdirectory/README");
 }
 
+void LazyTreeTest() {
+  auto fs = std::make_unique<directory_container::DirectoryContainer>();
+  gitlstree::GitTree::Config config;
+  config.lazy_tree = true;
+  auto git = gitlstree::GitTree::NewGitTree(
+      GetCurrentDir() + "/out/fetch_test_repo/gitlstreefs", "HEAD", "",
+      GetCurrentDir() + "/out/gitlstree_test_cache/", fs.get(), config);
+  // Only the root tree is loaded at this point.
+  assert(fs->is_directory("/testdata"));
+  int count = 0;
+  fs->for_each("/testdata",
+               [&count](const string&, const directory_container::File*) {
+                 count++;
+               });
+  assert(count > 0);
+}
+
+void PrefetchTest() {
+  auto fs = std::make_unique<directory_container::DirectoryContainer>();
+  gitlstree::GitTree::Config config;
+  config.prefetch = true;
+  config.prefetch_config.priority_paths = {"/dummytestdirectory/"};
+  auto git = gitlstree::GitTree::NewGitTree(
+      GetCurrentDir() + "/out/fetch_test_repo/gitlstreefs", "HEAD", "",
+      GetCurrentDir() + "/out/gitlstree_test_cache/", fs.get(), config);
+  git->StartBackgroundWork();
+  git->prefetcher()->WaitIdle();
+  TryReadFileTest(fs.get(), "/dummytestdirectory/README");
+
+  auto status = fs->mutable_get("/.status");
+  struct stat st;
+  assert(status->Getattr(&st) == 0);
+  string content(st.st_size, '\0');
+  assert(status->Read(content.data(), content.size(), 0) == st.st_size);
+  assert(content.find("prefetch: ") != string::npos);
+  assert(content.find(" 0 failed done") != string::npos);
+}
+
+void MultiRevisionTest() {
+  auto fs = std::make_unique<directory_container::DirectoryContainer>();
+  gitlstree::GitTree::Config config;
+  config.multi_revision = true;
+  const string gitdir = GetCurrentDir() + "/out/fetch_test_repo/gitlstreefs";
+  auto git = gitlstree::GitTree::NewGitTree(
+      gitdir, "", "", GetCurrentDir() + "/out/gitlstree_test_cache/", fs.get(),
+      config);
+  int exit_code;
+  string head = git->RunGitCommand({"git", "rev-parse", "HEAD"}, &exit_code,
+                                   "rev-parse");
+  assert(exit_code == 0);
+  head.resize(head.size() - 1);
+
+  auto count_root = [&fs]() {
+    int count = 0;
+    fs->for_each("/", [&count](const string&,
+                               const directory_container::File*) { count++; });
+    return count;
+  };
+  // Revisions are resolved when they are looked up.
+  assert(count_root() == 1);
+  TryReadFileTest(fs.get(), "/HEAD/dummytestdirectory/README");
+  assert(fs->is_directory("/" + head + "/dummytestdirectory"));
+  // The same tree is the same directory.
+  assert(fs->get("/HEAD/dummytestdirectory") ==
+         fs->get("/" + head + "/dummytestdirectory"));
+  assert(fs->get("/HEAD/dummytestdirectory/README") ==
+         fs->get("/" + head + "/dummytestdirectory/README"));
+
+  assert(!fs->get("/no-such-revision"));
+  assert(!fs->get("/no-such-revision"));
+  assert(!fs->get("/HEAD;true"));
+  assert(!fs->get("/HEAD/no-such-file"));
+  // .status, HEAD and the hash.
+  assert(count_root() == 3);
+
+  // Concurrent first lookups of a revision all find it.
+  const string short_head = "/" + head.substr(0, 12);
+  std::vector<std::future<const directory_container::File*>> lookups;
+  for (int i = 0; i < 8; ++i) {
+    lookups.emplace_back(std::async(std::launch::async, [&fs, &short_head]() {
+      return fs->get(short_head);
+    }));
+  }
+  const directory_container::File* found = fs->get(short_head);
+  assert(found);
+  for (auto& lookup : lookups) assert(lookup.get() == found);
+  assert(count_root() == 4);
+}
+
+void TreeIndexTest() {
+  const string cache_dir = GetCurrentDir() + "/out/gitlstree_tree_index_cache/";
+  assert(system(("rm -rf " + cache_dir).c_str()) == 0);
+  string tree_index;
+  // Listed with git the first time, and from the tree index after.
+  for (int i = 0; i < 2; ++i) {
+    auto fs = std::make_unique<directory_container::DirectoryContainer>();
+    auto git = gitlstree::GitTree::NewGitTree(
+        GetCurrentDir() + "/out/fetch_test_repo/gitlstreefs", "HEAD", "",
+        cache_dir, fs.get());
+    assert(git);
+    if (i == 0) {
+      int exit_code;
+      tree_index = cache_dir + "trees/" +
+                   git->RunGitCommand({"git", "rev-parse", "HEAD^{tree}"},
+                                      &exit_code, "rev-parse");
+      tree_index.resize(tree_index.size() - 1);
+    }
+    struct stat st;
+    assert(stat(tree_index.c_str(), &st) == 0);
+    assert(fs->is_directory("/dummytestdirectory"));
+    assert(fs->get("/.git/HEAD") != nullptr);
+    TryReadFileTest(fs.get(), "/dummytestdirectory/README");
+  }
+}
+
+void SharedSubtreeTest(const gitlstree::GitTree::Config& config) {
+  const string gitdir = GetCurrentDir() + "/out/gitlstree_shared_subtree";
+  // Two copies of the same directory, and a different one. And a blob
+  // large enough to be streamed into the cache.
+  assert(system(("rm -rf " + gitdir + " && mkdir -p " + gitdir +
+                 "/a/sub && cd " + gitdir +
+                 " && git init -q && echo hello > a/sub/file && "
+                 "cp -r a b && cp -r a c && echo world > c/sub/file && "
+                 "yes | head -c 3000000 > large && "
+                 "git add . && git -c user.name=test -c user.email=test "
+                 "commit -q -m test")
+                    .c_str()) == 0);
+  auto fs = std::make_unique<directory_container::DirectoryContainer>();
+  auto git = gitlstree::GitTree::NewGitTree(
+      gitdir, "HEAD", "", GetCurrentDir() + "/out/gitlstree_test_cache/",
+      fs.get(), config);
+  assert(fs->is_directory("/b/sub"));
+  assert(fs->get("/a") == fs->get("/b"));
+  assert(fs->get("/a/sub/file") == fs->get("/b/sub/file"));
+  assert(fs->get("/a") != fs->get("/c"));
+  assert(fs->get("/a/sub/file") != fs->get("/c/sub/file"));
+  assert(!fs->get("/b/sub/no-such-file"));
+  TryReadFileTest(fs.get(), "/b/sub/file");
+
+  auto large = dynamic_cast<gitlstree::FileElement*>(fs->mutable_get("/large"));
+  assert(large->Open() == 0);
+  char buf[4];
+  assert(large->Read(buf, sizeof(buf), 3000000 - 4) == sizeof(buf));
+  assert(string(buf, sizeof(buf)) == "y\ny\n");
+  assert(large->Release() == 0);
+}
+
+// Large blobs read while they arrive, from the repository of
+// SharedSubtreeTest.
+void ProgressiveReadTest() {
+  const string gitdir = GetCurrentDir() + "/out/gitlstree_shared_subtree";
+  const string cache_dir =
+      GetCurrentDir() + "/out/gitlstree_test_progressive_cache/";
+  assert(system(("rm -rf " + cache_dir).c_str()) == 0);
+  gitlstree::GitTree::Config config;
+  config.progressive_reads = true;
+  auto fs = std::make_unique<directory_container::DirectoryContainer>();
+  auto git = gitlstree::GitTree::NewGitTree(gitdir, "HEAD", "", cache_dir,
+                                            fs.get(), config);
+  auto large = dynamic_cast<gitlstree::FileElement*>(fs->mutable_get("/large"));
+  for (int i = 0; i < 2; ++i) {
+    // Uncached the first time, and from the cache the second time.
+    assert(large->Open() == 0);
+    char buf[4];
+    assert(large->Read(buf, sizeof(buf), 0) == sizeof(buf));
+    assert(string(buf, sizeof(buf)) == "y\ny\n");
+    assert(large->Read(buf, sizeof(buf), 3000000 - 2) == 2);
+    assert(string(buf, 2) == "y\n");
+    assert(large->Read(buf, sizeof(buf), 3000000) == 0);
+    int fd;
+    off_t fd_offset;
+    assert(large->ReadFd(sizeof(buf), 3000000 - 4, &fd, &fd_offset) == 4);
+    assert(pread(fd, buf, sizeof(buf), fd_offset) == 4);
+    assert(string(buf, sizeof(buf)) == "y\ny\n");
+    assert(large->Release() == 0);
+  }
+  // Small files are read as before.
+  TryReadFileTest(fs.get(), "/a/sub/file");
+}
+
 int main(int argc, char** argv) {
   int iter = argv[1] ? atoi(argv[1]) : 1;
   for (int i = 0; i < iter; ++i) {
-    ScenarioTest();
+    ScenarioTest(gitlstree::GitTree::Config());
   }
+  LazyTreeTest();
+  gitlstree::GitTree::Config config;
+  config.lazy_tree = true;
+  config.cat_file_processes = 2;
+  ScenarioTest(config);
+  PrefetchTest();
+  MultiRevisionTest();
+  TreeIndexTest();
+  SharedSubtreeTest(gitlstree::GitTree::Config());
+  // From the tree index.
+  SharedSubtreeTest(gitlstree::GitTree::Config());
+  SharedSubtreeTest(config);
+  ProgressiveReadTest();
 }
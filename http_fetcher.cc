@@ -0,0 +1,244 @@
+#include "http_fetcher.h"
+
+#include <assert.h>
+#include <curl/curl.h>
+
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+using std::lock_guard;
+using std::mutex;
+using std::string;
+using std::unique_lock;
+
+namespace {
+
+class CurlFetcher : public HttpFetcher {
+ public:
+  explicit CurlFetcher(const Config& config);
+  virtual ~CurlFetcher() override;
+
+  virtual bool FetchStreaming(
+      const string& url,
+      std::function<void(std::string_view data)> on_data) override;
+
+ private:
+  struct Request {
+    Request(CurlFetcher* f, const string& u) : fetcher(f), url(u) {}
+    CurlFetcher* const fetcher;
+    const string& url;
+    // Set once handed to multi_.
+    CURL* easy{};
+    // Received and not yet passed on.
+    string data{};
+    // Write() refused data as too much was buffered.
+    bool paused{};
+    bool done{};
+    bool ok{};
+    std::condition_variable cv{};
+  };
+
+  static size_t Write(char* data, size_t size, size_t count, void* request);
+  // Start the requests that are waiting. Called with mutex_ held.
+  void AddPendingLocked();
+  // Report the requests that completed.
+  void FinishCompleted();
+  // Remove |easy| from multi_ and report its request done.
+  void Finish(CURL* easy, bool ok);
+  void Run();
+
+  const Config config_;
+  CURLM* const multi_;
+  // Guards the requests as well.
+  mutex mutex_{};
+  // Requests not yet handed to multi_.
+  std::deque<Request*> pending_{};
+  // Paused requests whose caller has taken the data.
+  std::vector<Request*> resume_{};
+  // Handles in multi_, only used on thread_.
+  std::unordered_set<CURL*> running_{};
+  // Threads in FetchStreaming, which the destructor waits for.
+  int callers_{};
+  std::condition_variable callers_cv_{};
+  bool stop_{};
+  std::thread thread_{};
+  DISALLOW_COPY_AND_ASSIGN(CurlFetcher);
+};
+
+CurlFetcher::CurlFetcher(const Config& config)
+    : config_(config), multi_(curl_multi_init()) {
+  assert(multi_);
+  curl_multi_setopt(multi_, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+  curl_multi_setopt(multi_, CURLMOPT_MAX_HOST_CONNECTIONS,
+                    config_.max_host_connections);
+  thread_ = std::thread([this]() { Run(); });
+}
+
+CurlFetcher::~CurlFetcher() {
+  {
+    lock_guard<mutex> l(mutex_);
+    stop_ = true;
+  }
+  curl_multi_wakeup(multi_);
+  thread_.join();
+  curl_multi_cleanup(multi_);
+  // The requests have failed, wait for their callers to return.
+  unique_lock<mutex> l(mutex_);
+  callers_cv_.wait(l, [this]() { return callers_ == 0; });
+}
+
+bool CurlFetcher::FetchStreaming(
+    const string& url, std::function<void(std::string_view data)> on_data) {
+  Request request(this, url);
+  {
+    lock_guard<mutex> l(mutex_);
+    if (stop_) return false;
+    pending_.push_back(&request);
+    callers_++;
+  }
+  curl_multi_wakeup(multi_);
+  unique_lock<mutex> l(mutex_);
+  while (true) {
+    request.cv.wait(
+        l, [&request]() { return request.done || !request.data.empty(); });
+    if (request.data.empty()) break;
+    // Handled without blocking the transfer.
+    string data;
+    data.swap(request.data);
+    const bool resume = request.paused && !request.done;
+    if (resume) {
+      request.paused = false;
+      resume_.push_back(&request);
+    }
+    l.unlock();
+    if (resume) curl_multi_wakeup(multi_);
+    on_data(data);
+    l.lock();
+  }
+  if (--callers_ == 0) callers_cv_.notify_all();
+  return request.ok;
+}
+
+size_t CurlFetcher::Write(char* data, size_t size, size_t count,
+                          void* r) {
+  Request* request = static_cast<Request*>(r);
+  {
+    CurlFetcher* fetcher = request->fetcher;
+    lock_guard<mutex> l(fetcher->mutex_);
+    if (request->data.size() >= fetcher->config_.max_buffered_bytes) {
+      // Passed again once resumed.
+      request->paused = true;
+      return CURL_WRITEFUNC_PAUSE;
+    }
+    request->data.append(data, size * count);
+  }
+  request->cv.notify_one();
+  return size * count;
+}
+
+void CurlFetcher::AddPendingLocked() {
+  while (!pending_.empty()) {
+    Request* request = pending_.front();
+    pending_.pop_front();
+    CURL* easy = curl_easy_init();
+    curl_easy_setopt(easy, CURLOPT_URL, request->url.c_str());
+    curl_easy_setopt(easy, CURLOPT_USERAGENT, config_.user_agent.c_str());
+    curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, Write);
+    curl_easy_setopt(easy, CURLOPT_WRITEDATA, request);
+    curl_easy_setopt(easy, CURLOPT_PRIVATE, request);
+    // Any encoding curl can decode; JSON compresses well.
+    curl_easy_setopt(easy, CURLOPT_ACCEPT_ENCODING, "");
+    curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1L);
+    // Rather wait for a connection being set up to multiplex over than
+    // open another.
+    curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);
+    curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(easy, CURLOPT_TIMEOUT, config_.timeout_seconds);
+    request->easy = easy;
+    curl_multi_add_handle(multi_, easy);
+    running_.insert(easy);
+  }
+}
+
+void CurlFetcher::FinishCompleted() {
+  int queued;
+  while (CURLMsg* message = curl_multi_info_read(multi_, &queued)) {
+    if (message->msg != CURLMSG_DONE) continue;
+    CURL* easy = message->easy_handle;
+    const CURLcode result = message->data.result;
+    if (result != CURLE_OK) {
+      Request* request;
+      curl_easy_getinfo(easy, CURLINFO_PRIVATE, &request);
+      std::cerr << request->url << ": " << curl_easy_strerror(result)
+                << std::endl;
+    }
+    Finish(easy, result == CURLE_OK);
+  }
+}
+
+void CurlFetcher::Finish(CURL* easy, bool ok) {
+  Request* request;
+  curl_easy_getinfo(easy, CURLINFO_PRIVATE, &request);
+  curl_multi_remove_handle(multi_, easy);
+  curl_easy_cleanup(easy);
+  running_.erase(easy);
+  lock_guard<mutex> l(mutex_);
+  // Paused requests can time out before being resumed.
+  std::erase(resume_, request);
+  request->done = true;
+  request->ok = ok;
+  // Under the lock, as the request is gone once its thread sees done.
+  request->cv.notify_one();
+}
+
+void CurlFetcher::Run() {
+  int running = 0;
+  std::vector<Request*> resume;
+  while (true) {
+    {
+      lock_guard<mutex> l(mutex_);
+      if (stop_) break;
+      AddPendingLocked();
+      resume.swap(resume_);
+    }
+    // Without the lock, as the data may be passed to Write() right
+    // away.
+    for (Request* request : resume) {
+      curl_easy_pause(request->easy, CURLPAUSE_CONT);
+    }
+    resume.clear();
+    curl_multi_perform(multi_, &running);
+    FinishCompleted();
+    // Until there is something to do, or a new request.
+    curl_multi_poll(multi_, nullptr, 0, 1000, nullptr);
+  }
+  // Nothing should be waiting when destroyed, but don't leave anyone
+  // hanging.
+  while (!running_.empty()) Finish(*running_.begin(), false);
+  lock_guard<mutex> l(mutex_);
+  for (Request* request : pending_) {
+    request->done = true;
+    request->cv.notify_one();
+  }
+  pending_.clear();
+  resume_.clear();
+}
+
+}  // namespace
+
+bool HttpFetcher::Fetch(const string& url, string* body) {
+  body->clear();
+  return FetchStreaming(url,
+                        [body](std::string_view data) { body->append(data); });
+}
+
+std::unique_ptr<HttpFetcher> HttpFetcher::New(const Config& config) {
+  static std::once_flag once;
+  std::call_once(once, []() { curl_global_init(CURL_GLOBAL_DEFAULT); });
+  return std::make_unique<CurlFetcher>(config);
+}
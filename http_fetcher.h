@@ -0,0 +1,58 @@
+#ifndef HTTP_FETCHER_H_
+#define HTTP_FETCHER_H_
+/**
+ * HTTP GET client for the GitHub API, in process instead of running a
+ * curl command per request.
+ *
+ * The default implementation drives libcurl from one thread: requests
+ * from any thread are added to a curl multi handle, whose connection
+ * cache keeps connections alive between requests, and which multiplexes
+ * concurrent requests over one HTTP/2 connection where the server
+ * supports it.
+ */
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "disallow.h"
+
+class HttpFetcher {
+ public:
+  struct Config {
+    Config() {}
+
+    std::string user_agent{
+        "git-githubfs(https://github.com/dancerj/gitlstreefs)"};
+    // Connections kept open to one host. Further requests wait for one
+    // to be free, or share one over HTTP/2.
+    long max_host_connections{6};
+    // For a whole request, 0 for no limit.
+    long timeout_seconds{0};
+    // Received data not yet taken by the caller of a request, above
+    // which its transfer is paused until the caller catches up.
+    size_t max_buffered_bytes{1 << 20};
+  };
+
+  HttpFetcher() {}
+  virtual ~HttpFetcher() {}
+
+  // Fetch |url|, passing the body to |on_data| in pieces as it
+  // arrives, on the calling thread. Thread safe. Returns false if there
+  // was no complete response, or the fetcher is destroyed meanwhile;
+  // error statuses return true with the body, which describes the error
+  // for the GitHub API.
+  virtual bool FetchStreaming(
+      const std::string& url,
+      std::function<void(std::string_view data)> on_data) = 0;
+  // Same, into |body|.
+  bool Fetch(const std::string& url, std::string* body);
+
+  // The libcurl implementation.
+  static std::unique_ptr<HttpFetcher> New(const Config& config = Config());
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(HttpFetcher);
+};
+
+#endif
@@ -0,0 +1,145 @@
+#include "http_fetcher.h"
+
+#include <assert.h>
+#include <fcntl.h>
+
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "local_http_server.h"
+#include "strutil.h"
+
+using std::string;
+
+namespace {
+// Serves /testdata/<file>.
+int ServeTestdata(const string& target, string* body) {
+  const string prefix = "/testdata/";
+  if (target.compare(0, prefix.size(), prefix) != 0 ||
+      target.find("..") != string::npos ||
+      access(target.c_str() + 1, R_OK) != 0) {
+    *body = "{\"message\": \"Not Found\"}";
+    return 404;
+  }
+  *body = ReadFromFileOrDie(AT_FDCWD, target.substr(1));
+  return 200;
+}
+
+void SequentialTest() {
+  LocalHttpServer server(ServeTestdata);
+  auto fetcher = HttpFetcher::New();
+  const string commit = ReadFromFileOrDie(AT_FDCWD, "testdata/commit.json");
+  string body;
+  for (int i = 0; i < 10; ++i) {
+    assert(fetcher->Fetch(server.url() + "/testdata/commit.json", &body));
+    assert(body == commit);
+  }
+  // Errors come with a body.
+  assert(fetcher->Fetch(server.url() + "/testdata/none.json", &body));
+  assert(body == "{\"message\": \"Not Found\"}");
+  assert(server.requests() == 11);
+  // One connection kept alive for all of them.
+  assert(server.connections() == 1);
+}
+
+void StreamingTest() {
+  LocalHttpServer server(ServeTestdata);
+  auto fetcher = HttpFetcher::New();
+  string body;
+  assert(fetcher->FetchStreaming(
+      server.url() + "/testdata/trees.json",
+      [&body](std::string_view data) { body.append(data); }));
+  assert(body == ReadFromFileOrDie(AT_FDCWD, "testdata/trees.json"));
+}
+
+void ConcurrentTest() {
+  LocalHttpServer server(ServeTestdata);
+  HttpFetcher::Config config;
+  config.max_host_connections = 4;
+  auto fetcher = HttpFetcher::New(config);
+  const string trees = ReadFromFileOrDie(AT_FDCWD, "testdata/trees.json");
+  std::vector<std::future<string>> results;
+  for (int i = 0; i < 32; ++i) {
+    results.emplace_back(std::async(std::launch::async, [&]() {
+      string body;
+      assert(fetcher->Fetch(server.url() + "/testdata/trees.json", &body));
+      return body;
+    }));
+  }
+  for (auto& result : results) assert(result.get() == trees);
+  assert(server.requests() == 32);
+  assert(server.connections() <= 4);
+}
+
+void UnreachableTest() {
+  string url;
+  {
+    LocalHttpServer server(ServeTestdata);
+    url = server.url();
+  }
+  auto fetcher = HttpFetcher::New();
+  string body;
+  assert(!fetcher->Fetch(url + "/testdata/commit.json", &body));
+}
+// Transfers pause while the caller is behind, without losing data.
+void BackpressureTest() {
+  string large;
+  for (int i = 0; large.size() < 3000000; ++i) {
+    large += std::to_string(i) + "\n";
+  }
+  LocalHttpServer server([&large](const string& target, string* body) {
+    *body = large;
+    return 200;
+  });
+  HttpFetcher::Config config;
+  config.max_buffered_bytes = 1;
+  auto fetcher = HttpFetcher::New(config);
+  string body;
+  assert(fetcher->FetchStreaming(server.url() + "/large",
+                                 [&body](std::string_view data) {
+                                   std::this_thread::sleep_for(
+                                       std::chrono::microseconds(100));
+                                   body.append(data);
+                                 }));
+  assert(body == large);
+}
+
+// Requests in flight fail when the fetcher is destroyed.
+void DestroyTest() {
+  LocalHttpServer server([](const string& target, string* body) {
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    *body = "late";
+    return 200;
+  });
+  auto fetcher = HttpFetcher::New();
+  const string url = server.url() + "/slow";
+  std::vector<std::future<bool>> results;
+  for (int i = 0; i < 4; ++i) {
+    results.emplace_back(
+        std::async(std::launch::async, [f = fetcher.get(), &url]() {
+          string body;
+          return f->Fetch(url, &body);
+        }));
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  // Waits for the callers to return.
+  fetcher.reset();
+  for (auto& result : results) assert(!result.get());
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  SequentialTest();
+  StreamingTest();
+  ConcurrentTest();
+  UnreachableTest();
+  BackpressureTest();
+  DestroyTest();
+  return 0;
+}
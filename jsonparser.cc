@@ -2,321 +2,709 @@
 #include "jsonparser.h"
 
 #include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
 
+#include <algorithm>
+#include <array>
 #include <iostream>
-#include <map>
 #include <memory>
-#include <set>
 #include <vector>
 
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
 namespace jjson {
 
 const Value& Value::operator[](size_t pos) const {
-  return *dynamic_cast<const ArrayValue*>(this)->value_.at(pos).get();
+  assert(type_ == Type::kArray);
+  assert(pos < size_);
+  return static_cast<const Value*>(data_)[pos];
 }
 
-const Value& Value::operator[](const std::string& key) const {
-  return *dynamic_cast<const ObjectValue*>(this)->value_.find(key)->second;
+const Value& Value::operator[](std::string_view key) const {
+  return get(key);
 }
 
-const std::vector<std::unique_ptr<Value> >& Value::get_array() const {
-  return dynamic_cast<const ArrayValue*>(this)->value_;
+const Value* Value::find(std::string_view key) const {
+  assert(type_ == Type::kObject);
+  for (const Member& member : get_object()) {
+    if (member.key == key) return &member.value;
+  }
+  return nullptr;
 }
 
-const Value& Value::get(const std::string& key) const {
-  const auto o = dynamic_cast<const ObjectValue*>(this);
-  assert(o != nullptr);
-  const auto& it = o->value_.find(key);
-  assert(it != o->value_.end());
-  const auto& n = it->second;
-  assert(n.get() != nullptr);
-  return *n;
+const Value& Value::get(std::string_view key) const {
+  const Value* value = find(key);
+  assert(value != nullptr);
+  return *value;
 }
 
-const std::string& Value::get_string() const {
-  const auto s = dynamic_cast<const StringValue*>(this);
-  assert(s != nullptr);
-  return s->value_;
+std::span<const Value> Value::get_array() const {
+  assert(type_ == Type::kArray);
+  return std::span<const Value>(static_cast<const Value*>(data_), size_);
 }
 
-float Value::get_number() const {
-  const auto n = dynamic_cast<const NumberValue*>(this);
-  assert(n != nullptr);
-  return n->value_;
+std::span<const Member> Value::get_object() const {
+  assert(type_ == Type::kObject);
+  return std::span<const Member>(static_cast<const Member*>(data_), size_);
 }
 
-float Value::get_int() const {
-  assert(this != nullptr);
-  const auto n = dynamic_cast<const NumberValue*>(this);
-  assert(n != nullptr);
-  return static_cast<int>(n->value_);
+std::string_view Value::get_string() const {
+  assert(type_ == Type::kString);
+  return std::string_view(static_cast<const char*>(data_), size_);
+}
+
+double Value::get_number() const {
+  assert(type_ == Type::kNumber);
+  return number_;
+}
+
+int Value::get_int() const { return static_cast<int>(get_number()); }
+
+namespace {
+enum CharClass : uint8_t {
+  kWhitespace = 1,
+  kDigit = 2,
+  // Other characters that may appear in a number.
+  kNumberSign = 4,
+};
+
+constexpr std::array<uint8_t, 256> MakeCharClasses() {
+  std::array<uint8_t, 256> classes{};
+  for (unsigned char c : {' ', '\t', '\n', '\r'}) classes[c] = kWhitespace;
+  for (unsigned char c = '0'; c <= '9'; ++c) classes[c] = kDigit;
+  for (unsigned char c : {'-', '+', '.', 'e', 'E'}) classes[c] = kNumberSign;
+  return classes;
 }
 
-bool Value::is_true() const {
-  return dynamic_cast<const TrueValue*>(this) != nullptr;
+constexpr std::array<uint8_t, 256> kCharClasses = MakeCharClasses();
+
+bool IsWhitespace(char c) {
+  return kCharClasses[static_cast<unsigned char>(c)] & kWhitespace;
 }
-bool Value::is_false() const {
-  return dynamic_cast<const FalseValue*>(this) != nullptr;
+
+bool IsDigit(char c) {
+  return kCharClasses[static_cast<unsigned char>(c)] & kDigit;
 }
-bool Value::is_null() const {
-  return dynamic_cast<const NullValue*>(this) != nullptr;
+
+bool IsNumberChar(char c) {
+  return kCharClasses[static_cast<unsigned char>(c)] & (kDigit | kNumberSign);
 }
 
-namespace {
-class Parser {
-  // Internal class used from Parse() method to do the actual parsing.
- public:
-  explicit Parser(const std::string& s) : text_(s) {}
-  ~Parser() {}
-
-  std::unique_ptr<Value> ParseJsonText() {
-    SkipWhitespace();
-    std::unique_ptr<Value> v = ObtainValue();
-    SkipWhitespace();
-    return v;
+// Scanning a block of bytes at a time. Each of these returns the offset
+// of the first byte in [p, p + size) that is, or is not, of interest, or
+// |size| if there is none.
+
+size_t FindQuoteOrBackslashScalar(const char* p, size_t size) {
+  for (size_t i = 0; i < size; ++i) {
+    if (p[i] == '"' || p[i] == '\\') return i;
   }
+  return size;
+}
 
- private:
-  char Peek() const {
-    if (Eof()) return 0;
-    return text_[position_];
+size_t SkipWhitespaceScalar(const char* p, size_t size) {
+  for (size_t i = 0; i < size; ++i) {
+    if (!IsWhitespace(p[i])) return i;
   }
+  return size;
+}
 
-  // Returns true on usual case, if there's exceptional case of EOF
-  // already, returns false.
-  bool Skip() {
-    if (Eof()) return false;
-    position_++;
-    return true;
+#ifdef __SSE2__
+size_t FindQuoteOrBackslashSse2(const char* p, size_t size) {
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    const __m128i block =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+    const unsigned mask = _mm_movemask_epi8(_mm_or_si128(
+        _mm_cmpeq_epi8(block, quote), _mm_cmpeq_epi8(block, backslash)));
+    if (mask) return i + __builtin_ctz(mask);
   }
+  return i + FindQuoteOrBackslashScalar(p + i, size - i);
+}
 
-  char Get() {
-    if (Eof()) return 0;
-    return text_[position_++];
+size_t SkipWhitespaceSse2(const char* p, size_t size) {
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i newline = _mm_set1_epi8('\n');
+  const __m128i carriage_return = _mm_set1_epi8('\r');
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    const __m128i block =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+    const __m128i whitespace = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(block, space), _mm_cmpeq_epi8(block, tab)),
+        _mm_or_si128(_mm_cmpeq_epi8(block, newline),
+                     _mm_cmpeq_epi8(block, carriage_return)));
+    const unsigned mask = ~_mm_movemask_epi8(whitespace) & 0xffff;
+    if (mask) return i + __builtin_ctz(mask);
   }
+  return i + SkipWhitespaceScalar(p + i, size - i);
+}
 
-  bool Eof() const { return position_ >= text_.size(); }
+// AVX2 is not in the baseline the tree is built for, so it is compiled
+// for separately and used only when the CPU has it.
+__attribute__((target("avx2"))) size_t FindQuoteOrBackslashAvx2(
+    const char* p, size_t size) {
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i backslash = _mm256_set1_epi8('\\');
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    const __m256i block =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+    const unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(
+        _mm256_cmpeq_epi8(block, quote), _mm256_cmpeq_epi8(block, backslash)));
+    if (mask) return i + __builtin_ctz(mask);
+  }
+  return i + FindQuoteOrBackslashSse2(p + i, size - i);
+}
 
-  void ReportError(const std::string& error) {
-    // TODO: do useful error reporting.
-    std::cout << "Error: " << error << " at " << position_ << " in ["
-              << text_.substr(position_) << "]" << std::endl;
+__attribute__((target("avx2"))) size_t SkipWhitespaceAvx2(const char* p,
+                                                          size_t size) {
+  const __m256i space = _mm256_set1_epi8(' ');
+  const __m256i tab = _mm256_set1_epi8('\t');
+  const __m256i newline = _mm256_set1_epi8('\n');
+  const __m256i carriage_return = _mm256_set1_epi8('\r');
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    const __m256i block =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+    const __m256i whitespace = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(block, space),
+                        _mm256_cmpeq_epi8(block, tab)),
+        _mm256_or_si256(_mm256_cmpeq_epi8(block, newline),
+                        _mm256_cmpeq_epi8(block, carriage_return)));
+    const unsigned mask = ~_mm256_movemask_epi8(whitespace);
+    if (mask) return i + __builtin_ctz(mask);
   }
+  return i + SkipWhitespaceSse2(p + i, size - i);
+}
 
-  std::string Consume(const std::set<char>& valid) {
-    std::string data{};
-    data.reserve(16);
-    while (valid.find(Peek()) != valid.end()) {
-      data += Peek();
-      if (!Skip()) break;
-    }
-    // Replacing with substr didn't improve speed.
-    return data;
+bool HasAvx2() {
+  static const bool has_avx2 =
+      (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+  return has_avx2;
+}
+#endif
+
+size_t FindQuoteOrBackslash(const char* p, size_t size) {
+#ifdef __SSE2__
+  // Short strings are most common, don't bother with the wide version
+  // for those.
+  if (size >= 64 && HasAvx2()) return FindQuoteOrBackslashAvx2(p, size);
+  return FindQuoteOrBackslashSse2(p, size);
+#else
+  return FindQuoteOrBackslashScalar(p, size);
+#endif
+}
+
+size_t SkipWhitespace(const char* p, size_t size) {
+  // Mostly there is none or a single space.
+  if (size == 0 || !IsWhitespace(p[0])) return 0;
+  if (size == 1 || !IsWhitespace(p[1])) return 1;
+#ifdef __SSE2__
+  if (size >= 64 && HasAvx2()) return SkipWhitespaceAvx2(p, size);
+  return SkipWhitespaceSse2(p, size);
+#else
+  return SkipWhitespaceScalar(p, size);
+#endif
+}
+
+int HexValue(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// Read 4 hex digits at |p|, -1 if they are not.
+long ReadHex4(const char* p) {
+  long value = 0;
+  for (int i = 0; i < 4; ++i) {
+    const int digit = HexValue(p[i]);
+    if (digit < 0) return -1;
+    value = value * 16 + digit;
   }
+  return value;
+}
 
-  void SkipValid(const std::set<char>& valid) {
-    while (valid.find(Peek()) != valid.end()) {
-      if (!Skip()) break;
-    }
+void AppendUtf8(long code_point, std::string* out) {
+  if (code_point < 0x80) {
+    *out += static_cast<char>(code_point);
+  } else if (code_point < 0x800) {
+    *out += static_cast<char>(0xc0 | (code_point >> 6));
+    *out += static_cast<char>(0x80 | (code_point & 0x3f));
+  } else if (code_point < 0x10000) {
+    *out += static_cast<char>(0xe0 | (code_point >> 12));
+    *out += static_cast<char>(0x80 | ((code_point >> 6) & 0x3f));
+    *out += static_cast<char>(0x80 | (code_point & 0x3f));
+  } else {
+    *out += static_cast<char>(0xf0 | (code_point >> 18));
+    *out += static_cast<char>(0x80 | ((code_point >> 12) & 0x3f));
+    *out += static_cast<char>(0x80 | ((code_point >> 6) & 0x3f));
+    *out += static_cast<char>(0x80 | (code_point & 0x3f));
   }
+}
 
-  const std::set<char> valid_whitespace{0x20, 0x09, 0x0a, 0x0d};
+// Index of the '"' closing the string that |text| starts with, searching
+// from |from|, or npos with |from| updated to where to resume once more
+// text is available. Sets |escaped| if an escape was passed.
+size_t FindStringEnd(std::string_view text, size_t* from, bool* escaped) {
+  size_t i = *from;
+  while (true) {
+    i += FindQuoteOrBackslash(text.data() + i, text.size() - i);
+    if (i == text.size()) break;
+    if (text[i] == '"') return i;
+    *escaped = true;
+    // Skip the escaped character, which may be '"'.
+    if (i + 1 >= text.size()) break;
+    i += 2;
+  }
+  *from = i;
+  return std::string_view::npos;
+}
 
-  void SkipWhitespace() { SkipValid(valid_whitespace); }
+}  // anonymous namespace
 
-  const std::set<char> valid_number{'-', '+', '0', '1', '2', '3', '4',
-                                    '5', '6', '7', '8', '9', '.', 'E'};
+// Builds the values of a Document for Parse(). Values are collected in
+// scratch space until their array or object ends, and then copied to
+// the arena.
+class TreeBuilder : public Handler {
+ public:
+  TreeBuilder(std::string_view text, Document* document)
+      : text_(text), document_(document) {}
+  virtual ~TreeBuilder() {}
+
+  virtual void StartObject() override { Start(); }
+  virtual void EndObject() override {
+    const size_t start = End();
+    const size_t size = scratch_.size() - start;
+    Member* members = document_->arena_.NewArray<Member>(size);
+    std::copy(scratch_.begin() + start, scratch_.end(), members);
+    scratch_.resize(start);
+    Add(Value(Value::Type::kObject, Size(size), members));
+  }
+  virtual void Key(std::string_view key) override { key_ = Keep(key); }
+  virtual void StartArray() override { Start(); }
+  virtual void EndArray() override {
+    const size_t start = End();
+    const size_t size = scratch_.size() - start;
+    Value* values = document_->arena_.NewArray<Value>(size);
+    for (size_t i = 0; i < size; ++i) values[i] = scratch_[start + i].value;
+    scratch_.resize(start);
+    Add(Value(Value::Type::kArray, Size(size), values));
+  }
+  virtual void String(std::string_view value) override {
+    value = Keep(value);
+    Add(Value(Value::Type::kString, Size(value.size()), value.data()));
+  }
+  virtual void Number(double value) override { Add(Value(value)); }
+  virtual void Bool(bool value) override {
+    Add(Value(value ? Value::Type::kTrue : Value::Type::kFalse, 0, nullptr));
+  }
+  virtual void Null() override { Add(Value()); }
 
-  std::unique_ptr<Value> ObtainNumber() {
-    std::string number = Consume(valid_number);
-    // TODO: implement proper handling of JSON number format.
-    return std::make_unique<NumberValue>(strtof(number.c_str(), nullptr));
+ private:
+  static uint32_t Size(size_t size) {
+    assert(size <= UINT32_MAX);
+    return size;
   }
 
-  std::unique_ptr<Value> ObtainObject() {
-    if (Get() != '{') {
-      ReportError("Unexpected error.");
-      return nullptr;
-    }
-    SkipWhitespace();
-    std::map<std::string, std::unique_ptr<Value> > object;
-    while (!Eof()) {
-      if (Peek() == '}') {
-        Skip();
-        return std::make_unique<ObjectValue>(std::move(object));
-      }
-      auto key = ObtainString();
-      SkipWhitespace();
-      if (Get() != ':') {
-        ReportError("':' expected in Object.");
-        return nullptr;
-      }
-      SkipWhitespace();
-      auto value = ObtainValue();
-      SkipWhitespace();
+  void Start() { open_.push_back(Open{scratch_.size(), key_}); }
 
-      object.emplace(std::move(dynamic_cast<StringValue*>(key.get())->value_),
-                     move(value));
-      if (Peek() == '}') {
-        continue;
-      }
-      if (Peek() == ',') {
-        Skip();
-        SkipWhitespace();
-        continue;
-      }
-      ReportError("',' or '}' expected in Object.");
+  // Returns where the members or elements start in scratch_.
+  size_t End() {
+    const Open open = open_.back();
+    open_.pop_back();
+    // The key of the object or array itself.
+    key_ = open.key;
+    return open.start;
+  }
+
+  // Refer to the text where the string is in it as is, otherwise copy.
+  std::string_view Keep(std::string_view s) {
+    if (s.data() >= text_.data() &&
+        s.data() + s.size() <= text_.data() + text_.size()) {
+      return s;
     }
-    ReportError("Unexpected end reached while parsing Object.");
-    return nullptr;
+    return document_->arena_.CopyString(s);
   }
 
-  std::unique_ptr<Value> ObtainArray() {
-    if (Get() != '[') {
-      return nullptr;
+  void Add(const Value& value) {
+    if (open_.empty()) {
+      static_cast<Value&>(*document_) = value;
+    } else {
+      // Array elements have no key, which doesn't hurt.
+      scratch_.push_back(Member{key_, value});
     }
-    SkipWhitespace();
-    std::vector<std::unique_ptr<Value> > array;
+  }
 
-    while (!Eof()) {
-      if (Peek() == ']') {
-        Skip();
-        return std::make_unique<ArrayValue>(std::move(array));
-      }
+  const std::string_view text_;
+  Document* const document_;
+  // Members and elements of the open objects and arrays.
+  std::vector<Member> scratch_{};
+  // An object or array being built.
+  struct Open {
+    // Index in scratch_.
+    size_t start;
+    std::string_view key;
+  };
+  std::vector<Open> open_{};
+  // Of the next member.
+  std::string_view key_{};
+  DISALLOW_COPY_AND_ASSIGN(TreeBuilder);
+};
 
-      std::unique_ptr<Value> value = ObtainValue();
-      if (value.get() == nullptr) {
-        ReportError("Invalid value parsing array.");
-        return nullptr;
-      }
-      array.emplace_back(move(value));
-      SkipWhitespace();
-      switch (Peek()) {
-        case ']':
-          continue;
-        case ',':
-          Skip();
-          SkipWhitespace();
-          continue;
-        default:
-          ReportError("Unexpected char during array.");
-          return nullptr;
-      }
-    }
-    ReportError("Unexpected end in array.");
-    return nullptr;
+StreamParser::StreamParser(Handler* handler) : handler_(handler) {}
+
+StreamParser::~StreamParser() {}
+
+bool StreamParser::Feed(std::string_view chunk) {
+  if (error_) return false;
+  if (buffer_.empty()) {
+    // Parse in place, and keep only an incomplete token at the end.
+    const size_t consumed = Parse(chunk, false);
+    offset_ += consumed;
+    if (!error_) buffer_.assign(chunk.substr(consumed));
+  } else {
+    buffer_.append(chunk);
+    const size_t consumed = Parse(buffer_, false);
+    offset_ += consumed;
+    buffer_.erase(0, consumed);
   }
+  return !error_;
+}
 
-  std::unique_ptr<Value> ObtainString() {
-    std::string s{};
-    // Just to reduce the number of reallocations, try a random large enough
-    // buffer.
-    s.reserve(1024);
-    if (Get() != '"') return nullptr;
-    while (!Eof()) {
-      if (Peek() == '"') {
-        // End of string.
-        Skip();
-        // TODO: some kind of char code conversion needed?
-        return std::make_unique<StringValue>(std::move(s));
-      } else if (Peek() == '\\') {
-        // escaped character.
-        Skip();
-        switch (char c = Get()) {
-          case 0x22:
-          case 0x5c:
-          case 0x2f:
-            s += c;
-            break;
-          case 0x62:
-            s += 0x8;
-            break;
-          case 0x66:
-            s += 0xc;
-            break;
-          case 0x6e:
-            s += 0xa;
-            break;
-          case 0x72:
-            s += 0xd;
-            break;
-          case 0x74:
-            s += 0x9;
-            break;
-          case 0x75:
-            // 4 hex digits. TODO implement properly.
-            char buf[5] = {Get(), Get(), Get(), Get(), 0};
-            long charcode = strtol(buf, nullptr, 16);
-            if (charcode >= 0 && charcode < 256) {
-              s += static_cast<char>(charcode);
-            } else {
-              ReportError("Unimplemented.");
-              return nullptr;
-            }
-            break;
+bool StreamParser::Finish() {
+  if (!error_ && !buffer_.empty()) {
+    const size_t consumed = Parse(buffer_, true);
+    offset_ += consumed;
+    buffer_.erase(0, consumed);
+  }
+  if (!error_ && expect_ != Expect::kDone) {
+    ReportError("Unexpected end of text.", 0);
+  }
+  return !error_;
+}
+
+void StreamParser::EndValue() {
+  expect_ = stack_.empty() ? Expect::kDone : Expect::kCommaOrEnd;
+}
+
+void StreamParser::ReportError(const char* error, size_t position) {
+  error_ = true;
+  std::cout << "Error: " << error << " at " << offset_ + position
+            << std::endl;
+}
+
+size_t StreamParser::ParseString(std::string_view text, bool last,
+                                 std::string_view* value) {
+  // Resume scanning where the previous attempt on the same token
+  // stopped.
+  size_t from = std::max<size_t>(string_scanned_, 1);
+  const size_t end = FindStringEnd(text, &from, &string_escaped_);
+  if (end == std::string_view::npos) {
+    if (last) ReportError("Unexpected end of text in string.", 0);
+    string_scanned_ = from;
+    return 0;
+  }
+  string_scanned_ = 0;
+  const std::string_view raw = text.substr(1, end - 1);
+  if (!string_escaped_) {
+    // Nothing to unescape, refer to the text.
+    *value = raw;
+    return end + 1;
+  }
+  string_escaped_ = false;
+  unescaped_.clear();
+  for (size_t i = 0; i < raw.size(); ++i) {
+    if (raw[i] != '\\') {
+      unescaped_ += raw[i];
+      continue;
+    }
+    switch (raw[++i]) {
+      case '"':
+      case '\\':
+      case '/':
+        unescaped_ += raw[i];
+        break;
+      case 'b':
+        unescaped_ += '\b';
+        break;
+      case 'f':
+        unescaped_ += '\f';
+        break;
+      case 'n':
+        unescaped_ += '\n';
+        break;
+      case 'r':
+        unescaped_ += '\r';
+        break;
+      case 't':
+        unescaped_ += '\t';
+        break;
+      case 'u': {
+        long code_point = i + 4 < raw.size() ? ReadHex4(&raw[i + 1]) : -1;
+        if (code_point < 0) {
+          ReportError("Invalid \\u escape.", 1 + i);
+          return 0;
+        }
+        i += 4;
+        // A surrogate pair encodes one code point.
+        if (code_point >= 0xd800 && code_point < 0xdc00 &&
+            i + 6 < raw.size() && raw[i + 1] == '\\' && raw[i + 2] == 'u') {
+          const long low = ReadHex4(&raw[i + 3]);
+          if (low >= 0xdc00 && low < 0xe000) {
+            code_point =
+                0x10000 + ((code_point - 0xd800) << 10) + (low - 0xdc00);
+            i += 6;
+          }
         }
-      } else {
-        s += Get();
+        AppendUtf8(code_point, &unescaped_);
+        break;
       }
+      default:
+        ReportError("Invalid escape.", 1 + i);
+        return 0;
     }
-    ReportError("Unexpected EOF found on string parsing.");
-    return nullptr;
   }
+  *value = unescaped_;
+  return end + 1;
+}
 
-  template <class T>
-  std::unique_ptr<Value> AssertConsume(const std::string& expect) {
-    for (char c : expect) {
-      if (c != Peek()) {
-        return nullptr;
-      }
-      if (!Skip()) return nullptr;
+size_t StreamParser::ParseNumber(std::string_view text, bool last,
+                                 double* value) {
+  size_t end = 0;
+  while (end < text.size() && IsNumberChar(text[end])) end++;
+  if (end == text.size() && !last) {
+    // There may be more digits.
+    return 0;
+  }
+  // Integers that a double holds exactly, which is most of them, are
+  // converted here.
+  const bool negative = text[0] == '-';
+  const size_t digits = end - negative;
+  if (digits > 0 && digits <= 15) {
+    uint64_t integer = 0;
+    size_t i = negative;
+    for (; i < end && IsDigit(text[i]); ++i) {
+      integer = integer * 10 + (text[i] - '0');
+    }
+    if (i == end) {
+      *value = negative ? -static_cast<double>(integer)
+                        : static_cast<double>(integer);
+      return end;
     }
-    return std::make_unique<T>();
   }
+  // strtod needs a terminated string.
+  const std::string number(text.substr(0, end));
+  char* number_end;
+  *value = strtod(number.c_str(), &number_end);
+  if (number_end != number.c_str() + number.size()) {
+    ReportError("Invalid number.", 0);
+    return 0;
+  }
+  return end;
+}
 
-  std::unique_ptr<Value> ObtainValue() {
-    switch (Peek()) {
-      case 'f':
-        return AssertConsume<FalseValue>("false");
-      case 'n':
-        return AssertConsume<NullValue>("null");
-      case 't':
-        return AssertConsume<TrueValue>("true");
-      case '-':
-      case '0':
-      case '1':
-      case '2':
-      case '3':
-      case '4':
-      case '5':
-      case '6':
-      case '7':
-      case '8':
-      case '9':
-      case '+':
-        return ObtainNumber();
+size_t StreamParser::Parse(std::string_view text, bool last) {
+  size_t position = 0;
+  while (!error_) {
+    position +=
+        SkipWhitespace(text.data() + position, text.size() - position);
+    if (position == text.size()) return position;
+    const char c = text[position];
+    const std::string_view rest = text.substr(position);
+
+    switch (expect_) {
+      case Expect::kDone:
+        ReportError("Unexpected text after value.", position);
+        return position;
+
+      case Expect::kColon:
+        if (c != ':') {
+          ReportError("':' expected in Object.", position);
+          return position;
+        }
+        position++;
+        expect_ = Expect::kValue;
+        continue;
 
-      case '[':
-        return ObtainArray();
+      case Expect::kCommaOrEnd:
+        if (c == ',') {
+          position++;
+          expect_ = stack_.back() == '{' ? Expect::kKey : Expect::kValue;
+        } else if (c == '}' && stack_.back() == '{') {
+          position++;
+          stack_.pop_back();
+          handler_->EndObject();
+          EndValue();
+        } else if (c == ']' && stack_.back() == '[') {
+          position++;
+          stack_.pop_back();
+          handler_->EndArray();
+          EndValue();
+        } else {
+          ReportError("',' or end of Object or Array expected.", position);
+          return position;
+        }
+        continue;
 
-      case '{':
-        return ObtainObject();
+      case Expect::kKeyOrEnd:
+        if (c == '}') {
+          position++;
+          stack_.pop_back();
+          handler_->EndObject();
+          EndValue();
+          continue;
+        }
+        [[fallthrough]];
+      case Expect::kKey: {
+        if (c != '"') {
+          ReportError("String expected for Object key.", position);
+          return position;
+        }
+        std::string_view key;
+        const size_t length = ParseString(rest, last, &key);
+        if (length == 0) return position;
+        handler_->Key(key);
+        position += length;
+        expect_ = Expect::kColon;
+        continue;
+      }
 
-      case '"':
-        return ObtainString();
+      case Expect::kValueOrEnd:
+        if (c == ']') {
+          position++;
+          stack_.pop_back();
+          handler_->EndArray();
+          EndValue();
+          continue;
+        }
+        [[fallthrough]];
+      case Expect::kValue:
+        break;
+    }
+
+    switch (c) {
+      case '{':
+        position++;
+        stack_.push_back('{');
+        handler_->StartObject();
+        expect_ = Expect::kKeyOrEnd;
+        continue;
+      case '[':
+        position++;
+        stack_.push_back('[');
+        handler_->StartArray();
+        expect_ = Expect::kValueOrEnd;
+        continue;
+      case '"': {
+        std::string_view value;
+        const size_t length = ParseString(rest, last, &value);
+        if (length == 0) return position;
+        handler_->String(value);
+        position += length;
+        EndValue();
+        continue;
+      }
+      case 't':
+      case 'f':
+      case 'n': {
+        const std::string_view keyword =
+            c == 't' ? "true" : c == 'f' ? "false" : "null";
+        if (rest.size() < keyword.size() &&
+            rest == keyword.substr(0, rest.size())) {
+          if (last) ReportError("Unexpected end of text.", position);
+          return position;
+        }
+        if (rest.substr(0, keyword.size()) != keyword) {
+          ReportError("Unknown keyword.", position);
+          return position;
+        }
+        position += keyword.size();
+        if (c == 'n') {
+          handler_->Null();
+        } else {
+          handler_->Bool(c == 't');
+        }
+        EndValue();
+        continue;
+      }
+      default:
+        if (c == '-' || c == '+' || (c >= '0' && c <= '9')) {
+          double value;
+          const size_t length = ParseNumber(rest, last, &value);
+          if (length == 0) return position;
+          handler_->Number(value);
+          position += length;
+          EndValue();
+          continue;
+        }
+        ReportError("Value expected.", position);
+        return position;
     }
-    return nullptr;
   }
+  return position;
+}
 
-  const std::string& text_;
-  size_t position_{0};
-  DISALLOW_COPY_AND_ASSIGN(Parser);
-};
-}  // anonymous namespace
+EntriesHandler::EntriesHandler(std::string_view array_key)
+    : array_key_(array_key) {}
+
+EntriesHandler::~EntriesHandler() {}
+
+void EntriesHandler::StartObject() {
+  if (++depth_ == kEntryDepth && in_entries_) StartEntry();
+}
+
+void EntriesHandler::EndObject() {
+  if (depth_-- == kEntryDepth && in_entries_) EndEntry();
+}
+
+void EntriesHandler::Key(std::string_view key) { key_ = key; }
+
+void EntriesHandler::StartArray() {
+  if (++depth_ == kEntryDepth - 1 && key_ == array_key_) in_entries_ = true;
+}
+
+void EntriesHandler::EndArray() {
+  if (depth_-- == kEntryDepth - 1) in_entries_ = false;
+}
+
+void EntriesHandler::String(std::string_view value) {
+  if (depth_ == kEntryDepth && in_entries_) EntryString(key_, value);
+}
+
+void EntriesHandler::Number(double value) {
+  if (depth_ == kEntryDepth && in_entries_) EntryNumber(key_, value);
+}
+
+void EntriesHandler::Bool(bool value) {
+  if (depth_ == 1) TopBool(key_, value);
+}
+
+bool Parse(std::string_view text, Handler* handler) {
+  StreamParser parser(handler);
+  return parser.Feed(text) && parser.Finish();
+}
+
+std::unique_ptr<Document> Parse(std::string_view text) {
+  auto document = std::make_unique<Document>();
+  TreeBuilder builder(text, document.get());
+  if (!Parse(text, &builder)) return nullptr;
+  return document;
+}
 
-std::unique_ptr<Value> Parse(const std::string& s) {
-  Parser p(s);
-  return p.ParseJsonText();
+std::unique_ptr<Document> Parse(std::string&& text) {
+  auto document = std::make_unique<Document>();
+  // Moved first, as a short string moves its characters.
+  document->text_ = std::move(text);
+  TreeBuilder builder(document->text_, document.get());
+  if (!Parse(std::string_view(document->text_), &builder)) return nullptr;
+  return document;
 }
 
 }  // namespace jjson
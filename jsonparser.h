@@ -1,74 +1,263 @@
 #ifndef JSON_PARSER_H_
 #define JSON_PARSER_H_
 
-#include <map>
+#include <stdint.h>
+
 #include <memory>
+#include <span>
+#include <string>
+#include <string_view>
 #include <vector>
 
+#include "arena.h"
 #include "disallow.h"
 
 namespace jjson {
 
+struct Member;
+class TreeBuilder;
+
+/**
+ * A parsed JSON value, a small handle into the Document it was parsed
+ * into, and valid as long as that is. Strings without escapes refer to
+ * the parsed text, so that has to outlive the Document too.
+ */
 class Value {
  public:
+  enum class Type : uint8_t {
+    kNull,
+    kFalse,
+    kTrue,
+    kNumber,
+    kString,
+    kArray,
+    kObject,
+  };
+
   Value() {}
-  virtual ~Value() {}
+
+  Type type() const { return type_; }
 
   /** Obtain array element. */
   const Value& operator[](size_t pos) const;
 
   /** Obtain object member. */
-  const Value& operator[](const std::string& key) const;
+  const Value& operator[](std::string_view key) const;
   /** Obtain object member. */
-  const Value& get(const std::string& key) const;
+  const Value& get(std::string_view key) const;
+  /** Obtain object member, nullptr if there is none. */
+  const Value* find(std::string_view key) const;
 
   /** Obtain array for iteration. */
-  const std::vector<std::unique_ptr<Value> >& get_array() const;
+  std::span<const Value> get_array() const;
+
+  /** Obtain object members for iteration, in the order of the text. */
+  std::span<const Member> get_object() const;
 
   /** Obtain string. */
-  const std::string& get_string() const;
+  std::string_view get_string() const;
 
   /** Obtain number. */
-  float get_number() const;
+  double get_number() const;
 
   /** Obtain number and convert to int. */
-  float get_int() const;
+  int get_int() const;
 
   /** Check if this was 'true' */
-  bool is_true() const;
+  bool is_true() const { return type_ == Type::kTrue; }
 
   /** Check if this was 'false' */
-  bool is_false() const;
+  bool is_false() const { return type_ == Type::kFalse; }
 
   /** Check if this was 'null' */
-  bool is_null() const;
+  bool is_null() const { return type_ == Type::kNull; }
+
+ private:
+  friend class TreeBuilder;
+
+  Value(Type type, uint32_t size, const void* data)
+      : type_(type), size_(size), data_(data) {}
+  explicit Value(double number) : type_(Type::kNumber), number_(number) {}
+
+  Type type_{Type::kNull};
+  // Of the string, array or object.
+  uint32_t size_{};
+  union {
+    double number_;
+    // char, Value or Member array.
+    const void* data_{};
+  };
+};
+
+struct Member {
+  std::string_view key;
+  Value value;
+};
+
+/**
+ * The root value of a parse, which owns the memory of all the values in
+ * it. The whole tree is released at once.
+ */
+class Document : public Value {
+ public:
+  Document() {}
+  ~Document() {}
+
+  // Memory taken by the values.
+  size_t allocated_bytes() const { return arena_.allocated_bytes(); }
+
+ private:
+  friend class TreeBuilder;
+
+  friend std::unique_ptr<Document> Parse(std::string&& text);
+
+  Arena arena_{};
+  // The text, when the Document owns it.
+  std::string text_{};
+  DISALLOW_COPY_AND_ASSIGN(Document);
+};
+
+/**
+ * Parse the whole of |text|, nullptr on error. |text| must outlive the
+ * result.
+ */
+std::unique_ptr<Document> Parse(std::string_view text);
+/** Same, for a string that the result takes and keeps. */
+std::unique_ptr<Document> Parse(std::string&& text);
+/** Same as for std::string_view, for literals. */
+inline std::unique_ptr<Document> Parse(const char* text) {
+  return Parse(std::string_view(text));
+}
+
+/**
+ * Receives the parts of a JSON text from StreamParser as they are
+ * parsed, without building a tree. Views are only valid during the
+ * call.
+ */
+class Handler {
+ public:
+  Handler() {}
+  virtual ~Handler() {}
+
+  virtual void StartObject() {}
+  virtual void EndObject() {}
+  /** Object member name, followed by its value. */
+  virtual void Key(std::string_view key) {}
+  virtual void StartArray() {}
+  virtual void EndArray() {}
+  virtual void String(std::string_view value) {}
+  virtual void Number(double value) {}
+  virtual void Bool(bool value) {}
+  virtual void Null() {}
 
  private:
-  DISALLOW_COPY_AND_ASSIGN(Value);
+  DISALLOW_COPY_AND_ASSIGN(Handler);
 };
 
-template <class T>
-class SpecialValue : public Value {
+/**
+ * Handler for the objects in the array member |array_key| of the top
+ * level object, such as the entries of a tree listing. The string and
+ * number members of each entry are passed on with their key, and the
+ * end of each entry is signalled. Deeper values are skipped.
+ */
+class EntriesHandler : public Handler {
  public:
-  explicit SpecialValue(T&& value) : value_(std::move(value)) {}
-  const T value_;
+  explicit EntriesHandler(std::string_view array_key);
+  virtual ~EntriesHandler();
+
+  virtual void StartEntry() {}
+  virtual void EndEntry() = 0;
+  virtual void EntryString(std::string_view key, std::string_view value) {}
+  virtual void EntryNumber(std::string_view key, double value) {}
+  /** Boolean members of the top level object. */
+  virtual void TopBool(std::string_view key, bool value) {}
+
+  virtual void StartObject() override;
+  virtual void EndObject() override;
+  virtual void Key(std::string_view key) override;
+  virtual void StartArray() override;
+  virtual void EndArray() override;
+  virtual void String(std::string_view value) override;
+  virtual void Number(double value) override;
+  virtual void Bool(bool value) override;
+
+ private:
+  // Of the entry objects, within the array in the top level object.
+  static constexpr int kEntryDepth = 3;
+
+  const std::string array_key_;
+  // Objects and arrays we are in.
+  int depth_{};
+  // In the array of entries.
+  bool in_entries_{};
+  // The last object key seen.
+  std::string key_{};
 };
 
-typedef SpecialValue<float> NumberValue;
-typedef SpecialValue<std::string> StringValue;
-;
-typedef SpecialValue<std::map<std::string, std::unique_ptr<Value> > >
-    ObjectValue;
-typedef SpecialValue<std::vector<std::unique_ptr<Value> > > ArrayValue;
-;
+/**
+ * Incremental event based parser, for consuming a JSON text in pieces
+ * while it arrives. Only the unparsed end of the last piece is kept.
+ */
+class StreamParser {
+ public:
+  explicit StreamParser(Handler* handler);
+  ~StreamParser();
+
+  /** Parse the next piece of the text. Returns false on error, after
+   * which the rest is ignored. */
+  bool Feed(std::string_view chunk);
+  /** Returns false unless the text was exactly one JSON value. */
+  bool Finish();
+
+ private:
+  enum class Expect {
+    kValue,
+    // After '['.
+    kValueOrEnd,
+    // After '{'.
+    kKeyOrEnd,
+    // After ',' in an object.
+    kKey,
+    kColon,
+    kCommaOrEnd,
+    kDone,
+  };
 
-class TrueValue : public Value {};
+  // Parse as much of |text| as possible and return the bytes consumed.
+  // An incomplete token at the end is left for later unless |last|.
+  size_t Parse(std::string_view text, bool last);
+  // Parse the string token at the start of |text| into |value|.
+  // Returns its length, or 0 if it is incomplete or on error.
+  size_t ParseString(std::string_view text, bool last,
+                     std::string_view* value);
+  // Parse the number token at the start of |text|, as ParseString.
+  size_t ParseNumber(std::string_view text, bool last, double* value);
+  // After a complete value.
+  void EndValue();
+  void ReportError(const char* error, size_t position);
 
-class FalseValue : public Value {};
+  Handler* const handler_;
+  // Unparsed text, the start of an incomplete token.
+  std::string buffer_{};
+  // How far into an incomplete string token in buffer_ has been
+  // scanned without finding its end.
+  size_t string_scanned_{};
+  // Whether that part has an escape.
+  bool string_escaped_{};
+  // Bytes before buffer_, for error messages.
+  size_t offset_{};
+  // '{' or '[' for each open object or array.
+  std::vector<char> stack_{};
+  Expect expect_{Expect::kValue};
+  bool error_{};
+  // For strings with escapes.
+  std::string unescaped_{};
 
-class NullValue : public Value {};
+  DISALLOW_COPY_AND_ASSIGN(StreamParser);
+};
 
-std::unique_ptr<Value> Parse(const std::string& s);
+/** Parse the whole of |text| with a StreamParser. */
+bool Parse(std::string_view text, Handler* handler);
 
 }  // end namespace jjson
 
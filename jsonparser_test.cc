@@ -6,37 +6,40 @@
 #include <map>
 #include <memory>
 #include <set>
+#include <string>
+#include <string_view>
 #include <vector>
 
 using jjson::Value;
 
-template <class T>
-void utilTestKeywordParse(const std::string& w) {
-  std::unique_ptr<Value> v = jjson::Parse(w);
+void utilTestKeywordParse(const std::string& w, Value::Type type) {
+  auto v = jjson::Parse(w);
   assert(v.get() != nullptr);
-  assert(dynamic_cast<T*>(v.get()) != nullptr);
+  assert(v->type() == type);
 }
 
-template <class T, class U>
-void utilTestValueParse(const std::string json, const U& value) {
-  std::unique_ptr<Value> v = jjson::Parse(json);
+void utilTestNumberParse(const std::string& json, double value) {
+  auto v = jjson::Parse(json);
   assert(v.get() != nullptr);
-  T* target = dynamic_cast<T*>(v.get());
-  assert(target != nullptr);
-  // std::cout << target->value_ << std::endl;
-  assert(target->value_ == value);
+  assert(v->type() == Value::Type::kNumber);
+  assert(v->get_number() == value);
 }
 
-template <class T, class U>
-void utilTestArrayParse(const std::string json, const std::vector<U>& values) {
-  std::unique_ptr<Value> v = jjson::Parse(json);
+void utilTestStringParse(const std::string& json, std::string_view value) {
+  auto v = jjson::Parse(json);
   assert(v.get() != nullptr);
-  jjson::ArrayValue* target = dynamic_cast<jjson::ArrayValue*>(v.get());
-  assert(target != nullptr);
+  assert(v->type() == Value::Type::kString);
+  assert(v->get_string() == value);
+}
+
+void utilTestArrayParse(const std::string& json,
+                        const std::vector<double>& values) {
+  auto v = jjson::Parse(json);
+  assert(v.get() != nullptr);
+  assert(v->type() == Value::Type::kArray);
+  assert(v->get_array().size() == values.size());
   for (size_t i = 0; i < values.size(); ++i) {
-    T* value = dynamic_cast<T*>(target->value_[i].get());
-    assert(value != nullptr);
-    assert(value->value_ == values[i]);
+    assert((*v)[i].get_number() == values[i]);
   }
 }
 
@@ -44,13 +47,12 @@ void testConsume() {
   {
     std::string space_tab = " \t\ntrue\n\t";
     auto parsed = jjson::Parse(space_tab);
-    jjson::TrueValue* t = dynamic_cast<jjson::TrueValue*>(parsed.get());
-    assert(t != nullptr);
+    assert(parsed->is_true());
   }
 
-  utilTestKeywordParse<jjson::TrueValue>("true");
-  utilTestKeywordParse<jjson::FalseValue>("false");
-  utilTestKeywordParse<jjson::NullValue>("null");
+  utilTestKeywordParse("true", Value::Type::kTrue);
+  utilTestKeywordParse("false", Value::Type::kFalse);
+  utilTestKeywordParse("null", Value::Type::kNull);
 
   assert(jjson::Parse("true")->is_true());
   assert(!jjson::Parse("true")->is_false());
@@ -62,57 +64,35 @@ void testConsume() {
   assert(!jjson::Parse("null")->is_false());
   assert(jjson::Parse("null")->is_null());
 
-  utilTestValueParse<jjson::NumberValue>("1", 1);
-  utilTestValueParse<jjson::NumberValue>("100", 100);
-  utilTestValueParse<jjson::NumberValue>("-10", -10);
-  utilTestValueParse<jjson::NumberValue>("5.5", 5.5);
+  utilTestNumberParse("1", 1);
+  utilTestNumberParse("100", 100);
+  utilTestNumberParse("-10", -10);
+  utilTestNumberParse("5.5", 5.5);
 
-  utilTestValueParse<jjson::StringValue>(R"("5.5")", "5.5");
-  utilTestValueParse<jjson::StringValue>(R"("unkotest")", "unkotest");
-  utilTestValueParse<jjson::StringValue>(R"("carriage\r\nreturn")",
-                                         "carriage\r\nreturn");
-  utilTestValueParse<jjson::StringValue>(R"("\u0075")", "u");
+  utilTestStringParse(R"("5.5")", "5.5");
+  utilTestStringParse(R"("unkotest")", "unkotest");
+  utilTestStringParse(R"("carriage\r\nreturn")", "carriage\r\nreturn");
+  utilTestStringParse(R"("\u0075")", "u");
 
-  utilTestArrayParse<jjson::NumberValue, float>("[1, 2, 3]", {1, 2, 3});
-  utilTestArrayParse<jjson::NumberValue, float>("[ ]", {});
+  utilTestArrayParse("[1, 2, 3]", {1, 2, 3});
+  utilTestArrayParse("[ ]", {});
 
   {
-    std::unique_ptr<Value> v =
-        jjson::Parse(R"({"string" : "hoge", "number" : 123})");
+    auto v = jjson::Parse(R"({"string" : "hoge", "number" : 123})");
     assert(v.get() != nullptr);
-    auto target = dynamic_cast<jjson::ObjectValue*>(v.get());
-    assert(target != nullptr);
-    assert(dynamic_cast<jjson::StringValue*>(
-               target->value_.find("string")->second.get())
-               ->value_ == "hoge");
-    assert(dynamic_cast<jjson::NumberValue*>(
-               target->value_.find("number")->second.get())
-               ->value_ == 123);
+    assert(v->type() == Value::Type::kObject);
+    assert(v->get("string").get_string() == "hoge");
+    assert(v->get("number").get_number() == 123);
+    assert(v->find("none") == nullptr);
+    // Members in the order of the text.
+    auto members = v->get_object();
+    assert(members.size() == 2);
+    assert(members[0].key == "string");
+    assert(members[1].key == "number");
   }
 
   {
-    std::unique_ptr<Value> v = jjson::Parse(R"(
-      {"obj" : {"hoge" : 12 },
-       "arr" : [1, 2, 3]})");
-    assert(v.get() != nullptr);
-    auto target = dynamic_cast<jjson::ObjectValue*>(v.get());
-    assert(target != nullptr);
-    auto num = dynamic_cast<jjson::NumberValue*>(
-        dynamic_cast<jjson::ObjectValue*>(
-            target->value_.find("obj")->second.get())
-            ->value_.find("hoge")
-            ->second.get());
-    assert(num->value_ == 12);
-    auto& arr = dynamic_cast<jjson::ArrayValue*>(
-                    target->value_.find("arr")->second.get())
-                    ->value_;
-    assert(dynamic_cast<jjson::NumberValue*>(arr[0].get())->value_ == 1);
-    assert(dynamic_cast<jjson::NumberValue*>(arr[1].get())->value_ == 2);
-    assert(dynamic_cast<jjson::NumberValue*>(arr[2].get())->value_ == 3);
-  }
-
-  {
-    std::unique_ptr<Value> v = jjson::Parse(R"(
+    auto v = jjson::Parse(R"(
       {"obj" : {"hoge" : 12,
                 "fuga": "sss" },
        "arr" : [1, 2, 3]}
@@ -123,7 +103,163 @@ void testConsume() {
     assert((*v)["arr"][0].get_number() == 1);
     assert((*v)["arr"][1].get_number() == 2);
     assert((*v)["arr"][2].get_number() == 3);
+    assert((*v)["arr"].get_array().size() == 3);
+  }
+
+  assert(jjson::Parse("[1,]") == nullptr);
+}
+
+// Strings without escapes are not copied, and all the values of a large
+// text take only a few allocations.
+void testDocument() {
+  const std::string json = R"({"plain": "abc", "escaped": "a\nb"})";
+  auto v = jjson::Parse(json);
+  assert(v->get("plain").get_string().data() == json.data() + 11);
+  assert(v->get("escaped").get_string() == "a\nb");
+  assert(v->get_object()[0].key.data() == json.data() + 2);
+
+  std::string large = "[";
+  for (size_t i = 0; i < 10000; ++i) {
+    if (i) large += ",";
+    large += R"({"path": "file)" + std::to_string(i) +
+             R"(", "mode": "100644", "size": )" + std::to_string(i) + "}";
+  }
+  large += "]";
+  auto document = jjson::Parse(large);
+  assert(document->get_array().size() == 10000);
+  assert((*document)[9999]["path"].get_string() == "file9999");
+  assert((*document)[9999]["size"].get_int() == 9999);
+  // The members and elements themselves, in 64KiB arena blocks with
+  // some room left at the end of each.
+  const size_t used = 10000 * 3 * sizeof(jjson::Member) +
+                      10000 * sizeof(Value);
+  assert(document->allocated_bytes() < used * 11 / 10);
+
+  // A temporary string is kept by the result.
+  auto owned = jjson::Parse(std::string(R"({"plain": "abc"})"));
+  assert(owned->get("plain").get_string() == "abc");
+}
+
+// Records the events as text.
+class EventRecorder : public jjson::Handler {
+ public:
+  virtual void StartObject() override { events_ += "{"; }
+  virtual void EndObject() override { events_ += "}"; }
+  virtual void Key(std::string_view key) override {
+    events_ += "K(" + std::string(key) + ")";
+  }
+  virtual void StartArray() override { events_ += "["; }
+  virtual void EndArray() override { events_ += "]"; }
+  virtual void String(std::string_view value) override {
+    events_ += "S(" + std::string(value) + ")";
   }
+  virtual void Number(double value) override {
+    events_ += "N(" + std::to_string(value) + ")";
+  }
+  virtual void Bool(bool value) override { events_ += value ? "T" : "F"; }
+  virtual void Null() override { events_ += "0"; }
+
+  std::string events_{};
+};
+
+std::string Events(const std::string& json) {
+  EventRecorder recorder;
+  if (!jjson::Parse(std::string_view(json), &recorder)) return "error";
+  return recorder.events_;
 }
 
-int main(int ac, char** av) { testConsume(); }
+void testStreamParser() {
+  assert(Events(R"({"a": [1, -2.5e1, "x\"y"], "b": {}, "c": [true, false,
+                   null]})") ==
+         "{K(a)[N(1.000000)N(-25.000000)S(x\"y)]K(b){}K(c)[TF0]}");
+  assert(Events("12") == "N(12.000000)");
+  assert(Events(R"("\u00e9\ud83d\ude00")") == "S(\xc3\xa9\xf0\x9f\x98\x80)");
+  for (const char* bad :
+       {"[1,]", R"({"a" 1})", "tru", "[1] 2", "[1", R"("abc)", "{1: 2}",
+        R"("\q")", "", "[}"}) {
+    assert(Events(bad) == "error");
+  }
+
+  // Fed in pieces split anywhere, the events are the same.
+  const std::string json =
+      R"({"key": "a \"quoted\" \u0041 string", "n": [123, 4.5, true],)"
+      R"( "nested": {"x": null, "y": false}})";
+  const std::string expected = Events(json);
+  for (size_t split = 0; split <= json.size(); ++split) {
+    EventRecorder recorder;
+    jjson::StreamParser parser(&recorder);
+    assert(parser.Feed(std::string_view(json).substr(0, split)));
+    assert(parser.Feed(std::string_view(json).substr(split)));
+    assert(parser.Finish());
+    assert(recorder.events_ == expected);
+  }
+  EventRecorder recorder;
+  jjson::StreamParser parser(&recorder);
+  for (char c : json) assert(parser.Feed(std::string_view(&c, 1)));
+  assert(parser.Finish());
+  assert(recorder.events_ == expected);
+}
+
+// Long strings and whitespace, so that each block size used in scanning
+// is exercised with the interesting byte at every offset.
+void testScanning() {
+  for (size_t length = 0; length < 100; ++length) {
+    for (size_t at = 0; at <= length; ++at) {
+      std::string plain(length, 'a');
+      assert(Events("\"" + plain + "\"") == "S(" + plain + ")");
+      std::string quoted = plain;
+      quoted.insert(at, "\\\"");
+      std::string expected = plain;
+      expected.insert(at, "\"");
+      assert(Events("\"" + quoted + "\"") == "S(" + expected + ")");
+      assert(Events(std::string(length, ' ') + "[" + std::string(at, '\n') +
+                    "1" + std::string(length - at, '\t') + "]\r\n") ==
+             "[N(1.000000)]");
+    }
+    assert(Events("\"" + std::string(length, 'a')) == "error");
+  }
+  // Split inside a long string with an escape before the split.
+  const std::string json = "[\"" + std::string(40, 'x') + "\\n" +
+                           std::string(80, 'y') + "\"]";
+  const std::string expected = Events(json);
+  assert(expected ==
+         "[S(" + std::string(40, 'x') + "\n" + std::string(80, 'y') + ")]");
+  for (size_t split = 0; split <= json.size(); ++split) {
+    EventRecorder recorder;
+    jjson::StreamParser parser(&recorder);
+    assert(parser.Feed(std::string_view(json).substr(0, split)));
+    assert(parser.Feed(std::string_view(json).substr(split)));
+    assert(parser.Finish());
+    assert(recorder.events_ == expected);
+  }
+}
+
+void testNumbers() {
+  const std::map<std::string, double> numbers{
+      {"0", 0},
+      {"-0", -0.0},
+      {"7", 7},
+      {"-42", -42},
+      {"999999999999999", 999999999999999.0},
+      {"1234567890123456789", 1234567890123456789.0},
+      {"-1.5", -1.5},
+      {"2e3", 2000},
+      {"1E-2", 0.01},
+  };
+  for (const auto& [text, number] : numbers) {
+    EventRecorder recorder;
+    assert(jjson::Parse(std::string_view("[" + text + "]"), &recorder));
+    assert(recorder.events_ == "[N(" + std::to_string(number) + ")]");
+  }
+  for (const char* bad : {"-", "1-", "1.2.3", "--1"}) {
+    assert(Events(bad) == "error");
+  }
+}
+
+int main(int ac, char** av) {
+  testConsume();
+  testDocument();
+  testStreamParser();
+  testScanning();
+  testNumbers();
+}
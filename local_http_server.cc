@@ -0,0 +1,131 @@
+#include "local_http_server.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using std::lock_guard;
+using std::mutex;
+using std::string;
+
+namespace {
+const char* StatusText(int status) {
+  switch (status) {
+    case 200:
+      return "OK";
+    case 404:
+      return "Not Found";
+    default:
+      return "Error";
+  }
+}
+
+bool WriteAll(int fd, const string& data) {
+  size_t position = 0;
+  while (position < data.size()) {
+    // Clients may have gone away.
+    ssize_t written = send(fd, data.data() + position, data.size() - position,
+                           MSG_NOSIGNAL);
+    if (written <= 0) return false;
+    position += written;
+  }
+  return true;
+}
+}  // namespace
+
+LocalHttpServer::LocalHttpServer(Handler handler)
+    : handler_(handler),
+      listen_fd_(socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) {
+  assert(listen_fd_.get() != -1);
+  struct sockaddr_in address {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = 0;
+  socklen_t length = sizeof(address);
+  assert(bind(listen_fd_.get(), reinterpret_cast<sockaddr*>(&address),
+              sizeof(address)) == 0);
+  assert(listen(listen_fd_.get(), 16) == 0);
+  assert(getsockname(listen_fd_.get(), reinterpret_cast<sockaddr*>(&address),
+                     &length) == 0);
+  port_ = ntohs(address.sin_port);
+  accept_thread_ = std::thread([this]() { Accept(); });
+}
+
+LocalHttpServer::~LocalHttpServer() {
+  {
+    lock_guard<mutex> l(mutex_);
+    stop_ = true;
+    // Wakes up the threads blocked in accept and read.
+    shutdown(listen_fd_.get(), SHUT_RDWR);
+    for (int fd : connection_fds_) shutdown(fd, SHUT_RDWR);
+  }
+  accept_thread_.join();
+  for (auto& thread : connection_threads_) thread.join();
+  for (int fd : connection_fds_) close(fd);
+}
+
+string LocalHttpServer::url() const {
+  return "http://127.0.0.1:" + std::to_string(port_);
+}
+
+void LocalHttpServer::Accept() {
+  while (true) {
+    int fd = accept4(listen_fd_.get(), nullptr, nullptr, SOCK_CLOEXEC);
+    lock_guard<mutex> l(mutex_);
+    if (stop_) {
+      if (fd != -1) close(fd);
+      return;
+    }
+    if (fd == -1) {
+      perror("accept");
+      continue;
+    }
+    connections_++;
+    connection_fds_.push_back(fd);
+    connection_threads_.emplace_back([this, fd]() { Serve(fd); });
+  }
+}
+
+void LocalHttpServer::Serve(int fd) {
+  string buffer;
+  char chunk[4096];
+  while (true) {
+    size_t end;
+    while ((end = buffer.find("\r\n\r\n")) == string::npos) {
+      ssize_t read_size = read(fd, chunk, sizeof(chunk));
+      if (read_size <= 0) {
+        // Closed by the client or by shutdown, leave closing to the
+        // destructor so that the descriptor is not reused meanwhile.
+        return;
+      }
+      buffer.append(chunk, read_size);
+    }
+    const string head = buffer.substr(0, end);
+    buffer.erase(0, end + 4);
+    requests_++;
+
+    // "GET /target HTTP/1.1"
+    const size_t space1 = head.find(' ');
+    const size_t space2 = head.find(' ', space1 + 1);
+    const string target = head.substr(space1 + 1, space2 - space1 - 1);
+    const bool close_requested =
+        strcasestr(head.c_str(), "\r\nConnection: close") != nullptr;
+    string body;
+    const int status = head.compare(0, 4, "GET ") == 0
+                           ? handler_(target, &body)
+                           : 405;
+    string response = "HTTP/1.1 " + std::to_string(status) + " " +
+                      StatusText(status) +
+                      "\r\nContent-Type: application/json"
+                      "\r\nContent-Length: " +
+                      std::to_string(body.size()) + "\r\n\r\n" + body;
+    if (!WriteAll(fd, response) || close_requested) {
+      shutdown(fd, SHUT_RDWR);
+      return;
+    }
+  }
+}
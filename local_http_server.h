@@ -0,0 +1,51 @@
+#ifndef LOCAL_HTTP_SERVER_H_
+#define LOCAL_HTTP_SERVER_H_
+/**
+ * Minimal HTTP/1.1 server on a loopback port, standing in for a remote
+ * API in tests. Serves GET requests with keep-alive, one thread per
+ * connection.
+ */
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "disallow.h"
+#include "scoped_fd.h"
+
+class LocalHttpServer {
+ public:
+  // Returns the status code for |target|, the path and query of the
+  // request, and fills |body|.
+  typedef std::function<int(const std::string& target, std::string* body)>
+      Handler;
+
+  explicit LocalHttpServer(Handler handler);
+  ~LocalHttpServer();
+
+  // e.g. "http://127.0.0.1:12345".
+  std::string url() const;
+  // Connections accepted so far.
+  size_t connections() const { return connections_; }
+  size_t requests() const { return requests_; }
+
+ private:
+  void Accept();
+  void Serve(int fd);
+
+  const Handler handler_;
+  ScopedFd listen_fd_;
+  int port_{};
+  std::atomic<size_t> connections_{};
+  std::atomic<size_t> requests_{};
+  std::thread accept_thread_{};
+  std::mutex mutex_{};
+  bool stop_{};
+  std::vector<int> connection_fds_{};
+  std::vector<std::thread> connection_threads_{};
+  DISALLOW_COPY_AND_ASSIGN(LocalHttpServer);
+};
+
+#endif
@@ -27,6 +27,9 @@ ScopedTimer::~ScopedTimer() {
 
 StatusHandler::StatusHandler() : message_() {}
 
+StatusHandler::StatusHandler(std::function<std::string()> extra_status)
+    : extra_status_(extra_status), message_() {}
+
 StatusHandler::~StatusHandler() {}
 
 int StatusHandler::Getattr(struct stat *stbuf) {
@@ -55,5 +58,8 @@ int StatusHandler::Open() {
 
 int StatusHandler::Release() { return 0; }
 
-void StatusHandler::RefreshMessage() { message_ = ScopedTimer::dump(); }
+void StatusHandler::RefreshMessage() {
+  message_ = ScopedTimer::dump();
+  if (extra_status_) message_ += extra_status_();
+}
 }  // namespace scoped_timer
@@ -4,6 +4,7 @@
  * Utility class to dump usecs.
  */
 #include <chrono>
+#include <functional>
 #include <string>
 
 #include "directory_container.h"
@@ -33,15 +34,19 @@ class ScopedTimer {
 class StatusHandler : public directory_container::File {
  public:
   StatusHandler();
+  // |extra_status| is appended to the timing statistics.
+  explicit StatusHandler(std::function<std::string()> extra_status);
   virtual ~StatusHandler();
 
   virtual int Getattr(struct stat *stbuf) override;
   virtual ssize_t Read(char *buf, size_t size, off_t offset) override;
   virtual int Open() override;
   virtual int Release() override;
+  virtual bool Volatile() const override { return true; }
 
  private:
   void RefreshMessage();
+  std::function<std::string()> extra_status_{};
   std::string message_;
   DISALLOW_COPY_AND_ASSIGN(StatusHandler);
 };
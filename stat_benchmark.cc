@@ -0,0 +1,51 @@
+// Stat storm benchmark: lstat every path under a directory
+// repeatedly, like a build system checking its inputs. Meant to be run
+// on a mounted file system, see stat_benchmark.sh.
+//
+// $ ./out/stat_benchmark mountpoint/ 10
+
+#include <assert.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "walk_filesystem.h"
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    std::cerr << argv[0] << " DIRECTORY [ROUNDS]" << std::endl;
+    return EXIT_FAILURE;
+  }
+  const std::string dir(argv[1]);
+  const int rounds = argc > 2 ? atoi(argv[2]) : 10;
+
+  // The first walk does the lookups.
+  auto begin = std::chrono::steady_clock::now();
+  std::vector<std::string> paths;
+  assert(WalkFilesystem(dir, [&paths](FTSENT* entry) {
+    if (entry->fts_info != FTS_DP) paths.emplace_back(entry->fts_path);
+  }));
+  auto end = std::chrono::steady_clock::now();
+  double seconds = std::chrono::duration<double>(end - begin).count();
+  std::cout << "walk: " << paths.size() << " paths in " << seconds << " s"
+            << std::endl;
+
+  begin = std::chrono::steady_clock::now();
+  size_t count = 0;
+  struct stat st;
+  for (int round = 0; round < rounds; ++round) {
+    for (const auto& path : paths) {
+      if (lstat(path.c_str(), &st) == 0) ++count;
+    }
+  }
+  end = std::chrono::steady_clock::now();
+  seconds = std::chrono::duration<double>(end - begin).count();
+  assert(count == paths.size() * rounds);
+  std::cout << "lstat: " << count << " in " << seconds << " s, "
+            << static_cast<size_t>(count / seconds) << " stats/s" << std::endl;
+  return 0;
+}
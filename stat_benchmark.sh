@@ -0,0 +1,17 @@
+#!/bin/bash
+# Compare stat performance of a gitlstree mount with and without
+# --immutable, and with the low-level API, over this repository.
+set -e
+ROUNDS=${1:-10}
+cleanup() {
+    fusermount3 -u -z out/stat_benchmark_mountpoint || true
+    rmdir out/stat_benchmark_mountpoint || true
+}
+trap cleanup exit
+mkdir -p out/stat_benchmark_mountpoint
+for option in "" --immutable "--immutable --lowlevel"; do
+    echo "gitlstree $option"
+    ./out/gitlstree --path=. $option out/stat_benchmark_mountpoint
+    ./out/stat_benchmark out/stat_benchmark_mountpoint "$ROUNDS"
+    fusermount3 -u out/stat_benchmark_mountpoint
+done
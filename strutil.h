@@ -1,6 +1,8 @@
 #ifndef STRUTIL_H_
 #define STRUTIL_H_
+#include <functional>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "scoped_fd.h"
@@ -10,7 +12,32 @@ std::string ReadFromFileOrDie(int dirfd, const std::string& filename);
 std::string PopenAndReadOrDie2(const std::vector<std::string>& command,
                                const std::string* cwd = nullptr,
                                int* maybe_exit_code = nullptr);
+// Same as PopenAndReadOrDie2 but hands output to |chunk_handler| as it
+// arrives from the pipe instead of accumulating it.
+void PopenAndStreamOrDie(const std::vector<std::string>& command,
+                         const std::string* cwd, int* maybe_exit_code,
+                         std::function<void(std::string_view chunk)>
+                             chunk_handler);
 std::vector<std::string> SplitStringUsing(const std::string s, char c,
                                           bool token_compress);
 std::pair<ScopedFd, ScopedFd> ScopedPipe();
+
+// Splits a stream of chunks into lines terminated by |delimiter|. Lines
+// that are contained within one chunk are passed on without copying.
+class LineSplitter {
+ public:
+  LineSplitter(char delimiter,
+               std::function<void(std::string_view line)> line_handler);
+  ~LineSplitter();
+
+  void Feed(std::string_view chunk);
+  // Emit the remaining unterminated line, if any.
+  void Flush();
+
+ private:
+  const char delimiter_;
+  std::function<void(std::string_view line)> line_handler_;
+  // Incomplete line carried over from the previous chunk.
+  std::string partial_{};
+};
 #endif
@@ -2,6 +2,9 @@
 
 #include <assert.h>
 
+#include <string>
+#include <vector>
+
 void test_PopenAndReadOrDie2() {
   // Check that basic input/output is correct.
   assert(PopenAndReadOrDie2({"echo", "hello", "world"}) == "hello world\n");
@@ -21,8 +24,35 @@ void test_SplitStringUsing() {
   assert(res[3] == "onaaaaaaaaxx");
 }
 
+void test_PopenAndStreamOrDie() {
+  std::string result;
+  int exit_code = -1;
+  PopenAndStreamOrDie({"echo", "hello", "world"}, nullptr, &exit_code,
+                      [&result](std::string_view chunk) { result += chunk; });
+  assert(result == "hello world\n");
+  assert(exit_code == 0);
+}
+
+void test_LineSplitter() {
+  std::vector<std::string> lines;
+  LineSplitter splitter(
+      '\n', [&lines](std::string_view line) { lines.emplace_back(line); });
+  // Lines that span multiple chunks get concatenated.
+  splitter.Feed("hoge\nfu");
+  splitter.Feed("g");
+  splitter.Feed("a\n\nlast");
+  splitter.Flush();
+  assert(lines.size() == 4);
+  assert(lines[0] == "hoge");
+  assert(lines[1] == "fuga");
+  assert(lines[2] == "");
+  assert(lines[3] == "last");
+}
+
 int main(int argc, char** argv) {
   test_PopenAndReadOrDie2();
   test_SplitStringUsing();
+  test_PopenAndStreamOrDie();
+  test_LineSplitter();
   return 0;
 }
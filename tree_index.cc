@@ -0,0 +1,291 @@
+#include "tree_index.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "scoped_fd.h"
+
+using std::string;
+using std::string_view;
+
+namespace {
+constexpr char kMagic[8] = {'G', 'T', 'I', 'D', 'X', '0', '0', '2'};
+
+// Records are 8 byte aligned.
+size_t Align(size_t size) { return (size + 7) & ~size_t{7}; }
+
+bool WriteAll(int fd, const void* data, size_t size) {
+  const char* p = static_cast<const char*>(data);
+  while (size > 0) {
+    ssize_t written = write(fd, p, size);
+    if (written == -1) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    p += written;
+    size -= written;
+  }
+  return true;
+}
+
+// The hash becomes a file name.
+bool IsHex(string_view sha1) {
+  if (sha1.empty()) return false;
+  for (char c : sha1) {
+    if (!isxdigit(static_cast<unsigned char>(c))) return false;
+  }
+  return true;
+}
+}  // namespace
+
+struct TreeIndex::Header {
+  char magic[8];
+  uint64_t count;
+  // Of the whole file, to detect truncation.
+  uint64_t file_size;
+};
+
+struct TreeIndex::RecordHeader {
+  uint32_t mode;
+  uint32_t path_size;
+  uint64_t size;
+  uint8_t type_size;
+  uint8_t sha1_size;
+  // Whether this is a tree listed before, whose entries are at |tree|.
+  uint8_t linked;
+  uint8_t padding[5];
+  // For trees, where the records of the entries under it end, or the
+  // record of the first copy if |linked|.
+  uint64_t tree;
+
+  size_t record_size() const {
+    return Align(sizeof(RecordHeader) + type_size + sha1_size + path_size);
+  }
+};
+
+void TreeIndex::Writer::Add(const Entry& entry) {
+  if (!skipped_prefix_.empty()) {
+    if (entry.path.substr(0, skipped_prefix_.size()) == skipped_prefix_) {
+      return;
+    }
+    skipped_prefix_.clear();
+  }
+  CloseTrees(entry.path);
+  // Directly under the innermost tree that is still open.
+  const size_t parent_size =
+      open_trees_.empty() ? 0 : open_trees_.back().first.size();
+  if (entry.path.size() <= parent_size ||
+      entry.path.find('/', parent_size) != string_view::npos) {
+    ordered_ = false;
+  }
+
+  const uint64_t offset = sizeof(Header) + records_.size();
+  RecordHeader header{};
+  header.mode = entry.mode;
+  header.path_size = entry.path.size();
+  header.size = entry.size;
+  header.type_size = entry.type.size();
+  header.sha1_size = entry.sha1.size();
+  if (entry.type == "tree") {
+    auto [it, inserted] = trees_.emplace(string(entry.sha1), offset);
+    string prefix = string(entry.path) + '/';
+    if (inserted) {
+      // The end is known once an entry outside of it comes.
+      open_trees_.emplace_back(std::move(prefix), offset);
+    } else {
+      header.linked = 1;
+      header.tree = it->second;
+      skipped_prefix_ = std::move(prefix);
+    }
+  }
+  const size_t begin = records_.size();
+  records_.append(reinterpret_cast<const char*>(&header), sizeof(header));
+  records_.append(entry.type);
+  records_.append(entry.sha1);
+  records_.append(entry.path);
+  records_.resize(begin + header.record_size());
+  count_++;
+}
+
+void TreeIndex::Writer::CloseTrees(string_view path) {
+  const uint64_t end = sizeof(Header) + records_.size();
+  while (!open_trees_.empty()) {
+    const auto& [prefix, offset] = open_trees_.back();
+    if (path.substr(0, prefix.size()) == prefix) break;
+    reinterpret_cast<RecordHeader*>(&records_[offset - sizeof(Header)])
+        ->tree = end;
+    open_trees_.pop_back();
+  }
+}
+
+bool TreeIndex::Writer::Commit(const string& dir, string_view sha1) {
+  if (!IsHex(sha1)) return false;
+  CloseTrees(string_view());
+  if (!ordered_) {
+    std::cerr << "Tree " << sha1 << " is not listed in order, not indexed"
+              << std::endl;
+    return false;
+  }
+  if (mkdir(dir.c_str(), 0700) == -1 && errno != EEXIST) {
+    perror(("mkdir " + dir).c_str());
+    return false;
+  }
+  const string path = dir + string(sha1);
+  // Other mounts may be writing the same tree.
+  const string temporary = path + ".tmp" + std::to_string(getpid());
+  ScopedFd fd(open(temporary.c_str(),
+                   O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+  if (fd.get() == -1) {
+    perror(("open " + temporary).c_str());
+    return false;
+  }
+  Header header{};
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.count = count_;
+  header.file_size = sizeof(header) + records_.size();
+  if (!WriteAll(fd.get(), &header, sizeof(header)) ||
+      !WriteAll(fd.get(), records_.data(), records_.size())) {
+    perror(("write " + temporary).c_str());
+    unlink(temporary.c_str());
+    return false;
+  }
+  // On disk before it gets the name, so that the name is never on a
+  // partial file after a crash.
+  if (fdatasync(fd.get()) == -1) {
+    perror(("fdatasync " + temporary).c_str());
+    unlink(temporary.c_str());
+    return false;
+  }
+  if (rename(temporary.c_str(), path.c_str()) == -1) {
+    perror(("rename " + temporary).c_str());
+    unlink(temporary.c_str());
+    return false;
+  }
+  return true;
+}
+
+/* static */
+std::unique_ptr<TreeIndex> TreeIndex::Open(const string& dir,
+                                           string_view sha1) {
+  if (!IsHex(sha1)) return nullptr;
+  ScopedFd fd(open((dir + string(sha1)).c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd.get() == -1) return nullptr;
+  struct stat st;
+  if (fstat(fd.get(), &st) == -1 ||
+      st.st_size < static_cast<off_t>(sizeof(Header))) {
+    return nullptr;
+  }
+  void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd.get(), 0);
+  if (data == MAP_FAILED) {
+    perror("mmap tree index");
+    return nullptr;
+  }
+  std::unique_ptr<TreeIndex> index(
+      new TreeIndex(static_cast<const char*>(data), st.st_size));
+  if (!index->Validate()) return nullptr;
+  return index;
+}
+
+TreeIndex::TreeIndex(const char* data, size_t size)
+    : data_(data), mapped_size_(size) {}
+
+TreeIndex::~TreeIndex() { munmap(const_cast<char*>(data_), mapped_size_); }
+
+bool TreeIndex::Validate() {
+  const Header* header = reinterpret_cast<const Header*>(data_);
+  if (memcmp(header->magic, kMagic, sizeof(kMagic)) != 0 ||
+      header->file_size != mapped_size_) {
+    return false;
+  }
+  // Records of trees that are not linked, which links refer to.
+  std::unordered_set<uint64_t> trees;
+  // Where the trees that the record is under end, innermost last.
+  std::vector<uint64_t> ends;
+  size_t offset = sizeof(Header);
+  for (uint64_t i = 0; i < header->count; ++i) {
+    while (!ends.empty() && ends.back() == offset) ends.pop_back();
+    if (!ends.empty() && ends.back() < offset) return false;
+    if (mapped_size_ - offset < sizeof(RecordHeader)) return false;
+    const RecordHeader* record =
+        reinterpret_cast<const RecordHeader*>(data_ + offset);
+    if (mapped_size_ - offset < record->record_size()) return false;
+    const size_t next = offset + record->record_size();
+    const string_view type(data_ + offset + sizeof(RecordHeader),
+                           record->type_size);
+    if (type == "tree" && record->linked) {
+      if (!trees.count(record->tree)) return false;
+    } else if (type == "tree") {
+      if (record->tree < next ||
+          record->tree > (ends.empty() ? mapped_size_ : ends.back())) {
+        return false;
+      }
+      trees.insert(offset);
+      ends.push_back(record->tree);
+    }
+    offset = next;
+  }
+  while (!ends.empty() && ends.back() == offset) ends.pop_back();
+  count_ = header->count;
+  return offset == mapped_size_ && ends.empty();
+}
+
+uint64_t TreeIndex::Read(uint64_t offset, Entry* entry) const {
+  const RecordHeader* record =
+      reinterpret_cast<const RecordHeader*>(data_ + offset);
+  const char* p = data_ + offset + sizeof(RecordHeader);
+  entry->mode = record->mode;
+  entry->type = string_view(p, record->type_size);
+  p += record->type_size;
+  entry->sha1 = string_view(p, record->sha1_size);
+  p += record->sha1_size;
+  entry->path = string_view(p, record->path_size);
+  entry->size = record->size;
+  entry->position = offset;
+  return offset + record->record_size();
+}
+
+void TreeIndex::for_each(
+    std::function<void(const Entry& entry)> callback) const {
+  uint64_t offset = sizeof(Header);
+  for (uint64_t i = 0; i < count_; ++i) {
+    Entry entry;
+    offset = Read(offset, &entry);
+    callback(entry);
+  }
+}
+
+void TreeIndex::for_each_child(
+    uint64_t position, std::function<void(const Entry& entry)> callback) const {
+  uint64_t begin = sizeof(Header);
+  uint64_t end = mapped_size_;
+  if (position != kRoot) {
+    const RecordHeader* tree =
+        reinterpret_cast<const RecordHeader*>(data_ + position);
+    if (tree->linked) {
+      position = tree->tree;
+      tree = reinterpret_cast<const RecordHeader*>(data_ + position);
+    }
+    begin = position + tree->record_size();
+    end = tree->tree;
+  }
+  for (uint64_t offset = begin; offset < end;) {
+    Entry entry;
+    const uint64_t next = Read(offset, &entry);
+    callback(entry);
+    const RecordHeader* record =
+        reinterpret_cast<const RecordHeader*>(data_ + offset);
+    // Skip the entries under a tree.
+    offset = entry.type == "tree" && !record->linked ? record->tree : next;
+  }
+}
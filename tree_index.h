@@ -0,0 +1,110 @@
+#ifndef TREE_INDEX_H_
+#define TREE_INDEX_H_
+/**
+ * Listing of a whole git tree, as from `git ls-tree -l -r -t`, stored
+ * in a file named after the tree hash. Trees never change, so a tree
+ * mounted before can be served from the file that is mapped to memory,
+ * without running git or fetching and parsing the listing again.
+ *
+ * The file is written to a temporary name and renamed, so it is either
+ * complete or missing.
+ *
+ * The entries under a tree follow it, so that the entries directly
+ * under a tree can be listed without reading the rest, and the file can
+ * be served from as directories are looked up. Trees listed more than
+ * once are stored once, and refer to the first copy elsewhere.
+ */
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "disallow.h"
+
+class TreeIndex {
+ public:
+  // Views point into the mapped file.
+  struct Entry {
+    mode_t mode{};
+    // "blob", "tree" or "commit".
+    std::string_view type{};
+    std::string_view sha1{};
+    size_t size{};
+    // Relative to the tree root, without the leading '/'.
+    std::string_view path{};
+    // Of the record, for for_each_child(). Set when read from the
+    // index.
+    uint64_t position{};
+  };
+  // The position of the root tree for for_each_child().
+  static constexpr uint64_t kRoot = 0;
+
+  // Collects entries in the order they should be replayed, each tree
+  // followed by the entries under it, as `git ls-tree -r -t` lists
+  // them.
+  class Writer {
+   public:
+    Writer() {}
+    // Entries under a tree that was added before are skipped.
+    void Add(const Entry& entry);
+    // Write the index for tree |sha1| under |dir|, which ends with '/'
+    // and is created if missing. Fails if the entries were not in
+    // order.
+    bool Commit(const std::string& dir, std::string_view sha1);
+
+   private:
+    // Record where the trees that |path| is not under end.
+    void CloseTrees(std::string_view path);
+
+    std::string records_{};
+    uint64_t count_{};
+    // The first record of each tree, by hash.
+    std::unordered_map<std::string, uint64_t> trees_{};
+    // "path/" and record of the trees that the next entry may be under,
+    // innermost last.
+    std::vector<std::pair<std::string, uint64_t>> open_trees_{};
+    // "path/" of a tree added before, whose entries are skipped.
+    std::string skipped_prefix_{};
+    bool ordered_{true};
+    DISALLOW_COPY_AND_ASSIGN(Writer);
+  };
+
+  // Map the index for tree |sha1| under |dir|. Returns nullptr if there
+  // is none or it is malformed.
+  static std::unique_ptr<TreeIndex> Open(const std::string& dir,
+                                         std::string_view sha1);
+  ~TreeIndex();
+
+  // All entries, in order. Trees listed more than once are empty but
+  // for the first.
+  void for_each(std::function<void(const Entry& entry)> callback) const;
+  // The entries directly under the tree at |position|, from an Entry or
+  // kRoot, in order.
+  void for_each_child(uint64_t position,
+                      std::function<void(const Entry& entry)> callback) const;
+  size_t size() const { return count_; }
+
+ private:
+  struct Header;
+  struct RecordHeader;
+
+  TreeIndex(const char* data, size_t size);
+  // Check that the records are within the file, and that trees refer to
+  // records.
+  bool Validate();
+  // The entry at |offset|, returning the offset of the next record.
+  uint64_t Read(uint64_t offset, Entry* entry) const;
+
+  const char* data_;
+  const size_t mapped_size_;
+  uint64_t count_{};
+  DISALLOW_COPY_AND_ASSIGN(TreeIndex);
+};
+
+#endif
@@ -0,0 +1,147 @@
+#include "tree_index.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+using std::string;
+
+namespace {
+const char kDir[] = "out/tree_index_test_dir/";
+const char kTree[] = "0123456789abcdef0123456789abcdef01234567";
+
+void RoundTripTest() {
+  unlink((string(kDir) + kTree).c_str());
+  assert(!TreeIndex::Open(kDir, kTree));
+  TreeIndex::Writer writer;
+  writer.Add(TreeIndex::Entry{040000, "tree",
+                              "1111111111111111111111111111111111111111", 0,
+                              "src"});
+  writer.Add(TreeIndex::Entry{0100644, "blob",
+                              "2222222222222222222222222222222222222222",
+                              1234, "src/main.cc"});
+  writer.Add(TreeIndex::Entry{0120000, "blob",
+                              "3333333333333333333333333333333333333333", 7,
+                              "src/odd name\twith tab"});
+  assert(writer.Commit(kDir, kTree));
+
+  auto index = TreeIndex::Open(kDir, kTree);
+  assert(index);
+  assert(index->size() == 3);
+  std::vector<string> entries;
+  index->for_each([&entries](const TreeIndex::Entry& entry) {
+    entries.push_back(std::to_string(entry.mode) + " " + string(entry.type) +
+                      " " + string(entry.sha1.substr(0, 1)) + " " +
+                      std::to_string(entry.size) + " " + string(entry.path));
+  });
+  assert(entries.size() == 3);
+  assert(entries[0] == std::to_string(040000) + " tree 1 0 src");
+  assert(entries[1] == std::to_string(0100644) + " blob 2 1234 src/main.cc");
+  assert(entries[2] ==
+         std::to_string(0120000) + " blob 3 7 src/odd name\twith tab");
+}
+
+TreeIndex::Entry Tree(const char* sha1, const char* path) {
+  return TreeIndex::Entry{040000, "tree", sha1, 0, path};
+}
+
+TreeIndex::Entry Blob(const char* sha1, const char* path) {
+  return TreeIndex::Entry{0100644, "blob", sha1, 1, path};
+}
+
+std::vector<string> Children(const TreeIndex& index, uint64_t position) {
+  std::vector<string> children;
+  index.for_each_child(position, [&children](const TreeIndex::Entry& entry) {
+    children.push_back(string(entry.path));
+  });
+  return children;
+}
+
+uint64_t Position(const TreeIndex& index, const string& path) {
+  uint64_t position = TreeIndex::kRoot;
+  index.for_each([&](const TreeIndex::Entry& entry) {
+    if (entry.path == path) position = entry.position;
+  });
+  return position;
+}
+
+void LinkedTreeTest() {
+  TreeIndex::Writer writer;
+  // a and b are the same tree, and c is not.
+  writer.Add(Tree("1111111111111111111111111111111111111111", "a"));
+  writer.Add(Tree("4444444444444444444444444444444444444444", "a/sub"));
+  writer.Add(Blob("2222222222222222222222222222222222222222", "a/sub/file"));
+  writer.Add(Blob("3333333333333333333333333333333333333333", "a/top"));
+  writer.Add(Tree("1111111111111111111111111111111111111111", "b"));
+  writer.Add(Tree("4444444444444444444444444444444444444444", "b/sub"));
+  writer.Add(Blob("2222222222222222222222222222222222222222", "b/sub/file"));
+  writer.Add(Blob("3333333333333333333333333333333333333333", "b/top"));
+  writer.Add(Tree("5555555555555555555555555555555555555555", "c"));
+  writer.Add(Tree("4444444444444444444444444444444444444444", "c/sub"));
+  writer.Add(Blob("6666666666666666666666666666666666666666", "file"));
+  assert(writer.Commit(kDir, kTree));
+
+  auto index = TreeIndex::Open(kDir, kTree);
+  assert(index);
+  // The entries under b are not stored again.
+  assert(index->size() == 8);
+  assert((Children(*index, TreeIndex::kRoot) ==
+          std::vector<string>{"a", "b", "c", "file"}));
+  assert((Children(*index, Position(*index, "a")) ==
+          std::vector<string>{"a/sub", "a/top"}));
+  // Linked trees list the entries of the first copy.
+  assert((Children(*index, Position(*index, "b")) ==
+          std::vector<string>{"a/sub", "a/top"}));
+  assert((Children(*index, Position(*index, "c")) ==
+          std::vector<string>{"c/sub"}));
+  assert((Children(*index, Position(*index, "c/sub")) ==
+          std::vector<string>{"a/sub/file"}));
+}
+
+void UnorderedTest() {
+  TreeIndex::Writer writer;
+  // The tree of the entry is missing.
+  writer.Add(Blob("2222222222222222222222222222222222222222", "a/file"));
+  assert(!writer.Commit(kDir, kTree));
+
+  TreeIndex::Writer after;
+  // The entry comes after the entries of another tree.
+  after.Add(Tree("1111111111111111111111111111111111111111", "a"));
+  after.Add(Tree("4444444444444444444444444444444444444444", "b"));
+  after.Add(Blob("2222222222222222222222222222222222222222", "a/file"));
+  assert(!after.Commit(kDir, kTree));
+}
+
+void TruncatedTest() {
+  const string path = string(kDir) + kTree;
+  TreeIndex::Writer writer;
+  writer.Add(TreeIndex::Entry{0100644, "blob",
+                              "2222222222222222222222222222222222222222", 1,
+                              "file"});
+  assert(writer.Commit(kDir, kTree));
+  struct stat st;
+  assert(stat(path.c_str(), &st) == 0);
+  assert(truncate(path.c_str(), st.st_size - 8) == 0);
+  assert(!TreeIndex::Open(kDir, kTree));
+}
+
+void InvalidHashTest() {
+  TreeIndex::Writer writer;
+  assert(!writer.Commit(kDir, "../escape"));
+  assert(!writer.Commit(kDir, ""));
+  assert(!TreeIndex::Open(kDir, "../escape"));
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  RoundTripTest();
+  LinkedTreeTest();
+  UnorderedTest();
+  TruncatedTest();
+  InvalidHashTest();
+  return 0;
+}
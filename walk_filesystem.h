@@ -5,8 +5,8 @@
 #include <functional>
 #include <string>
 
-bool WalkFilesystem(const std::string& dir,
-                    std::function<void(FTSENT* entry)> cb) {
+inline bool WalkFilesystem(const std::string& dir,
+                           std::function<void(FTSENT* entry)> cb) {
   // fts wants a mutable directory name, why?
   std::string mutable_dir(dir);
   char* const paths[] = {&mutable_dir[0], nullptr};